@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpu.h"
+
+#define MAX_WORKLOADS 16
+
+/**
+ * A fixed amount of work for the CPU: a CP/M program from `path`, or
+ * `code` loaded at 0x100, run for `cycles` cycles or, if that is 0, until
+ * it has warm booted `runs` times, starting over from 0x100 after each.
+ */
+typedef struct {
+    const char *name;
+    const char *path;
+    const u8 *code;
+    u32 size;
+    u64 cycles;
+    u32 runs;
+} Workload;
+
+// Copies 4 KiB from 0x2000 to 0x4000 a byte at a time, over and over.
+static const u8 COPY[] = {
+    0x21, 0x00, 0x20, // lxi h, 2000h
+    0x11, 0x00, 0x40, // lxi d, 4000h
+    0x01, 0x00, 0x10, // lxi b, 1000h
+    0x7e,             // loop: mov a, m
+    0x12,             // stax d
+    0x23,             // inx h
+    0x13,             // inx d
+    0x0b,             // dcx b
+    0x78,             // mov a, b
+    0xb1,             // ora c
+    0xc2, 0x09, 0x01, // jnz loop
+    0xc3, 0x00, 0x01, // jmp 100h
+};
+
+// Calls a subroutine that saves registers and does some arithmetic.
+static const u8 CALLS[] = {
+    0x31, 0x00, 0xf0, // lxi sp, f000h
+    0xcd, 0x09, 0x01, // loop: call sub
+    0xc3, 0x03, 0x01, // jmp loop
+    0xc5,             // sub: push b
+    0xd5,             // push d
+    0x3c,             // inr a
+    0x87,             // add a
+    0xce, 0x05,       // aci 5
+    0xd1,             // pop d
+    0xc1,             // pop b
+    0xc9,             // ret
+};
+
+static const Workload WORKLOADS[] = {
+    { "8080PRE", "tests/8080PRE.COM", 0, 0, 0, 20000 },
+    { "8080EXM", "tests/8080EXM.COM", 0, 0, 400000000, 0 },
+    { "copy", 0, COPY, sizeof(COPY), 200000000, 0 },
+    { "calls", 0, CALLS, sizeof(CALLS), 200000000, 0 },
+};
+
+#define WORKLOAD_COUNT (sizeof(WORKLOADS) / sizeof(WORKLOADS[0]))
+
+/**
+ * What a workload took over the timed repetitions. The median is what is
+ * reported; baselines are compared on the fastest run, since the work is
+ * fixed and anything else running on the host only ever adds to it.
+ */
+typedef struct {
+    char name[32];
+    u64 instructions;
+    u64 cycles;
+    double seconds; // Median.
+    double fastest;
+    double slowest;
+} Result;
+
+typedef struct {
+    CPU cpu;
+    bool done;
+} Bench;
+
+static double seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// BDOS calls print nothing; a warm boot ends the program.
+static void out(CPU *cpu, u8 port) {
+    if (port == 0) {
+        ((Bench *)cpu)->done = true;
+        cpu_stop(cpu);
+    }
+}
+
+static void init_workload(Bench *machine, const Workload *workload) {
+    CPU *cpu = &machine->cpu;
+    cpu_init(cpu, 0, out);
+    machine->done = false;
+
+    if (workload->path) {
+        File *file = fopen(workload->path, "rb");
+        if (!file) {
+            fprintf(stderr, "Could not open %s.\n", workload->path);
+            exit(1);
+        }
+
+        fread(&cpu->memory[0x100], sizeof(u8), 0x10000 - 0x100, file);
+        fclose(file);
+    }
+    else
+        memcpy(&cpu->memory[0x100], workload->code, workload->size);
+
+    cpu->pc = 0x100;
+
+    cpu->memory[0x0] = 0xd3;
+    cpu->memory[0x1] = 0x00;
+
+    cpu->memory[0x5] = 0xd3;
+    cpu->memory[0x6] = 0x01;
+    cpu->memory[0x7] = 0xc9;
+}
+
+// Runs the workload once from the start, returning the seconds it took.
+static double run(const Workload *workload, u64 *instructions, u64 *cycles) {
+    Bench machine;
+    CPU *cpu = &machine.cpu;
+    init_workload(&machine, workload);
+
+    *instructions = 0;
+    u32 runs = 0;
+    double start = seconds();
+
+    while (!workload->cycles || cpu->cycles < workload->cycles) {
+        if (machine.done) {
+            if (++runs == workload->runs)
+                break;
+            machine.done = false;
+            cpu->pc = 0x100;
+        }
+
+        u64 left = workload->cycles ? workload->cycles - cpu->cycles : 1000000;
+        *instructions += cpu_run(cpu, left < 1000000 ? left : 1000000);
+    }
+
+    double elapsed = seconds() - start;
+    *cycles = cpu->cycles;
+    cpu_free(cpu);
+
+    return elapsed;
+}
+
+static int compare_times(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void measure(const Workload *workload, u32 warmup, u32 repetitions, Result *result) {
+    double *times = malloc(repetitions * sizeof(double));
+
+    for (u32 i = 0; i < warmup + repetitions; i++) {
+        double elapsed = run(workload, &result->instructions, &result->cycles);
+        if (i >= warmup)
+            times[i - warmup] = elapsed;
+    }
+
+    qsort(times, repetitions, sizeof(double), compare_times);
+    snprintf(result->name, sizeof(result->name), "%s", workload->name);
+    result->seconds = repetitions % 2 ? times[repetitions / 2]
+            : (times[repetitions / 2 - 1] + times[repetitions / 2]) / 2;
+    result->fastest = times[0];
+    result->slowest = times[repetitions - 1];
+
+    free(times);
+}
+
+static double mips(const Result *result) {
+    return result->instructions / result->seconds / 1e6;
+}
+
+static double best_mips(const Result *result) {
+    return result->instructions / result->fastest / 1e6;
+}
+
+static void write_json(File *file, const Result *results, u32 count, u32 warmup, u32 repetitions) {
+    fprintf(file, "{\n  \"engine\": \"%s\",\n  \"warmup\": %u,\n  \"repetitions\": %u,\n  \"workloads\": [\n",
+            cpu_engine(), warmup, repetitions);
+
+    for (u32 i = 0; i < count; i++) {
+        const Result *result = &results[i];
+        fprintf(file, "    { \"name\": \"%s\", \"instructions\": %llu, \"cycles\": %llu, "
+                "\"seconds\": %.6f, \"fastest\": %.6f, \"slowest\": %.6f, "
+                "\"mips\": %.2f, \"mhz\": %.2f, \"ns_per_instruction\": %.3f }%s\n",
+                result->name, (unsigned long long)result->instructions,
+                (unsigned long long)result->cycles, result->seconds, result->fastest,
+                result->slowest, mips(result), result->cycles / result->seconds / 1e6,
+                result->seconds * 1e9 / result->instructions, i + 1 < count ? "," : "");
+    }
+
+    fprintf(file, "  ]\n}\n");
+}
+
+/**
+ * Reads back the workloads of a file written by write_json. Each one is on
+ * a line of its own, so this is no general JSON reader.
+ */
+static u32 read_baseline(const char *path, Result *results) {
+    File *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Could not open %s.\n", path);
+        exit(1);
+    }
+
+    u32 count = 0;
+    char line[512];
+    while (count < MAX_WORKLOADS && fgets(line, sizeof(line), file)) {
+        Result *result = &results[count];
+        const char *name = strstr(line, "\"name\": \"");
+        const char *instructions = strstr(line, "\"instructions\": ");
+        const char *fastest = strstr(line, "\"fastest\": ");
+        if (!name || !instructions || !fastest)
+            continue;
+
+        unsigned long long value;
+        if (sscanf(name + 9, "%31[^\"]", result->name) != 1
+                || sscanf(instructions + 16, "%llu", &value) != 1
+                || sscanf(fastest + 11, "%lf", &result->fastest) != 1)
+            continue;
+
+        result->instructions = value;
+        count++;
+    }
+
+    fclose(file);
+    return count;
+}
+
+/**
+ * Compares `results` against the baseline at `path`, reporting to stderr.
+ * A workload fails when it runs slower than the baseline by more than
+ * `tolerance` percent, or runs a different number of instructions, which
+ * means the CPU no longer does what it did.
+ */
+static bool compare(const char *path, const Result *results, u32 count, double tolerance) {
+    Result baseline[MAX_WORKLOADS];
+    u32 known = read_baseline(path, baseline);
+    bool passed = true;
+
+    for (u32 i = 0; i < count; i++) {
+        const Result *result = &results[i];
+        const Result *base = 0;
+        for (u32 j = 0; j < known; j++) {
+            if (!strcmp(baseline[j].name, result->name))
+                base = &baseline[j];
+        }
+
+        if (!base) {
+            fprintf(stderr, "%-8s %8.1f MIPS, not in %s\n", result->name, best_mips(result), path);
+            continue;
+        }
+
+        double change = 100 * (best_mips(result) / best_mips(base) - 1);
+        bool same = result->instructions == base->instructions;
+        bool slower = change < -tolerance;
+        passed &= same && !slower;
+
+        fprintf(stderr, "%-8s %8.1f MIPS against %8.1f, %+6.1f%%%s%s\n",
+                result->name, best_mips(result), best_mips(base), change,
+                slower ? ", ERROR: slower than the baseline" : "",
+                same ? "" : ", ERROR: ran a different number of instructions");
+    }
+
+    return passed;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "Usage: bench [-n repetitions] [-w warmup] [-o output] [-b baseline [-t tolerance]]\n"
+            "\n"
+            "Runs each workload `warmup` times, then times `repetitions` more runs\n"
+            "and writes their medians as JSON to `output`, or stdout. With -b, fails\n"
+            "if a workload's fastest run is more than `tolerance` percent (10 by\n"
+            "default) slower than in `baseline`, a file written by an earlier run.\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    u32 repetitions = 5;
+    u32 warmup = 1;
+    const char *output = 0;
+    const char *baseline = 0;
+    double tolerance = 10;
+
+    int option;
+    while ((option = getopt(argc, argv, "n:w:o:b:t:")) != -1) {
+        switch (option) {
+            case 'n': repetitions = strtoul(optarg, 0, 10); break;
+            case 'w': warmup = strtoul(optarg, 0, 10); break;
+            case 'o': output = optarg; break;
+            case 'b': baseline = optarg; break;
+            case 't': tolerance = atof(optarg); break;
+            default: usage();
+        }
+    }
+
+    if (!repetitions)
+        usage();
+
+    Result results[WORKLOAD_COUNT];
+    for (u32 i = 0; i < WORKLOAD_COUNT; i++)
+        measure(&WORKLOADS[i], warmup, repetitions, &results[i]);
+
+    File *file = output ? fopen(output, "w") : stdout;
+    if (!file) {
+        fprintf(stderr, "Could not open %s.\n", output);
+        exit(1);
+    }
+
+    write_json(file, results, WORKLOAD_COUNT, warmup, repetitions);
+    if (output)
+        fclose(file);
+
+    return baseline && !compare(baseline, results, WORKLOAD_COUNT, tolerance);
+}
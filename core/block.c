@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include "cpu.h"
+#include "block.h"
+
+static const u8 LENGTHS[256] = {
+    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
+    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
+    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1,
+    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 3, 3, 3, 2, 1,
+    1, 1, 3, 2, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1,
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1,
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1
+};
+
+// Opcodes after which execution may not continue at the next address.
+static const u8 ENDS_BLOCK[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 0, 1, 1, 1, 0, 0, 1, 1, 1, 1, 1, 1, 1, 0, 1,
+    1, 0, 1, 1, 1, 0, 0, 1, 1, 1, 1, 1, 1, 1, 0, 1,
+    1, 0, 1, 0, 1, 0, 0, 1, 1, 1, 1, 0, 1, 1, 0, 1,
+    1, 0, 1, 0, 1, 0, 0, 1, 1, 0, 1, 1, 1, 1, 0, 1
+};
+
+BlockCache *block_cache_new(void) {
+    BlockCache *cache = calloc(1, sizeof(BlockCache));
+    if (!cache) {
+        fprintf(stderr, "Block cache: Out of memory.\n");
+        exit(1);
+    }
+
+    return cache;
+}
+
+void block_cache_free(BlockCache *cache) {
+    if (!cache)
+        return;
+
+    for (u32 addr = 0; addr < 0x10000; addr++)
+        free(cache->blocks[addr]);
+
+    block_free_retired(cache);
+    free(cache);
+}
+
+// Code is read the way the interpreter fetches opcodes, so decoding never
+// fires the side effects of memory-mapped I/O.
+static inline u8 fetch(const MemoryMap *map, u32 addr) {
+    addr &= 0xffff;
+    return map->fetch[addr / PAGE_SIZE][addr % PAGE_SIZE];
+}
+
+static Block *decode(CPU *cpu, u16 pc) {
+    MicroOp ops[BLOCK_MAX_OPS];
+    u32 addr = pc;
+    u32 cycles = 0;
+    u8 count = 0;
+
+    while (count < BLOCK_MAX_OPS) {
+        u8 opcode = fetch(cpu->map, addr);
+        u8 length = LENGTHS[opcode];
+
+        // Only an instruction that starts a block may wrap around the
+        // address space; its wrapped operand bytes are not tracked.
+        bool wraps = addr + length > 0x10000;
+        if (wraps && count > 0)
+            break;
+
+        MicroOp *op = &ops[count++];
+        op->opcode = opcode;
+        op->imm    = 0;
+        if (length > 1)
+            op->imm = fetch(cpu->map, addr + 1);
+        if (length > 2)
+            op->imm |= fetch(cpu->map, addr + 2) << 8;
+
+        op->next = addr + length;
+        cycles  += CYCLES[opcode];
+
+        if (wraps) {
+            addr = 0x10000;
+            break;
+        }
+
+        addr += length;
+        if (ENDS_BLOCK[opcode])
+            break;
+    }
+
+    Block *block = malloc(sizeof(Block) + count * sizeof(MicroOp));
+    if (!block) {
+        fprintf(stderr, "Block cache: Out of memory.\n");
+        exit(1);
+    }
+
+    block->start   = pc;
+    block->end     = addr;
+    block->cycles  = cycles;
+    block->count   = count;
+    block->valid   = true;
+    block->hits    = 0;
+    block->native  = 0;
+    block->retired = 0;
+
+    for (u8 i = 0; i < count; i++)
+        block->ops[i] = ops[i];
+
+    return block;
+}
+
+Block *block_decode(CPU *cpu, u16 pc) {
+    BlockCache *cache = cpu->blocks;
+
+    Block *block = decode(cpu, pc);
+    cache->blocks[pc] = block;
+    cache->decoded++;
+
+    for (u32 addr = block->start; addr < block->end; addr++) {
+        if (cache->code[addr] < 255)
+            cache->code[addr]++;
+    }
+
+    return block;
+}
+
+static void retire(BlockCache *cache, Block *block) {
+    cache->blocks[block->start] = 0;
+    cache->invalidated++;
+
+    // Saturated counts stay set: a few extra scans are harmless, missing an
+    // invalidation is not.
+    for (u32 addr = block->start; addr < block->end; addr++) {
+        if (cache->code[addr] < 255)
+            cache->code[addr]--;
+    }
+
+    block->valid   = false;
+    block->retired = cache->retired;
+    cache->retired = block;
+}
+
+void block_invalidate(BlockCache *cache, u16 addr) {
+    u32 first = addr >= BLOCK_MAX_BYTES ? addr - BLOCK_MAX_BYTES + 1 : 0;
+
+    for (u32 start = first; start <= addr; start++) {
+        Block *block = cache->blocks[start];
+        if (block && block->end > addr)
+            retire(cache, block);
+    }
+}
+
+void block_free_retired(BlockCache *cache) {
+    while (cache->retired) {
+        Block *block = cache->retired;
+        cache->retired = block->retired;
+        free(block);
+    }
+}
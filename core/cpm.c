@@ -0,0 +1,1215 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cpm.h"
+
+/**
+ * The system area, between the top of the programs' memory and the BIOS:
+ *
+ *   CPM_BDOS + 0x06  BDOS entry, OUT CPM_BDOS_PORT; RET
+ *   CPM_BDOS + 0x10  Disk parameter block of image drives
+ *   CPM_BDOS + 0x20  Disk parameter block of directory drives
+ *   CPM_BDOS + 0x30  Sector translation table of image drives
+ *   CPM_BDOS + 0x50  Directory checksums, shared by all drives
+ *   CPM_BDOS + 0x80  Directory buffer, shared by all drives
+ *   CPM_BDOS + 0x100 Disk parameter headers, 16 bytes per drive
+ *   CPM_BDOS + 0x200 Allocation vector, of the drive last asked for it
+ *   CPM_BIOS         BIOS jump table, OUT CPM_BIOS_PORT + n; RET
+ */
+#define BDOS_ENTRY    (CPM_BDOS + 0x06)
+#define DPB_IMAGE     (CPM_BDOS + 0x10)
+#define DPB_DIRECTORY (CPM_BDOS + 0x20)
+#define SKEW          (CPM_BDOS + 0x30)
+#define CSV           (CPM_BDOS + 0x50)
+#define DIRBUF        (CPM_BDOS + 0x80)
+#define DPH           (CPM_BDOS + 0x100)
+#define ALV           (CPM_BDOS + 0x200)
+
+#define DEFAULT_DMA 0x80
+#define FCB1        0x5c
+#define FCB2        0x6c
+
+// Entries of the BIOS jump table.
+enum {
+    BIOS_BOOT,
+    BIOS_WBOOT,
+    BIOS_CONST,
+    BIOS_CONIN,
+    BIOS_CONOUT,
+    BIOS_LIST,
+    BIOS_PUNCH,
+    BIOS_READER,
+    BIOS_HOME,
+    BIOS_SELDSK,
+    BIOS_SETTRK,
+    BIOS_SETSEC,
+    BIOS_SETDMA,
+    BIOS_READ,
+    BIOS_WRITE,
+    BIOS_LISTST,
+    BIOS_SECTRAN,
+    BIOS_COUNT,
+};
+
+// File system errors, as BDOS calls return them.
+#define OK         0x00
+#define END        0x01 // Reading past the end, or an unwritten record.
+#define FULL       0x02 // No room for the record, or no directory entry.
+#define OVERFLOW   0x06 // Random record past the end of the disk.
+#define NOT_FOUND  0xff
+
+#define CTRL_Z 0x1a
+#define FREE   0xe5
+
+static const u8 SKEW_TABLE[CPM_IMAGE_SECTORS] = {
+    1, 7, 13, 19, 25, 5, 11, 17, 23, 3, 9, 15, 21,
+    2, 8, 14, 20, 26, 6, 12, 18, 24, 4, 10, 16, 22,
+};
+
+/**
+ * Disk parameter blocks: SPT, BSH, BLM, EXM, DSM, DRM, AL0, AL1, CKS, OFF.
+ * Directory drives claim 4 MiB in 2 KiB blocks, so that both kinds keep
+ * one 16 KiB extent per directory entry (EXM 0).
+ */
+static const u8 IMAGE_DPB[15] = {
+    26, 0, 3, 7, 0, CPM_IMAGE_BLOCKS - 1, 0, CPM_IMAGE_ENTRIES - 1, 0, 0xc0, 0x00, 16, 0, 2, 0,
+};
+
+static const u8 DIRECTORY_DPB[15] = {
+    64, 0, 4, 15, 0, 0xff, 0x07, 0xff, 0x01, 0xff, 0x00, 0, 0, 0, 0,
+};
+
+#define IMAGE_BLOCK_RECORDS 8
+#define IMAGE_DIRECTORY_BLOCKS 2
+#define EXTENT_RECORDS 128
+
+static u8 peek(Cpm *cpm, u16 addr) {
+    return read_byte(&cpm->cpu, addr);
+}
+
+// Goes through write_byte, so that code the program loads is picked up.
+static void poke(Cpm *cpm, u16 addr, u8 value) {
+    write_byte(&cpm->cpu, addr, value);
+}
+
+static void poke_bytes(Cpm *cpm, u16 addr, const u8 *bytes, u32 count) {
+    for (u32 i = 0; i < count; i++)
+        poke(cpm, addr + i, bytes[i]);
+}
+
+static void peek_bytes(Cpm *cpm, u16 addr, u8 *bytes, u32 count) {
+    for (u32 i = 0; i < count; i++)
+        bytes[i] = peek(cpm, addr + i);
+}
+
+/**
+ * Console. Output is gathered and written in large blocks; input is read
+ * straight from the descriptor, so that console status can tell whether a
+ * key is waiting without blocking.
+ */
+
+void cpm_flush(Cpm *cpm) {
+    if (cpm->output && cpm->length) {
+        fwrite(cpm->console, 1, cpm->length, cpm->output);
+        fflush(cpm->output);
+    }
+
+    cpm->length = 0;
+}
+
+static void console_out(Cpm *cpm, u8 c) {
+    if (!cpm->output)
+        return;
+
+    if (cpm->length == CPM_CONSOLE)
+        cpm_flush(cpm);
+    cpm->console[cpm->length++] = c;
+}
+
+static bool console_ready(Cpm *cpm) {
+    if (!cpm->input || cpm->exhausted)
+        return false;
+
+    struct pollfd fd = { fileno(cpm->input), POLLIN, 0 };
+    return poll(&fd, 1, 0) == 1 && (fd.revents & (POLLIN | POLLHUP));
+}
+
+/**
+ * Waits for a key. Line feeds read as carriage returns, the CP/M end of
+ * line. Once input runs out the program gets ^Z; asking again after that
+ * ends it, as nothing more will come.
+ */
+static u8 console_in(Cpm *cpm) {
+    cpm_flush(cpm);
+
+    u8 c;
+    if (!cpm->input || cpm->exhausted || read(fileno(cpm->input), &c, 1) != 1) {
+        if (cpm->exhausted) {
+            cpm->done = true;
+            cpu_stop(&cpm->cpu);
+        }
+        cpm->exhausted = true;
+        return CTRL_Z;
+    }
+
+    return c == '\n' ? '\r' : c;
+}
+
+// Input from a terminal is echoed by the terminal.
+static void console_echo(Cpm *cpm, u8 c) {
+    if (cpm->input && !isatty(fileno(cpm->input)))
+        console_out(cpm, c);
+}
+
+static void read_line(Cpm *cpm, u16 buffer) {
+    u8 max = peek(cpm, buffer);
+    u8 count = 0;
+
+    for (;;) {
+        u8 c = console_in(cpm);
+        if (c == '\r' || c == CTRL_Z || cpm->done)
+            break;
+        if (count < max)
+            poke(cpm, buffer + 2 + count++, c);
+        console_echo(cpm, c);
+    }
+
+    poke(cpm, buffer + 1, count);
+    console_echo(cpm, '\r');
+    console_echo(cpm, '\n');
+}
+
+/**
+ * Names. Files are named by the 11 bytes of an FCB or directory entry, the
+ * name and type padded with spaces; the top bits are attributes.
+ */
+
+static bool names_match(const u8 *pattern, const u8 *name) {
+    for (u32 i = 0; i < 11; i++) {
+        u8 p = pattern[i] & 0x7f;
+        if (p != '?' && p != (name[i] & 0x7f))
+            return false;
+    }
+
+    return true;
+}
+
+static bool name_char(char c) {
+    return c > ' ' && c < 0x7f && !strchr("<>.,;:=?*[]", c);
+}
+
+// The CP/M name of host file `host`, if it can have one.
+static bool host_name(const char *host, u8 name[11]) {
+    const char *dot = strrchr(host, '.');
+    size_t base = dot ? (size_t)(dot - host) : strlen(host);
+    size_t type = dot ? strlen(dot + 1) : 0;
+    if (!base || base > 8 || type > 3)
+        return false;
+
+    memset(name, ' ', 11);
+    for (size_t i = 0; i < base + type; i++) {
+        char c = toupper((unsigned char)(i < base ? host[i] : dot[1 + i - base]));
+        if (!name_char(c))
+            return false;
+        name[i < base ? i : 8 + i - base] = c;
+    }
+
+    return true;
+}
+
+static void host_path(const CpmDrive *drive, const char *file, char *path, size_t size) {
+    snprintf(path, size, "%s/%s", drive->path, file);
+}
+
+/**
+ * Fills `names` with up to `max` files of a directory drive that match
+ * `pattern`, and returns how many there are; with `paths`, also where they
+ * are on the host.
+ */
+static u32 host_list(const CpmDrive *drive, const u8 pattern[11], u8 (*names)[11], char (*paths)[1024], u32 max) {
+    DIR *dir = opendir(drive->path);
+    if (!dir)
+        return 0;
+
+    u32 count = 0;
+    struct dirent *entry;
+    while (count < max && (entry = readdir(dir))) {
+        u8 name[11];
+        char path[1024];
+        struct stat info;
+
+        if (!host_name(entry->d_name, name) || !names_match(pattern, name))
+            continue;
+        host_path(drive, entry->d_name, path, sizeof(path));
+        if (stat(path, &info) || !S_ISREG(info.st_mode))
+            continue;
+
+        memcpy(names[count], name, 11);
+        if (paths)
+            memcpy(paths[count], path, sizeof(path));
+        count++;
+    }
+
+    closedir(dir);
+    return count;
+}
+
+static bool host_find(const CpmDrive *drive, const u8 name[11], char *path) {
+    u8 found[1][11];
+    char paths[1][1024];
+    if (!host_list(drive, name, found, paths, 1))
+        return false;
+
+    memcpy(path, paths[0], 1024);
+    return true;
+}
+
+static void host_close(CpmOpen *open) {
+    if (open->file)
+        fclose(open->file);
+    open->file = 0;
+}
+
+static void host_forget(Cpm *cpm, u8 drive, const u8 name[11]) {
+    for (u32 i = 0; i < CPM_OPEN; i++) {
+        CpmOpen *open = &cpm->open[i];
+        if (open->file && open->drive == drive && !memcmp(open->name, name, 11))
+            host_close(open);
+    }
+}
+
+/**
+ * The host file behind `name` on directory drive `drive`, opened for
+ * reading and, if the host allows, writing. Files stay open until they are
+ * pushed out by newer ones, deleted or renamed. With `create` the file is
+ * made empty first.
+ */
+static CpmOpen *host_open(Cpm *cpm, u8 drive, const u8 name[11], bool create) {
+    CpmOpen *slot = &cpm->open[0];
+    for (u32 i = 0; i < CPM_OPEN; i++) {
+        CpmOpen *open = &cpm->open[i];
+        if (open->file && open->drive == drive && !memcmp(open->name, name, 11) && !create) {
+            open->used = ++cpm->opened;
+            return open;
+        }
+        if (!open->file || (slot->file && open->used < slot->used))
+            slot = open;
+    }
+
+    const CpmDrive *disk = &cpm->drives[drive];
+    char path[1024];
+    File *file = 0;
+
+    if (create) {
+        host_forget(cpm, drive, name);
+        if (!host_find(disk, name, path)) {
+            char file_name[13];
+            u32 length = 0;
+            for (u32 i = 0; i < 11; i++) {
+                if (i == 8 && name[8] != ' ')
+                    file_name[length++] = '.';
+                if (name[i] != ' ')
+                    file_name[length++] = tolower(name[i] & 0x7f);
+            }
+            file_name[length] = 0;
+            host_path(disk, file_name, path, sizeof(path));
+        }
+        file = fopen(path, "w+b");
+    }
+    else if (host_find(disk, name, path)) {
+        file = fopen(path, "r+b");
+        if (!file)
+            file = fopen(path, "rb");
+    }
+
+    if (!file)
+        return 0;
+
+    host_close(slot);
+    slot->file = file;
+    slot->drive = drive;
+    memcpy(slot->name, name, 11);
+    slot->used = ++cpm->opened;
+
+    return slot;
+}
+
+static u32 host_records(CpmOpen *open) {
+    struct stat info;
+    fflush(open->file);
+    if (fstat(fileno(open->file), &info))
+        return 0;
+
+    return (info.st_size + CPM_RECORD - 1) / CPM_RECORD;
+}
+
+/**
+ * Disk images. Logical record n of the disk is past the reserved tracks,
+ * on the sector the translation table gives for it; block b is logical
+ * records 8b to 8b + 7. The directory is the first two blocks.
+ */
+
+static u8 *image_record(const CpmDrive *drive, u32 record) {
+    u32 track = CPM_IMAGE_RESERVED + record / CPM_IMAGE_SECTORS;
+    u32 sector = SKEW_TABLE[record % CPM_IMAGE_SECTORS] - 1;
+
+    return drive->image + (track * CPM_IMAGE_SECTORS + sector) * CPM_RECORD;
+}
+
+static u8 *image_entry(const CpmDrive *drive, u32 index) {
+    return image_record(drive, index / 4) + index % 4 * 32;
+}
+
+static u32 entry_extent(const u8 *entry) {
+    return (entry[14] & 0x3f) * 32 + (entry[12] & 0x1f);
+}
+
+static u8 *image_find(const CpmDrive *drive, u8 user, const u8 name[11], u32 extent) {
+    for (u32 i = 0; i < CPM_IMAGE_ENTRIES; i++) {
+        u8 *entry = image_entry(drive, i);
+        if (entry[0] == user && names_match(name, entry + 1) && entry_extent(entry) == extent)
+            return entry;
+    }
+
+    return 0;
+}
+
+// Records in the file, or -1 if there is no such file.
+static i64 image_records(const CpmDrive *drive, u8 user, const u8 name[11]) {
+    i64 records = -1;
+
+    for (u32 i = 0; i < CPM_IMAGE_ENTRIES; i++) {
+        u8 *entry = image_entry(drive, i);
+        if (entry[0] != user || !names_match(name, entry + 1))
+            continue;
+
+        i64 end = (i64)entry_extent(entry) * EXTENT_RECORDS + entry[15];
+        if (end > records)
+            records = end;
+    }
+
+    return records;
+}
+
+static void image_used(const CpmDrive *drive, bool used[CPM_IMAGE_BLOCKS]) {
+    memset(used, 0, CPM_IMAGE_BLOCKS);
+    for (u32 b = 0; b < IMAGE_DIRECTORY_BLOCKS; b++)
+        used[b] = true;
+
+    for (u32 i = 0; i < CPM_IMAGE_ENTRIES; i++) {
+        u8 *entry = image_entry(drive, i);
+        if (entry[0] == FREE)
+            continue;
+
+        for (u32 j = 16; j < 32; j++) {
+            if (entry[j] && entry[j] < CPM_IMAGE_BLOCKS)
+                used[entry[j]] = true;
+        }
+    }
+}
+
+static u8 *image_new_entry(const CpmDrive *drive, u8 user, const u8 name[11], u32 extent) {
+    for (u32 i = 0; i < CPM_IMAGE_ENTRIES; i++) {
+        u8 *entry = image_entry(drive, i);
+        if (entry[0] != FREE)
+            continue;
+
+        memset(entry, 0, 32);
+        entry[0] = user;
+        memcpy(entry + 1, name, 11);
+        entry[12] = extent % 32;
+        entry[14] = extent / 32;
+        return entry;
+    }
+
+    return 0;
+}
+
+static u8 image_read(const CpmDrive *drive, u8 user, const u8 name[11], u32 record, u8 *data) {
+    u8 *entry = image_find(drive, user, name, record / EXTENT_RECORDS);
+    u32 offset = record % EXTENT_RECORDS;
+    if (!entry || offset >= entry[15])
+        return END;
+
+    u8 block = entry[16 + offset / IMAGE_BLOCK_RECORDS];
+    if (!block || block >= CPM_IMAGE_BLOCKS)
+        return END;
+
+    memcpy(data, image_record(drive, block * IMAGE_BLOCK_RECORDS + offset % IMAGE_BLOCK_RECORDS), CPM_RECORD);
+    return OK;
+}
+
+static u8 image_write(const CpmDrive *drive, u8 user, const u8 name[11], u32 record, const u8 *data) {
+    u32 extent = record / EXTENT_RECORDS;
+    u32 offset = record % EXTENT_RECORDS;
+
+    u8 *entry = image_find(drive, user, name, extent);
+    if (!entry)
+        entry = image_new_entry(drive, user, name, extent);
+    if (!entry)
+        return FULL;
+
+    u8 *block = &entry[16 + offset / IMAGE_BLOCK_RECORDS];
+    if (!*block) {
+        bool used[CPM_IMAGE_BLOCKS];
+        image_used(drive, used);
+
+        u32 free_block = IMAGE_DIRECTORY_BLOCKS;
+        while (free_block < CPM_IMAGE_BLOCKS && used[free_block])
+            free_block++;
+        if (free_block == CPM_IMAGE_BLOCKS)
+            return FULL;
+
+        *block = free_block;
+        for (u32 r = 0; r < IMAGE_BLOCK_RECORDS; r++)
+            memset(image_record(drive, free_block * IMAGE_BLOCK_RECORDS + r), 0, CPM_RECORD);
+    }
+
+    memcpy(image_record(drive, *block * IMAGE_BLOCK_RECORDS + offset % IMAGE_BLOCK_RECORDS), data, CPM_RECORD);
+    if (offset >= entry[15])
+        entry[15] = offset + 1;
+
+    return OK;
+}
+
+/**
+ * Files, whatever drive they are on. Records count from the start of the
+ * file, CPM_RECORD bytes each.
+ */
+
+static CpmDrive *drive_of(Cpm *cpm, u16 fcb, u8 *index) {
+    u8 dr = peek(cpm, fcb) & 0x1f;
+    *index = dr ? dr - 1 : cpm->drive;
+
+    if (*index >= CPM_DRIVES || cpm->drives[*index].kind == CPM_NONE)
+        return 0;
+
+    return &cpm->drives[*index];
+}
+
+static i64 file_records(Cpm *cpm, u8 index, const u8 name[11]) {
+    CpmDrive *drive = &cpm->drives[index];
+    if (drive->kind == CPM_IMAGE)
+        return image_records(drive, cpm->user, name);
+
+    CpmOpen *open = host_open(cpm, index, name, false);
+    return open ? (i64)host_records(open) : -1;
+}
+
+static u8 file_read(Cpm *cpm, u8 index, const u8 name[11], u32 record, u8 *data) {
+    CpmDrive *drive = &cpm->drives[index];
+    if (drive->kind == CPM_IMAGE)
+        return image_read(drive, cpm->user, name, record, data);
+
+    CpmOpen *open = host_open(cpm, index, name, false);
+    if (!open || fseek(open->file, (long)record * CPM_RECORD, SEEK_SET))
+        return END;
+
+    size_t count = fread(data, 1, CPM_RECORD, open->file);
+    if (!count)
+        return END;
+
+    // The last record of a host file is padded the way CP/M text ends.
+    memset(data + count, CTRL_Z, CPM_RECORD - count);
+    return OK;
+}
+
+static u8 file_write(Cpm *cpm, u8 index, const u8 name[11], u32 record, const u8 *data) {
+    CpmDrive *drive = &cpm->drives[index];
+    if (drive->kind == CPM_IMAGE)
+        return image_write(drive, cpm->user, name, record, data);
+
+    CpmOpen *open = host_open(cpm, index, name, false);
+    if (!open || fseek(open->file, (long)record * CPM_RECORD, SEEK_SET)
+            || fwrite(data, 1, CPM_RECORD, open->file) != CPM_RECORD)
+        return FULL;
+
+    return OK;
+}
+
+static bool file_create(Cpm *cpm, u8 index, const u8 name[11]) {
+    CpmDrive *drive = &cpm->drives[index];
+    if (drive->kind == CPM_IMAGE)
+        return image_find(drive, cpm->user, name, 0) || image_new_entry(drive, cpm->user, name, 0);
+
+    return host_open(cpm, index, name, true) != 0;
+}
+
+// Deletes the files matching `pattern`, returning whether there were any.
+static bool file_delete(Cpm *cpm, u8 index, const u8 pattern[11]) {
+    CpmDrive *drive = &cpm->drives[index];
+    bool deleted = false;
+
+    if (drive->kind == CPM_IMAGE) {
+        for (u32 i = 0; i < CPM_IMAGE_ENTRIES; i++) {
+            u8 *entry = image_entry(drive, i);
+            if (entry[0] == cpm->user && names_match(pattern, entry + 1)) {
+                entry[0] = FREE;
+                deleted = true;
+            }
+        }
+        return deleted;
+    }
+
+    u8 names[256][11];
+    char (*paths)[1024] = malloc(256 * 1024);
+    u32 count = host_list(drive, pattern, names, paths, 256);
+    for (u32 i = 0; i < count; i++) {
+        host_forget(cpm, index, names[i]);
+        deleted |= !remove(paths[i]);
+    }
+
+    free(paths);
+    return deleted;
+}
+
+static bool file_rename(Cpm *cpm, u8 index, const u8 from[11], const u8 to[11]) {
+    CpmDrive *drive = &cpm->drives[index];
+    bool renamed = false;
+
+    if (drive->kind == CPM_IMAGE) {
+        for (u32 i = 0; i < CPM_IMAGE_ENTRIES; i++) {
+            u8 *entry = image_entry(drive, i);
+            if (entry[0] == cpm->user && names_match(from, entry + 1)) {
+                memcpy(entry + 1, to, 11);
+                renamed = true;
+            }
+        }
+        return renamed;
+    }
+
+    char path[1024];
+    if (!host_find(drive, from, path))
+        return false;
+
+    char file_name[13];
+    u32 length = 0;
+    for (u32 i = 0; i < 11; i++) {
+        if (i == 8 && to[8] != ' ')
+            file_name[length++] = '.';
+        if (to[i] != ' ')
+            file_name[length++] = tolower(to[i] & 0x7f);
+    }
+    file_name[length] = 0;
+
+    char new_path[1024];
+    host_path(drive, file_name, new_path, sizeof(new_path));
+    host_forget(cpm, index, from);
+
+    return !rename(path, new_path);
+}
+
+/**
+ * Search First gathers the directory entries the FCB matches, and Search
+ * Next hands them out one at a time. Entries of directory drives are made
+ * up from the size of each file, one per 16 KiB extent.
+ */
+static void found_add(Cpm *cpm, const u8 *entry) {
+    if (cpm->found_count % 64 == 0)
+        cpm->found = realloc(cpm->found, (cpm->found_count + 64) * 32);
+    memcpy(cpm->found[cpm->found_count++], entry, 32);
+}
+
+static bool extent_matches(const u8 *fcb, const u8 *entry) {
+    return fcb[12] == '?' || ((fcb[12] & 0x1f) == (entry[12] & 0x1f) && (fcb[14] & 0x3f) == (entry[14] & 0x3f));
+}
+
+static void search(Cpm *cpm, u16 address) {
+    cpm->found_count = 0;
+    cpm->found_next = 0;
+
+    u8 fcb[15];
+    peek_bytes(cpm, address, fcb, sizeof(fcb));
+    bool any = fcb[0] == '?';
+    if (any)
+        memset(fcb + 1, '?', 12);
+
+    u8 index = cpm->drive;
+    CpmDrive *drive = any ? &cpm->drives[index] : drive_of(cpm, address, &index);
+    if (!drive || drive->kind == CPM_NONE)
+        return;
+
+    if (drive->kind == CPM_IMAGE) {
+        for (u32 i = 0; i < CPM_IMAGE_ENTRIES; i++) {
+            u8 *entry = image_entry(drive, i);
+            if (entry[0] == FREE || (!any && entry[0] != cpm->user))
+                continue;
+            if (names_match(fcb + 1, entry + 1) && extent_matches(fcb, entry))
+                found_add(cpm, entry);
+        }
+        return;
+    }
+
+    u8 names[256][11];
+    char (*paths)[1024] = malloc(256 * 1024);
+    u32 count = host_list(drive, fcb + 1, names, paths, 256);
+    for (u32 i = 0; i < count; i++) {
+        struct stat info;
+        i64 records = stat(paths[i], &info) ? 0 : (info.st_size + CPM_RECORD - 1) / CPM_RECORD;
+        u32 extents = records > 0 ? (records + EXTENT_RECORDS - 1) / EXTENT_RECORDS : 1;
+
+        for (u32 extent = 0; extent < extents; extent++) {
+            u8 entry[32] = { cpm->user };
+            memcpy(entry + 1, names[i], 11);
+            entry[12] = extent % 32;
+            entry[14] = extent / 32;
+            i64 left = records - (i64)extent * EXTENT_RECORDS;
+            entry[15] = left > EXTENT_RECORDS ? EXTENT_RECORDS : left > 0 ? left : 0;
+            if (extent_matches(fcb, entry))
+                found_add(cpm, entry);
+        }
+    }
+
+    free(paths);
+}
+
+static u8 search_next(Cpm *cpm) {
+    if (cpm->found_next == cpm->found_count)
+        return NOT_FOUND;
+
+    poke_bytes(cpm, cpm->dma, cpm->found[cpm->found_next++], 32);
+    return 0;
+}
+
+/**
+ * File control blocks. The sequential position is record `cr` of extent
+ * `ex` + 32 `s2`; `rc` is the records in that extent. Random access goes
+ * through the 3-byte record number r0-r2.
+ */
+
+static u32 fcb_record(Cpm *cpm, u16 fcb) {
+    return ((peek(cpm, fcb + 14) & 0x3f) * 32 + (peek(cpm, fcb + 12) & 0x1f)) * EXTENT_RECORDS
+         + (peek(cpm, fcb + 32) & 0x7f);
+}
+
+static void fcb_seek(Cpm *cpm, u16 fcb, u8 index, const u8 name[11], u32 record) {
+    u32 extent = record / EXTENT_RECORDS;
+    poke(cpm, fcb + 12, extent % 32);
+    poke(cpm, fcb + 14, extent / 32);
+    poke(cpm, fcb + 32, record % EXTENT_RECORDS);
+
+    i64 left = file_records(cpm, index, name) - (i64)extent * EXTENT_RECORDS;
+    poke(cpm, fcb + 15, left > EXTENT_RECORDS ? EXTENT_RECORDS : left > 0 ? left : 0);
+}
+
+static void fcb_name(Cpm *cpm, u16 fcb, u8 name[11]) {
+    for (u32 i = 0; i < 11; i++)
+        name[i] = peek(cpm, fcb + 1 + i) & 0x7f;
+}
+
+static u8 open_file(Cpm *cpm, u16 fcb) {
+    u8 index, name[11];
+    if (!drive_of(cpm, fcb, &index))
+        return NOT_FOUND;
+    fcb_name(cpm, fcb, name);
+
+    // A name with wildcards opens the first file it matches.
+    search(cpm, fcb);
+    if (!cpm->found_count)
+        return NOT_FOUND;
+    memcpy(name, cpm->found[0] + 1, 11);
+    poke_bytes(cpm, fcb + 1, name, 11);
+
+    i64 records = file_records(cpm, index, name);
+    u32 extent = (peek(cpm, fcb + 14) & 0x3f) * 32 + (peek(cpm, fcb + 12) & 0x1f);
+    if (records < 0 || (extent && records <= (i64)extent * EXTENT_RECORDS))
+        return NOT_FOUND;
+
+    i64 left = records - (i64)extent * EXTENT_RECORDS;
+    poke(cpm, fcb + 15, left > EXTENT_RECORDS ? EXTENT_RECORDS : left);
+    return 0;
+}
+
+static u8 make_file(Cpm *cpm, u16 fcb) {
+    u8 index, name[11];
+    if (!drive_of(cpm, fcb, &index))
+        return NOT_FOUND;
+    fcb_name(cpm, fcb, name);
+
+    if (!file_create(cpm, index, name))
+        return NOT_FOUND;
+
+    poke(cpm, fcb + 15, 0);
+    return 0;
+}
+
+static u8 close_file(Cpm *cpm, u16 fcb) {
+    u8 index, name[11];
+    if (!drive_of(cpm, fcb, &index))
+        return NOT_FOUND;
+    fcb_name(cpm, fcb, name);
+
+    if (cpm->drives[index].kind == CPM_IMAGE)
+        return image_records(&cpm->drives[index], cpm->user, name) < 0 ? NOT_FOUND : 0;
+
+    CpmOpen *open = host_open(cpm, index, name, false);
+    if (!open)
+        return NOT_FOUND;
+
+    fflush(open->file);
+    return 0;
+}
+
+static u8 transfer(Cpm *cpm, u16 fcb, u32 record, bool write, bool advance) {
+    u8 index, name[11];
+    if (!drive_of(cpm, fcb, &index))
+        return NOT_FOUND;
+    fcb_name(cpm, fcb, name);
+
+    u8 data[CPM_RECORD];
+    u8 status;
+    if (write) {
+        peek_bytes(cpm, cpm->dma, data, CPM_RECORD);
+        status = file_write(cpm, index, name, record, data);
+    }
+    else {
+        status = file_read(cpm, index, name, record, data);
+        if (status == OK)
+            poke_bytes(cpm, cpm->dma, data, CPM_RECORD);
+    }
+
+    // Random calls leave the sequential position at the record they
+    // moved, so that reading on carries on from it.
+    fcb_seek(cpm, fcb, index, name, status == OK && advance ? record + 1 : record);
+    return status;
+}
+
+static u8 random_transfer(Cpm *cpm, u16 fcb, bool write) {
+    if (peek(cpm, fcb + 35))
+        return OVERFLOW;
+
+    u32 record = peek(cpm, fcb + 33) | peek(cpm, fcb + 34) << 8;
+    return transfer(cpm, fcb, record, write, false);
+}
+
+static void set_random(Cpm *cpm, u16 fcb, u32 record) {
+    poke(cpm, fcb + 33, record);
+    poke(cpm, fcb + 34, record >> 8);
+    poke(cpm, fcb + 35, record >> 16);
+}
+
+static u8 file_size(Cpm *cpm, u16 fcb) {
+    u8 index, name[11];
+    if (!drive_of(cpm, fcb, &index))
+        return NOT_FOUND;
+    fcb_name(cpm, fcb, name);
+
+    i64 records = file_records(cpm, index, name);
+    if (records < 0)
+        return NOT_FOUND;
+
+    set_random(cpm, fcb, records);
+    return 0;
+}
+
+static u8 set_attributes(Cpm *cpm, u16 fcb) {
+    u8 index, name[11];
+    if (!drive_of(cpm, fcb, &index))
+        return NOT_FOUND;
+    fcb_name(cpm, fcb, name);
+
+    CpmDrive *drive = &cpm->drives[index];
+    if (drive->kind != CPM_IMAGE)
+        return file_records(cpm, index, name) < 0 ? NOT_FOUND : 0;
+
+    u8 flagged[11];
+    peek_bytes(cpm, fcb + 1, flagged, 11);
+
+    bool found = false;
+    for (u32 i = 0; i < CPM_IMAGE_ENTRIES; i++) {
+        u8 *entry = image_entry(drive, i);
+        if (entry[0] == cpm->user && names_match(name, entry + 1)) {
+            memcpy(entry + 1, flagged, 11);
+            found = true;
+        }
+    }
+
+    return found ? 0 : NOT_FOUND;
+}
+
+// Writes the allocation vector of the current drive, and returns it.
+static u16 allocation(Cpm *cpm) {
+    CpmDrive *drive = &cpm->drives[cpm->drive];
+    u8 vector[256] = { 0 };
+
+    if (drive->kind == CPM_IMAGE) {
+        bool used[CPM_IMAGE_BLOCKS];
+        image_used(drive, used);
+        for (u32 b = 0; b < CPM_IMAGE_BLOCKS; b++)
+            vector[b / 8] |= used[b] << (7 - b % 8);
+    }
+    else
+        vector[0] = DIRECTORY_DPB[9];
+
+    poke_bytes(cpm, ALV, vector, sizeof(vector));
+    return ALV;
+}
+
+static u16 mounted(Cpm *cpm) {
+    u16 vector = 0;
+    for (u32 i = 0; i < CPM_DRIVES; i++)
+        vector |= (cpm->drives[i].kind != CPM_NONE) << i;
+
+    return vector;
+}
+
+static void bdos_return(CPU *cpu, u16 value) {
+    cpu->regs.hl = value;
+    cpu->regs.a = value;
+    cpu->regs.b = value >> 8;
+}
+
+/**
+ * A BDOS call: the function in C, its byte argument in E or word argument
+ * in DE, the result returned in A and L, or HL and BA.
+ */
+static void bdos(Cpm *cpm) {
+    CPU *cpu = &cpm->cpu;
+    u16 de = cpu->regs.de;
+    u16 result = 0;
+
+    switch (cpu->regs.c) {
+        case 0: cpm->done = true; cpu_stop(cpu); break;
+        case 1: {
+            result = console_in(cpm);
+            if (result != CTRL_Z)
+                console_echo(cpm, result);
+            break;
+        }
+        case 2: console_out(cpm, cpu->regs.e); break;
+        case 3: result = CTRL_Z; break;
+        case 4: break;
+        case 5: break; // No printer: the list device drops its output.
+        case 6: {
+            if (cpu->regs.e == 0xff)
+                result = console_ready(cpm) ? console_in(cpm) : 0;
+            else if (cpu->regs.e == 0xfe)
+                result = console_ready(cpm) ? 0xff : 0;
+            else
+                console_out(cpm, cpu->regs.e);
+            break;
+        }
+        case 7: result = cpm->iobyte; break;
+        case 8: cpm->iobyte = cpu->regs.e; break;
+        case 9: {
+            u8 c;
+            for (u16 addr = de; (c = peek(cpm, addr)) != '$'; addr++)
+                console_out(cpm, c);
+            break;
+        }
+        case 10: read_line(cpm, de); break;
+        case 11: result = console_ready(cpm) ? 0xff : 0; break;
+        case 12: result = 0x0022; break;
+        case 13: cpm->drive = 0; cpm->dma = DEFAULT_DMA; break;
+        case 14: {
+            if (cpu->regs.e < CPM_DRIVES && cpm->drives[cpu->regs.e].kind != CPM_NONE)
+                cpm->drive = cpu->regs.e;
+            else
+                result = NOT_FOUND;
+            break;
+        }
+        case 15: result = open_file(cpm, de); break;
+        case 16: result = close_file(cpm, de); break;
+        case 17: search(cpm, de); result = search_next(cpm); break;
+        case 18: result = search_next(cpm); break;
+        case 19: {
+            u8 index, name[11];
+            fcb_name(cpm, de, name);
+            result = drive_of(cpm, de, &index) && file_delete(cpm, index, name) ? 0 : NOT_FOUND;
+            break;
+        }
+        case 20: result = transfer(cpm, de, fcb_record(cpm, de), false, true); break;
+        case 21: result = transfer(cpm, de, fcb_record(cpm, de), true, true); break;
+        case 22: result = make_file(cpm, de); break;
+        case 23: {
+            u8 index, from[11], to[11];
+            fcb_name(cpm, de, from);
+            fcb_name(cpm, de + 16, to);
+            result = drive_of(cpm, de, &index) && file_rename(cpm, index, from, to) ? 0 : NOT_FOUND;
+            break;
+        }
+        case 24: result = mounted(cpm); break;
+        case 25: result = cpm->drive; break;
+        case 26: cpm->dma = de; break;
+        case 27: result = allocation(cpm); break;
+        case 28: break;
+        case 29: result = 0; break;
+        case 30: result = set_attributes(cpm, de); break;
+        case 31: result = cpm->drives[cpm->drive].kind == CPM_IMAGE ? DPB_IMAGE : DPB_DIRECTORY; break;
+        case 32: {
+            if (cpu->regs.e == 0xff)
+                result = cpm->user;
+            else
+                cpm->user = cpu->regs.e & 0x0f;
+            break;
+        }
+        case 33: result = random_transfer(cpm, de, false); break;
+        case 34: result = random_transfer(cpm, de, true); break;
+        case 35: result = file_size(cpm, de); break;
+        case 36: set_random(cpm, de, fcb_record(cpm, de)); break;
+        case 37: break;
+        case 40: result = random_transfer(cpm, de, true); break;
+        default: result = NOT_FOUND; break;
+    }
+
+    bdos_return(cpu, result);
+}
+
+// Raw sector access, only to disk images.
+static u8 *bios_sector(Cpm *cpm) {
+    CpmDrive *drive = &cpm->drives[cpm->bios_drive];
+    if (drive->kind != CPM_IMAGE || cpm->track >= CPM_IMAGE_TRACKS
+            || cpm->sector < 1 || cpm->sector > CPM_IMAGE_SECTORS)
+        return 0;
+
+    return drive->image + (cpm->track * CPM_IMAGE_SECTORS + cpm->sector - 1) * CPM_RECORD;
+}
+
+static void bios(Cpm *cpm, u8 function) {
+    CPU *cpu = &cpm->cpu;
+
+    switch (function) {
+        case BIOS_BOOT:
+        case BIOS_WBOOT: cpm->done = true; cpu_stop(cpu); break;
+        case BIOS_CONST: cpu->regs.a = console_ready(cpm) ? 0xff : 0; break;
+        case BIOS_CONIN: cpu->regs.a = console_in(cpm); break;
+        case BIOS_CONOUT: console_out(cpm, cpu->regs.c); break;
+        case BIOS_LIST: break;
+        case BIOS_PUNCH: break;
+        case BIOS_READER: cpu->regs.a = CTRL_Z; break;
+        case BIOS_HOME: cpm->track = 0; break;
+        case BIOS_SELDSK: {
+            u8 drive = cpu->regs.c;
+            bool image = drive < CPM_DRIVES && cpm->drives[drive].kind == CPM_IMAGE;
+            if (image)
+                cpm->bios_drive = drive;
+            cpu->regs.hl = image ? DPH + drive * 16 : 0;
+            break;
+        }
+        case BIOS_SETTRK: cpm->track = cpu->regs.bc; break;
+        case BIOS_SETSEC: cpm->sector = cpu->regs.bc; break;
+        case BIOS_SETDMA: cpm->bios_dma = cpu->regs.bc; break;
+        case BIOS_READ: {
+            u8 *sector = bios_sector(cpm);
+            if (sector)
+                poke_bytes(cpm, cpm->bios_dma, sector, CPM_RECORD);
+            cpu->regs.a = !sector;
+            break;
+        }
+        case BIOS_WRITE: {
+            u8 *sector = bios_sector(cpm);
+            if (sector)
+                peek_bytes(cpm, cpm->bios_dma, sector, CPM_RECORD);
+            cpu->regs.a = !sector;
+            break;
+        }
+        case BIOS_LISTST: cpu->regs.a = 0xff; break;
+        case BIOS_SECTRAN: {
+            u16 table = cpu->regs.de;
+            cpu->regs.hl = table ? peek(cpm, table + cpu->regs.bc) : cpu->regs.bc;
+            break;
+        }
+    }
+}
+
+static void in(CPU *cpu, u8 port) {
+    (void)port;
+    cpu->regs.a = 0xff;
+}
+
+static void out(CPU *cpu, u8 port) {
+    Cpm *cpm = (Cpm *)cpu;
+
+    if (port == CPM_BDOS_PORT)
+        bdos(cpm);
+    else if (port >= CPM_BIOS_PORT && port < CPM_BIOS_PORT + BIOS_COUNT)
+        bios(cpm, port - CPM_BIOS_PORT);
+    else {
+        fprintf(stderr, "CP/M: Port %d not handled.\n", port);
+        exit(1);
+    }
+}
+
+/**
+ * Sets up an empty machine with no drives, its console on `output` and
+ * `input`; either may be null.
+ */
+void cpm_init(Cpm *cpm, File *output, File *input) {
+    memset(cpm, 0, sizeof(Cpm));
+
+    CPU *cpu = &cpm->cpu;
+    cpu_init(cpu, in, out);
+
+    cpm->dma = DEFAULT_DMA;
+    cpm->output = output;
+    cpm->input = input;
+
+    u8 *memory = cpu->memory;
+    u8 jump_bios[] = { 0xc3, (CPM_BIOS + 3) & 0xff, (CPM_BIOS + 3) >> 8 };
+    u8 jump_bdos[] = { 0xc3, BDOS_ENTRY & 0xff, BDOS_ENTRY >> 8 };
+    memcpy(&memory[0x0000], jump_bios, 3);
+    memcpy(&memory[0x0005], jump_bdos, 3);
+
+    u8 trap[] = { 0xd3, CPM_BDOS_PORT, 0xc9 };
+    memcpy(&memory[BDOS_ENTRY], trap, 3);
+    for (u32 i = 0; i < BIOS_COUNT; i++) {
+        trap[1] = CPM_BIOS_PORT + i;
+        memcpy(&memory[CPM_BIOS + 3 * i], trap, 3);
+    }
+
+    memcpy(&memory[DPB_IMAGE], IMAGE_DPB, sizeof(IMAGE_DPB));
+    memcpy(&memory[DPB_DIRECTORY], DIRECTORY_DPB, sizeof(DIRECTORY_DPB));
+    memcpy(&memory[SKEW], SKEW_TABLE, sizeof(SKEW_TABLE));
+}
+
+void cpm_free(Cpm *cpm) {
+    cpm_flush(cpm);
+
+    for (u32 i = 0; i < CPM_OPEN; i++)
+        host_close(&cpm->open[i]);
+
+    for (u32 i = 0; i < CPM_DRIVES; i++) {
+        CpmDrive *drive = &cpm->drives[i];
+        if (drive->kind == CPM_IMAGE)
+            munmap(drive->image, CPM_IMAGE_SIZE);
+        free(drive->path);
+    }
+
+    free(cpm->found);
+    cpu_free(&cpm->cpu);
+}
+
+/**
+ * Makes `path` drive `drive`, 0 for A:. A directory serves the files in
+ * it; a file must be an IBM 3740 disk image, which is mapped into memory
+ * and written through.
+ */
+bool cpm_mount(Cpm *cpm, u8 drive, const char *path) {
+    struct stat info;
+    if (drive >= CPM_DRIVES || stat(path, &info)) {
+        fprintf(stderr, "CP/M: Could not mount %s.\n", path);
+        return false;
+    }
+
+    CpmDrive *disk = &cpm->drives[drive];
+    if (S_ISDIR(info.st_mode))
+        disk->kind = CPM_DIRECTORY;
+    else {
+        if (info.st_size != CPM_IMAGE_SIZE) {
+            fprintf(stderr, "CP/M: %s is not an 8\" single density image.\n", path);
+            return false;
+        }
+
+        int fd = open(path, O_RDWR);
+        void *image = fd < 0 ? MAP_FAILED
+                : mmap(0, CPM_IMAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (fd >= 0)
+            close(fd);
+        if (image == MAP_FAILED) {
+            fprintf(stderr, "CP/M: Could not map %s.\n", path);
+            return false;
+        }
+
+        disk->kind = CPM_IMAGE;
+        disk->image = image;
+
+        // Disk parameter header: XLT, scratch, DIRBUF, DPB, CSV, ALV.
+        u16 header = DPH + drive * 16;
+        u8 *memory = cpm->cpu.memory;
+        memset(&memory[header], 0, 16);
+        memory[header + 0] = SKEW & 0xff;   memory[header + 1] = SKEW >> 8;
+        memory[header + 8] = DIRBUF & 0xff; memory[header + 9] = DIRBUF >> 8;
+        memory[header + 10] = DPB_IMAGE & 0xff; memory[header + 11] = DPB_IMAGE >> 8;
+        memory[header + 12] = CSV & 0xff;   memory[header + 13] = CSV >> 8;
+        memory[header + 14] = ALV & 0xff;   memory[header + 15] = ALV >> 8;
+    }
+
+    free(disk->path);
+    disk->path = strdup(path);
+    return true;
+}
+
+// Fills the FCB at `fcb` from a command line argument such as B:NAME.TYP.
+static void parse_fcb(Cpm *cpm, u16 fcb, const char *argument) {
+    u8 bytes[16] = { 0 };
+    memset(bytes + 1, ' ', 11);
+
+    if (argument) {
+        if (argument[0] && argument[1] == ':') {
+            bytes[0] = toupper((unsigned char)argument[0]) - 'A' + 1;
+            argument += 2;
+        }
+
+        u32 i = 0;
+        u32 end = 8;
+        for (; *argument; argument++) {
+            char c = toupper((unsigned char)*argument);
+            if (c == '.') {
+                i = 8;
+                end = 11;
+            }
+            else if (c == '*') {
+                while (i < end)
+                    bytes[1 + i++] = '?';
+            }
+            else if (i < end)
+                bytes[1 + i++] = c;
+        }
+    }
+
+    memcpy(&cpm->cpu.memory[fcb], bytes, sizeof(bytes));
+}
+
+/**
+ * Loads the program at `path` into the TPA and sets it up the way the CCP
+ * would: the arguments as the command tail and the first two as FCBs, and
+ * a stack that returns to a warm boot.
+ */
+void cpm_load(Cpm *cpm, const char *path, int argc, char **argv) {
+    CPU *cpu = &cpm->cpu;
+
+    File *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Could not open %s.\n", path);
+        exit(1);
+    }
+
+    size_t size = fread(&cpu->memory[0x100], sizeof(u8), CPM_BDOS - 0x100, file);
+    bool whole = fgetc(file) == EOF;
+    fclose(file);
+    if (!size || !whole) {
+        fprintf(stderr, "CP/M: %s does not fit in memory.\n", path);
+        exit(1);
+    }
+
+    // The tail's length byte goes at 0x80, so 127 characters reach up to
+    // the program at 0x100.
+    char tail[127];
+    u32 length = 0;
+    for (int i = 0; i < argc && length < sizeof(tail); i++) {
+        tail[length++] = ' ';
+        for (const char *c = argv[i]; *c && length < sizeof(tail); c++)
+            tail[length++] = toupper((unsigned char)*c);
+    }
+
+    cpu->memory[DEFAULT_DMA] = length;
+    memcpy(&cpu->memory[DEFAULT_DMA + 1], tail, length);
+    parse_fcb(cpm, FCB1, argc > 0 ? argv[0] : 0);
+    parse_fcb(cpm, FCB2, argc > 1 ? argv[1] : 0);
+
+    cpu->memory[0x0003] = cpm->iobyte;
+    cpu->memory[0x0004] = cpm->user << 4 | cpm->drive;
+
+    cpu->pc = 0x100;
+    cpu->sp = CPM_BDOS + 4;
+    cpu->memory[cpu->sp] = 0;
+    cpu->memory[cpu->sp + 1] = 0;
+}
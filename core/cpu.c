@@ -1,7 +1,15 @@
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include "cpu.h"
-
-static const u8 CYCLES[256] = {
+#include "block.h"
+#include "memory.h"
+#include "jit.h"
+#include "trace.h"
+#include "profile.h"
+#include "debugger.h"
+
+const u8 CYCLES[256] = {
     4, 10,  7,  5,  5,  5,  7,  4,  4, 10,  7,  5,  5,  5, 7,  4,    
     4, 10,  7,  5,  5,  5,  7,  4,  4, 10,  7,  5,  5,  5, 7,  4,    
     4, 10, 16,  5,  5,  5,  7,  4,  4, 10, 16,  5,  5,  5, 7,  4,    
@@ -20,17 +28,38 @@ static const u8 CYCLES[256] = {
     5, 10, 10,  4, 11, 11,  7, 11,  5,  5, 10,  4, 11, 17, 7, 11
 };
 
+#define ZSP_MASK (FLAG_SIGN | FLAG_ZERO | FLAG_PARITY)
+
+// Sign, zero and parity flags of every byte value.
+static const u8 ZSP[256] = {
+    0x44, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+    0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+    0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+    0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+    0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+    0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+    0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84
+};
+
+static void pages_free(PageSet *set);
+
 void cpu_init(CPU *cpu, void (*in)(CPU*, u8), void (*out)(CPU*, u8)) {
     cpu->regs.a  = 0;
     cpu->regs.bc = 0;
     cpu->regs.de = 0;
     cpu->regs.hl = 0;
 
-    cpu->flags.sign      = 0;
-    cpu->flags.zero      = 0;
-    cpu->flags.aux_carry = 0;
-    cpu->flags.parity    = 0;
-    cpu->flags.carry     = 0;
+    cpu->flags = 0;
+    cpu->lazy  = 0;
     
     cpu->pc = 0;
     cpu->sp = 0;
@@ -38,6 +67,8 @@ void cpu_init(CPU *cpu, void (*in)(CPU*, u8), void (*out)(CPU*, u8)) {
     cpu->interrupts_enabled = 0;
     cpu->interrupt_vector = 0;
 
+    cpu->stop = false;
+
     cpu->cycles = 0;
 
     cpu->memory = calloc(0x10000, sizeof(u8));
@@ -46,18 +77,447 @@ void cpu_init(CPU *cpu, void (*in)(CPU*, u8), void (*out)(CPU*, u8)) {
         exit(1);
     }
 
+    cpu->map = memory_map_new(cpu->memory);
+    cpu->pages = 0;
+
+#ifdef CPU_BLOCK_CACHE
+    cpu->blocks = block_cache_new();
+#else
+    cpu->blocks = 0;
+#endif
+
+#ifdef CPU_JIT
+    cpu->jit = jit_new();
+#else
+    cpu->jit = 0;
+#endif
+
+    cpu->debugger = 0;
+
+#ifdef CPU_TRACE
+    cpu->trace = 0;
+#endif
+
+#ifdef CPU_PROFILE
+    cpu->profile = 0;
+#endif
+
     cpu->in  = in;
     cpu->out = out;
 }
 
+void cpu_free(CPU *cpu) {
+    free(cpu->memory);
+    cpu->memory = 0;
+
+    memory_map_free(cpu->map);
+    cpu->map = 0;
+
+    pages_free(cpu->pages);
+    cpu->pages = 0;
+
+    block_cache_free(cpu->blocks);
+    cpu->blocks = 0;
+
+#ifdef CPU_JIT
+    jit_free(cpu->jit);
+    cpu->jit = 0;
+#endif
+
+#ifdef CPU_TRACE
+    trace_stop(cpu);
+#endif
+}
+
 void cpu_reset(CPU *cpu) {
     void (*in)(CPU*, u8) = cpu->in;
     void (*out)(CPU*, u8) = cpu->out;
+    Debugger *debugger = cpu->debugger;
 
-    free(cpu->memory);
-    cpu->memory = 0;
+#ifdef CPU_TRACE
+    Trace *trace = cpu->trace;
+    cpu->trace = 0;
+#endif
+#ifdef CPU_PROFILE
+    Profile *profile = cpu->profile;
+#endif
 
+    cpu_free(cpu);
     cpu_init(cpu, in, out);
+    cpu->debugger = debugger;
+
+#ifdef CPU_TRACE
+    cpu->trace = trace;
+#endif
+#ifdef CPU_PROFILE
+    cpu->profile = profile;
+#endif
+}
+
+_Static_assert(PAGES <= 64, "PageSet keeps one dirty bit per page");
+
+// A page holding a copy of `data`, or uninitialized if it is null.
+static Page *page_new(const u8 *data) {
+    Page *page = malloc(sizeof(Page));
+    if (!page) {
+        fprintf(stderr, "CPU: Out of memory.\n");
+        exit(1);
+    }
+
+    atomic_init(&page->refs, 1);
+    if (data)
+        memcpy(page->data, data, PAGE_SIZE);
+
+    return page;
+}
+
+static Page *page_retain(Page *page) {
+    atomic_fetch_add(&page->refs, 1);
+    return page;
+}
+
+static void page_release(Page *page) {
+    if (page && atomic_fetch_sub(&page->refs, 1) == 1)
+        free(page);
+}
+
+// Whether map page `base` lies inside `memory`, where snapshots can see it.
+static bool in_memory(PageSet *set, const u8 *base) {
+    return base >= set->memory && base + PAGE_SIZE <= set->memory + 0x10000;
+}
+
+static void write_protected(void *context, u16 addr, u8 value) {
+    PageSet *set = context;
+    MemoryMap *map = set->map;
+    u8 *base = map->read[addr / PAGE_SIZE];
+
+    // A page mapped off the page grid straddles two pages of `memory`.
+    u32 offset = base - set->memory;
+    set->dirty |= 1ull << offset / PAGE_SIZE;
+    set->dirty |= 1ull << (offset + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    // Mirrors of the page become writable with it.
+    for (u32 page = 0; page < PAGES; page++) {
+        if (map->read[page] == base && map->io[page].write == write_protected) {
+            map->write[page] = base;
+            map->io[page] = (MemoryIO){ 0 };
+        }
+    }
+
+    base[addr % PAGE_SIZE] = value;
+}
+
+static void protect(PageSet *set) {
+    MemoryMap *map = set->map;
+
+    for (u32 page = 0; page < PAGES; page++) {
+        u8 *base = map->write[page];
+        if (base && base == map->read[page] && in_memory(set, base)) {
+            map->write[page] = 0;
+            map->io[page] = (MemoryIO){ 0, write_protected, set };
+        }
+    }
+}
+
+/**
+ * Pages of `memory` written behind the page set's back: RAM whose writes
+ * go to a handler that stores them itself, like watched video RAM. They
+ * are compared rather than tracked.
+ */
+static u64 untracked(PageSet *set) {
+    MemoryMap *map = set->map;
+    u64 pages = 0;
+
+    for (u32 page = 0; page < PAGES; page++) {
+        u8 *base = map->read[page];
+        if (base && !map->write[page] && map->io[page].write != write_protected && in_memory(set, base)) {
+            u32 offset = base - set->memory;
+            pages |= 1ull << offset / PAGE_SIZE;
+            pages |= 1ull << (offset + PAGE_SIZE - 1) / PAGE_SIZE;
+        }
+    }
+
+    return pages;
+}
+
+static PageSet *pages(CPU *cpu) {
+    if (!cpu->pages) {
+        cpu->pages = calloc(1, sizeof(PageSet));
+        if (!cpu->pages) {
+            fprintf(stderr, "CPU: Out of memory.\n");
+            exit(1);
+        }
+
+        cpu->pages->memory = cpu->memory;
+        cpu->pages->map = cpu->map;
+        cpu->pages->dirty = ~0ull;
+    }
+
+    return cpu->pages;
+}
+
+static void pages_free(PageSet *set) {
+    if (!set)
+        return;
+
+    for (u32 page = 0; page < PAGES; page++)
+        page_release(set->pages[page]);
+
+    free(set);
+}
+
+// Drops decoded code read from page `page` of memory, through any mapping.
+static void invalidate_page(CPU *cpu, u32 page) {
+#ifdef CPU_BLOCK_CACHE
+    const u8 *start = cpu->memory + page * PAGE_SIZE;
+
+    for (u32 mapped = 0; mapped < PAGES; mapped++) {
+        const u8 *base = cpu->map->fetch[mapped];
+        if (base + PAGE_SIZE <= start || base >= start + PAGE_SIZE)
+            continue;
+
+        for (u32 addr = mapped * PAGE_SIZE; addr < (mapped + 1) * PAGE_SIZE; addr++) {
+            if (block_is_code(cpu->blocks, addr))
+                block_invalidate(cpu->blocks, addr);
+        }
+    }
+#else
+    (void)cpu;
+    (void)page;
+#endif
+}
+
+#ifdef CPU_BLOCK_CACHE
+/**
+ * Drops decoded code at the other addresses that fetch the byte a write to
+ * `addr` stored, such as its mirrors, as found from the backing page.
+ */
+static void invalidate_aliases(CPU *cpu, u16 addr) {
+    const MemoryMap *map = cpu->map;
+    u32 page = addr / PAGE_SIZE;
+    const u8 *base = map->write[page] ? map->write[page] : map->read[page];
+    uintptr_t stored = (uintptr_t)base + addr % PAGE_SIZE;
+
+    for (u64 pages = map->aliases[page]; pages; pages &= pages - 1) {
+        u32 mapped = __builtin_ctzll(pages);
+        uintptr_t fetched = (uintptr_t)map->fetch[mapped];
+        if (stored < fetched || stored >= fetched + PAGE_SIZE)
+            continue;
+
+        u16 alias = mapped * PAGE_SIZE + (stored - fetched);
+        if (block_is_code(cpu->blocks, alias))
+            block_invalidate(cpu->blocks, alias);
+    }
+}
+#endif
+
+/**
+ * Saves the CPU, its memory and the rest of the machine that embeds it,
+ * `machine_size` bytes from the CPU on. Only pages written since the last
+ * snapshot or restore are copied; the rest are shared with it.
+ *
+ * Writes are tracked through the memory map, so memory written directly
+ * through `cpu->memory` must be in place before the first snapshot.
+ */
+Snapshot *cpu_snapshot(CPU *cpu, u32 machine_size) {
+    PageSet *set = pages(cpu);
+    u32 size = machine_size > sizeof(CPU) ? machine_size - sizeof(CPU) : 0;
+
+    Snapshot *snapshot = malloc(sizeof(Snapshot) + size);
+    if (!snapshot) {
+        fprintf(stderr, "CPU: Out of memory.\n");
+        exit(1);
+    }
+
+    set->dirty |= untracked(set);
+
+    for (u32 page = 0; page < PAGES; page++) {
+        const u8 *data = cpu->memory + page * PAGE_SIZE;
+        Page *old = set->pages[page];
+
+        // Written pages that came back to what they held stay shared.
+        if ((set->dirty >> page & 1) && (!old || memcmp(old->data, data, PAGE_SIZE))) {
+            // Nothing else holds the old copy: update it in place.
+            if (old && atomic_load(&old->refs) == 1)
+                memcpy(old->data, data, PAGE_SIZE);
+            else {
+                page_release(old);
+                set->pages[page] = page_new(data);
+            }
+        }
+
+        snapshot->pages[page] = page_retain(set->pages[page]);
+    }
+
+    set->dirty = 0;
+    protect(set);
+
+    snapshot->cpu = *cpu;
+    snapshot->size = size;
+    memcpy(snapshot->device, (u8 *)cpu + sizeof(CPU), size);
+
+    return snapshot;
+}
+
+/**
+ * Puts the machine back in the state of `snapshot`, which may come from
+ * another machine of the same kind. Only pages that differ are copied.
+ */
+void cpu_restore(CPU *cpu, const Snapshot *snapshot) {
+    PageSet *set = pages(cpu);
+    set->dirty |= untracked(set);
+
+    for (u32 page = 0; page < PAGES; page++) {
+        Page *saved = snapshot->pages[page];
+        if (!(set->dirty >> page & 1) && set->pages[page] == saved)
+            continue;
+
+        memcpy(cpu->memory + page * PAGE_SIZE, saved->data, PAGE_SIZE);
+        invalidate_page(cpu, page);
+
+        page_retain(saved);
+        page_release(set->pages[page]);
+        set->pages[page] = saved;
+    }
+
+    set->dirty = 0;
+    protect(set);
+
+    // The snapshot's CPU only lends its registers; memory, code caches and
+    // callbacks stay with this machine.
+    CPU current = *cpu;
+    *cpu = snapshot->cpu;
+    cpu->memory = current.memory;
+    cpu->map    = current.map;
+    cpu->pages  = current.pages;
+    cpu->blocks = current.blocks;
+    cpu->jit    = current.jit;
+    cpu->debugger = current.debugger;
+    cpu->in     = current.in;
+    cpu->out    = current.out;
+#ifdef CPU_TRACE
+    cpu->trace  = current.trace;
+#endif
+#ifdef CPU_PROFILE
+    cpu->profile = current.profile;
+#endif
+
+    memcpy((u8 *)cpu + sizeof(CPU), snapshot->device, snapshot->size);
+}
+
+void snapshot_free(Snapshot *snapshot) {
+    if (!snapshot)
+        return;
+
+    for (u32 page = 0; page < PAGES; page++)
+        page_release(snapshot->pages[page]);
+
+    free(snapshot);
+}
+
+/**
+ * Writes `snapshot` to `file`. Pages it shares with `previous`, the
+ * snapshot written before it to the same file if any, are left out.
+ *
+ * The CPU is written field by field rather than as the struct, whose
+ * layout and host pointers change with the build:
+ *
+ *   u8 SNAPSHOT_VERSION
+ *   u8 A, flags, B, C, D, E, H, L, SP low, SP high, PC low, PC high,
+ *      interrupts enabled, interrupt vector, stopped
+ *   u64 cycles, u32 device size, the device bytes
+ *   u64 pages written, then each of them
+ */
+void snapshot_write(const Snapshot *snapshot, const Snapshot *previous, File *file) {
+    u64 changed = 0;
+    for (u32 page = 0; page < PAGES; page++) {
+        if (!previous || previous->pages[page] != snapshot->pages[page])
+            changed |= 1ull << page;
+    }
+
+    CPU cpu = snapshot->cpu;
+    u8 registers[SNAPSHOT_REGISTERS] = {
+        cpu.regs.a, cpu_flags(&cpu), cpu.regs.b, cpu.regs.c, cpu.regs.d, cpu.regs.e,
+        cpu.regs.h, cpu.regs.l, cpu.sp & 0xff, cpu.sp >> 8, cpu.pc & 0xff, cpu.pc >> 8,
+        cpu.interrupts_enabled, cpu.interrupt_vector, cpu.stop,
+    };
+
+    fputc(SNAPSHOT_VERSION, file);
+    fwrite(registers, 1, sizeof(registers), file);
+    fwrite(&cpu.cycles, sizeof(u64), 1, file);
+    fwrite(&snapshot->size, sizeof(u32), 1, file);
+    fwrite(snapshot->device, 1, snapshot->size, file);
+    fwrite(&changed, sizeof(u64), 1, file);
+
+    for (u32 page = 0; page < PAGES; page++) {
+        if (changed >> page & 1)
+            fwrite(snapshot->pages[page]->data, 1, PAGE_SIZE, file);
+    }
+}
+
+/**
+ * Reads a snapshot written by snapshot_write after `previous`, of a machine
+ * `machine_size` bytes long like cpu_snapshot takes. Returns null if the
+ * file ends, does not hold one, or holds one of another version or of
+ * another kind of machine.
+ */
+Snapshot *snapshot_read(File *file, const Snapshot *previous, u32 machine_size) {
+    u8 registers[SNAPSHOT_REGISTERS];
+    u64 cycles;
+    u32 size;
+    if (fgetc(file) != SNAPSHOT_VERSION || fread(registers, 1, sizeof(registers), file) != sizeof(registers)
+            || fread(&cycles, sizeof(u64), 1, file) != 1 || fread(&size, sizeof(u32), 1, file) != 1)
+        return 0;
+
+    if (size != (machine_size > sizeof(CPU) ? machine_size - sizeof(CPU) : 0))
+        return 0;
+
+    Snapshot *snapshot = malloc(sizeof(Snapshot) + size);
+    if (!snapshot) {
+        fprintf(stderr, "CPU: Out of memory.\n");
+        exit(1);
+    }
+
+    CPU *cpu = &snapshot->cpu;
+    memset(cpu, 0, sizeof(CPU));
+    cpu->regs.a = registers[0];
+    cpu->flags = registers[1];
+    cpu->regs.b = registers[2];
+    cpu->regs.c = registers[3];
+    cpu->regs.d = registers[4];
+    cpu->regs.e = registers[5];
+    cpu->regs.h = registers[6];
+    cpu->regs.l = registers[7];
+    cpu->sp = registers[8] | registers[9] << 8;
+    cpu->pc = registers[10] | registers[11] << 8;
+    cpu->interrupts_enabled = registers[12];
+    cpu->interrupt_vector = registers[13];
+    cpu->stop = registers[14];
+    cpu->cycles = cycles;
+
+    snapshot->size = size;
+    memset(snapshot->pages, 0, sizeof(snapshot->pages));
+
+    u64 changed = 0;
+    bool complete = fread(snapshot->device, 1, size, file) == size
+                 && fread(&changed, sizeof(u64), 1, file) == 1
+                 && (previous || changed == ~0ull);
+
+    for (u32 page = 0; complete && page < PAGES; page++) {
+        if (changed >> page & 1) {
+            snapshot->pages[page] = page_new(0);
+            complete = fread(snapshot->pages[page]->data, 1, PAGE_SIZE, file) == PAGE_SIZE;
+        }
+        else
+            snapshot->pages[page] = page_retain(previous->pages[page]);
+    }
+
+    if (!complete) {
+        snapshot_free(snapshot);
+        return 0;
+    }
+
+    return snapshot;
 }
 
 static void not_implemented(u8 opcode) {
@@ -65,68 +525,154 @@ static void not_implemented(u8 opcode) {
     exit(1);
 }
 
-static void print_state(CPU *cpu, u8 opcode) {
-    printf("PC %04x  ", cpu->pc);
-    printf("Opcode %02x  ", opcode);
-    printf("SP %04x  ", cpu->sp);
-    printf("BC %04x  ", cpu->regs.bc);
-    printf("DE %04x  ", cpu->regs.de);
-    printf("HL %04x\n", cpu->regs.hl);
-}
-
 u8 read_byte(CPU *cpu, u16 addr) {
-    return cpu->memory[addr];
+    const u8 *page = cpu->map->read[addr / PAGE_SIZE];
+    if (page)
+        return page[addr % PAGE_SIZE];
+
+    return memory_read_io(cpu->map, addr);
 }
 
 void write_byte(CPU *cpu, u16 addr, u8 value) {
-    cpu->memory[addr] = value;
+    u8 *page = cpu->map->write[addr / PAGE_SIZE];
+    if (page)
+        page[addr % PAGE_SIZE] = value;
+    else
+        memory_write_io(cpu->map, addr, value);
+
+#ifdef CPU_BLOCK_CACHE
+    if (block_is_code(cpu->blocks, addr))
+        block_invalidate(cpu->blocks, addr);
+    if (cpu->map->aliases[addr / PAGE_SIZE])
+        invalidate_aliases(cpu, addr);
+#endif
 }
 
-static u16 read_word(CPU *cpu, u16 addr) {
+static inline u16 read_word(CPU *cpu, u16 addr) {
     u8 lo  = read_byte(cpu, addr);
     u16 hi = read_byte(cpu, addr+1);
 
     return lo | (hi << 8);
 }
 
-static void write_word(CPU *cpu, u16 addr, u16 word) {
+static inline void write_word(CPU *cpu, u16 addr, u16 word) {
     write_byte(cpu, addr, word & 0xff);
     write_byte(cpu, addr+1, word >> 8);
 }
 
+static inline u8 fetch_byte(CPU *cpu, u16 addr) {
+    return cpu->map->fetch[addr / PAGE_SIZE][addr % PAGE_SIZE];
+}
+
 static inline u8 next_byte(CPU *cpu) {
-    return read_byte(cpu, cpu->pc++);
+    return fetch_byte(cpu, cpu->pc++);
 }
 
 static inline u16 next_word(CPU *cpu) {
-    u16 word = read_word(cpu, cpu->pc);
+    u8 lo  = fetch_byte(cpu, cpu->pc);
+    u16 hi = fetch_byte(cpu, cpu->pc+1);
+    u16 word = lo | (hi << 8);
     cpu->pc += 2;
     return word;
 }
 
-static u8 parity(u8 value) {
-    u8 bits = 0;
+#ifdef CPU_LAZY_FLAGS
 
-    while (value) {
-        bits += value & 0x1;
-        value >>= 1;
+static inline void set_zsp(CPU *cpu, u8 value) {
+    cpu->lazy = 0x100 | value;
+}
+
+// Sets every flag: Z, S and P from `value`, carry and aux carry from `ca`.
+static inline void set_flags(CPU *cpu, u8 value, u8 ca) {
+    cpu->flags = ca;
+    cpu->lazy  = 0x100 | value;
+}
+
+static inline u8 get_flags(CPU *cpu) {
+    if (cpu->lazy) {
+        cpu->flags = (cpu->flags & ~ZSP_MASK) | ZSP[cpu->lazy & 0xff];
+        cpu->lazy  = 0;
     }
 
-    return (bits & 0x1) == 0;
+    return cpu->flags;
 }
 
+#else
+
 static inline void set_zsp(CPU *cpu, u8 value) {
-    cpu->flags.zero   = (value == 0);
-    cpu->flags.sign   = value >> 7;
-    cpu->flags.parity = parity(value);
+    cpu->flags = (cpu->flags & ~ZSP_MASK) | ZSP[value];
+}
+
+// Sets every flag: Z, S and P from `value`, carry and aux carry from `ca`.
+static inline void set_flags(CPU *cpu, u8 value, u8 ca) {
+    cpu->flags = ZSP[value] | ca;
+}
+
+static inline u8 get_flags(CPU *cpu) {
+    return cpu->flags;
+}
+
+#endif
+
+u8 cpu_flags(CPU *cpu) {
+    return get_flags(cpu);
+}
+
+/**
+ * With CPU_TRACE, every instruction and interrupt is recorded before it
+ * runs, at cycle `at`, while the CPU has a trace started. With
+ * CPU_PROFILE, it is counted while a profile is attached. Without them,
+ * OBSERVE compiles to nothing.
+ */
+#ifdef CPU_TRACE
+#define TRACING(cpu) ((cpu)->trace != 0)
+#define TRACE(pc, opcode, at, interrupt)                                        \
+    do {                                                                        \
+        if (cpu->trace)                                                         \
+            trace_record(cpu->trace, cpu, pc, opcode, get_flags(cpu), at, interrupt); \
+    } while (0)
+#else
+#define TRACING(cpu) 0
+#define TRACE(pc, opcode, at, interrupt) do {} while (0)
+#endif
+
+#ifdef CPU_PROFILE
+#define PROFILING(cpu) ((cpu)->profile != 0)
+#define PROFILE(pc, opcode, at, interrupt)                                      \
+    do {                                                                        \
+        if (cpu->profile)                                                       \
+            profile_step(cpu->profile, cpu, pc, opcode, at, interrupt);         \
+    } while (0)
+#else
+#define PROFILING(cpu) 0
+#define PROFILE(pc, opcode, at, interrupt) do {} while (0)
+#endif
+
+#if defined(CPU_TRACE) || defined(CPU_PROFILE)
+#define CPU_OBSERVED
+#endif
+
+#define OBSERVED(cpu) (TRACING(cpu) || PROFILING(cpu))
+#define OBSERVE(pc, opcode, at, interrupt)                                      \
+    do {                                                                        \
+        TRACE(pc, opcode, at, interrupt);                                       \
+        PROFILE(pc, opcode, at, interrupt);                                     \
+    } while (0)
+
+static inline bool flag(CPU *cpu, u8 mask) {
+    // Carry and aux carry are never deferred.
+    if (mask & ZSP_MASK)
+        return get_flags(cpu) & mask;
+
+    return cpu->flags & mask;
 }
 
 static inline void set_carry(CPU *cpu, bool carry) {
-    cpu->flags.carry = carry;
+    cpu->flags = (cpu->flags & ~FLAG_CARRY) | carry;
 }
 
 static inline void set_aux(CPU *cpu, bool carry) {
-    cpu->flags.aux_carry = carry;
+    cpu->flags = (cpu->flags & ~FLAG_AUX_CARRY) | (carry << 4);
 }
 
 static inline u8 inr(CPU *cpu, u8 reg) {
@@ -151,7 +697,7 @@ static inline void daa(CPU *cpu) {
     u16 sum = cpu->regs.a;
 
     u8 lsbs = cpu->regs.a & 0x0f;
-    if (lsbs > 9 || cpu->flags.aux_carry) {
+    if (lsbs > 9 || flag(cpu, FLAG_AUX_CARRY)) {
         sum += 0x06;
         set_aux(cpu, lsbs > 9);
     }
@@ -160,7 +706,7 @@ static inline void daa(CPU *cpu) {
         set_carry(cpu, 1);
 
     u8 msbs = (sum & 0xf0) >> 4;
-    if (msbs > 9 || cpu->flags.carry) {
+    if (msbs > 9 || flag(cpu, FLAG_CARRY)) {
         sum += 0x60;
         set_carry(cpu, 1);
     }
@@ -174,11 +720,11 @@ static inline void cma(CPU *cpu) {
 }
 
 static inline void stc(CPU *cpu) {
-    cpu->flags.carry = 1;
+    cpu->flags |= FLAG_CARRY;
 }
 
 static inline void cmc(CPU *cpu) {
-    cpu->flags.carry = !cpu->flags.carry;
+    cpu->flags ^= FLAG_CARRY;
 }
 
 static inline void dad(CPU *cpu, u16 value) {
@@ -188,22 +734,22 @@ static inline void dad(CPU *cpu, u16 value) {
 
 static inline void rlc(CPU *cpu) {
     set_carry(cpu, cpu->regs.a >> 7);
-    cpu->regs.a = (cpu->regs.a << 1) | cpu->flags.carry;
+    cpu->regs.a = (cpu->regs.a << 1) | (cpu->flags & FLAG_CARRY);
 }
 
 static inline void rrc(CPU *cpu) {
     set_carry(cpu, cpu->regs.a & 0x1);
-    cpu->regs.a = (cpu->regs.a >> 1) | (cpu->flags.carry << 7);
+    cpu->regs.a = (cpu->regs.a >> 1) | (cpu->flags & FLAG_CARRY) << 7;
 }
 
 static inline void ral(CPU *cpu) {
-    bool carry = cpu->flags.carry;
+    bool carry = cpu->flags & FLAG_CARRY;
     set_carry(cpu, cpu->regs.a >> 7);
     cpu->regs.a = cpu->regs.a << 1 | carry;
 }
 
 static inline void rar(CPU *cpu) {
-    bool carry = cpu->flags.carry;
+    bool carry = cpu->flags & FLAG_CARRY;
     set_carry(cpu, cpu->regs.a & 1);
     cpu->regs.a = cpu->regs.a >> 1 | carry << 7;
 }
@@ -219,44 +765,37 @@ static inline void lhld(CPU *cpu, u16 addr) {
 static inline void add(CPU *cpu, u8 value, bool carry) {
     u16 result = cpu->regs.a + value + carry;
 
-    set_zsp(cpu, result);
-    set_carry(cpu, result >> 8);
-    set_aux(cpu, (cpu->regs.a ^ value ^ result) & 0x10);
+    set_flags(cpu, result,
+            (result >> 8) | ((cpu->regs.a ^ value ^ result) & FLAG_AUX_CARRY));
 
     cpu->regs.a = result;
 }
 
 static inline void sub(CPU *cpu, u8 value, bool carry) {
     add(cpu, ~value, !carry);
-    set_carry(cpu, !cpu->flags.carry);
+    cmc(cpu);
 }
 
 static inline void ana(CPU *cpu, u8 value) {
-    set_aux(cpu, ((cpu->regs.a | value) & 0x08) != 0);
+    u8 aux = ((cpu->regs.a | value) & 0x08) << 1;
     cpu->regs.a &= value;
-    set_carry(cpu, 0);
-    set_zsp(cpu, cpu->regs.a);
+    set_flags(cpu, cpu->regs.a, aux);
 }
 
 static inline void xra(CPU *cpu, u8 value) {
     cpu->regs.a ^= value;
-    set_zsp(cpu, cpu->regs.a);
-    set_carry(cpu, 0);
-    set_aux(cpu, 0);
+    set_flags(cpu, cpu->regs.a, 0);
 }
 
 static inline void ora(CPU *cpu, u8 value) {
     cpu->regs.a |= value;
-    set_carry(cpu, 0);
-    set_aux(cpu, 0);
-    set_zsp(cpu, cpu->regs.a);
+    set_flags(cpu, cpu->regs.a, 0);
 }
 
 static inline void cmp(CPU *cpu, u8 value) {
     u16 comp = cpu->regs.a - value;
-    set_zsp(cpu, comp);
-    set_carry(cpu, comp >> 8);
-    set_aux(cpu, ~(cpu->regs.a ^ comp ^ value) & 0x10);
+    set_flags(cpu, comp,
+            ((comp >> 8) & FLAG_CARRY) | (~(cpu->regs.a ^ comp ^ value) & FLAG_AUX_CARRY));
 }
 
 static inline void push(CPU *cpu, u16 value) {
@@ -272,33 +811,18 @@ static inline u16 pop(CPU *cpu) {
 }
 
 static inline void push_psw(CPU *cpu) {
-    u16 af = cpu->regs.a << 8; 
-
-    af |= cpu->flags.sign << 7;
-    af |= cpu->flags.zero << 6;
-    af |= cpu->flags.aux_carry << 4;
-    af |= cpu->flags.parity << 2;
-    af |= 0x1 << 1;
-    af |= cpu->flags.carry;
-
-    push(cpu, af);
+    push(cpu, cpu->regs.a << 8 | get_flags(cpu) | 0x02);
 }
 
 static inline void pop_psw(CPU *cpu) {
     u16 af = pop(cpu);
 
     cpu->regs.a = af >> 8;
-    u8 psw = af & 0xff;
-
-    cpu->flags.sign      = psw >> 7;
-    cpu->flags.zero      = psw >> 6 & 0x1;
-    cpu->flags.aux_carry = psw >> 4 & 0x1;
-    cpu->flags.parity    = psw >> 2 & 0x1;
-    cpu->flags.carry     = psw & 0x1;
+    cpu->flags  = af & (ZSP_MASK | FLAG_AUX_CARRY | FLAG_CARRY);
+    cpu->lazy   = 0;
 }
 
-static inline void jmp(CPU *cpu, bool condition) {
-    u16 addr = next_word(cpu);
+static inline void jmp(CPU *cpu, u16 addr, bool condition) {
     if (condition)
         cpu->pc = addr;
 }
@@ -314,14 +838,12 @@ static inline void cond_ret(CPU *cpu, bool cond) {
     }
 }
 
-static inline void call(CPU *cpu) {
-    u16 addr = next_word(cpu);
+static inline void call(CPU *cpu, u16 addr) {
     push(cpu, cpu->pc);
     cpu->pc = addr;
 }
 
-static inline void cond_call(CPU *cpu, bool cond) {
-    u16 addr = next_word(cpu);
+static inline void cond_call(CPU *cpu, u16 addr, bool cond) {
     if (cond) {
         push(cpu, cpu->pc);
         cpu->pc = addr;
@@ -346,347 +868,449 @@ static inline void rst(CPU *cpu, u8 expr) {
     cpu->pc = expr << 3;
 }
 
+// Single registers, read and written in place.
+#define B cpu->regs.b
+#define C cpu->regs.c
+#define D cpu->regs.d
+#define E cpu->regs.e
+#define H cpu->regs.h
+#define L cpu->regs.l
+#define SET_B(value) (cpu->regs.b = (value))
+#define SET_C(value) (cpu->regs.c = (value))
+#define SET_D(value) (cpu->regs.d = (value))
+#define SET_E(value) (cpu->regs.e = (value))
+#define SET_H(value) (cpu->regs.h = (value))
+#define SET_L(value) (cpu->regs.l = (value))
+
 void cpu_execute(CPU *cpu, u8 opcode) {
     cpu->cycles += CYCLES[opcode];
     switch (opcode) {
-        // NOP
-        case 0x00: break;
-
-        // LXI
-        case 0x01: cpu->regs.bc = next_word(cpu); break;
-        case 0x11: cpu->regs.de = next_word(cpu); break;
-        case 0x21: cpu->regs.hl = next_word(cpu); break;
-        case 0x31: cpu->sp = next_word(cpu); break;
-
-        // INX
-        case 0x03: cpu->regs.bc += 1; break;
-        case 0x13: cpu->regs.de += 1; break;
-        case 0x23: cpu->regs.hl += 1; break;
-        case 0x33: cpu->sp += 1; break;
-        
-        // INR
-        case 0x3c: cpu->regs.a = inr(cpu, cpu->regs.a); break;
-        case 0x04: cpu->regs.b = inr(cpu, cpu->regs.b); break;
-        case 0x0c: cpu->regs.c = inr(cpu, cpu->regs.c); break;
-        case 0x14: cpu->regs.d = inr(cpu, cpu->regs.d); break;
-        case 0x1c: cpu->regs.e = inr(cpu, cpu->regs.e); break;
-        case 0x24: cpu->regs.h = inr(cpu, cpu->regs.h); break;
-        case 0x2c: cpu->regs.l = inr(cpu, cpu->regs.l); break;
-        case 0x34: write_byte(cpu, cpu->regs.hl, inr(cpu, read_byte(cpu, cpu->regs.hl))); break;
-
-        // DCX
-        case 0x0b: cpu->regs.bc -= 1; break;
-        case 0x1b: cpu->regs.de -= 1; break;
-        case 0x2b: cpu->regs.hl -= 1; break;
-        case 0x3b: cpu->sp -= 1; break;
-
-        // DCR
-        case 0x3d: cpu->regs.a = dcr(cpu, cpu->regs.a); break; 
-        case 0x05: cpu->regs.b = dcr(cpu, cpu->regs.b); break;
-        case 0x0d: cpu->regs.c = dcr(cpu, cpu->regs.c); break;
-        case 0x15: cpu->regs.d = dcr(cpu, cpu->regs.d); break;
-        case 0x1d: cpu->regs.e = dcr(cpu, cpu->regs.e); break;
-        case 0x25: cpu->regs.h = dcr(cpu, cpu->regs.h); break;
-        case 0x2d: cpu->regs.l = dcr(cpu, cpu->regs.l); break;
-        case 0x35: write_byte(cpu, cpu->regs.hl, dcr(cpu, read_byte(cpu, cpu->regs.hl))); break;
-
-        // MVI
-        case 0x3e: cpu->regs.a = next_byte(cpu); break;
-        case 0x06: cpu->regs.b = next_byte(cpu); break;
-        case 0x0e: cpu->regs.c = next_byte(cpu); break;
-        case 0x16: cpu->regs.d = next_byte(cpu); break;
-        case 0x1e: cpu->regs.e = next_byte(cpu); break;
-        case 0x26: cpu->regs.h = next_byte(cpu); break;
-        case 0x2e: cpu->regs.l = next_byte(cpu); break;
-        case 0x36: write_byte(cpu, cpu->regs.hl, next_byte(cpu)); break;
-
-        case 0x27: daa(cpu); break; // DAA 
-        case 0x2f: cma(cpu); break; // CMA 
-        case 0x37: stc(cpu); break; // STC 
-        case 0x3f: cmc(cpu); break; // CMC 
-
-        // DAD
-        case 0x09: dad(cpu, cpu->regs.bc); break;
-        case 0x19: dad(cpu, cpu->regs.de); break;
-        case 0x29: dad(cpu, cpu->regs.hl); break;
-        case 0x39: dad(cpu, cpu->sp); break;
-
-        // STAX
-        case 0x02: write_byte(cpu, cpu->regs.bc, cpu->regs.a); break;
-        case 0x12: write_byte(cpu, cpu->regs.de, cpu->regs.a); break;
-        case 0x32: write_byte(cpu, next_word(cpu), cpu->regs.a); break; // STA
-
-        // LDAX
-        case 0x0a: cpu->regs.a = read_byte(cpu, cpu->regs.bc); break;
-        case 0x1a: cpu->regs.a = read_byte(cpu, cpu->regs.de); break;
-        case 0x3a: cpu->regs.a = read_byte(cpu, next_word(cpu)); break; // LDA
-
-        case 0x07: rlc(cpu); break; // RLC
-        case 0x0f: rrc(cpu); break; // RRC
-        case 0x17: ral(cpu); break; // RAL
-        case 0x1f: rar(cpu); break; // RAR
-
-        case 0x22: write_word(cpu, next_word(cpu), cpu->regs.hl); break; // SHLD
-        case 0x2a: cpu->regs.hl = read_word(cpu, next_word(cpu)); break; // LHLD
-
-        // MOV
-        case 0x7f: cpu->regs.a = cpu->regs.a; break;
-        case 0x78: cpu->regs.a = cpu->regs.b; break;
-        case 0x79: cpu->regs.a = cpu->regs.c; break;
-        case 0x7a: cpu->regs.a = cpu->regs.d; break;
-        case 0x7b: cpu->regs.a = cpu->regs.e; break;
-        case 0x7c: cpu->regs.a = cpu->regs.h; break;
-        case 0x7d: cpu->regs.a = cpu->regs.l; break;
-        case 0x7e: cpu->regs.a = read_byte(cpu, cpu->regs.hl); break;
-
-        case 0x47: cpu->regs.b = cpu->regs.a; break;
-        case 0x40: cpu->regs.b = cpu->regs.b; break;
-        case 0x41: cpu->regs.b = cpu->regs.c; break;
-        case 0x42: cpu->regs.b = cpu->regs.d; break;
-        case 0x43: cpu->regs.b = cpu->regs.e; break;
-        case 0x44: cpu->regs.b = cpu->regs.h; break;
-        case 0x45: cpu->regs.b = cpu->regs.l; break;
-        case 0x46: cpu->regs.b = read_byte(cpu, cpu->regs.hl); break;
-
-        case 0x4f: cpu->regs.c = cpu->regs.a; break;
-        case 0x48: cpu->regs.c = cpu->regs.b; break;
-        case 0x49: cpu->regs.c = cpu->regs.c; break;
-        case 0x4a: cpu->regs.c = cpu->regs.d; break;
-        case 0x4b: cpu->regs.c = cpu->regs.e; break;
-        case 0x4c: cpu->regs.c = cpu->regs.h; break;
-        case 0x4d: cpu->regs.c = cpu->regs.l; break;
-        case 0x4e: cpu->regs.c = read_byte(cpu, cpu->regs.hl); break;
-
-        case 0x57: cpu->regs.d = cpu->regs.a; break;
-        case 0x50: cpu->regs.d = cpu->regs.b; break;
-        case 0x51: cpu->regs.d = cpu->regs.c; break;
-        case 0x52: cpu->regs.d = cpu->regs.d; break;
-        case 0x53: cpu->regs.d = cpu->regs.e; break;
-        case 0x54: cpu->regs.d = cpu->regs.h; break;
-        case 0x55: cpu->regs.d = cpu->regs.l; break;
-        case 0x56: cpu->regs.d = read_byte(cpu, cpu->regs.hl); break;
-        
-        case 0x5f: cpu->regs.e = cpu->regs.a; break;
-        case 0x58: cpu->regs.e = cpu->regs.b; break;
-        case 0x59: cpu->regs.e = cpu->regs.c; break;
-        case 0x5a: cpu->regs.e = cpu->regs.d; break;
-        case 0x5b: cpu->regs.e = cpu->regs.e; break;
-        case 0x5c: cpu->regs.e = cpu->regs.h; break;
-        case 0x5d: cpu->regs.e = cpu->regs.l; break;
-        case 0x5e: cpu->regs.e = read_byte(cpu, cpu->regs.hl); break;
-
-        case 0x67: cpu->regs.h = cpu->regs.a; break;
-        case 0x60: cpu->regs.h = cpu->regs.b; break;
-        case 0x61: cpu->regs.h = cpu->regs.c; break;
-        case 0x62: cpu->regs.h = cpu->regs.d; break;
-        case 0x63: cpu->regs.h = cpu->regs.e; break;
-        case 0x64: cpu->regs.h = cpu->regs.h; break;
-        case 0x65: cpu->regs.h = cpu->regs.l; break; 
-        case 0x66: cpu->regs.h = read_byte(cpu, cpu->regs.hl); break;
-
-        case 0x6f: cpu->regs.l = cpu->regs.a; break;
-        case 0x68: cpu->regs.l = cpu->regs.b; break;
-        case 0x69: cpu->regs.l = cpu->regs.c; break;
-        case 0x6a: cpu->regs.l = cpu->regs.d; break;
-        case 0x6b: cpu->regs.l = cpu->regs.e; break;
-        case 0x6c: cpu->regs.l = cpu->regs.h; break;
-        case 0x6d: cpu->regs.l = cpu->regs.l; break;
-        case 0x6e: cpu->regs.l = read_byte(cpu, cpu->regs.hl); break;
-        
-        case 0x77: write_byte(cpu, cpu->regs.hl, cpu->regs.a); break;
-        case 0x70: write_byte(cpu, cpu->regs.hl, cpu->regs.b); break;
-        case 0x71: write_byte(cpu, cpu->regs.hl, cpu->regs.c); break;
-        case 0x72: write_byte(cpu, cpu->regs.hl, cpu->regs.d); break;
-        case 0x73: write_byte(cpu, cpu->regs.hl, cpu->regs.e); break;
-        case 0x74: write_byte(cpu, cpu->regs.hl, cpu->regs.h); break;
-        case 0x75: write_byte(cpu, cpu->regs.hl, cpu->regs.l); break;
-        case 0x76: write_byte(cpu, cpu->regs.hl, read_byte(cpu, cpu->regs.hl)); break;
-
-        // ADD
-        case 0x87: add(cpu, cpu->regs.a, 0); break;
-        case 0x80: add(cpu, cpu->regs.b, 0); break;
-        case 0x81: add(cpu, cpu->regs.c, 0); break;
-        case 0x82: add(cpu, cpu->regs.d, 0); break;
-        case 0x83: add(cpu, cpu->regs.e, 0); break;
-        case 0x84: add(cpu, cpu->regs.h, 0); break;
-        case 0x85: add(cpu, cpu->regs.l, 0); break;
-        case 0x86: add(cpu, read_byte(cpu, cpu->regs.hl), 0); break;
-        case 0xc6: add(cpu, next_byte(cpu), 0); break;
-
-        // ADC
-        case 0x8f: add(cpu, cpu->regs.a, cpu->flags.carry); break;
-        case 0x88: add(cpu, cpu->regs.b, cpu->flags.carry); break;
-        case 0x89: add(cpu, cpu->regs.c, cpu->flags.carry); break;
-        case 0x8a: add(cpu, cpu->regs.d, cpu->flags.carry); break;
-        case 0x8b: add(cpu, cpu->regs.e, cpu->flags.carry); break;
-        case 0x8c: add(cpu, cpu->regs.h, cpu->flags.carry); break;
-        case 0x8d: add(cpu, cpu->regs.l, cpu->flags.carry); break;
-        case 0x8e: add(cpu, read_byte(cpu, cpu->regs.hl), cpu->flags.carry); break;
-        case 0xce: add(cpu, next_byte(cpu), cpu->flags.carry); break;
-
-        // SUB
-        case 0x97: sub(cpu, cpu->regs.a, 0); break;
-        case 0x90: sub(cpu, cpu->regs.b, 0); break;
-        case 0x91: sub(cpu, cpu->regs.c, 0); break;
-        case 0x92: sub(cpu, cpu->regs.d, 0); break;
-        case 0x93: sub(cpu, cpu->regs.e, 0); break;
-        case 0x94: sub(cpu, cpu->regs.h, 0); break;
-        case 0x95: sub(cpu, cpu->regs.l, 0); break;
-        case 0x96: sub(cpu, read_byte(cpu, cpu->regs.hl), 0); break;
-        case 0xd6: sub(cpu, next_byte(cpu), 0); break;
-
-        // SBB
-        case 0x9f: sub(cpu, cpu->regs.a, cpu->flags.carry); break;
-        case 0x98: sub(cpu, cpu->regs.b, cpu->flags.carry); break;
-        case 0x99: sub(cpu, cpu->regs.c, cpu->flags.carry); break;
-        case 0x9a: sub(cpu, cpu->regs.d, cpu->flags.carry); break;
-        case 0x9b: sub(cpu, cpu->regs.e, cpu->flags.carry); break;
-        case 0x9c: sub(cpu, cpu->regs.h, cpu->flags.carry); break;
-        case 0x9d: sub(cpu, cpu->regs.l, cpu->flags.carry); break;
-        case 0x9e: sub(cpu, read_byte(cpu, cpu->regs.hl), cpu->flags.carry); break;
-        case 0xde: sub(cpu, next_byte(cpu), cpu->flags.carry); break;
-
-        // ANA
-        case 0xa7: ana(cpu, cpu->regs.a); break;
-        case 0xa0: ana(cpu, cpu->regs.b); break;
-        case 0xa1: ana(cpu, cpu->regs.c); break;
-        case 0xa2: ana(cpu, cpu->regs.d); break;
-        case 0xa3: ana(cpu, cpu->regs.e); break;
-        case 0xa4: ana(cpu, cpu->regs.h); break;
-        case 0xa5: ana(cpu, cpu->regs.l); break;
-        case 0xa6: ana(cpu, read_byte(cpu, cpu->regs.hl)); break;
-        case 0xe6: ana(cpu, next_byte(cpu)); break;
-
-        // XRA
-        case 0xaf: xra(cpu, cpu->regs.a); break;
-        case 0xa8: xra(cpu, cpu->regs.b); break;
-        case 0xa9: xra(cpu, cpu->regs.c); break;
-        case 0xaa: xra(cpu, cpu->regs.d); break;
-        case 0xab: xra(cpu, cpu->regs.e); break;
-        case 0xac: xra(cpu, cpu->regs.h); break;
-        case 0xad: xra(cpu, cpu->regs.l); break;
-        case 0xae: xra(cpu, read_byte(cpu, cpu->regs.hl)); break;
-        case 0xee: xra(cpu, next_byte(cpu)); break;
-
-        // ORA
-        case 0xb7: ora(cpu, cpu->regs.a); break;
-        case 0xb0: ora(cpu, cpu->regs.b); break;
-        case 0xb1: ora(cpu, cpu->regs.c); break;
-        case 0xb2: ora(cpu, cpu->regs.d); break;
-        case 0xb3: ora(cpu, cpu->regs.e); break;
-        case 0xb4: ora(cpu, cpu->regs.h); break;
-        case 0xb5: ora(cpu, cpu->regs.l); break;
-        case 0xb6: ora(cpu, read_byte(cpu, cpu->regs.hl)); break;
-        case 0xf6: ora(cpu, next_byte(cpu)); break;
-
-        // PUSH
-        case 0xc5: push(cpu, cpu->regs.bc); break;
-        case 0xd5: push(cpu, cpu->regs.de); break;
-        case 0xe5: push(cpu, cpu->regs.hl); break;
-        case 0xf5: push_psw(cpu); break;
-
-        // POP
-        case 0xc1: cpu->regs.bc = pop(cpu); break;
-        case 0xd1: cpu->regs.de = pop(cpu); break;
-        case 0xe1: cpu->regs.hl = pop(cpu); break;
-        case 0xf1: pop_psw(cpu); break;
-
-        // PCHL
-        case 0xe9: cpu->pc = cpu->regs.hl; break;
-
-        // JMP
-        case 0xc3: jmp(cpu, 1); break;
-        case 0xc2: jmp(cpu, !cpu->flags.zero); break;
-        case 0xca: jmp(cpu, cpu->flags.zero); break;
-        case 0xd2: jmp(cpu, !cpu->flags.carry); break;
-        case 0xda: jmp(cpu, cpu->flags.carry); break;
-        case 0xe2: jmp(cpu, !cpu->flags.parity); break;
-        case 0xea: jmp(cpu, cpu->flags.parity); break;
-        case 0xf2: jmp(cpu, !cpu->flags.sign); break;
-        case 0xfa: jmp(cpu, cpu->flags.sign); break;
-
-        // RET
-        case 0xc9: ret(cpu); break;
-        case 0xc0: cond_ret(cpu, !cpu->flags.zero); break;
-        case 0xc8: cond_ret(cpu, cpu->flags.zero); break;
-        case 0xd0: cond_ret(cpu, !cpu->flags.carry); break;
-        case 0xd8: cond_ret(cpu, cpu->flags.carry); break;
-        case 0xe0: cond_ret(cpu, !cpu->flags.parity); break;
-        case 0xe8: cond_ret(cpu, cpu->flags.parity); break;
-        case 0xf0: cond_ret(cpu, !cpu->flags.sign); break;
-        case 0xf8: cond_ret(cpu, cpu->flags.sign); break;
-
-        // CALL
-        case 0xcd: call(cpu); break;
-        case 0xc4: cond_call(cpu, !cpu->flags.zero); break;
-        case 0xcc: cond_call(cpu, cpu->flags.zero); break;
-        case 0xd4: cond_call(cpu, !cpu->flags.carry); break;
-        case 0xdc: cond_call(cpu, cpu->flags.carry); break;
-        case 0xe4: cond_call(cpu, !cpu->flags.parity); break;
-        case 0xec: cond_call(cpu, cpu->flags.parity); break;
-        case 0xf4: cond_call(cpu, !cpu->flags.sign); break;
-        case 0xfc: cond_call(cpu, cpu->flags.sign); break;
-
-        // IN
-        case 0xdb: cpu->in(cpu, next_byte(cpu)); break;
-
-        // OUT
-        case 0xd3: cpu->out(cpu, next_byte(cpu)); break;
-
-        // XCHG
-        case 0xeb: xchg(cpu); break;
-        
-        // XTHL
-        case 0xe3: xthl(cpu); break;
-
-        // SPHL
-        case 0xf9: cpu->sp = cpu->regs.hl; break;
-
-        case 0xfb: cpu->interrupts_enabled = true; break; // EI
-        case 0xf3: cpu->interrupts_enabled = false; break; // DI 
-
-        // CMP
-        case 0xbf: cmp(cpu, cpu->regs.a); break;
-        case 0xb8: cmp(cpu, cpu->regs.b); break;
-        case 0xb9: cmp(cpu, cpu->regs.c); break;
-        case 0xba: cmp(cpu, cpu->regs.d); break;
-        case 0xbb: cmp(cpu, cpu->regs.e); break;
-        case 0xbc: cmp(cpu, cpu->regs.h); break;
-        case 0xbd: cmp(cpu, cpu->regs.l); break;
-        case 0xbe: cmp(cpu, read_byte(cpu, cpu->regs.hl)); break;
-        case 0xfe: cmp(cpu, next_byte(cpu)); break;
-
-        // RST
-        case 0xcf: rst(cpu, 0x1); break;
-        case 0xd7: rst(cpu, 0x2); break;
-        case 0xdf: rst(cpu, 0x3); break;
-        case 0xe7: rst(cpu, 0x4); break;
-        case 0xef: rst(cpu, 0x5); break;
-        case 0xf7: rst(cpu, 0x6); break;
-        case 0xff: rst(cpu, 0x7); break;
-
-        // Undocumented opcodes
-        case 0x08: break;
-        case 0x10: break;
-        case 0x18: break;
-        case 0x20: break;
-        case 0x28: break;
-        case 0x30: break;
-        case 0x38: break;
-
-        // Undocumented calls
-        case 0xdd: call(cpu); break;
-        
-        default: not_implemented(opcode);
+#define OP(opcode) case opcode:
+#define OP_DEFAULT default:
+#define NEXT       break
+#define SYNC       do {} while (0)
+#define IMM8       next_byte(cpu)
+#define IMM16      next_word(cpu)
+#define PORT_IN(port)  cpu->in(cpu, port)
+#define PORT_OUT(port) cpu->out(cpu, port)
+#include "opcodes.h"
+#undef OP
+#undef OP_DEFAULT
+#undef NEXT
+#undef SYNC
     }
 }
 
+#ifdef CPU_JIT
+
+// One function per opcode, called from translated code.
+#define OP(opcode) static void jit_##opcode(CPU *cpu, u16 imm) { (void)cpu; (void)imm;
+#define OP_DEFAULT void jit_invalid(CPU *cpu, u16 imm) { u8 opcode = imm; (void)cpu;
+#define NEXT       } extern int jit_unused
+#define SYNC       do {} while (0)
+#undef IMM8
+#undef IMM16
+#define IMM8       ((u8)imm)
+#define IMM16      imm
+#include "opcodes.h"
+#undef OP
+#undef OP_DEFAULT
+#undef NEXT
+#undef SYNC
+#undef IMM8
+#undef IMM16
+#define IMM8       next_byte(cpu)
+#define IMM16      next_word(cpu)
+
+const JitOp JIT_OPS[256] = {
+    jit_0x00, jit_0x01, jit_0x02, jit_0x03, jit_0x04, jit_0x05, jit_0x06, jit_0x07,
+    jit_0x08, jit_0x09, jit_0x0a, jit_0x0b, jit_0x0c, jit_0x0d, jit_0x0e, jit_0x0f,
+    jit_0x10, jit_0x11, jit_0x12, jit_0x13, jit_0x14, jit_0x15, jit_0x16, jit_0x17,
+    jit_0x18, jit_0x19, jit_0x1a, jit_0x1b, jit_0x1c, jit_0x1d, jit_0x1e, jit_0x1f,
+    jit_0x20, jit_0x21, jit_0x22, jit_0x23, jit_0x24, jit_0x25, jit_0x26, jit_0x27,
+    jit_0x28, jit_0x29, jit_0x2a, jit_0x2b, jit_0x2c, jit_0x2d, jit_0x2e, jit_0x2f,
+    jit_0x30, jit_0x31, jit_0x32, jit_0x33, jit_0x34, jit_0x35, jit_0x36, jit_0x37,
+    jit_0x38, jit_0x39, jit_0x3a, jit_0x3b, jit_0x3c, jit_0x3d, jit_0x3e, jit_0x3f,
+    jit_0x40, jit_0x41, jit_0x42, jit_0x43, jit_0x44, jit_0x45, jit_0x46, jit_0x47,
+    jit_0x48, jit_0x49, jit_0x4a, jit_0x4b, jit_0x4c, jit_0x4d, jit_0x4e, jit_0x4f,
+    jit_0x50, jit_0x51, jit_0x52, jit_0x53, jit_0x54, jit_0x55, jit_0x56, jit_0x57,
+    jit_0x58, jit_0x59, jit_0x5a, jit_0x5b, jit_0x5c, jit_0x5d, jit_0x5e, jit_0x5f,
+    jit_0x60, jit_0x61, jit_0x62, jit_0x63, jit_0x64, jit_0x65, jit_0x66, jit_0x67,
+    jit_0x68, jit_0x69, jit_0x6a, jit_0x6b, jit_0x6c, jit_0x6d, jit_0x6e, jit_0x6f,
+    jit_0x70, jit_0x71, jit_0x72, jit_0x73, jit_0x74, jit_0x75, jit_0x76, jit_0x77,
+    jit_0x78, jit_0x79, jit_0x7a, jit_0x7b, jit_0x7c, jit_0x7d, jit_0x7e, jit_0x7f,
+    jit_0x80, jit_0x81, jit_0x82, jit_0x83, jit_0x84, jit_0x85, jit_0x86, jit_0x87,
+    jit_0x88, jit_0x89, jit_0x8a, jit_0x8b, jit_0x8c, jit_0x8d, jit_0x8e, jit_0x8f,
+    jit_0x90, jit_0x91, jit_0x92, jit_0x93, jit_0x94, jit_0x95, jit_0x96, jit_0x97,
+    jit_0x98, jit_0x99, jit_0x9a, jit_0x9b, jit_0x9c, jit_0x9d, jit_0x9e, jit_0x9f,
+    jit_0xa0, jit_0xa1, jit_0xa2, jit_0xa3, jit_0xa4, jit_0xa5, jit_0xa6, jit_0xa7,
+    jit_0xa8, jit_0xa9, jit_0xaa, jit_0xab, jit_0xac, jit_0xad, jit_0xae, jit_0xaf,
+    jit_0xb0, jit_0xb1, jit_0xb2, jit_0xb3, jit_0xb4, jit_0xb5, jit_0xb6, jit_0xb7,
+    jit_0xb8, jit_0xb9, jit_0xba, jit_0xbb, jit_0xbc, jit_0xbd, jit_0xbe, jit_0xbf,
+    jit_0xc0, jit_0xc1, jit_0xc2, jit_0xc3, jit_0xc4, jit_0xc5, jit_0xc6, jit_invalid,
+    jit_0xc8, jit_0xc9, jit_0xca, jit_invalid, jit_0xcc, jit_0xcd, jit_0xce, jit_0xcf,
+    jit_0xd0, jit_0xd1, jit_0xd2, jit_0xd3, jit_0xd4, jit_0xd5, jit_0xd6, jit_0xd7,
+    jit_0xd8, jit_invalid, jit_0xda, jit_0xdb, jit_0xdc, jit_0xdd, jit_0xde, jit_0xdf,
+    jit_0xe0, jit_0xe1, jit_0xe2, jit_0xe3, jit_0xe4, jit_0xe5, jit_0xe6, jit_0xe7,
+    jit_0xe8, jit_0xe9, jit_0xea, jit_0xeb, jit_0xec, jit_invalid, jit_0xee, jit_0xef,
+    jit_0xf0, jit_0xf1, jit_0xf2, jit_0xf3, jit_0xf4, jit_0xf5, jit_0xf6, jit_0xf7,
+    jit_0xf8, jit_0xf9, jit_0xfa, jit_0xfb, jit_0xfc, jit_invalid, jit_0xfe, jit_0xff,
+};
+
+#endif
+
+/**
+ * Runs `vector`, an RST, as an interrupt taken before the instruction at
+ * PC. Unlike cpu_execute, it shows up in traces as an interrupt.
+ */
+void cpu_interrupt(CPU *cpu, u8 vector) {
+    OBSERVE(cpu->pc, vector, cpu->cycles, true);
+    cpu_execute(cpu, vector);
+}
+
+static void interrupt(CPU *cpu) {
+    u8 vector = cpu->interrupt_vector;
+    cpu->interrupt_vector = 0;
+    cpu_interrupt(cpu, vector);
+}
+
 void cpu_step(CPU *cpu) {
     if (cpu->interrupts_enabled && cpu->interrupt_vector) {
-        cpu_execute(cpu, cpu->interrupt_vector);
+        cpu_interrupt(cpu, cpu->interrupt_vector);
         cpu->interrupt_vector = 0;
     }
     else {
-        cpu_execute(cpu, read_byte(cpu, cpu->pc++));
+        u8 opcode = fetch_byte(cpu, cpu->pc++);
+        OBSERVE(cpu->pc - 1, opcode, cpu->cycles, false);
+        cpu_execute(cpu, opcode);
+    }
+}
+
+void cpu_stop(CPU *cpu) {
+    cpu->stop = true;
+}
+
+/**
+ * With CPU_REGISTER_CACHE, cpu_run works on a local copy of the CPU so that
+ * the compiler can keep registers, flags, PC and SP in host registers for the
+ * whole run. The copy never escapes: it is written back to `machine` and
+ * reloaded around the I/O callbacks and interrupt delivery, and when cpu_run
+ * returns.
+ *
+ * The threaded engine ignores it, since GCC merges its dispatch tails back
+ * into a single jump once the registers live in locals. Translated code
+ * keeps its registers in the CPU struct, so the JIT engine ignores it too.
+ */
+#if !defined(CPU_REGISTER_CACHE) || defined(CPU_THREADED) || defined(CPU_JIT)
+#define CACHE(machine) CPU *cpu = machine
+#define WRITE_BACK()   do {} while (0)
+#define RELOAD()       do {} while (0)
+#else
+#define CACHE(machine) CPU cache = *machine; CPU *cpu = &cache
+#define WRITE_BACK()   (*machine = *cpu)
+#define RELOAD()       (*cpu = *machine)
+
+/**
+ * The compiler can only keep a register pair in a host register if it is
+ * never also accessed as two bytes, so single registers are extracted from
+ * and merged into their pair.
+ */
+#undef B
+#undef C
+#undef D
+#undef E
+#undef H
+#undef L
+#undef SET_B
+#undef SET_C
+#undef SET_D
+#undef SET_E
+#undef SET_H
+#undef SET_L
+
+#define HI(pair) ((u8)(cpu->regs.pair >> 8))
+#define LO(pair) ((u8)cpu->regs.pair)
+#define SET_HI(pair, value) (cpu->regs.pair = (cpu->regs.pair & 0x00ff) | (u8)(value) << 8)
+#define SET_LO(pair, value) (cpu->regs.pair = (cpu->regs.pair & 0xff00) | (u8)(value))
+
+#define B HI(bc)
+#define C LO(bc)
+#define D HI(de)
+#define E LO(de)
+#define H HI(hl)
+#define L LO(hl)
+#define SET_B(value) SET_HI(bc, value)
+#define SET_C(value) SET_LO(bc, value)
+#define SET_D(value) SET_HI(de, value)
+#define SET_E(value) SET_LO(de, value)
+#define SET_H(value) SET_HI(hl, value)
+#define SET_L(value) SET_LO(hl, value)
+#endif
+
+#undef PORT_IN
+#undef PORT_OUT
+
+#define PORT_IN(port)                   \
+    do {                                \
+        u8 in_port = port;              \
+        WRITE_BACK();                   \
+        machine->in(machine, in_port);  \
+        RELOAD();                       \
+    } while (0)
+
+#define PORT_OUT(port)                  \
+    do {                                \
+        u8 out_port = port;             \
+        WRITE_BACK();                   \
+        machine->out(machine, out_port);\
+        RELOAD();                       \
+    } while (0)
+
+/**
+ * Interrupts and stop requests can only appear from outside the run loop or
+ * from the I/O callbacks, so they are checked on entry and after SYNC instead
+ * of before every instruction.
+ */
+#define SYNC                                                    \
+    do {                                                        \
+        if (cpu->stop)                                          \
+            goto done;                                          \
+        if (cpu->interrupts_enabled && cpu->interrupt_vector) { \
+            WRITE_BACK();                                       \
+            interrupt(machine);                                 \
+            RELOAD();                                           \
+        }                                                       \
+    } while (0)
+
+#ifdef CPU_THREADED
+
+const char *cpu_engine(void) {
+    return "threaded";
+}
+
+/**
+ * Direct-threaded engine: every opcode ends with its own copy of the
+ * dispatch sequence, so the host branch predictor sees one indirect jump
+ * per opcode instead of the single shared jump of the switch.
+ */
+u64 cpu_run(CPU *machine, u64 cycles) {
+    static const void *const dispatch[256] = {
+        &&op_0x00, &&op_0x01, &&op_0x02, &&op_0x03, &&op_0x04, &&op_0x05, &&op_0x06, &&op_0x07,
+        &&op_0x08, &&op_0x09, &&op_0x0a, &&op_0x0b, &&op_0x0c, &&op_0x0d, &&op_0x0e, &&op_0x0f,
+        &&op_0x10, &&op_0x11, &&op_0x12, &&op_0x13, &&op_0x14, &&op_0x15, &&op_0x16, &&op_0x17,
+        &&op_0x18, &&op_0x19, &&op_0x1a, &&op_0x1b, &&op_0x1c, &&op_0x1d, &&op_0x1e, &&op_0x1f,
+        &&op_0x20, &&op_0x21, &&op_0x22, &&op_0x23, &&op_0x24, &&op_0x25, &&op_0x26, &&op_0x27,
+        &&op_0x28, &&op_0x29, &&op_0x2a, &&op_0x2b, &&op_0x2c, &&op_0x2d, &&op_0x2e, &&op_0x2f,
+        &&op_0x30, &&op_0x31, &&op_0x32, &&op_0x33, &&op_0x34, &&op_0x35, &&op_0x36, &&op_0x37,
+        &&op_0x38, &&op_0x39, &&op_0x3a, &&op_0x3b, &&op_0x3c, &&op_0x3d, &&op_0x3e, &&op_0x3f,
+        &&op_0x40, &&op_0x41, &&op_0x42, &&op_0x43, &&op_0x44, &&op_0x45, &&op_0x46, &&op_0x47,
+        &&op_0x48, &&op_0x49, &&op_0x4a, &&op_0x4b, &&op_0x4c, &&op_0x4d, &&op_0x4e, &&op_0x4f,
+        &&op_0x50, &&op_0x51, &&op_0x52, &&op_0x53, &&op_0x54, &&op_0x55, &&op_0x56, &&op_0x57,
+        &&op_0x58, &&op_0x59, &&op_0x5a, &&op_0x5b, &&op_0x5c, &&op_0x5d, &&op_0x5e, &&op_0x5f,
+        &&op_0x60, &&op_0x61, &&op_0x62, &&op_0x63, &&op_0x64, &&op_0x65, &&op_0x66, &&op_0x67,
+        &&op_0x68, &&op_0x69, &&op_0x6a, &&op_0x6b, &&op_0x6c, &&op_0x6d, &&op_0x6e, &&op_0x6f,
+        &&op_0x70, &&op_0x71, &&op_0x72, &&op_0x73, &&op_0x74, &&op_0x75, &&op_0x76, &&op_0x77,
+        &&op_0x78, &&op_0x79, &&op_0x7a, &&op_0x7b, &&op_0x7c, &&op_0x7d, &&op_0x7e, &&op_0x7f,
+        &&op_0x80, &&op_0x81, &&op_0x82, &&op_0x83, &&op_0x84, &&op_0x85, &&op_0x86, &&op_0x87,
+        &&op_0x88, &&op_0x89, &&op_0x8a, &&op_0x8b, &&op_0x8c, &&op_0x8d, &&op_0x8e, &&op_0x8f,
+        &&op_0x90, &&op_0x91, &&op_0x92, &&op_0x93, &&op_0x94, &&op_0x95, &&op_0x96, &&op_0x97,
+        &&op_0x98, &&op_0x99, &&op_0x9a, &&op_0x9b, &&op_0x9c, &&op_0x9d, &&op_0x9e, &&op_0x9f,
+        &&op_0xa0, &&op_0xa1, &&op_0xa2, &&op_0xa3, &&op_0xa4, &&op_0xa5, &&op_0xa6, &&op_0xa7,
+        &&op_0xa8, &&op_0xa9, &&op_0xaa, &&op_0xab, &&op_0xac, &&op_0xad, &&op_0xae, &&op_0xaf,
+        &&op_0xb0, &&op_0xb1, &&op_0xb2, &&op_0xb3, &&op_0xb4, &&op_0xb5, &&op_0xb6, &&op_0xb7,
+        &&op_0xb8, &&op_0xb9, &&op_0xba, &&op_0xbb, &&op_0xbc, &&op_0xbd, &&op_0xbe, &&op_0xbf,
+        &&op_0xc0, &&op_0xc1, &&op_0xc2, &&op_0xc3, &&op_0xc4, &&op_0xc5, &&op_0xc6, &&op_invalid,
+        &&op_0xc8, &&op_0xc9, &&op_0xca, &&op_invalid, &&op_0xcc, &&op_0xcd, &&op_0xce, &&op_0xcf,
+        &&op_0xd0, &&op_0xd1, &&op_0xd2, &&op_0xd3, &&op_0xd4, &&op_0xd5, &&op_0xd6, &&op_0xd7,
+        &&op_0xd8, &&op_invalid, &&op_0xda, &&op_0xdb, &&op_0xdc, &&op_0xdd, &&op_0xde, &&op_0xdf,
+        &&op_0xe0, &&op_0xe1, &&op_0xe2, &&op_0xe3, &&op_0xe4, &&op_0xe5, &&op_0xe6, &&op_0xe7,
+        &&op_0xe8, &&op_0xe9, &&op_0xea, &&op_0xeb, &&op_0xec, &&op_invalid, &&op_0xee, &&op_0xef,
+        &&op_0xf0, &&op_0xf1, &&op_0xf2, &&op_0xf3, &&op_0xf4, &&op_0xf5, &&op_0xf6, &&op_0xf7,
+        &&op_0xf8, &&op_0xf9, &&op_0xfa, &&op_0xfb, &&op_0xfc, &&op_invalid, &&op_0xfe, &&op_0xff,
+    };
+
+    if (machine->debugger)
+        return debugger_run(machine->debugger, cycles);
+
+    machine->stop = false;
+    CACHE(machine);
+
+    u64 target = cpu->cycles + cycles;
+    u64 count = 0;
+    u8 opcode;
+
+    SYNC;
+
+#define OP(opcode) op_##opcode:
+#define OP_DEFAULT op_invalid:
+#define NEXT                                    \
+    do {                                        \
+        if (cpu->cycles >= target)              \
+            goto done;                          \
+        opcode = fetch_byte(cpu, cpu->pc++);    \
+        OBSERVE(cpu->pc - 1, opcode, cpu->cycles, false); \
+        cpu->cycles += CYCLES[opcode];          \
+        count++;                                \
+        goto *dispatch[opcode];                 \
+    } while (0)
+
+    NEXT;
+#include "opcodes.h"
+#undef OP
+#undef OP_DEFAULT
+#undef NEXT
+
+done:
+    WRITE_BACK();
+    return count;
+}
+
+#elif defined(CPU_BLOCK_CACHE)
+
+const char *cpu_engine(void) {
+#ifdef CPU_JIT
+    return "jit";
+#else
+    return "block";
+#endif
+}
+
+/**
+ * Block engine: runs pre-decoded blocks from the block cache. The cycles of a
+ * whole block are accounted on entry, and the budget is only checked between
+ * blocks.
+ *
+ * With CPU_JIT, blocks that run JIT_THRESHOLD times are translated to native
+ * code. Interrupts and stop requests are then handled between blocks; blocks
+ * that cannot be translated, or all of them if there is no translator for
+ * the host, keep being interpreted.
+ */
+u64 cpu_run(CPU *machine, u64 cycles) {
+    if (machine->debugger)
+        return debugger_run(machine->debugger, cycles);
+
+    machine->stop = false;
+    CACHE(machine);
+
+    u64 target = cpu->cycles + cycles;
+    u64 count = 0;
+
+    SYNC;
+
+#define OP(opcode) case opcode:
+#define OP_DEFAULT default:
+#define NEXT       break
+#undef IMM8
+#undef IMM16
+#define IMM8       ((u8)uop->imm)
+#define IMM16      uop->imm
+
+    BlockCache *blocks = cpu->blocks;
+
+    while (cpu->cycles < target) {
+        block_collect(blocks);
+
+        Block *block = block_fetch(machine, blocks, cpu->pc);
+        const MicroOp *uop = block->ops;
+        const MicroOp *end = uop + block->count;
+
+        cpu->cycles += block->cycles;
+
+#ifdef CPU_JIT
+        if (!block->native && cpu->jit && ++block->hits == JIT_THRESHOLD && !OBSERVED(cpu))
+            jit_translate(cpu->jit, cpu->blocks, block);
+
+        // Translated code runs whole blocks, so it is left alone while
+        // tracing or profiling.
+        if (block->native && !OBSERVED(cpu)) {
+            count += ((JitBlock)block->native)(cpu);
+            SYNC;
+            continue;
+        }
+#endif
+
+        count += block->count;
+
+#ifdef CPU_OBSERVED
+        // Cycles accounted for but not run yet.
+        u64 ahead = block->cycles;
+#endif
+
+        for (; uop < end; uop++) {
+            u8 opcode = uop->opcode;
+#ifdef CPU_OBSERVED
+            OBSERVE(uop == block->ops ? block->start : uop[-1].next, opcode, cpu->cycles - ahead, false);
+            ahead -= CYCLES[opcode];
+#endif
+            cpu->pc = uop->next;
+
+            switch (opcode) {
+#include "opcodes.h"
+            }
+
+            // The block wrote over its own code: give back the cycles and
+            // the count of the stale instructions and decode again from
+            // here.
+            if (!block->valid) {
+                while (++uop < end) {
+                    cpu->cycles -= CYCLES[uop->opcode];
+                    count--;
+                }
+                break;
+            }
+        }
     }
+
+#undef OP
+#undef OP_DEFAULT
+#undef NEXT
+#undef IMM8
+#undef IMM16
+
+done:
+    WRITE_BACK();
+    block_collect(cpu->blocks);
+    return count;
 }
+
+#else
+
+const char *cpu_engine(void) {
+    return "switch";
+}
+
+u64 cpu_run(CPU *machine, u64 cycles) {
+    if (machine->debugger)
+        return debugger_run(machine->debugger, cycles);
+
+    machine->stop = false;
+    CACHE(machine);
+
+    u64 target = cpu->cycles + cycles;
+    u64 count = 0;
+
+    SYNC;
+
+    while (cpu->cycles < target) {
+        u8 opcode = fetch_byte(cpu, cpu->pc++);
+        OBSERVE(cpu->pc - 1, opcode, cpu->cycles, false);
+        cpu->cycles += CYCLES[opcode];
+        count++;
+
+        switch (opcode) {
+#define OP(opcode) case opcode:
+#define OP_DEFAULT default:
+#define NEXT       break
+#include "opcodes.h"
+#undef OP
+#undef OP_DEFAULT
+#undef NEXT
+        }
+    }
+
+done:
+    WRITE_BACK();
+    return count;
+}
+
+#endif
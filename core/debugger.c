@@ -0,0 +1,696 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debugger.h"
+#include "disassembler.h"
+
+static const char *const REGISTERS[] = {
+    "a", "b", "c", "d", "e", "h", "l", "f", "bc", "de", "hl", "sp", "pc",
+};
+
+static const char *const OPERATORS[] = {
+    "==", "!=", "<", "<=", ">", ">=", "&",
+};
+
+#define FLAGS_MASK (FLAG_SIGN | FLAG_ZERO | FLAG_AUX_CARRY | FLAG_PARITY | FLAG_CARRY)
+
+// A memory or port access an instruction is about to make.
+typedef struct Access {
+    u8 kind;
+    u16 addr; // Or port.
+    u8 size;
+} Access;
+
+static void update(Debugger *debugger) {
+    bool armed = debugger->count || debugger->steps || debugger->paused;
+    debugger->cpu->debugger = armed ? debugger : 0;
+}
+
+Debugger *debugger_new(CPU *cpu, File *in, File *out) {
+    Debugger *debugger = calloc(1, sizeof(Debugger));
+    if (!debugger) {
+        fprintf(stderr, "Debugger: Out of memory.\n");
+        exit(1);
+    }
+
+    debugger->cpu = cpu;
+    debugger->in = in;
+    debugger->out = out;
+    debugger->next_id = 1;
+    debugger->listed = cpu->pc;
+
+    return debugger;
+}
+
+void debugger_free(Debugger *debugger) {
+    if (!debugger)
+        return;
+
+    if (debugger->cpu->debugger == debugger)
+        debugger->cpu->debugger = 0;
+
+    free(debugger);
+}
+
+// Builds the filters the run loop checks from the points.
+static void rebuild(Debugger *debugger) {
+    memset(debugger->code, 0, sizeof(debugger->code));
+    memset(debugger->pages, 0, sizeof(debugger->pages));
+    memset(debugger->ports, 0, sizeof(debugger->ports));
+    debugger->watched = 0;
+    debugger->conditions = 0;
+
+    for (u32 i = 0; i < debugger->count; i++) {
+        DebugPoint *point = &debugger->points[i];
+        debugger->watched |= point->kind;
+
+        if (!point->kind)
+            debugger->conditions++;
+        if (point->kind & DEBUG_EXECUTE)
+            debugger->code[point->start]++;
+
+        for (u32 page = point->start / PAGE_SIZE; page <= point->end / PAGE_SIZE; page++)
+            debugger->pages[page] |= point->kind & (DEBUG_READ | DEBUG_WRITE);
+
+        for (u32 port = point->start; port <= point->end && port < 256; port++)
+            debugger->ports[port] |= point->kind & (DEBUG_IN | DEBUG_OUT);
+    }
+
+    update(debugger);
+}
+
+static u32 add(Debugger *debugger, u8 kind, u16 start, u16 end, const DebugCondition *condition) {
+    if (debugger->count == DEBUG_POINTS) {
+        fprintf(debugger->out, "No room for more than %d points.\n", DEBUG_POINTS);
+        return 0;
+    }
+
+    DebugPoint *point = &debugger->points[debugger->count++];
+    *point = (DebugPoint){ debugger->next_id++, kind, start, end, { 0 }, false, 0 };
+    if (condition)
+        point->condition = *condition;
+
+    rebuild(debugger);
+    return point->id;
+}
+
+/**
+ * Stops the CPU before the instruction at `addr` runs, if `condition`
+ * holds when it is given. Returns the breakpoint's id, or 0 if there is no
+ * room for it.
+ */
+u32 debugger_break(Debugger *debugger, u16 addr, const DebugCondition *condition) {
+    return add(debugger, DEBUG_EXECUTE, addr, addr, condition);
+}
+
+/**
+ * Stops the CPU after an instruction accesses an address from `start` to
+ * `end` with DEBUG_READ or DEBUG_WRITE in `kind`, or a port in that range
+ * with DEBUG_IN or DEBUG_OUT.
+ */
+u32 debugger_watch(Debugger *debugger, u8 kind, u16 start, u16 end, const DebugCondition *condition) {
+    return add(debugger, kind & ~DEBUG_EXECUTE, start, end, condition);
+}
+
+// Stops the CPU before the first instruction `condition` holds at.
+u32 debugger_when(Debugger *debugger, const DebugCondition *condition) {
+    return add(debugger, 0, 0, 0, condition);
+}
+
+bool debugger_delete(Debugger *debugger, u32 id) {
+    for (u32 i = 0; i < debugger->count; i++) {
+        if (debugger->points[i].id == id) {
+            debugger->points[i] = debugger->points[--debugger->count];
+            rebuild(debugger);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Stops the CPU before the next instruction it runs.
+void debugger_pause(Debugger *debugger) {
+    debugger->paused = true;
+    update(debugger);
+}
+
+static u8 fetched(const CPU *cpu, u16 addr) {
+    return cpu->map->fetch[addr / PAGE_SIZE][addr % PAGE_SIZE];
+}
+
+// What is in memory at `addr`, or -1 if reading it would go to a device.
+static int peek(const CPU *cpu, u16 addr) {
+    const u8 *page = cpu->map->read[addr / PAGE_SIZE];
+    return page ? page[addr % PAGE_SIZE] : -1;
+}
+
+static u16 value_of(CPU *cpu, DebugRegister reg) {
+    switch (reg) {
+        case DEBUG_A:  return cpu->regs.a;
+        case DEBUG_B:  return cpu->regs.b;
+        case DEBUG_C:  return cpu->regs.c;
+        case DEBUG_D:  return cpu->regs.d;
+        case DEBUG_E:  return cpu->regs.e;
+        case DEBUG_H:  return cpu->regs.h;
+        case DEBUG_L:  return cpu->regs.l;
+        case DEBUG_F:  return cpu_flags(cpu);
+        case DEBUG_BC: return cpu->regs.bc;
+        case DEBUG_DE: return cpu->regs.de;
+        case DEBUG_HL: return cpu->regs.hl;
+        case DEBUG_SP: return cpu->sp;
+        case DEBUG_PC: return cpu->pc;
+    }
+
+    return 0;
+}
+
+static bool holds(CPU *cpu, const DebugCondition *condition) {
+    if (!condition->used)
+        return true;
+
+    u16 value = value_of(cpu, condition->reg);
+    switch (condition->op) {
+        case DEBUG_EQUAL:         return value == condition->value;
+        case DEBUG_NOT_EQUAL:     return value != condition->value;
+        case DEBUG_LESS:          return value < condition->value;
+        case DEBUG_LESS_EQUAL:    return value <= condition->value;
+        case DEBUG_GREATER:       return value > condition->value;
+        case DEBUG_GREATER_EQUAL: return value >= condition->value;
+        case DEBUG_AND:           return (value & condition->value) != 0;
+    }
+
+    return false;
+}
+
+// Whether the conditional call or return `opcode` will be taken.
+static bool taken(CPU *cpu, u8 opcode) {
+    static const u8 FLAGS[4] = { FLAG_ZERO, FLAG_CARRY, FLAG_PARITY, FLAG_SIGN };
+
+    bool set = cpu_flags(cpu) & FLAGS[opcode >> 4 & 3];
+    return opcode & 0x08 ? set : !set;
+}
+
+/**
+ * The memory or port access `opcode` will make when it runs next, if it
+ * makes one. Instructions that both read and write, like INR M and XTHL,
+ * access the same bytes both ways.
+ */
+static bool decode(CPU *cpu, u8 opcode, Access *access) {
+    u16 hl = cpu->regs.hl;
+    u16 imm = fetched(cpu, cpu->pc + 1) | fetched(cpu, cpu->pc + 2) << 8;
+    u16 pushed = cpu->sp - 2;
+
+    switch (opcode) {
+        case 0x0a: *access = (Access){ DEBUG_READ, cpu->regs.bc, 1 }; return true;
+        case 0x1a: *access = (Access){ DEBUG_READ, cpu->regs.de, 1 }; return true;
+        case 0x02: *access = (Access){ DEBUG_WRITE, cpu->regs.bc, 1 }; return true;
+        case 0x12: *access = (Access){ DEBUG_WRITE, cpu->regs.de, 1 }; return true;
+        case 0x3a: *access = (Access){ DEBUG_READ, imm, 1 }; return true;
+        case 0x32: *access = (Access){ DEBUG_WRITE, imm, 1 }; return true;
+        case 0x2a: *access = (Access){ DEBUG_READ, imm, 2 }; return true;
+        case 0x22: *access = (Access){ DEBUG_WRITE, imm, 2 }; return true;
+        case 0x34: case 0x35:
+        case 0x76: *access = (Access){ DEBUG_READ | DEBUG_WRITE, hl, 1 }; return true;
+        case 0x36: *access = (Access){ DEBUG_WRITE, hl, 1 }; return true;
+        case 0xe3: *access = (Access){ DEBUG_READ | DEBUG_WRITE, cpu->sp, 2 }; return true;
+        case 0xc5: case 0xd5: case 0xe5: case 0xf5:
+        case 0xcd: case 0xdd:
+            *access = (Access){ DEBUG_WRITE, pushed, 2 };
+            return true;
+        case 0xc1: case 0xd1: case 0xe1: case 0xf1:
+        case 0xc9:
+            *access = (Access){ DEBUG_READ, cpu->sp, 2 };
+            return true;
+        case 0xdb: *access = (Access){ DEBUG_IN, imm & 0xff, 1 }; return true;
+        case 0xd3: *access = (Access){ DEBUG_OUT, imm & 0xff, 1 }; return true;
+    }
+
+    if ((opcode & 0xc7) == 0xc7 || ((opcode & 0xc7) == 0xc4 && taken(cpu, opcode)))
+        *access = (Access){ DEBUG_WRITE, pushed, 2 };
+    else if ((opcode & 0xc7) == 0xc0 && taken(cpu, opcode))
+        *access = (Access){ DEBUG_READ, cpu->sp, 2 };
+    else if (opcode >= 0x70 && opcode <= 0x77)
+        *access = (Access){ DEBUG_WRITE, hl, 1 };
+    else if ((opcode & 0xc7) == 0x46 || (opcode & 0xc7) == 0x86)
+        *access = (Access){ DEBUG_READ, hl, 1 };
+    else
+        return false;
+
+    return true;
+}
+
+// Whether a point may watch `access`, from the filters alone.
+static bool filtered(const Debugger *debugger, const Access *access) {
+    if (access->kind & (DEBUG_IN | DEBUG_OUT))
+        return debugger->ports[access->addr] & access->kind;
+
+    u16 last = access->addr + access->size - 1;
+    return (debugger->pages[access->addr / PAGE_SIZE] | debugger->pages[last / PAGE_SIZE]) & access->kind;
+}
+
+// Formats the instruction at `addr` into `text` and returns its length.
+static u8 instruction_at(const CPU *cpu, u16 addr, char *text) {
+    u8 bytes[3] = { fetched(cpu, addr), fetched(cpu, addr + 1), fetched(cpu, addr + 2) };
+
+    Instruction instruction;
+    u8 length = disassemble(bytes, sizeof(bytes), addr, addr, &instruction);
+    disassemble_format(&instruction, 0, text);
+
+    return length ? length : 1;
+}
+
+static void show(Debugger *debugger) {
+    CPU *cpu = debugger->cpu;
+    char text[DIS_TEXT];
+    instruction_at(cpu, cpu->pc, text);
+
+    fprintf(debugger->out, "%04x  %-16s A %02x  F %02x  BC %04x  DE %04x  HL %04x  SP %04x  %s  %llu cycles\n",
+            cpu->pc, text, cpu->regs.a, cpu_flags(cpu), cpu->regs.bc, cpu->regs.de,
+            cpu->regs.hl, cpu->sp, cpu->interrupts_enabled ? "EI" : "DI",
+            (unsigned long long)cpu->cycles);
+}
+
+static void describe(Debugger *debugger, const DebugPoint *point) {
+    File *out = debugger->out;
+    const DebugCondition *condition = &point->condition;
+
+    fprintf(out, "%3u  ", point->id);
+    if (point->kind & DEBUG_EXECUTE)
+        fprintf(out, "break %04x", point->start);
+    else if (point->kind & (DEBUG_READ | DEBUG_WRITE)) {
+        const char *kind = (point->kind & DEBUG_READ) && (point->kind & DEBUG_WRITE) ? "rw"
+                         : point->kind & DEBUG_READ ? "r" : "w";
+        fprintf(out, "watch %s %04x-%04x", kind, point->start, point->end);
+    }
+    else if (point->kind & (DEBUG_IN | DEBUG_OUT)) {
+        const char *kind = (point->kind & DEBUG_IN) && (point->kind & DEBUG_OUT) ? "io"
+                         : point->kind & DEBUG_IN ? "in" : "out";
+        fprintf(out, "port %s %02x-%02x", kind, point->start, point->end);
+    }
+    else
+        fprintf(out, "when");
+
+    if (condition->used)
+        fprintf(out, " %s %s %x", REGISTERS[condition->reg], OPERATORS[condition->op], condition->value);
+
+    fprintf(out, ", %llu hits\n", (unsigned long long)point->hits);
+}
+
+static bool parse_number(const char *word, int base, u32 max, u32 *value) {
+    char *end;
+    if (!word || !*word)
+        return false;
+
+    *value = strtoul(word, &end, base);
+    return !*end && *value <= max;
+}
+
+static bool parse_hex(const char *word, u32 max, u32 *value) {
+    return parse_number(word, 16, max, value);
+}
+
+// Ids and counts are in decimal.
+static bool parse_count(const char *word, u32 max, u32 *value) {
+    return parse_number(word, 10, max, value);
+}
+
+// `start` or `start-end`.
+static bool parse_range(const char *word, u32 max, u16 *start, u16 *end) {
+    char copy[32];
+    u32 first, last;
+    if (!word || strlen(word) >= sizeof(copy))
+        return false;
+
+    strcpy(copy, word);
+    char *dash = strchr(copy, '-');
+    if (dash)
+        *dash = 0;
+
+    if (!parse_hex(copy, max, &first) || !parse_hex(dash ? dash + 1 : copy, max, &last) || last < first)
+        return false;
+
+    *start = first;
+    *end = last;
+    return true;
+}
+
+static bool parse_register(const char *word, DebugRegister *reg) {
+    for (u32 i = 0; word && i < sizeof(REGISTERS) / sizeof(REGISTERS[0]); i++) {
+        if (!strcmp(word, REGISTERS[i])) {
+            *reg = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// `reg op value`, from three words.
+static bool parse_condition(char **words, DebugCondition *condition) {
+    u32 value;
+    if (!parse_register(words[0], &condition->reg) || !words[1] || !parse_hex(words[2], 0xffff, &value))
+        return false;
+
+    for (u32 i = 0; i < sizeof(OPERATORS) / sizeof(OPERATORS[0]); i++) {
+        if (!strcmp(words[1], OPERATORS[i])) {
+            condition->used = true;
+            condition->op = i;
+            condition->value = value;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void set_register(CPU *cpu, DebugRegister reg, u16 value) {
+    switch (reg) {
+        case DEBUG_A:  cpu->regs.a = value; break;
+        case DEBUG_B:  cpu->regs.b = value; break;
+        case DEBUG_C:  cpu->regs.c = value; break;
+        case DEBUG_D:  cpu->regs.d = value; break;
+        case DEBUG_E:  cpu->regs.e = value; break;
+        case DEBUG_H:  cpu->regs.h = value; break;
+        case DEBUG_L:  cpu->regs.l = value; break;
+        case DEBUG_BC: cpu->regs.bc = value; break;
+        case DEBUG_DE: cpu->regs.de = value; break;
+        case DEBUG_HL: cpu->regs.hl = value; break;
+        case DEBUG_SP: cpu->sp = value; break;
+        case DEBUG_PC: cpu->pc = value; break;
+        case DEBUG_F:
+            // Folds deferred flags in first, so they do not overwrite these.
+            cpu_flags(cpu);
+            cpu->flags = value & FLAGS_MASK;
+            break;
+    }
+}
+
+static void dump(Debugger *debugger, u16 addr, u32 length) {
+    for (u32 offset = 0; offset < length; offset += 16) {
+        fprintf(debugger->out, "%04x ", (u16)(addr + offset));
+        for (u32 i = offset; i < offset + 16 && i < length; i++) {
+            int value = peek(debugger->cpu, addr + i);
+            if (value < 0)
+                fprintf(debugger->out, " --");
+            else
+                fprintf(debugger->out, " %02x", value);
+        }
+        fprintf(debugger->out, "\n");
+    }
+}
+
+static void list(Debugger *debugger, u16 addr, u32 count) {
+    for (u32 i = 0; i < count; i++) {
+        char text[DIS_TEXT];
+        u8 length = instruction_at(debugger->cpu, addr, text);
+        fprintf(debugger->out, "%04x  %s\n", addr, text);
+        addr += length;
+    }
+
+    debugger->listed = addr;
+}
+
+static void help(Debugger *debugger) {
+    fprintf(debugger->out,
+            "c                            continue\n"
+            "s [n]                        run n instructions, 1 by default\n"
+            "b addr [cond]                break before the instruction at addr\n"
+            "watch [r|w|rw] addr[-addr] [cond]\n"
+            "                             break after memory is read or written\n"
+            "port [in|out] port[-port] [cond]\n"
+            "                             break after IN or OUT on a port\n"
+            "when cond                    break when cond becomes true\n"
+            "l                            list breakpoints and watchpoints\n"
+            "d id                         delete one\n"
+            "r                            show the registers\n"
+            "set reg value                change a register\n"
+            "x addr [n]                   dump n bytes of memory\n"
+            "u [addr] [n]                 disassemble n instructions\n"
+            "q                            quit\n"
+            "\n"
+            "Addresses, ports and values are in hex, ids and counts in decimal.\n"
+            "A condition is `reg op value`, where reg is one\n"
+            "of a b c d e h l f bc de hl sp pc and op one of == != < <= > >= &.\n");
+}
+
+#define MAX_WORDS 8
+
+/**
+ * Reads commands until one resumes the run. At the end of the input, the
+ * run goes on and every later stop is only reported.
+ */
+static void console(Debugger *debugger) {
+    CPU *cpu = debugger->cpu;
+    File *out = debugger->out;
+    char line[256];
+
+    debugger->steps = 0;
+    debugger->paused = false;
+    debugger->listed = cpu->pc;
+    show(debugger);
+
+    while (fprintf(out, "> "), fflush(out), fgets(line, sizeof(line), debugger->in)) {
+        char *words[MAX_WORDS + 1] = { 0 };
+        u32 count = 0;
+        for (char *word = strtok(line, " \t\r\n"); word && count < MAX_WORDS; word = strtok(0, " \t\r\n"))
+            words[count++] = word;
+
+        if (!count)
+            continue;
+
+        const char *command = words[0];
+        DebugCondition condition = { 0 };
+        DebugRegister reg;
+        u32 value, length;
+        u16 start, end;
+        u32 id = 0;
+
+        if (!strcmp(command, "c"))
+            break;
+        else if (!strcmp(command, "s")) {
+            debugger->steps = 1;
+            if (count > 1 && (!parse_count(words[1], ~0u, &value) || !value))
+                goto invalid;
+            if (count > 1)
+                debugger->steps = value;
+            break;
+        }
+        else if (!strcmp(command, "b")) {
+            if (!parse_hex(words[1], 0xffff, &value) || (count > 2 && !parse_condition(words + 2, &condition)))
+                goto invalid;
+            id = debugger_break(debugger, value, &condition);
+        }
+        else if (!strcmp(command, "watch") || !strcmp(command, "port")) {
+            bool memory = !strcmp(command, "watch");
+            u8 kind = memory ? DEBUG_WRITE : DEBUG_IN | DEBUG_OUT;
+            u32 at = 1;
+
+            if (words[1] && !strcmp(words[1], memory ? "r" : "in"))
+                kind = memory ? DEBUG_READ : DEBUG_IN;
+            else if (words[1] && !strcmp(words[1], memory ? "w" : "out"))
+                kind = memory ? DEBUG_WRITE : DEBUG_OUT;
+            else if (words[1] && !strcmp(words[1], memory ? "rw" : "io"))
+                kind = memory ? DEBUG_READ | DEBUG_WRITE : DEBUG_IN | DEBUG_OUT;
+            else
+                at = 0;
+
+            if (!parse_range(words[1 + at], memory ? 0xffff : 0xff, &start, &end)
+                    || (count > 2 + at && !parse_condition(words + 2 + at, &condition)))
+                goto invalid;
+            id = debugger_watch(debugger, kind, start, end, &condition);
+        }
+        else if (!strcmp(command, "when")) {
+            if (!parse_condition(words + 1, &condition))
+                goto invalid;
+            id = debugger_when(debugger, &condition);
+        }
+        else if (!strcmp(command, "l")) {
+            for (u32 i = 0; i < debugger->count; i++)
+                describe(debugger, &debugger->points[i]);
+        }
+        else if (!strcmp(command, "d")) {
+            if (!parse_count(words[1], ~0u, &value))
+                goto invalid;
+            if (!debugger_delete(debugger, value))
+                fprintf(out, "No point %u.\n", value);
+        }
+        else if (!strcmp(command, "r"))
+            show(debugger);
+        else if (!strcmp(command, "set")) {
+            if (!parse_register(words[1], &reg) || !parse_hex(words[2], 0xffff, &value))
+                goto invalid;
+            set_register(cpu, reg, value);
+            show(debugger);
+        }
+        else if (!strcmp(command, "x")) {
+            length = 64;
+            if (!parse_hex(words[1], 0xffff, &value) || (count > 2 && !parse_count(words[2], 0x10000, &length)))
+                goto invalid;
+            dump(debugger, value, length);
+        }
+        else if (!strcmp(command, "u")) {
+            value = debugger->listed;
+            length = 16;
+            if ((count > 1 && !parse_hex(words[1], 0xffff, &value))
+                    || (count > 2 && !parse_count(words[2], 0x10000, &length)))
+                goto invalid;
+            list(debugger, value, length);
+        }
+        else if (!strcmp(command, "q"))
+            exit(0);
+        else if (!strcmp(command, "h") || !strcmp(command, "?"))
+            help(debugger);
+        else
+            goto invalid;
+
+        if (id)
+            describe(debugger, &debugger->points[debugger->count - 1]);
+        continue;
+
+    invalid:
+        fprintf(out, "Invalid command, h for help.\n");
+    }
+
+    // Whatever the run stopped at is not hit again before it moves on.
+    debugger->resume = true;
+    update(debugger);
+}
+
+static void stop(Debugger *debugger, DebugPoint *point, const char *format, ...) {
+    if (point) {
+        point->hits++;
+        fprintf(debugger->out, "%u: ", point->id);
+    }
+
+    va_list args;
+    va_start(args, format);
+    vfprintf(debugger->out, format, args);
+    va_end(args);
+
+    console(debugger);
+}
+
+// Whether the CPU stops before the instruction at PC runs.
+static bool stops_before(Debugger *debugger) {
+    CPU *cpu = debugger->cpu;
+    DebugPoint *hit = 0;
+
+    if (debugger->code[cpu->pc]) {
+        for (u32 i = 0; i < debugger->count && !hit; i++) {
+            DebugPoint *point = &debugger->points[i];
+            if (point->kind & DEBUG_EXECUTE && point->start == cpu->pc && holds(cpu, &point->condition))
+                hit = point;
+        }
+
+        if (hit) {
+            stop(debugger, hit, "Breakpoint at %04x\n", cpu->pc);
+            return true;
+        }
+    }
+
+    // Every condition is brought up to date, even past the first one that
+    // stops the CPU.
+    for (u32 i = 0; i < debugger->count && debugger->conditions; i++) {
+        DebugPoint *point = &debugger->points[i];
+        if (point->kind)
+            continue;
+
+        bool now = holds(cpu, &point->condition);
+        if (now && !point->held && !hit)
+            hit = point;
+        point->held = now;
+    }
+
+    if (hit) {
+        const DebugCondition *condition = &hit->condition;
+        stop(debugger, hit, "%s %s %x\n", REGISTERS[condition->reg], OPERATORS[condition->op],
+             condition->value);
+        return true;
+    }
+
+    if (debugger->paused) {
+        stop(debugger, 0, "Paused\n");
+        return true;
+    }
+
+    return false;
+}
+
+// The first point that watches a byte of `access`, after it was made.
+static DebugPoint *watcher(Debugger *debugger, const Access *access, u16 *addr) {
+    for (u32 i = 0; i < debugger->count; i++) {
+        DebugPoint *point = &debugger->points[i];
+        if (!(point->kind & access->kind) || !holds(debugger->cpu, &point->condition))
+            continue;
+
+        for (u32 byte = 0; byte < access->size; byte++) {
+            *addr = access->addr + byte;
+            if (*addr >= point->start && *addr <= point->end)
+                return point;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Runs the CPU like cpu_run, one instruction at a time, and stops it at
+ * every point it hits to take commands. Returns the instructions run.
+ */
+u64 debugger_run(Debugger *debugger, u64 cycles) {
+    CPU *cpu = debugger->cpu;
+    cpu->stop = false;
+
+    u64 target = cpu->cycles + cycles;
+    u64 count = 0;
+
+    while (cpu->cycles < target && !cpu->stop) {
+        // Nothing left to check: the rest of the run goes at full speed.
+        if (cpu->debugger != debugger)
+            return count + cpu_run(cpu, target - cpu->cycles);
+
+        bool interrupt = cpu->interrupts_enabled && cpu->interrupt_vector;
+        u8 opcode = interrupt ? cpu->interrupt_vector : fetched(cpu, cpu->pc);
+
+        if (!interrupt) {
+            bool resume = debugger->resume;
+            debugger->resume = false;
+            if (!resume && stops_before(debugger))
+                continue;
+        }
+
+        Access access;
+        bool watching = debugger->watched & ~DEBUG_EXECUTE && decode(cpu, opcode, &access)
+                     && filtered(debugger, &access);
+        int before[2] = { 0 };
+        if (watching && access.kind & DEBUG_WRITE) {
+            before[0] = peek(cpu, access.addr);
+            before[1] = peek(cpu, access.addr + 1);
+        }
+
+        u16 pc = cpu->pc;
+        cpu_step(cpu);
+        count += !interrupt;
+
+        u16 addr;
+        DebugPoint *point = watching ? watcher(debugger, &access, &addr) : 0;
+        if (point && point->kind & access.kind & DEBUG_WRITE) {
+            int old = before[(u16)(addr - access.addr)];
+            stop(debugger, point, "write %04x %02x -> %02x by %04x%s\n", addr, old & 0xff,
+                 peek(cpu, addr) & 0xff, pc, interrupt ? " (interrupt)" : "");
+        }
+        else if (point && point->kind & access.kind & DEBUG_READ)
+            stop(debugger, point, "read %04x (%02x) by %04x%s\n", addr, peek(cpu, addr) & 0xff,
+                 pc, interrupt ? " (interrupt)" : "");
+        else if (point)
+            stop(debugger, point, "%s %02x, A %02x, by %04x\n", access.kind & DEBUG_IN ? "in" : "out",
+                 access.addr, cpu->regs.a, pc);
+        else if (!interrupt && debugger->steps && --debugger->steps == 0)
+            console(debugger);
+    }
+
+    return count;
+}
@@ -1,337 +1,539 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdarg.h>
+#include <string.h>
 
 #include "types.h"
-#include "cpu.h"
+#include "disassembler.h"
+
+// Decodes what the core runs (core/opcodes.h), not the documented 8080:
+// the undocumented NOPs and CALL are code, 0x76 moves [HL] onto itself
+// rather than halting and 0xc7 is not implemented.
+static const struct {
+    const char *mnemonic;
+    DisOperand kind;
+    DisFlow flow;
+} OPCODES[256] = {
+    [0x00] = { "NOP", OPERAND_NONE, DIS_NEXT },
+    [0x01] = { "LXI B,", OPERAND_WORD, DIS_NEXT },
+    [0x02] = { "STAX B", OPERAND_NONE, DIS_NEXT },
+    [0x03] = { "INX B", OPERAND_NONE, DIS_NEXT },
+    [0x04] = { "INR B", OPERAND_NONE, DIS_NEXT },
+    [0x05] = { "DCR B", OPERAND_NONE, DIS_NEXT },
+    [0x06] = { "MVI B,", OPERAND_BYTE, DIS_NEXT },
+    [0x07] = { "RLC", OPERAND_NONE, DIS_NEXT },
+    [0x08] = { "NOP", OPERAND_NONE, DIS_NEXT },
+    [0x09] = { "DAD B", OPERAND_NONE, DIS_NEXT },
+    [0x0a] = { "LDAX B", OPERAND_NONE, DIS_NEXT },
+    [0x0b] = { "DCX B", OPERAND_NONE, DIS_NEXT },
+    [0x0c] = { "INR C", OPERAND_NONE, DIS_NEXT },
+    [0x0d] = { "DCR C", OPERAND_NONE, DIS_NEXT },
+    [0x0e] = { "MVI C,", OPERAND_BYTE, DIS_NEXT },
+    [0x0f] = { "RRC", OPERAND_NONE, DIS_NEXT },
+    [0x10] = { "NOP", OPERAND_NONE, DIS_NEXT },
+    [0x11] = { "LXI D,", OPERAND_WORD, DIS_NEXT },
+    [0x12] = { "STAX D", OPERAND_NONE, DIS_NEXT },
+    [0x13] = { "INX D", OPERAND_NONE, DIS_NEXT },
+    [0x14] = { "INR D", OPERAND_NONE, DIS_NEXT },
+    [0x15] = { "DCR D", OPERAND_NONE, DIS_NEXT },
+    [0x16] = { "MVI D,", OPERAND_BYTE, DIS_NEXT },
+    [0x17] = { "RAL", OPERAND_NONE, DIS_NEXT },
+    [0x18] = { "NOP", OPERAND_NONE, DIS_NEXT },
+    [0x19] = { "DAD D", OPERAND_NONE, DIS_NEXT },
+    [0x1a] = { "LDAX D", OPERAND_NONE, DIS_NEXT },
+    [0x1b] = { "DCX D", OPERAND_NONE, DIS_NEXT },
+    [0x1c] = { "INR E", OPERAND_NONE, DIS_NEXT },
+    [0x1d] = { "DCR E", OPERAND_NONE, DIS_NEXT },
+    [0x1e] = { "MVI E,", OPERAND_BYTE, DIS_NEXT },
+    [0x1f] = { "RAR", OPERAND_NONE, DIS_NEXT },
+    [0x20] = { "NOP", OPERAND_NONE, DIS_NEXT },
+    [0x21] = { "LXI H,", OPERAND_WORD, DIS_NEXT },
+    [0x22] = { "SHLD ", OPERAND_DATA, DIS_NEXT },
+    [0x23] = { "INX H", OPERAND_NONE, DIS_NEXT },
+    [0x24] = { "INR H", OPERAND_NONE, DIS_NEXT },
+    [0x25] = { "DCR H", OPERAND_NONE, DIS_NEXT },
+    [0x26] = { "MVI H,", OPERAND_BYTE, DIS_NEXT },
+    [0x27] = { "DAA", OPERAND_NONE, DIS_NEXT },
+    [0x28] = { "NOP", OPERAND_NONE, DIS_NEXT },
+    [0x29] = { "DAD H", OPERAND_NONE, DIS_NEXT },
+    [0x2a] = { "LHLD ", OPERAND_DATA, DIS_NEXT },
+    [0x2b] = { "DCX H", OPERAND_NONE, DIS_NEXT },
+    [0x2c] = { "INR L", OPERAND_NONE, DIS_NEXT },
+    [0x2d] = { "DCR L", OPERAND_NONE, DIS_NEXT },
+    [0x2e] = { "MVI L,", OPERAND_BYTE, DIS_NEXT },
+    [0x2f] = { "CMA", OPERAND_NONE, DIS_NEXT },
+    [0x30] = { "NOP", OPERAND_NONE, DIS_NEXT },
+    [0x31] = { "LXI SP,", OPERAND_WORD, DIS_NEXT },
+    [0x32] = { "STA ", OPERAND_DATA, DIS_NEXT },
+    [0x33] = { "INX SP", OPERAND_NONE, DIS_NEXT },
+    [0x34] = { "INR M", OPERAND_NONE, DIS_NEXT },
+    [0x35] = { "DCR M", OPERAND_NONE, DIS_NEXT },
+    [0x36] = { "MVI M,", OPERAND_BYTE, DIS_NEXT },
+    [0x37] = { "STC", OPERAND_NONE, DIS_NEXT },
+    [0x38] = { "NOP", OPERAND_NONE, DIS_NEXT },
+    [0x39] = { "DAD SP", OPERAND_NONE, DIS_NEXT },
+    [0x3a] = { "LDA ", OPERAND_DATA, DIS_NEXT },
+    [0x3b] = { "DCX SP", OPERAND_NONE, DIS_NEXT },
+    [0x3c] = { "INR A", OPERAND_NONE, DIS_NEXT },
+    [0x3d] = { "DCR A", OPERAND_NONE, DIS_NEXT },
+    [0x3e] = { "MVI A,", OPERAND_BYTE, DIS_NEXT },
+    [0x3f] = { "CMC", OPERAND_NONE, DIS_NEXT },
+    [0x40] = { "MOV B,B", OPERAND_NONE, DIS_NEXT },
+    [0x41] = { "MOV B,C", OPERAND_NONE, DIS_NEXT },
+    [0x42] = { "MOV B,D", OPERAND_NONE, DIS_NEXT },
+    [0x43] = { "MOV B,E", OPERAND_NONE, DIS_NEXT },
+    [0x44] = { "MOV B,H", OPERAND_NONE, DIS_NEXT },
+    [0x45] = { "MOV B,L", OPERAND_NONE, DIS_NEXT },
+    [0x46] = { "MOV B,M", OPERAND_NONE, DIS_NEXT },
+    [0x47] = { "MOV B,A", OPERAND_NONE, DIS_NEXT },
+    [0x48] = { "MOV C,B", OPERAND_NONE, DIS_NEXT },
+    [0x49] = { "MOV C,C", OPERAND_NONE, DIS_NEXT },
+    [0x4a] = { "MOV C,D", OPERAND_NONE, DIS_NEXT },
+    [0x4b] = { "MOV C,E", OPERAND_NONE, DIS_NEXT },
+    [0x4c] = { "MOV C,H", OPERAND_NONE, DIS_NEXT },
+    [0x4d] = { "MOV C,L", OPERAND_NONE, DIS_NEXT },
+    [0x4e] = { "MOV C,M", OPERAND_NONE, DIS_NEXT },
+    [0x4f] = { "MOV C,A", OPERAND_NONE, DIS_NEXT },
+    [0x50] = { "MOV D,B", OPERAND_NONE, DIS_NEXT },
+    [0x51] = { "MOV D,C", OPERAND_NONE, DIS_NEXT },
+    [0x52] = { "MOV D,D", OPERAND_NONE, DIS_NEXT },
+    [0x53] = { "MOV D,E", OPERAND_NONE, DIS_NEXT },
+    [0x54] = { "MOV D,H", OPERAND_NONE, DIS_NEXT },
+    [0x55] = { "MOV D,L", OPERAND_NONE, DIS_NEXT },
+    [0x56] = { "MOV D,M", OPERAND_NONE, DIS_NEXT },
+    [0x57] = { "MOV D,A", OPERAND_NONE, DIS_NEXT },
+    [0x58] = { "MOV E,B", OPERAND_NONE, DIS_NEXT },
+    [0x59] = { "MOV E,C", OPERAND_NONE, DIS_NEXT },
+    [0x5a] = { "MOV E,D", OPERAND_NONE, DIS_NEXT },
+    [0x5b] = { "MOV E,E", OPERAND_NONE, DIS_NEXT },
+    [0x5c] = { "MOV E,H", OPERAND_NONE, DIS_NEXT },
+    [0x5d] = { "MOV E,L", OPERAND_NONE, DIS_NEXT },
+    [0x5e] = { "MOV E,M", OPERAND_NONE, DIS_NEXT },
+    [0x5f] = { "MOV E,A", OPERAND_NONE, DIS_NEXT },
+    [0x60] = { "MOV H,B", OPERAND_NONE, DIS_NEXT },
+    [0x61] = { "MOV H,C", OPERAND_NONE, DIS_NEXT },
+    [0x62] = { "MOV H,D", OPERAND_NONE, DIS_NEXT },
+    [0x63] = { "MOV H,E", OPERAND_NONE, DIS_NEXT },
+    [0x64] = { "MOV H,H", OPERAND_NONE, DIS_NEXT },
+    [0x65] = { "MOV H,L", OPERAND_NONE, DIS_NEXT },
+    [0x66] = { "MOV H,M", OPERAND_NONE, DIS_NEXT },
+    [0x67] = { "MOV H,A", OPERAND_NONE, DIS_NEXT },
+    [0x68] = { "MOV L,B", OPERAND_NONE, DIS_NEXT },
+    [0x69] = { "MOV L,C", OPERAND_NONE, DIS_NEXT },
+    [0x6a] = { "MOV L,D", OPERAND_NONE, DIS_NEXT },
+    [0x6b] = { "MOV L,E", OPERAND_NONE, DIS_NEXT },
+    [0x6c] = { "MOV L,H", OPERAND_NONE, DIS_NEXT },
+    [0x6d] = { "MOV L,L", OPERAND_NONE, DIS_NEXT },
+    [0x6e] = { "MOV L,M", OPERAND_NONE, DIS_NEXT },
+    [0x6f] = { "MOV L,A", OPERAND_NONE, DIS_NEXT },
+    [0x70] = { "MOV M,B", OPERAND_NONE, DIS_NEXT },
+    [0x71] = { "MOV M,C", OPERAND_NONE, DIS_NEXT },
+    [0x72] = { "MOV M,D", OPERAND_NONE, DIS_NEXT },
+    [0x73] = { "MOV M,E", OPERAND_NONE, DIS_NEXT },
+    [0x74] = { "MOV M,H", OPERAND_NONE, DIS_NEXT },
+    [0x75] = { "MOV M,L", OPERAND_NONE, DIS_NEXT },
+    [0x76] = { "MOV M,M", OPERAND_NONE, DIS_NEXT },
+    [0x77] = { "MOV M,A", OPERAND_NONE, DIS_NEXT },
+    [0x78] = { "MOV A,B", OPERAND_NONE, DIS_NEXT },
+    [0x79] = { "MOV A,C", OPERAND_NONE, DIS_NEXT },
+    [0x7a] = { "MOV A,D", OPERAND_NONE, DIS_NEXT },
+    [0x7b] = { "MOV A,E", OPERAND_NONE, DIS_NEXT },
+    [0x7c] = { "MOV A,H", OPERAND_NONE, DIS_NEXT },
+    [0x7d] = { "MOV A,L", OPERAND_NONE, DIS_NEXT },
+    [0x7e] = { "MOV A,M", OPERAND_NONE, DIS_NEXT },
+    [0x7f] = { "MOV A,A", OPERAND_NONE, DIS_NEXT },
+    [0x80] = { "ADD B", OPERAND_NONE, DIS_NEXT },
+    [0x81] = { "ADD C", OPERAND_NONE, DIS_NEXT },
+    [0x82] = { "ADD D", OPERAND_NONE, DIS_NEXT },
+    [0x83] = { "ADD E", OPERAND_NONE, DIS_NEXT },
+    [0x84] = { "ADD H", OPERAND_NONE, DIS_NEXT },
+    [0x85] = { "ADD L", OPERAND_NONE, DIS_NEXT },
+    [0x86] = { "ADD M", OPERAND_NONE, DIS_NEXT },
+    [0x87] = { "ADD A", OPERAND_NONE, DIS_NEXT },
+    [0x88] = { "ADC B", OPERAND_NONE, DIS_NEXT },
+    [0x89] = { "ADC C", OPERAND_NONE, DIS_NEXT },
+    [0x8a] = { "ADC D", OPERAND_NONE, DIS_NEXT },
+    [0x8b] = { "ADC E", OPERAND_NONE, DIS_NEXT },
+    [0x8c] = { "ADC H", OPERAND_NONE, DIS_NEXT },
+    [0x8d] = { "ADC L", OPERAND_NONE, DIS_NEXT },
+    [0x8e] = { "ADC M", OPERAND_NONE, DIS_NEXT },
+    [0x8f] = { "ADC A", OPERAND_NONE, DIS_NEXT },
+    [0x90] = { "SUB B", OPERAND_NONE, DIS_NEXT },
+    [0x91] = { "SUB C", OPERAND_NONE, DIS_NEXT },
+    [0x92] = { "SUB D", OPERAND_NONE, DIS_NEXT },
+    [0x93] = { "SUB E", OPERAND_NONE, DIS_NEXT },
+    [0x94] = { "SUB H", OPERAND_NONE, DIS_NEXT },
+    [0x95] = { "SUB L", OPERAND_NONE, DIS_NEXT },
+    [0x96] = { "SUB M", OPERAND_NONE, DIS_NEXT },
+    [0x97] = { "SUB A", OPERAND_NONE, DIS_NEXT },
+    [0x98] = { "SBB B", OPERAND_NONE, DIS_NEXT },
+    [0x99] = { "SBB C", OPERAND_NONE, DIS_NEXT },
+    [0x9a] = { "SBB D", OPERAND_NONE, DIS_NEXT },
+    [0x9b] = { "SBB E", OPERAND_NONE, DIS_NEXT },
+    [0x9c] = { "SBB H", OPERAND_NONE, DIS_NEXT },
+    [0x9d] = { "SBB L", OPERAND_NONE, DIS_NEXT },
+    [0x9e] = { "SBB M", OPERAND_NONE, DIS_NEXT },
+    [0x9f] = { "SBB A", OPERAND_NONE, DIS_NEXT },
+    [0xa0] = { "ANA B", OPERAND_NONE, DIS_NEXT },
+    [0xa1] = { "ANA C", OPERAND_NONE, DIS_NEXT },
+    [0xa2] = { "ANA D", OPERAND_NONE, DIS_NEXT },
+    [0xa3] = { "ANA E", OPERAND_NONE, DIS_NEXT },
+    [0xa4] = { "ANA H", OPERAND_NONE, DIS_NEXT },
+    [0xa5] = { "ANA L", OPERAND_NONE, DIS_NEXT },
+    [0xa6] = { "ANA M", OPERAND_NONE, DIS_NEXT },
+    [0xa7] = { "ANA A", OPERAND_NONE, DIS_NEXT },
+    [0xa8] = { "XRA B", OPERAND_NONE, DIS_NEXT },
+    [0xa9] = { "XRA C", OPERAND_NONE, DIS_NEXT },
+    [0xaa] = { "XRA D", OPERAND_NONE, DIS_NEXT },
+    [0xab] = { "XRA E", OPERAND_NONE, DIS_NEXT },
+    [0xac] = { "XRA H", OPERAND_NONE, DIS_NEXT },
+    [0xad] = { "XRA L", OPERAND_NONE, DIS_NEXT },
+    [0xae] = { "XRA M", OPERAND_NONE, DIS_NEXT },
+    [0xaf] = { "XRA A", OPERAND_NONE, DIS_NEXT },
+    [0xb0] = { "ORA B", OPERAND_NONE, DIS_NEXT },
+    [0xb1] = { "ORA C", OPERAND_NONE, DIS_NEXT },
+    [0xb2] = { "ORA D", OPERAND_NONE, DIS_NEXT },
+    [0xb3] = { "ORA E", OPERAND_NONE, DIS_NEXT },
+    [0xb4] = { "ORA H", OPERAND_NONE, DIS_NEXT },
+    [0xb5] = { "ORA L", OPERAND_NONE, DIS_NEXT },
+    [0xb6] = { "ORA M", OPERAND_NONE, DIS_NEXT },
+    [0xb7] = { "ORA A", OPERAND_NONE, DIS_NEXT },
+    [0xb8] = { "CMP B", OPERAND_NONE, DIS_NEXT },
+    [0xb9] = { "CMP C", OPERAND_NONE, DIS_NEXT },
+    [0xba] = { "CMP D", OPERAND_NONE, DIS_NEXT },
+    [0xbb] = { "CMP E", OPERAND_NONE, DIS_NEXT },
+    [0xbc] = { "CMP H", OPERAND_NONE, DIS_NEXT },
+    [0xbd] = { "CMP L", OPERAND_NONE, DIS_NEXT },
+    [0xbe] = { "CMP M", OPERAND_NONE, DIS_NEXT },
+    [0xbf] = { "CMP A", OPERAND_NONE, DIS_NEXT },
+    [0xc0] = { "RNZ", OPERAND_NONE, DIS_NEXT },
+    [0xc1] = { "POP B", OPERAND_NONE, DIS_NEXT },
+    [0xc2] = { "JNZ ", OPERAND_ADDR, DIS_BRANCH },
+    [0xc3] = { "JMP ", OPERAND_ADDR, DIS_JUMP },
+    [0xc4] = { "CNZ ", OPERAND_ADDR, DIS_CALL },
+    [0xc5] = { "PUSH B", OPERAND_NONE, DIS_NEXT },
+    [0xc6] = { "ADI ", OPERAND_BYTE, DIS_NEXT },
+    [0xc7] = { 0, OPERAND_NONE, DIS_INVALID },
+    [0xc8] = { "RZ", OPERAND_NONE, DIS_NEXT },
+    [0xc9] = { "RET", OPERAND_NONE, DIS_RETURN },
+    [0xca] = { "JZ ", OPERAND_ADDR, DIS_BRANCH },
+    [0xcb] = { 0, OPERAND_NONE, DIS_INVALID },
+    [0xcc] = { "CZ ", OPERAND_ADDR, DIS_CALL },
+    [0xcd] = { "CALL ", OPERAND_ADDR, DIS_CALL },
+    [0xce] = { "ACI ", OPERAND_BYTE, DIS_NEXT },
+    [0xcf] = { "RST 1", OPERAND_NONE, DIS_CALL },
+    [0xd0] = { "RNC", OPERAND_NONE, DIS_NEXT },
+    [0xd1] = { "POP D", OPERAND_NONE, DIS_NEXT },
+    [0xd2] = { "JNC ", OPERAND_ADDR, DIS_BRANCH },
+    [0xd3] = { "OUT ", OPERAND_BYTE, DIS_NEXT },
+    [0xd4] = { "CNC ", OPERAND_ADDR, DIS_CALL },
+    [0xd5] = { "PUSH D", OPERAND_NONE, DIS_NEXT },
+    [0xd6] = { "SUI ", OPERAND_BYTE, DIS_NEXT },
+    [0xd7] = { "RST 2", OPERAND_NONE, DIS_CALL },
+    [0xd8] = { "RC", OPERAND_NONE, DIS_NEXT },
+    [0xd9] = { 0, OPERAND_NONE, DIS_INVALID },
+    [0xda] = { "JC ", OPERAND_ADDR, DIS_BRANCH },
+    [0xdb] = { "IN ", OPERAND_BYTE, DIS_NEXT },
+    [0xdc] = { "CC ", OPERAND_ADDR, DIS_CALL },
+    [0xdd] = { "CALL ", OPERAND_ADDR, DIS_CALL },
+    [0xde] = { "SBI ", OPERAND_BYTE, DIS_NEXT },
+    [0xdf] = { "RST 3", OPERAND_NONE, DIS_CALL },
+    [0xe0] = { "RPO", OPERAND_NONE, DIS_NEXT },
+    [0xe1] = { "POP H", OPERAND_NONE, DIS_NEXT },
+    [0xe2] = { "JPO ", OPERAND_ADDR, DIS_BRANCH },
+    [0xe3] = { "XTHL", OPERAND_NONE, DIS_NEXT },
+    [0xe4] = { "CPO ", OPERAND_ADDR, DIS_CALL },
+    [0xe5] = { "PUSH H", OPERAND_NONE, DIS_NEXT },
+    [0xe6] = { "ANI ", OPERAND_BYTE, DIS_NEXT },
+    [0xe7] = { "RST 4", OPERAND_NONE, DIS_CALL },
+    [0xe8] = { "RPE", OPERAND_NONE, DIS_NEXT },
+    [0xe9] = { "PCHL", OPERAND_NONE, DIS_RETURN },
+    [0xea] = { "JPE ", OPERAND_ADDR, DIS_BRANCH },
+    [0xeb] = { "XCHG", OPERAND_NONE, DIS_NEXT },
+    [0xec] = { "CPE ", OPERAND_ADDR, DIS_CALL },
+    [0xed] = { 0, OPERAND_NONE, DIS_INVALID },
+    [0xee] = { "XRI ", OPERAND_BYTE, DIS_NEXT },
+    [0xef] = { "RST 5", OPERAND_NONE, DIS_CALL },
+    [0xf0] = { "RP", OPERAND_NONE, DIS_NEXT },
+    [0xf1] = { "POP PSW", OPERAND_NONE, DIS_NEXT },
+    [0xf2] = { "JP ", OPERAND_ADDR, DIS_BRANCH },
+    [0xf3] = { "DI", OPERAND_NONE, DIS_NEXT },
+    [0xf4] = { "CP ", OPERAND_ADDR, DIS_CALL },
+    [0xf5] = { "PUSH PSW", OPERAND_NONE, DIS_NEXT },
+    [0xf6] = { "ORI ", OPERAND_BYTE, DIS_NEXT },
+    [0xf7] = { "RST 6", OPERAND_NONE, DIS_CALL },
+    [0xf8] = { "RM", OPERAND_NONE, DIS_NEXT },
+    [0xf9] = { "SPHL", OPERAND_NONE, DIS_NEXT },
+    [0xfa] = { "JM ", OPERAND_ADDR, DIS_BRANCH },
+    [0xfb] = { "EI", OPERAND_NONE, DIS_NEXT },
+    [0xfc] = { "CM ", OPERAND_ADDR, DIS_CALL },
+    [0xfd] = { 0, OPERAND_NONE, DIS_INVALID },
+    [0xfe] = { "CPI ", OPERAND_BYTE, DIS_NEXT },
+    [0xff] = { "RST 7", OPERAND_NONE, DIS_CALL },
+};
+
+static const u8 LENGTHS[] = {
+    [OPERAND_NONE] = 1, [OPERAND_BYTE] = 2, [OPERAND_WORD] = 3, [OPERAND_DATA] = 3, [OPERAND_ADDR] = 3,
+};
+
+static const char HEX[] = "0123456789abcdef";
+
+/**
+ * Decodes the instruction at `addr` from `size` bytes of `memory` loaded at
+ * `base`. Returns its length: 1 for opcodes the CPU does not implement,
+ * which decode as DIS_INVALID, and 0 when it runs past the buffer.
+ */
+u8 disassemble(const u8 *memory, u32 size, u16 base, u16 addr, Instruction *instruction) {
+    u32 offset = (u16)(addr - base);
+    if (offset >= size)
+        return instruction->length = 0;
+
+    u8 opcode = memory[offset];
+    instruction->addr = addr;
+    instruction->opcode = opcode;
+    instruction->mnemonic = OPCODES[opcode].mnemonic;
+    instruction->kind = OPCODES[opcode].kind;
+    instruction->flow = OPCODES[opcode].flow;
+    instruction->operand = 0;
+    instruction->target = 0;
+
+    u8 length = LENGTHS[instruction->kind];
+    if (offset + length > size)
+        return instruction->length = 0;
+
+    if (length == 2)
+        instruction->operand = memory[offset + 1];
+    else if (length == 3)
+        instruction->operand = memory[offset + 1] | memory[offset + 2] << 8;
+
+    if (instruction->kind == OPERAND_ADDR)
+        instruction->target = instruction->operand;
+    else if ((opcode & 0xc7) == 0xc7)
+        instruction->target = opcode & 0x38;
+
+    return instruction->length = length;
+}
+
+/**
+ * Appends to a caller's buffer like snprintf: `length` counts everything,
+ * but only what fits in `capacity` is written.
+ */
+typedef struct {
+    char *out;
+    u32 capacity;
+    u32 length;
+} Text;
+
+static void put(Text *text, char c) {
+    if (text->length < text->capacity)
+        text->out[text->length] = c;
+    text->length++;
+}
+
+static void put_string(Text *text, const char *string) {
+    while (*string)
+        put(text, *string++);
+}
+
+static void put_hex(Text *text, u16 value, u32 digits) {
+    while (digits--)
+        put(text, HEX[value >> digits * 4 & 0xf]);
+}
 
-static void println(char *msg) {
-    printf("%s%c", msg, '\n');
+static void terminate(Text *text) {
+    if (text->capacity)
+        text->out[text->length < text->capacity ? text->length : text->capacity - 1] = 0;
 }
 
-static void not_implemented(u8 opcode) {
-    fprintf(stderr, "Opcode 0x%02x not implemented.\n", opcode);
-    exit(1);
+static const char *label_prefix(u8 flags) {
+    if (flags & DIS_BODY)
+        return 0;
+    if (flags & DIS_CALLED)
+        return "sub_";
+    if (flags & (DIS_JUMPED | DIS_ENTRY))
+        return "loc_";
+    if (flags & DIS_DATA)
+        return "dat_";
+    return 0;
 }
 
-void disassemble_opcode(CPU *cpu, u8 opcode) {
-    printf("%04x\t", cpu->pc - 1);
-    switch (opcode) {
-        // NOP
-        case 0x00: println("NOP"); break;
-
-        // LXI
-        case 0x01: println("LXI BC"); break;
-        case 0x11: println("LXI DE"); break;
-        case 0x21: println("LXI HL"); break;
-        case 0x31: println("LXI SP"); break;
-
-        // INX
-        case 0x03: println("INX BC"); break;
-        case 0x13: println("INX DE"); break;
-        case 0x23: println("INX HL"); break;
-        case 0x33: println("INX SP"); break;
-        
-        // INR
-        case 0x3c: println("INR A"); break;
-        case 0x04: println("INR B"); break;
-        case 0x0c: println("INR C"); break;
-        case 0x14: println("INR D"); break;
-        case 0x1c: println("INR E"); break;
-        case 0x24: println("INR H"); break;
-        case 0x2c: println("INR L"); break;
-        case 0x34: println("INR M"); break;
-
-        // DCX
-        case 0x0b: println("DCX BC"); break;
-        case 0x1b: println("DCX DE"); break;
-        case 0x2b: println("DCX HL"); break;
-        case 0x3b: println("DCX SP"); break;
-
-        // DCR
-        case 0x3d: println("DCR A"); break; 
-        case 0x05: println("DCR B"); break;
-        case 0x0d: println("DCR C"); break;
-        case 0x15: println("DCR D"); break;
-        case 0x1d: println("DCR E"); break;
-        case 0x25: println("DCR H"); break;
-        case 0x2d: println("DCR L"); break;
-        case 0x35: println("DCR M"); break;
-
-        // MVI
-        case 0x3e: println("MVI A"); break;
-        case 0x06: println("MVI D"); break;
-        case 0x0e: println("MVI C"); break;
-        case 0x16: println("MVI D"); break;
-        case 0x1e: println("MVI E"); break;
-        case 0x26: println("MVI H"); break;
-        case 0x2e: println("MVI L"); break;
-        case 0x36: println("MVI M"); break;
-
-        case 0x27: println("DAA"); break; // DAA 
-        case 0x2f: println("CMA"); break; // CMA 
-        case 0x37: println("STC"); break; // STC 
-        case 0x3f: println("CMC"); break; // CMC 
-
-        // DAD
-        case 0x09: println("DAD BC"); break;
-        case 0x19: println("DAD DE"); break;
-        case 0x29: println("DAD HL"); break;
-        case 0x39: println("DAD SP"); break;
-
-        // STAX
-        case 0x02: println("STAX BC"); break;
-        case 0x12: println("STAX DE"); break;
-        case 0x32: println("STA"); break; // STA
-
-        // LDAX
-        case 0x0a: println("LDAX BC"); break;
-        case 0x1a: println("LDAX DE"); break;
-        case 0x3a: println("LDA"); break; // LDA
-
-        case 0x07: println("RLC"); break; // RLC
-        case 0x0f: println("RRC"); break; // RRC
-        case 0x17: println("RAL"); break; // RAL
-        case 0x1f: println("RAR"); break; // RAR
-
-        case 0x22: println("SHLD"); break; // SHLD
-        case 0x2a: println("LHLD"); break; // LHLD
-
-        // MOV
-        case 0x7f: println("MOV A A"); break;
-        case 0x78: println("MOV A B"); break;
-        case 0x79: println("MOV A C"); break;
-        case 0x7a: println("MOV A D"); break;
-        case 0x7b: println("MOV A E"); break;
-        case 0x7c: println("MOV A H"); break;
-        case 0x7d: println("MOV A L"); break;
-        case 0x7e: println("MOV A M"); break;
-
-        case 0x47: println("MOV B A"); break;
-        case 0x40: println("MOV B B"); break;
-        case 0x41: println("MOV B C"); break;
-        case 0x42: println("MOV B D"); break;
-        case 0x43: println("MOV B E"); break;
-        case 0x44: println("MOV B H"); break;
-        case 0x45: println("MOV B L"); break;
-        case 0x46: println("MOV B M"); break;
-
-        case 0x4f: println("MOV C A"); break;
-        case 0x48: println("MOV C B"); break;
-        case 0x49: println("MOV C C"); break;
-        case 0x4a: println("MOV C D"); break;
-        case 0x4b: println("MOV C E"); break;
-        case 0x4c: println("MOV C H"); break;
-        case 0x4d: println("MOV C L"); break;
-        case 0x4e: println("MOV C M"); break;
-
-        case 0x57: println("MOV D A"); break;
-        case 0x50: println("MOV D B"); break;
-        case 0x51: println("MOV D C"); break;
-        case 0x52: println("MOV D D"); break;
-        case 0x53: println("MOV D E"); break;
-        case 0x54: println("MOV D H"); break;
-        case 0x55: println("MOV D L"); break;
-        case 0x56: println("MOV D M"); break;
-        
-        case 0x5f: println("MOV E A"); break;
-        case 0x58: println("MOV E B"); break;
-        case 0x59: println("MOV E C"); break;
-        case 0x5a: println("MOV E D"); break;
-        case 0x5b: println("MOV E E"); break;
-        case 0x5c: println("MOV E H"); break;
-        case 0x5d: println("MOV E L"); break;
-        case 0x5e: println("MOV E M"); break;
-
-        case 0x67: println("MOV H A"); break;
-        case 0x60: println("MOV H B"); break;
-        case 0x61: println("MOV H C"); break;
-        case 0x62: println("MOV H D"); break;
-        case 0x63: println("MOV H E"); break;
-        case 0x64: println("MOV H H"); break;
-        case 0x65: println("MOV H L"); break; 
-        case 0x66: println("MOV H M"); break;
-
-        case 0x6f: println("MOV L A"); break;
-        case 0x68: println("MOV L B"); break;
-        case 0x69: println("MOV L C"); break;
-        case 0x6a: println("MOV L D"); break;
-        case 0x6b: println("MOV L E"); break;
-        case 0x6c: println("MOV L H"); break;
-        case 0x6d: println("MOV L L"); break;
-        case 0x6e: println("MOV L M"); break;
-        
-        case 0x77: println("MOV M A"); break;
-        case 0x70: println("MOV M B"); break;
-        case 0x71: println("MOV M C"); break;
-        case 0x72: println("MOV M D"); break;
-        case 0x73: println("MOV M E"); break;
-        case 0x74: println("MOV M H"); break;
-        case 0x75: println("MOV M L"); break;
-        case 0x76: println("MOV M M"); break;
-
-        // ADD
-        case 0x87: println("ADD A"); break;
-        case 0x80: println("ADD B"); break;
-        case 0x81: println("ADD C"); break;
-        case 0x82: println("ADD D"); break;
-        case 0x83: println("ADD E"); break;
-        case 0x84: println("ADD H"); break;
-        case 0x85: println("ADD L"); break;
-        case 0x86: println("ADD M"); break;
-        case 0xc6: println("ADD byte"); break;
-
-        // ADC
-        case 0x8f: println("ADC A"); break;
-        case 0x88: println("ADC B"); break;
-        case 0x89: println("ADC C"); break;
-        case 0x8a: println("ADC D"); break;
-        case 0x8b: println("ADC E"); break;
-        case 0x8c: println("ADC H"); break;
-        case 0x8d: println("ADC L"); break;
-        case 0x8e: println("ADC M"); break;
-        case 0xce: println("ADC byte"); break;
-
-        // SUB
-        case 0x97: println("SUB A"); break;
-        case 0x90: println("SUB B"); break;
-        case 0x91: println("SUB C"); break;
-        case 0x92: println("SUB D"); break;
-        case 0x93: println("SUB E"); break;
-        case 0x94: println("SUB H"); break;
-        case 0x95: println("SUB L"); break;
-        case 0x96: println("SUB M"); break;
-        case 0xd6: println("SUB byte"); break;
-
-        // SBB
-        case 0x9f: println("SBB A"); break;
-        case 0x98: println("SBB B"); break;
-        case 0x99: println("SBB C"); break;
-        case 0x9a: println("SBB D"); break;
-        case 0x9b: println("SBB E"); break;
-        case 0x9c: println("SBB H"); break;
-        case 0x9d: println("SBB L"); break;
-        case 0x9e: println("SBB M"); break;
-        case 0xde: println("SBB byte"); break;
-
-        // ANA
-        case 0xa7: println("ANA A"); break;
-        case 0xa0: println("ANA B"); break;
-        case 0xa1: println("ANA C"); break;
-        case 0xa2: println("ANA D"); break;
-        case 0xa3: println("ANA E"); break;
-        case 0xa4: println("ANA H"); break;
-        case 0xa5: println("ANA L"); break;
-        case 0xa6: println("ANA M"); break;
-        case 0xe6: println("ANA byte"); break;
-
-        // XRA
-        case 0xaf: println("XRA A"); break;
-        case 0xa8: println("XRA B"); break;
-        case 0xa9: println("XRA C"); break;
-        case 0xaa: println("XRA D"); break;
-        case 0xab: println("XRA E"); break;
-        case 0xac: println("XRA H"); break;
-        case 0xad: println("XRA L"); break;
-        case 0xae: println("XRA M"); break;
-        case 0xee: println("XRA byte"); break;
-
-        // ORA
-        case 0xb7: println("ORA A"); break;
-        case 0xb0: println("ORA B"); break;
-        case 0xb1: println("ORA C"); break;
-        case 0xb2: println("ORA D"); break;
-        case 0xb3: println("ORA E"); break;
-        case 0xb4: println("ORA H"); break;
-        case 0xb5: println("ORA L"); break;
-        case 0xb6: println("ORA M"); break;
-        case 0xf6: println("ORA byte"); break;
-
-        // PUSH
-        case 0xc5: println("PUSH BC"); break;
-        case 0xd5: println("PUSH DE"); break;
-        case 0xe5: println("PUSH HL"); break;
-        case 0xf5: println("PUSH PSW"); break;
-
-        // POP
-        case 0xc1: println("POP BC"); break;
-        case 0xd1: println("POP DE"); break;
-        case 0xe1: println("POP HL"); break;
-        case 0xf1: println("POP PSW"); break;
-
-        // PCHL
-        case 0xe9: println("PCHL"); break;
-
-        // JMP
-        case 0xc3: println("JMP"); break;
-        case 0xc2: println("JNZ"); break;
-        case 0xca: println("JZ"); break;
-        case 0xd2: println("JNC"); break;
-        case 0xda: println("JC"); break;
-        case 0xe2: println("JPO"); break;
-        case 0xea: println("JPE"); break;
-        case 0xf2: println("JP"); break;
-        case 0xfa: println("JM"); break;
-
-        // RET
-        case 0xc9: println("RET"); break;
-        case 0xc0: println("RNZ"); break;
-        case 0xc8: println("RZ"); break;
-        case 0xd0: println("RNC"); break;
-        case 0xd8: println("RC"); break;
-        case 0xe0: println("RPO"); break;
-        case 0xe8: println("RPE"); break;
-        case 0xf0: println("RP"); break;
-        case 0xf8: println("RM"); break;
-
-        // CALL
-        case 0xcd: println("CALL"); break;
-        case 0xc4: println("CNZ"); break;
-        case 0xcc: println("CZ"); break;
-        case 0xd4: println("CNC"); break;
-        case 0xdc: println("CC"); break;
-        case 0xe4: println("CPO"); break;
-        case 0xec: println("CPE"); break;
-        case 0xf4: println("CP"); break;
-        case 0xfc: println("CM"); break;
-
-        // IN
-        case 0xdb: println("IN"); break;
-
-        // OUT
-        case 0xd3: println("OUT"); break;
-
-        // XCHG
-        case 0xeb: println("XCHG"); break;
-        
-        // XTHL
-        case 0xe3: println("XTHL"); break;
-
-        // SPHL
-        case 0xf9: println("SPHL"); break;
-
-        case 0xfb: println("EI"); break; // EI
-        case 0xf3: println("DI"); break; // DI 
-
-        // CMP
-        case 0xbf: println("CMP A"); break;
-        case 0xb8: println("CMP B"); break;
-        case 0xb9: println("CMP C"); break;
-        case 0xba: println("CMP D"); break;
-        case 0xbb: println("CMP E"); break;
-        case 0xbc: println("CMP H"); break;
-        case 0xbd: println("CMP L"); break;
-        case 0xbe: println("CMP M"); break;
-        case 0xfe: println("CMP byte"); break;
-
-        /// RST
-        //case 0xff: rst(cpu, 0x38); break;
-
-        // Undocumented opcodes
-        case 0x08: println("NOP"); break;
-        //case 0x18: break;
-        //case 0x20: break;
-        
-        default: not_implemented(opcode);
+static void put_address(Text *text, const CodeMap *map, u16 addr) {
+    const char *prefix = map ? label_prefix(map->flags[addr]) : 0;
+    put_string(text, prefix ? prefix : "$");
+    put_hex(text, addr, 4);
+}
+
+static void put_instruction(Text *text, const Instruction *instruction, const CodeMap *map) {
+    if (instruction->flow == DIS_INVALID) {
+        put_string(text, "DB $");
+        put_hex(text, instruction->opcode, 2);
+        return;
+    }
+
+    put_string(text, instruction->mnemonic);
+    switch (instruction->kind) {
+        case OPERAND_NONE:
+            break;
+        case OPERAND_BYTE:
+            put(text, '$');
+            put_hex(text, instruction->operand, 2);
+            break;
+        case OPERAND_WORD:
+            put(text, '$');
+            put_hex(text, instruction->operand, 4);
+            break;
+        case OPERAND_DATA:
+        case OPERAND_ADDR:
+            put_address(text, map, instruction->operand);
+            break;
     }
 }
+
+/**
+ * Writes the instruction in Intel syntax to `out`, which has room for
+ * DIS_TEXT characters, and returns its length. Addresses are written as
+ * the labels `map` gives them when there is a map, and in hex otherwise.
+ */
+u32 disassemble_format(const Instruction *instruction, const CodeMap *map, char *out) {
+    Text text = { out, DIS_TEXT, 0 };
+    put_instruction(&text, instruction, map);
+    terminate(&text);
+
+    return text.length;
+}
+
+void code_map_init(CodeMap *map, const u8 *memory, u32 size, u16 base) {
+    map->memory = memory;
+    map->size = size < 0x10000u - base ? size : 0x10000u - base;
+    map->base = base;
+    map->instructions = 0;
+    memset(map->flags, 0, sizeof(map->flags));
+}
+
+static bool inside(const CodeMap *map, u16 addr) {
+    return (u16)(addr - map->base) < map->size;
+}
+
+/**
+ * Follows the code from `entry`, marking every instruction it reaches.
+ * Branches are followed depth first, through a stack of the targets still
+ * to visit. A path ends at an unconditional jump or return, an opcode the
+ * CPU does not implement, the end of the buffer, or an instruction that
+ * would overlap one already found.
+ */
+void code_map_discover(CodeMap *map, u16 entry) {
+    if (!inside(map, entry) || map->flags[entry] & (DIS_CODE | DIS_BODY))
+        return;
+
+    map->flags[entry] |= DIS_ENTRY;
+    u32 pending = 0;
+    map->pending[pending++] = entry;
+
+    while (pending) {
+        u16 addr = map->pending[--pending];
+
+        while (!(map->flags[addr] & (DIS_CODE | DIS_BODY))) {
+            Instruction instruction;
+            u8 length = disassemble(map->memory, map->size, map->base, addr, &instruction);
+            if (!length || instruction.flow == DIS_INVALID)
+                break;
+
+            bool overlaps = false;
+            for (u8 i = 1; i < length; i++)
+                overlaps |= map->flags[(u16)(addr + i)] & (DIS_CODE | DIS_BODY);
+            if (overlaps)
+                break;
+
+            map->flags[addr] |= DIS_CODE;
+            for (u8 i = 1; i < length; i++)
+                map->flags[(u16)(addr + i)] |= DIS_BODY;
+            map->instructions++;
+
+            if (instruction.kind == OPERAND_DATA && inside(map, instruction.operand))
+                map->flags[instruction.operand] |= DIS_DATA;
+
+            u16 target = instruction.target;
+            bool jumps = instruction.flow == DIS_BRANCH || instruction.flow == DIS_JUMP;
+            if ((jumps || instruction.flow == DIS_CALL) && inside(map, target)) {
+                map->flags[target] |= jumps ? DIS_JUMPED : DIS_CALLED;
+                if (!(map->flags[target] & (DIS_CODE | DIS_BODY)) && pending < 0x10000)
+                    map->pending[pending++] = target;
+            }
+
+            if (instruction.flow == DIS_JUMP || instruction.flow == DIS_RETURN)
+                break;
+
+            addr += length;
+            if (!inside(map, addr))
+                break;
+        }
+    }
+}
+
+/**
+ * Discovers code from the reset vector and then from each RST vector in
+ * turn. Vectors that earlier code already runs through are no entry points.
+ */
+void code_map_discover_vectors(CodeMap *map) {
+    for (u16 vector = 0; vector <= 0x38; vector += 8)
+        code_map_discover(map, vector);
+}
+
+static void put_label(Text *text, const CodeMap *map, u16 addr) {
+    const char *prefix = label_prefix(map->flags[addr]);
+    if (!prefix)
+        return;
+
+    put_string(text, prefix);
+    put_hex(text, addr, 4);
+    put_string(text, ":\n");
+}
+
+/**
+ * Writes a listing of the whole buffer to `out`: a label for every address
+ * that is jumped to, called or read as data, one instruction per line with
+ * its address and bytes, and DB lines of up to 8 bytes for the rest.
+ * Returns the length of the whole listing, which may not have fit in
+ * `capacity` bytes, like snprintf.
+ */
+u32 code_map_listing(const CodeMap *map, char *out, u32 capacity) {
+    Text text = { out, capacity, 0 };
+    u32 end = map->base + map->size;
+
+    for (u32 addr = map->base; addr < end;) {
+        put_label(&text, map, addr);
+        put_hex(&text, addr, 4);
+        put_string(&text, "  ");
+
+        if (map->flags[addr] & DIS_CODE) {
+            Instruction instruction;
+            u8 length = disassemble(map->memory, map->size, map->base, addr, &instruction);
+
+            for (u8 i = 0; i < 3; i++) {
+                if (i < length)
+                    put_hex(&text, map->memory[addr - map->base + i], 2);
+                else
+                    put_string(&text, "  ");
+                put(&text, ' ');
+            }
+
+            put(&text, ' ');
+            put_instruction(&text, &instruction, map);
+            addr += length;
+        }
+        else {
+            put_string(&text, "DB ");
+            u32 start = addr;
+            do {
+                if (addr != start)
+                    put(&text, ',');
+                put(&text, '$');
+                put_hex(&text, map->memory[addr - map->base], 2);
+                addr++;
+            } while (addr < end && addr - start < 8 && !(map->flags[addr] & DIS_CODE)
+                    && !label_prefix(map->flags[addr]));
+        }
+
+        put(&text, '\n');
+    }
+
+    terminate(&text);
+    return text.length;
+}
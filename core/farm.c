@@ -0,0 +1,444 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include "farm.h"
+
+/**
+ * Work-stealing pool of time-sliced machines.
+ *
+ * Every worker owns a queue of machines. It takes the machine at the head,
+ * runs it for one slice and, unless it is finished, puts it back at the
+ * tail, so the machines of a worker advance round robin. A worker whose
+ * queue is empty steals from the tail of another one.
+ *
+ * The farm wraps every machine's I/O callbacks to count the calls in and
+ * out of them, and the watchdog thread looks at those counts. A worker
+ * that has stayed inside one call for longer than the timeout is blocked
+ * there; a slow slice that keeps running is not. The watchdog then takes
+ * the machine from its worker and finishes it as stuck. The worker is detached
+ * and left to its callback; if the slice ever ends, it leaves without
+ * touching the machine or the pool again. A new worker takes its place and
+ * its queue, so a farm of one thread carries on too. Machines that keep
+ * running without reaching their stop condition are caught by their worker
+ * when their busy time runs out.
+ */
+
+#define CACHE_LINE 64
+
+#define WATCHDOG_PERIOD_MS 50
+#define IDLE_US            100
+
+typedef struct {
+    FarmJob *job;
+
+    // The machine's own I/O callbacks, behind the farm's.
+    void (*in)(CPU *cpu, u8 port);
+    void (*out)(CPU *cpu, u8 port);
+} Slot;
+
+typedef struct Pool Pool;
+
+typedef struct {
+    pthread_mutex_t lock;
+    Slot **slots; // Ring buffer big enough for every machine.
+    u32 head;
+    u32 count;
+
+    // Read by the watchdog. Whichever of the worker and the watchdog takes
+    // `current` back first finishes its slice.
+    _Atomic(Slot *) current;
+    _Atomic u64 slice_start;
+    _Atomic u64 callbacks; // Entries and exits: odd inside a callback.
+    atomic_bool abandoned; // Stuck in a slice the watchdog took.
+
+    // The watchdog's own: the count it last saw and since when.
+    u64 seen;
+    u64 seen_since;
+
+    u64 slices;
+    u64 steals;
+
+    Pool *pool;
+    u32 index;
+    pthread_t thread;
+} __attribute__((aligned(CACHE_LINE))) Worker;
+
+struct Pool {
+    Farm *farm;
+    _Atomic(Worker *) *workers; // Swapped by the watchdog for replacements.
+    u32 capacity;
+    bool abandoned; // Some thread was left to its callback.
+
+    atomic_uint remaining;
+    _Atomic u64 finished;
+};
+
+// The worker running on this thread, for the callback wrappers.
+static _Thread_local Worker *self;
+
+static u64 now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (u64)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void push(Worker *worker, Slot *slot) {
+    pthread_mutex_lock(&worker->lock);
+    u32 tail = (worker->head + worker->count) % worker->pool->capacity;
+    worker->slots[tail] = slot;
+    worker->count++;
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static Slot *pop_head(Worker *worker) {
+    Slot *slot = 0;
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->count) {
+        slot = worker->slots[worker->head];
+        worker->head = (worker->head + 1) % worker->pool->capacity;
+        worker->count--;
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    return slot;
+}
+
+static Slot *pop_tail(Worker *worker) {
+    Slot *slot = 0;
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->count) {
+        worker->count--;
+        slot = worker->slots[(worker->head + worker->count) % worker->pool->capacity];
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    return slot;
+}
+
+static Slot *steal(Worker *worker) {
+    Pool *pool = worker->pool;
+    u32 threads = pool->farm->threads;
+
+    for (u32 i = 1; i < threads; i++) {
+        Slot *slot = pop_tail(atomic_load(&pool->workers[(worker->index + i) % threads]));
+        if (slot) {
+            worker->steals++;
+            return slot;
+        }
+    }
+
+    return 0;
+}
+
+// Counts a machine as finished.
+static void finish(Pool *pool) {
+    if (atomic_fetch_sub(&pool->remaining, 1) == 1)
+        atomic_store(&pool->finished, now_ns());
+}
+
+/**
+ * Runs one slice of `slot` and sets `status` to where its machine is.
+ * Returns false when the watchdog took the machine during the slice: the
+ * worker must then leave without touching it or the pool.
+ */
+static bool run_slice(Worker *worker, Slot *slot, FarmStatus *status) {
+    Farm *farm = worker->pool->farm;
+    FarmJob *job = slot->job;
+    CPU *cpu = job->cpu;
+
+    u64 start = now_ns();
+    atomic_store(&worker->slice_start, start);
+    atomic_store(&worker->current, slot);
+
+    u64 cycles = cpu->cycles;
+    u64 instructions = job->run ? job->run(cpu, farm->slice) : cpu_run(cpu, farm->slice);
+
+    if (atomic_exchange(&worker->current, (Slot *)0) != slot)
+        return false;
+
+    job->instructions += instructions;
+    job->cycles += cpu->cycles - cycles;
+    job->busy += (now_ns() - start) / 1e9;
+    worker->slices++;
+
+    if (job->done(cpu))
+        *status = FARM_DONE;
+    else if (job->max_cycles && job->cycles >= job->max_cycles)
+        *status = FARM_CYCLES;
+    else if (farm->timeout && job->busy > farm->timeout)
+        *status = FARM_STUCK;
+    else
+        *status = FARM_RUNNING;
+
+    return true;
+}
+
+static void wrapped_in(CPU *cpu, u8 port) {
+    Worker *worker = self;
+    atomic_fetch_add(&worker->callbacks, 1);
+    atomic_load(&worker->current)->in(cpu, port);
+    atomic_fetch_add(&worker->callbacks, 1);
+}
+
+static void wrapped_out(CPU *cpu, u8 port) {
+    Worker *worker = self;
+    atomic_fetch_add(&worker->callbacks, 1);
+    atomic_load(&worker->current)->out(cpu, port);
+    atomic_fetch_add(&worker->callbacks, 1);
+}
+
+static void *work(void *arg) {
+    Worker *worker = arg;
+    Pool *pool = worker->pool;
+    self = worker;
+
+    while (atomic_load(&pool->remaining)) {
+        Slot *slot = pop_head(worker);
+        if (!slot)
+            slot = steal(worker);
+        if (!slot) {
+            struct timespec idle = { 0, IDLE_US * 1000 };
+            nanosleep(&idle, 0);
+            continue;
+        }
+
+        FarmStatus status;
+        if (!run_slice(worker, slot, &status))
+            return 0;
+
+        if (status == FARM_RUNNING) {
+            push(worker, slot);
+            continue;
+        }
+
+        slot->job->status = status;
+        finish(pool);
+    }
+
+    return 0;
+}
+
+static Worker *worker_new(Pool *pool, u32 index) {
+    Worker *worker = aligned_alloc(CACHE_LINE, sizeof(Worker));
+    if (!worker) {
+        fprintf(stderr, "Farm: Out of memory.\n");
+        exit(1);
+    }
+
+    memset(worker, 0, sizeof(Worker));
+    worker->pool = pool;
+    worker->index = index;
+    pthread_mutex_init(&worker->lock, 0);
+    atomic_init(&worker->current, (Slot *)0);
+    atomic_init(&worker->slice_start, 0);
+    atomic_init(&worker->callbacks, 0);
+    atomic_init(&worker->abandoned, false);
+
+    worker->slots = calloc(pool->capacity, sizeof(Slot *));
+    if (!worker->slots) {
+        fprintf(stderr, "Farm: Out of memory.\n");
+        exit(1);
+    }
+
+    return worker;
+}
+
+static void start(Worker *worker) {
+    if (pthread_create(&worker->thread, 0, work, worker)) {
+        fprintf(stderr, "Farm: Could not start worker %u.\n", worker->index);
+        exit(1);
+    }
+}
+
+/**
+ * Puts a new worker in the place of `old`, which is stuck in a callback,
+ * and hands it the machines still queued on `old`. Nobody else pushes to a
+ * stuck worker, and stealers only ever find fewer machines on it. The old
+ * worker is never freed, since its thread may still come back to it.
+ */
+static void replace(Pool *pool, Worker *old) {
+    Worker *worker = worker_new(pool, old->index);
+    worker->slices = old->slices;
+    worker->steals = old->steals;
+
+    Slot *slot;
+    while ((slot = pop_head(old)))
+        push(worker, slot);
+
+    atomic_store(&pool->workers[old->index], worker);
+    pthread_detach(old->thread);
+    pool->abandoned = true;
+    start(worker);
+}
+
+static void watch(Pool *pool) {
+    Farm *farm = pool->farm;
+    u64 timeout = farm->timeout * 1e9;
+    struct timespec period = { 0, WATCHDOG_PERIOD_MS * 1000000 };
+
+    while (atomic_load(&pool->remaining)) {
+        nanosleep(&period, 0);
+        if (!timeout)
+            continue;
+
+        u64 now = now_ns();
+        for (u32 i = 0; i < farm->threads; i++) {
+            Worker *worker = atomic_load(&pool->workers[i]);
+
+            // Stuck only if it is in the same callback as last time.
+            u64 callbacks = atomic_load(&worker->callbacks);
+            if (!(callbacks & 1) || callbacks != worker->seen) {
+                worker->seen = callbacks;
+                worker->seen_since = now;
+                continue;
+            }
+
+            if (now - worker->seen_since <= timeout)
+                continue;
+
+            Slot *slot = atomic_load(&worker->current);
+            if (!slot)
+                continue;
+
+            u64 start = atomic_load(&worker->slice_start);
+
+            // Unless the slice ended in the meantime, the machine is the
+            // watchdog's now, and its worker is lost to the callback.
+            if (!atomic_compare_exchange_strong(&worker->current, &slot, (Slot *)0))
+                continue;
+
+            atomic_store(&worker->abandoned, true);
+            slot->job->status = FARM_STUCK;
+            slot->job->abandoned = true;
+            slot->job->busy += (now - start) / 1e9;
+            fprintf(stderr, "Farm: %s is stuck in a callback on worker %u, which is abandoned.\n",
+                    slot->job->name, i);
+            finish(pool);
+            replace(pool, worker);
+        }
+    }
+}
+
+void farm_run(Farm *farm, FarmJob *jobs, u32 count) {
+    if (!farm->threads)
+        farm->threads = 1;
+
+    // Threads left to their callbacks may still look at the pool, their
+    // worker and their slot, so in that case all three outlive farm_run.
+    Pool *pool = calloc(1, sizeof(Pool));
+    Slot *slots = calloc(count ? count : 1, sizeof(Slot));
+    if (!pool || !slots) {
+        fprintf(stderr, "Farm: Out of memory.\n");
+        exit(1);
+    }
+
+    pool->farm = farm;
+    pool->capacity = count ? count : 1;
+    atomic_init(&pool->remaining, count);
+
+    pool->workers = calloc(farm->threads, sizeof(*pool->workers));
+    if (!pool->workers) {
+        fprintf(stderr, "Farm: Out of memory.\n");
+        exit(1);
+    }
+
+    for (u32 i = 0; i < farm->threads; i++)
+        atomic_init(&pool->workers[i], worker_new(pool, i));
+
+    // Deal the machines out round robin; stealing evens out the rest.
+    for (u32 i = 0; i < count; i++) {
+        FarmJob *job = &jobs[i];
+        job->status = FARM_RUNNING;
+        job->instructions = 0;
+        job->cycles = 0;
+        job->busy = 0;
+        job->abandoned = false;
+
+        // The wrappers only run on workers, so the originals come back
+        // once the farm is done with the machine.
+        CPU *cpu = job->cpu;
+        slots[i] = (Slot){ .job = job, .in = cpu->in, .out = cpu->out };
+        if (cpu->in)
+            cpu->in = wrapped_in;
+        if (cpu->out)
+            cpu->out = wrapped_out;
+
+        push(atomic_load(&pool->workers[i % farm->threads]), &slots[i]);
+    }
+
+    u64 started = now_ns();
+    atomic_init(&pool->finished, started);
+
+    for (u32 i = 0; i < farm->threads; i++)
+        start(atomic_load(&pool->workers[i]));
+
+    watch(pool);
+
+    // The workers in place now are all live: abandoned ones were replaced.
+    farm->slices = 0;
+    farm->steals = 0;
+    for (u32 i = 0; i < farm->threads; i++) {
+        Worker *worker = atomic_load(&pool->workers[i]);
+        pthread_join(worker->thread, 0);
+        pthread_mutex_destroy(&worker->lock);
+
+        farm->slices += worker->slices;
+        farm->steals += worker->steals;
+
+        free(worker->slots);
+        free(worker);
+    }
+
+    farm->seconds = (atomic_load(&pool->finished) - started) / 1e9;
+
+    // A thread still in a callback goes on through the wrappers.
+    for (u32 i = 0; i < count; i++) {
+        if (jobs[i].abandoned)
+            continue;
+
+        jobs[i].cpu->in = slots[i].in;
+        jobs[i].cpu->out = slots[i].out;
+    }
+
+    if (!pool->abandoned) {
+        free(pool->workers);
+        free(pool);
+        free(slots);
+    }
+}
+
+static const char *STATUS[] = {
+    [FARM_RUNNING] = "running",
+    [FARM_DONE]    = "done",
+    [FARM_CYCLES]  = "out of cycles",
+    [FARM_STUCK]   = "stuck",
+};
+
+void farm_report(const Farm *farm, const FarmJob *jobs, u32 count, File *file) {
+    u64 instructions = 0;
+    u64 cycles = 0;
+    u32 done = 0;
+
+    for (u32 i = 0; i < count; i++) {
+        const FarmJob *job = &jobs[i];
+        fprintf(file, "%s: %s, %llu instructions in %.2f s busy\n",
+                job->name, STATUS[job->status],
+                (unsigned long long)job->instructions, job->busy);
+
+        instructions += job->instructions;
+        cycles += job->cycles;
+        done += job->status == FARM_DONE;
+    }
+
+    double seconds = farm->seconds > 0 ? farm->seconds : 1e-9;
+    fprintf(file, "%u/%u machines done on %u threads (%s) in %.2f s: "
+            "%.1f MIPS, %.1f MHz emulated, %llu slices, %llu steals\n",
+            done, count, farm->threads, cpu_engine(), farm->seconds,
+            instructions / seconds / 1e6, cycles / seconds / 1e6,
+            (unsigned long long)farm->slices, (unsigned long long)farm->steals);
+}
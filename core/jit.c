@@ -0,0 +1,305 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include "cpu.h"
+#include "block.h"
+#include "jit.h"
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+
+/**
+ * x86-64 translator.
+ *
+ * Translated blocks keep the CPU pointer in rbx. Register moves, immediates
+ * and 16-bit increments are emitted inline; every other opcode becomes a
+ * direct call to its handler in JIT_OPS. After an instruction that may write
+ * memory the block checks whether it has been invalidated and, if so, leaves
+ * with the cycles of the instructions it skipped given back.
+ */
+
+// Worst case bytes emitted for one instruction, plus the prologue and
+// epilogue of a block.
+#define MAX_OP_BYTES    64
+#define MAX_FRAME_BYTES 16
+
+typedef struct {
+    u8 *start;
+    u8 *at;
+} Emitter;
+
+static inline void emit8(Emitter *e, u8 byte) {
+    *e->at++ = byte;
+}
+
+static inline void emit16(Emitter *e, u16 word) {
+    memcpy(e->at, &word, 2);
+    e->at += 2;
+}
+
+static inline void emit32(Emitter *e, u32 dword) {
+    memcpy(e->at, &dword, 4);
+    e->at += 4;
+}
+
+static inline void emit64(Emitter *e, u64 qword) {
+    memcpy(e->at, &qword, 8);
+    e->at += 8;
+}
+
+// ModRM for [rbx + disp32] with the given reg field.
+static inline void emit_rbx(Emitter *e, u8 reg, u32 offset) {
+    emit8(e, 0x80 | reg << 3 | 3);
+    emit32(e, offset);
+}
+
+// B, C, D, E, H, L, M, A in opcode encoding order. M has no offset.
+static const u32 REGS[8] = {
+    offsetof(CPU, regs.b), offsetof(CPU, regs.c),
+    offsetof(CPU, regs.d), offsetof(CPU, regs.e),
+    offsetof(CPU, regs.h), offsetof(CPU, regs.l),
+    0,                     offsetof(CPU, regs.a),
+};
+
+// BC, DE, HL, SP in opcode encoding order.
+static const u32 PAIRS[4] = {
+    offsetof(CPU, regs.bc), offsetof(CPU, regs.de),
+    offsetof(CPU, regs.hl), offsetof(CPU, sp),
+};
+
+static bool writes_memory(u8 opcode) {
+    switch (opcode) {
+        case 0x02: case 0x12: case 0x22: case 0x32: // STAX, SHLD, STA
+        case 0x34: case 0x35: case 0x36:            // INR M, DCR M, MVI M
+        case 0x70: case 0x71: case 0x72: case 0x73: // MOV M
+        case 0x74: case 0x75: case 0x76: case 0x77:
+        case 0xc5: case 0xd5: case 0xe5: case 0xf5: // PUSH
+        case 0xe3:                                  // XTHL
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Emits `opcode` inline if it only moves data between registers.
+static bool emit_inline(Emitter *e, const MicroOp *uop) {
+    u8 opcode = uop->opcode;
+
+    // MOV r, r
+    if (opcode >= 0x40 && opcode < 0x80 && opcode != 0x76) {
+        u8 dst = opcode >> 3 & 7;
+        u8 src = opcode & 7;
+        if (dst == 6 || src == 6)
+            return false;
+
+        emit8(e, 0x0f); emit8(e, 0xb6); emit_rbx(e, 0, REGS[src]); // movzx eax, byte [src]
+        emit8(e, 0x88); emit_rbx(e, 0, REGS[dst]);                 // mov [dst], al
+        return true;
+    }
+
+    switch (opcode) {
+        // NOP and undocumented NOPs
+        case 0x00: case 0x08: case 0x10: case 0x18:
+        case 0x20: case 0x28: case 0x30: case 0x38:
+            return true;
+
+        // MVI r
+        case 0x06: case 0x0e: case 0x16: case 0x1e:
+        case 0x26: case 0x2e: case 0x3e:
+            emit8(e, 0xc6); emit_rbx(e, 0, REGS[opcode >> 3]); // mov byte [r], imm8
+            emit8(e, uop->imm);
+            return true;
+
+        // LXI
+        case 0x01: case 0x11: case 0x21: case 0x31:
+            emit8(e, 0x66); emit8(e, 0xc7); emit_rbx(e, 0, PAIRS[opcode >> 4]); // mov word [rp], imm16
+            emit16(e, uop->imm);
+            return true;
+
+        // INX
+        case 0x03: case 0x13: case 0x23: case 0x33:
+            emit8(e, 0x66); emit8(e, 0xff); emit_rbx(e, 0, PAIRS[opcode >> 4]); // inc word [rp]
+            return true;
+
+        // DCX
+        case 0x0b: case 0x1b: case 0x2b: case 0x3b:
+            emit8(e, 0x66); emit8(e, 0xff); emit_rbx(e, 1, PAIRS[opcode >> 4]); // dec word [rp]
+            return true;
+
+        // CMA
+        case 0x2f:
+            emit8(e, 0xf6); emit_rbx(e, 2, offsetof(CPU, regs.a)); // not byte [a]
+            return true;
+
+        // STC
+        case 0x37:
+            emit8(e, 0x80); emit_rbx(e, 1, offsetof(CPU, flags)); // or byte [flags], 1
+            emit8(e, FLAG_CARRY);
+            return true;
+
+        // CMC
+        case 0x3f:
+            emit8(e, 0x80); emit_rbx(e, 6, offsetof(CPU, flags)); // xor byte [flags], 1
+            emit8(e, FLAG_CARRY);
+            return true;
+
+        // XCHG
+        case 0xeb:
+            emit8(e, 0x66); emit8(e, 0x8b); emit_rbx(e, 0, offsetof(CPU, regs.de)); // mov ax, [de]
+            emit8(e, 0x66); emit8(e, 0x8b); emit_rbx(e, 1, offsetof(CPU, regs.hl)); // mov cx, [hl]
+            emit8(e, 0x66); emit8(e, 0x89); emit_rbx(e, 1, offsetof(CPU, regs.de)); // mov [de], cx
+            emit8(e, 0x66); emit8(e, 0x89); emit_rbx(e, 0, offsetof(CPU, regs.hl)); // mov [hl], ax
+            return true;
+
+        // SPHL
+        case 0xf9:
+            emit8(e, 0x66); emit8(e, 0x8b); emit_rbx(e, 0, offsetof(CPU, regs.hl)); // mov ax, [hl]
+            emit8(e, 0x66); emit8(e, 0x89); emit_rbx(e, 0, offsetof(CPU, sp));      // mov [sp], ax
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+static void emit_call(Emitter *e, const MicroOp *uop) {
+    JitOp op = JIT_OPS[uop->opcode];
+    u16 imm = op == jit_invalid ? uop->opcode : uop->imm;
+
+    emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0xdf); // mov rdi, rbx
+    emit8(e, 0xbe); emit32(e, imm);                 // mov esi, imm
+    emit8(e, 0x48); emit8(e, 0xb8); emit64(e, (u64)op); // mov rax, op
+    emit8(e, 0xff); emit8(e, 0xd0);                 // call rax
+}
+
+static void emit_set_pc(Emitter *e, u16 pc) {
+    emit8(e, 0x66); emit8(e, 0xc7); emit_rbx(e, 0, offsetof(CPU, pc)); // mov word [pc], imm16
+    emit16(e, pc);
+}
+
+static void emit_return(Emitter *e, u32 executed) {
+    emit8(e, 0xb8); emit32(e, executed); // mov eax, executed
+    emit8(e, 0x5b);                      // pop rbx
+    emit8(e, 0xc3);                      // ret
+}
+
+/**
+ * Leaves the block after instruction `index` if a store invalidated it.
+ */
+static void emit_valid_check(Emitter *e, Block *block, u8 index) {
+    u32 skipped = 0;
+    for (u8 i = index + 1; i < block->count; i++)
+        skipped += CYCLES[block->ops[i].opcode];
+
+    emit8(e, 0x48); emit8(e, 0xb8); emit64(e, (u64)&block->valid); // mov rax, &valid
+    emit8(e, 0x80); emit8(e, 0x38); emit8(e, 0x00);                 // cmp byte [rax], 0
+
+    // jne over the exit stub below.
+    emit8(e, 0x75);
+    u8 *jump = e->at;
+    emit8(e, 0);
+
+    u8 *stub = e->at;
+    emit_set_pc(e, block->ops[index].next);
+    emit8(e, 0x48); emit8(e, 0x81); emit_rbx(e, 5, offsetof(CPU, cycles)); // sub qword [cycles], imm32
+    emit32(e, skipped);
+    emit_return(e, index + 1);
+
+    *jump = e->at - stub;
+}
+
+static void flush(Jit *jit, BlockCache *cache) {
+    for (u32 addr = 0; addr < 0x10000; addr++) {
+        Block *block = cache->blocks[addr];
+        if (block)
+            block->native = 0;
+    }
+
+    jit->used = 0;
+    jit->flushes++;
+}
+
+bool jit_translate(Jit *jit, BlockCache *cache, Block *block) {
+    u32 size = block->count * MAX_OP_BYTES + MAX_FRAME_BYTES;
+    if (jit->used + size > JIT_BUFFER_SIZE)
+        flush(jit, cache);
+
+    Emitter e = { jit->code + jit->used, jit->code + jit->used };
+
+    emit8(&e, 0x53);                              // push rbx
+    emit8(&e, 0x48); emit8(&e, 0x89); emit8(&e, 0xfb); // mov rbx, rdi
+
+    for (u8 i = 0; i < block->count; i++) {
+        const MicroOp *uop = &block->ops[i];
+        bool last = i == block->count - 1;
+
+        // Handlers of the last instruction may read the PC or jump.
+        if (last)
+            emit_set_pc(&e, uop->next);
+
+        if (emit_inline(&e, uop))
+            continue;
+
+        emit_call(&e, uop);
+        if (!last && writes_memory(uop->opcode))
+            emit_valid_check(&e, block, i);
+    }
+
+    emit_return(&e, block->count);
+
+    block->native = e.start;
+    jit->used += e.at - e.start;
+    jit->translated++;
+
+    return true;
+}
+
+Jit *jit_new(void) {
+    u8 *code = mmap(0, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        fprintf(stderr, "JIT: No executable memory, falling back to the interpreter.\n");
+        return 0;
+    }
+
+    Jit *jit = calloc(1, sizeof(Jit));
+    if (!jit) {
+        fprintf(stderr, "JIT: Out of memory.\n");
+        exit(1);
+    }
+
+    jit->code = code;
+
+    return jit;
+}
+
+void jit_free(Jit *jit) {
+    if (!jit)
+        return;
+
+    munmap(jit->code, JIT_BUFFER_SIZE);
+    free(jit);
+}
+
+#else
+
+// No translator for this host: cpu_run interprets every block.
+
+Jit *jit_new(void) {
+    return 0;
+}
+
+void jit_free(Jit *jit) {
+    (void)jit;
+}
+
+bool jit_translate(Jit *jit, BlockCache *cache, Block *block) {
+    (void)jit;
+    (void)cache;
+    (void)block;
+
+    return false;
+}
+
+#endif
@@ -0,0 +1,1242 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lanes.h"
+
+/**
+ * Lockstep interpreter.
+ *
+ * While every running lane is at one PC and holds the same code there, the
+ * lanes run together: each instruction is fetched once, from the first
+ * lane, and executed once for all of them, and their cycles are checked
+ * against their targets once per batch of instructions. Register-only
+ * opcodes run on all lanes at once with SSE2 (8-bit registers and flags,
+ * 16 lanes per register) and AVX2 (PC and SP, 16 lanes of 16 bits). Loads,
+ * stores, the stack and calls run one lane at a time on the lane arrays;
+ * only I/O, interrupts and the rare rest load the lane into its CPU and go
+ * through cpu_execute.
+ *
+ * Lanes at one PC whose code differs fetch their own opcodes and run in
+ * groups of one opcode, each under a mask of its lanes. Once lanes go to
+ * different PCs they are split: the most lanes at one PC carry on together
+ * and the others finish their run alone through cpu_run, which is faster
+ * than the steps they would add to the group.
+ *
+ * Build with -DLANES_SCALAR to use plain C loops instead of intrinsics.
+ */
+
+#if defined(__SSE2__) && !defined(LANES_SCALAR)
+#include <immintrin.h>
+#define LANES_SIMD
+#endif
+
+#ifdef LANES_SIMD
+
+typedef __m128i V8;
+
+static inline V8 load8(const u8 *p)      { return _mm_loadu_si128((const __m128i *)p); }
+static inline void store8(u8 *p, V8 v)   { _mm_storeu_si128((__m128i *)p, v); }
+static inline V8 set8(u8 x)              { return _mm_set1_epi8((char)x); }
+static inline V8 add8(V8 a, V8 b)        { return _mm_add_epi8(a, b); }
+static inline V8 sub8(V8 a, V8 b)        { return _mm_sub_epi8(a, b); }
+static inline V8 and8(V8 a, V8 b)        { return _mm_and_si128(a, b); }
+static inline V8 or8(V8 a, V8 b)         { return _mm_or_si128(a, b); }
+static inline V8 xor8(V8 a, V8 b)        { return _mm_xor_si128(a, b); }
+static inline V8 andnot8(V8 a, V8 b)     { return _mm_andnot_si128(a, b); }
+static inline V8 eq8(V8 a, V8 b)         { return _mm_cmpeq_epi8(a, b); }
+static inline V8 msb8(V8 a)              { return _mm_cmplt_epi8(a, _mm_setzero_si128()); }
+static inline u32 bits8(V8 mask)         { return _mm_movemask_epi8(mask); }
+
+// There are no byte shifts: shift words and drop what crossed into a byte.
+static inline V8 srl8(V8 a, int n) {
+    return and8(_mm_srli_epi16(a, n), set8(0xff >> n));
+}
+
+static inline V8 mask8(u32 bits) {
+    const V8 select = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                    1, 2, 4, 8, 16, 32, 64, -128);
+    V8 spread = _mm_unpacklo_epi64(set8(bits), set8(bits >> 8));
+
+    return eq8(and8(spread, select), select);
+}
+
+static inline V8 blend8(V8 old, V8 new, V8 mask) {
+    return or8(and8(mask, new), andnot8(mask, old));
+}
+
+#ifdef __AVX2__
+
+typedef __m256i V16;
+
+static inline V16 load16(const u16 *p)   { return _mm256_loadu_si256((const __m256i *)p); }
+static inline void store16(u16 *p, V16 v){ _mm256_storeu_si256((__m256i *)p, v); }
+static inline V16 set16(u16 x)           { return _mm256_set1_epi16((short)x); }
+static inline V16 add16(V16 a, V16 b)    { return _mm256_add_epi16(a, b); }
+static inline V16 widen(V8 mask)         { return _mm256_cvtepi8_epi16(mask); }
+
+static inline V16 blend16(V16 old, V16 new, V16 mask) {
+    return _mm256_blendv_epi8(old, new, mask);
+}
+
+// Lanes where `a` equals `b`, narrowed to a byte mask.
+static inline V8 eq16(V16 a, V16 b) {
+    __m256i eq = _mm256_cmpeq_epi16(a, b);
+    return _mm_packs_epi16(_mm256_castsi256_si128(eq), _mm256_extracti128_si256(eq, 1));
+}
+
+#else
+
+typedef struct {
+    __m128i lo, hi;
+} V16;
+
+static inline V16 load16(const u16 *p) {
+    return (V16){ _mm_loadu_si128((const __m128i *)p), _mm_loadu_si128((const __m128i *)p + 1) };
+}
+
+static inline void store16(u16 *p, V16 v) {
+    _mm_storeu_si128((__m128i *)p, v.lo);
+    _mm_storeu_si128((__m128i *)p + 1, v.hi);
+}
+
+static inline V16 set16(u16 x) {
+    return (V16){ _mm_set1_epi16((short)x), _mm_set1_epi16((short)x) };
+}
+
+static inline V16 add16(V16 a, V16 b) {
+    return (V16){ _mm_add_epi16(a.lo, b.lo), _mm_add_epi16(a.hi, b.hi) };
+}
+
+static inline V16 widen(V8 mask) {
+    return (V16){ _mm_unpacklo_epi8(mask, mask), _mm_unpackhi_epi8(mask, mask) };
+}
+
+static inline V16 blend16(V16 old, V16 new, V16 mask) {
+    return (V16){
+        _mm_or_si128(_mm_and_si128(mask.lo, new.lo), _mm_andnot_si128(mask.lo, old.lo)),
+        _mm_or_si128(_mm_and_si128(mask.hi, new.hi), _mm_andnot_si128(mask.hi, old.hi)),
+    };
+}
+
+static inline V8 eq16(V16 a, V16 b) {
+    return _mm_packs_epi16(_mm_cmpeq_epi16(a.lo, b.lo), _mm_cmpeq_epi16(a.hi, b.hi));
+}
+
+#endif
+
+#else
+
+typedef struct {
+    u8 v[LANES];
+} V8;
+
+typedef struct {
+    u16 v[LANES];
+} V16;
+
+#define MAP8(expr)                          \
+    V8 r;                                   \
+    for (u32 i = 0; i < LANES; i++)         \
+        r.v[i] = (expr);                    \
+    return r
+
+#define MAP16(expr)                         \
+    V16 r;                                  \
+    for (u32 i = 0; i < LANES; i++)         \
+        r.v[i] = (expr);                    \
+    return r
+
+static inline V8 load8(const u8 *p)      { MAP8(p[i]); }
+static inline V8 set8(u8 x)              { MAP8(x); }
+static inline V8 add8(V8 a, V8 b)        { MAP8(a.v[i] + b.v[i]); }
+static inline V8 sub8(V8 a, V8 b)        { MAP8(a.v[i] - b.v[i]); }
+static inline V8 and8(V8 a, V8 b)        { MAP8(a.v[i] & b.v[i]); }
+static inline V8 or8(V8 a, V8 b)         { MAP8(a.v[i] | b.v[i]); }
+static inline V8 xor8(V8 a, V8 b)        { MAP8(a.v[i] ^ b.v[i]); }
+static inline V8 andnot8(V8 a, V8 b)     { MAP8(~a.v[i] & b.v[i]); }
+static inline V8 eq8(V8 a, V8 b)         { MAP8(a.v[i] == b.v[i] ? 0xff : 0); }
+static inline V8 msb8(V8 a)              { MAP8(a.v[i] & 0x80 ? 0xff : 0); }
+static inline V8 srl8(V8 a, int n)       { MAP8(a.v[i] >> n); }
+static inline V8 mask8(u32 bits)         { MAP8(bits >> i & 1 ? 0xff : 0); }
+
+static inline V8 blend8(V8 old, V8 new, V8 mask) {
+    MAP8((new.v[i] & mask.v[i]) | (old.v[i] & ~mask.v[i]));
+}
+
+static inline void store8(u8 *p, V8 v) {
+    for (u32 i = 0; i < LANES; i++)
+        p[i] = v.v[i];
+}
+
+// The top bits of eight lanes at a time, gathered into one byte by a
+// multiply instead of a loop of shifts.
+static inline u32 bits8(V8 mask) {
+    u32 bits = 0;
+    for (u32 half = 0; half < LANES; half += 8) {
+        u64 tops = 0;
+        for (u32 i = 0; i < 8; i++)
+            tops |= (u64)(mask.v[half + i] & 0x80) << i * 8;
+
+        bits |= (tops * 0x0002040810204081 >> 56) << half;
+    }
+
+    return bits;
+}
+
+static inline V16 load16(const u16 *p)   { MAP16(p[i]); }
+static inline V16 set16(u16 x)           { MAP16(x); }
+static inline V16 add16(V16 a, V16 b)    { MAP16(a.v[i] + b.v[i]); }
+static inline V16 widen(V8 mask)         { MAP16(mask.v[i] ? 0xffff : 0); }
+static inline V8 eq16(V16 a, V16 b)      { MAP8(a.v[i] == b.v[i] ? 0xff : 0); }
+
+static inline V16 blend16(V16 old, V16 new, V16 mask) {
+    MAP16((new.v[i] & mask.v[i]) | (old.v[i] & ~mask.v[i]));
+}
+
+static inline void store16(u16 *p, V16 v) {
+    for (u32 i = 0; i < LANES; i++)
+        p[i] = v.v[i];
+}
+
+#endif
+
+const char *lanes_isa(void) {
+#if !defined(LANES_SIMD)
+    return "scalar";
+#elif defined(__AVX2__)
+    return "avx2";
+#else
+    return "sse2";
+#endif
+}
+
+// Stores `value` into the lanes of `mask` only.
+static inline void put8(u8 *reg, V8 value, V8 mask) {
+    store8(reg, blend8(load8(reg), value, mask));
+}
+
+static inline V8 zsp8(V8 value) {
+    // Fold the byte onto bit 0, which ends up set for odd parity.
+    V8 odd = xor8(value, srl8(value, 4));
+    odd = xor8(odd, srl8(odd, 2));
+    odd = xor8(odd, srl8(odd, 1));
+
+    V8 parity = andnot8(odd, set8(1));
+    parity = add8(parity, parity);
+    parity = add8(parity, parity);
+
+    V8 zero = and8(eq8(value, set8(0)), set8(FLAG_ZERO));
+    V8 sign = and8(value, set8(FLAG_SIGN));
+
+    return or8(or8(sign, zero), parity);
+}
+
+// The carry out of bit 7 of a + b, rebuilt from the operands and the sum
+// so that no lane needs 9 bits. All ones where there is one.
+static inline V8 carry8(V8 a, V8 b, V8 sum) {
+    return msb8(or8(and8(a, b), andnot8(sum, or8(a, b))));
+}
+
+// a + b + carry_in, with the flags ADD sets.
+static inline V8 adder(V8 a, V8 b, V8 carry_in, V8 *flags) {
+    V8 sum = add8(add8(a, b), carry_in);
+
+    V8 carry = carry8(a, b, sum);
+    V8 aux = and8(xor8(xor8(a, b), sum), set8(FLAG_AUX_CARRY));
+
+    *flags = or8(or8(zsp8(sum), and8(carry, set8(FLAG_CARRY))), aux);
+    return sum;
+}
+
+static void alu(Lanes *lanes, u8 operation, V8 value, V8 mask) {
+    V8 a = load8(lanes->a);
+    V8 flags = load8(lanes->flags);
+    V8 carry = and8(flags, set8(FLAG_CARRY));
+    V8 one = set8(1);
+
+    V8 result = a;
+    V8 out;
+
+    switch (operation) {
+        case 0: // ADD
+            result = adder(a, value, set8(0), &out);
+            break;
+        case 1: // ADC
+            result = adder(a, value, carry, &out);
+            break;
+        case 2: // SUB
+            result = adder(a, xor8(value, set8(0xff)), one, &out);
+            out = xor8(out, set8(FLAG_CARRY));
+            break;
+        case 3: // SBB
+            result = adder(a, xor8(value, set8(0xff)), xor8(carry, one), &out);
+            out = xor8(out, set8(FLAG_CARRY));
+            break;
+        case 4: { // ANA
+            V8 aux = and8(or8(a, value), set8(0x08));
+            result = and8(a, value);
+            out = or8(zsp8(result), add8(aux, aux));
+            break;
+        }
+        case 5: // XRA
+            result = xor8(a, value);
+            out = zsp8(result);
+            break;
+        case 6: // ORA
+            result = or8(a, value);
+            out = zsp8(result);
+            break;
+        default: { // CMP
+            V8 diff = sub8(a, value);
+            V8 borrow = msb8(or8(andnot8(a, value), andnot8(xor8(a, value), diff)));
+            V8 aux = andnot8(xor8(xor8(a, diff), value), set8(FLAG_AUX_CARRY));
+            out = or8(or8(zsp8(diff), and8(borrow, set8(FLAG_CARRY))), aux);
+            break;
+        }
+    }
+
+    put8(lanes->a, result, mask);
+    put8(lanes->flags, out, mask);
+}
+
+static void advance(Lanes *lanes, V8 mask, u16 length) {
+    V16 pc = load16(lanes->pc);
+    store16(lanes->pc, blend16(pc, add16(pc, set16(length)), widen(mask)));
+}
+
+// Code comes through the fetch table, as in next_byte.
+static inline u8 fetch(const MemoryMap *map, u16 addr) {
+    return map->fetch[addr / PAGE_SIZE][addr % PAGE_SIZE];
+}
+
+static inline u16 fetch_word(const MemoryMap *map, u16 addr) {
+    return fetch(map, addr) | fetch(map, addr + 1) << 8;
+}
+
+static inline u8 load(Lanes *lanes, u32 i, u16 addr) {
+    const u8 *page = lanes->maps[i]->read[addr / PAGE_SIZE];
+    return page ? page[addr % PAGE_SIZE] : read_byte(lanes->cpus[i], addr);
+}
+
+// Bytes in the instruction, opcode included.
+static inline u32 length(u8 opcode) {
+    if ((opcode & 0xc7) == 0x06 || (opcode & 0xc7) == 0xc6 || opcode == 0xd3 || opcode == 0xdb)
+        return 2;
+    if ((opcode & 0xcf) == 0x01 || (opcode & 0xe7) == 0x22 || (opcode & 0xc7) == 0xc2 ||
+        (opcode & 0xc7) == 0xc4 || opcode == 0xc3 || opcode == 0xcd || opcode == 0xdd)
+        return 3;
+
+    return 1;
+}
+
+#define CHUNK 64
+
+/**
+ * Compares the CHUNK bytes of code around `addr` across the lanes of
+ * `running` and stamps those that every lane shares with the current era.
+ * A chunk at a time costs about what a few bytes would, one at a time.
+ */
+static void compare(Lanes *lanes, u32 running, u16 addr) {
+    u16 base = addr & ~(CHUNK - 1);
+    u32 offset = base % PAGE_SIZE;
+    const u8 *first = lanes->maps[__builtin_ctz(running)]->fetch[base / PAGE_SIZE] + offset;
+
+    u8 shared[CHUNK];
+    memset(shared, 0xff, sizeof(shared));
+
+    for (u32 bits = running & (running - 1); bits; bits &= bits - 1) {
+        const u8 *code = lanes->maps[__builtin_ctz(bits)]->fetch[base / PAGE_SIZE] + offset;
+        for (u32 k = 0; k < CHUNK; k++)
+            shared[k] &= code[k] == first[k] ? 0xff : 0;
+    }
+
+    for (u32 k = 0; k < CHUNK; k++) {
+        if (shared[k])
+            lanes->same[base + k] = lanes->era;
+    }
+    lanes->stamped |= 1ull << base / PAGE_SIZE;
+}
+
+/**
+ * Whether every lane of `running` holds the same `length` bytes of code at
+ * `addr`. Bytes found the same are stamped with the current `era` until a
+ * lane stores to them, so shared code is compared once rather than on
+ * every fetch.
+ */
+static bool agree(Lanes *lanes, u32 running, u16 addr, u32 length) {
+    for (; length; length--, addr++) {
+        if (lanes->same[addr] == lanes->era)
+            continue;
+
+        compare(lanes, running, addr);
+        if (lanes->same[addr] != lanes->era)
+            return false;
+    }
+
+    return true;
+}
+
+// After memory may have changed without going through store(). Era 0 is
+// never current, so that stores can clear a byte with it.
+static void forget(Lanes *lanes) {
+    lanes->stamped = 0;
+    if (++lanes->era == 0) {
+        memset(lanes->same, 0, sizeof(lanes->same));
+        lanes->era = 1;
+    }
+}
+
+// Whether every lane of `bits` is at the same PC.
+static inline bool converged(Lanes *lanes, u32 bits) {
+    V8 at = eq16(load16(lanes->pc), set16(lanes->pc[__builtin_ctz(bits)]));
+    return (bits8(at) & bits) == bits;
+}
+
+/**
+ * The byte or word after the opcode in every lane of `bits`. Lanes that run
+ * `together` share their code, so it is fetched once, from the first.
+ */
+static V8 operand8(Lanes *lanes, u32 bits, bool together) {
+    if (together) {
+        u32 i = __builtin_ctz(bits);
+        return set8(fetch(lanes->maps[i], lanes->pc[i] + 1));
+    }
+
+    u8 imm[LANES] = { 0 };
+    for (; bits; bits &= bits - 1) {
+        u32 i = __builtin_ctz(bits);
+        imm[i] = fetch(lanes->maps[i], lanes->pc[i] + 1);
+    }
+
+    return load8(imm);
+}
+
+static V16 operand16(Lanes *lanes, u32 bits, bool together) {
+    if (together) {
+        u32 i = __builtin_ctz(bits);
+        return set16(fetch_word(lanes->maps[i], lanes->pc[i] + 1));
+    }
+
+    u16 imm[LANES] = { 0 };
+    for (; bits; bits &= bits - 1) {
+        u32 i = __builtin_ctz(bits);
+        imm[i] = fetch_word(lanes->maps[i], lanes->pc[i] + 1);
+    }
+
+    return load16(imm);
+}
+
+// The byte at HL of every lane in `bits`.
+static V8 gather_m(Lanes *lanes, u32 bits) {
+    u8 value[LANES] = { 0 };
+    for (; bits; bits &= bits - 1) {
+        u32 i = __builtin_ctz(bits);
+        value[i] = load(lanes, i, lanes->h[i] << 8 | lanes->l[i]);
+    }
+
+    return load8(value);
+}
+
+// Lanes of `mask` whose flags satisfy condition `cc` of a Jcc, Ccc or Rcc.
+static V8 condition(Lanes *lanes, u8 cc, V8 mask) {
+    static const u8 FLAG[4] = { FLAG_ZERO, FLAG_CARRY, FLAG_PARITY, FLAG_SIGN };
+
+    V8 clear = eq8(and8(load8(lanes->flags), set8(FLAG[cc >> 1])), set8(0));
+
+    return cc & 1 ? andnot8(clear, mask) : and8(clear, mask);
+}
+
+/**
+ * Runs `opcode` on the lanes of `mask` if it only touches registers.
+ * Returns false for everything that writes memory or needs I/O or the stack.
+ */
+static bool execute_vector(Lanes *lanes, u8 opcode, V8 mask, u32 bits, bool together) {
+    u8 *const REGS[8] = {
+        lanes->b, lanes->c, lanes->d, lanes->e, lanes->h, lanes->l, 0, lanes->a,
+    };
+
+    // MOV r, r and MOV r, M
+    if (opcode >= 0x40 && opcode < 0x80) {
+        u8 *dst = REGS[opcode >> 3 & 7];
+        u8 *src = REGS[opcode & 7];
+        if (!dst)
+            return false;
+
+        put8(dst, src ? load8(src) : gather_m(lanes, bits), mask);
+        advance(lanes, mask, 1);
+        return true;
+    }
+
+    // ADD..CMP r and M
+    if (opcode >= 0x80 && opcode < 0xc0) {
+        u8 *src = REGS[opcode & 7];
+
+        alu(lanes, opcode >> 3 & 7, src ? load8(src) : gather_m(lanes, bits), mask);
+        advance(lanes, mask, 1);
+        return true;
+    }
+
+    // ADI..CPI
+    if (opcode >= 0xc0 && (opcode & 0x07) == 0x06) {
+        alu(lanes, opcode >> 3 & 7, operand8(lanes, bits, together), mask);
+        advance(lanes, mask, 2);
+        return true;
+    }
+
+    if (opcode < 0x40) {
+        u8 *reg = REGS[opcode >> 3];
+
+        switch (opcode & 0x07) {
+            case 0x04: { // INR r
+                if (!reg)
+                    return false;
+
+                V8 value = add8(load8(reg), set8(1));
+                V8 aux = and8(eq8(and8(value, set8(0x0f)), set8(0)), set8(FLAG_AUX_CARRY));
+                V8 flags = or8(and8(load8(lanes->flags), set8(FLAG_CARRY)), or8(zsp8(value), aux));
+
+                put8(reg, value, mask);
+                put8(lanes->flags, flags, mask);
+                advance(lanes, mask, 1);
+                return true;
+            }
+            case 0x05: { // DCR r
+                if (!reg)
+                    return false;
+
+                V8 value = sub8(load8(reg), set8(1));
+                V8 aux = andnot8(eq8(and8(value, set8(0x0f)), set8(0x0f)), set8(FLAG_AUX_CARRY));
+                V8 flags = or8(and8(load8(lanes->flags), set8(FLAG_CARRY)), or8(zsp8(value), aux));
+
+                put8(reg, value, mask);
+                put8(lanes->flags, flags, mask);
+                advance(lanes, mask, 1);
+                return true;
+            }
+            case 0x06: // MVI r
+                if (!reg)
+                    return false;
+
+                put8(reg, operand8(lanes, bits, together), mask);
+                advance(lanes, mask, 2);
+                return true;
+        }
+    }
+
+    switch (opcode) {
+        // NOP and undocumented NOPs
+        case 0x00: case 0x08: case 0x10: case 0x18:
+        case 0x20: case 0x28: case 0x30: case 0x38:
+            advance(lanes, mask, 1);
+            return true;
+
+        // LXI B, D, H
+        case 0x01: case 0x11: case 0x21: {
+            u8 *hi = REGS[(opcode >> 4) * 2];
+            u8 *lo = REGS[(opcode >> 4) * 2 + 1];
+
+            if (together) {
+                u32 first = __builtin_ctz(bits);
+                u16 imm = fetch_word(lanes->maps[first], lanes->pc[first] + 1);
+
+                put8(lo, set8(imm), mask);
+                put8(hi, set8(imm >> 8), mask);
+            }
+            else for (; bits; bits &= bits - 1) {
+                u32 i = __builtin_ctz(bits);
+                u16 imm = fetch_word(lanes->maps[i], lanes->pc[i] + 1);
+
+                lo[i] = imm;
+                hi[i] = imm >> 8;
+            }
+
+            advance(lanes, mask, 3);
+            return true;
+        }
+
+        case 0x31: // LXI SP
+            store16(lanes->sp, blend16(load16(lanes->sp), operand16(lanes, bits, together), widen(mask)));
+            advance(lanes, mask, 3);
+            return true;
+
+        // INX B, D, H
+        case 0x03: case 0x13: case 0x23: {
+            u8 *hi = REGS[(opcode >> 4) * 2];
+            u8 *lo = REGS[(opcode >> 4) * 2 + 1];
+
+            V8 low = add8(load8(lo), set8(1));
+            V8 high = sub8(load8(hi), eq8(low, set8(0)));
+
+            put8(lo, low, mask);
+            put8(hi, high, mask);
+            advance(lanes, mask, 1);
+            return true;
+        }
+
+        // DCX B, D, H
+        case 0x0b: case 0x1b: case 0x2b: {
+            u8 *hi = REGS[(opcode >> 4) * 2];
+            u8 *lo = REGS[(opcode >> 4) * 2 + 1];
+
+            V8 low = load8(lo);
+            V8 high = add8(load8(hi), eq8(low, set8(0)));
+
+            put8(lo, sub8(low, set8(1)), mask);
+            put8(hi, high, mask);
+            advance(lanes, mask, 1);
+            return true;
+        }
+
+        // DAD B, D, H
+        case 0x09: case 0x19: case 0x29: {
+            V8 h = load8(lanes->h), l = load8(lanes->l);
+            V8 hi = load8(REGS[(opcode >> 4) * 2]), lo = load8(REGS[(opcode >> 4) * 2 + 1]);
+
+            V8 low = add8(l, lo);
+            V8 high = sub8(add8(h, hi), carry8(l, lo, low));
+            V8 carry = and8(carry8(h, hi, high), set8(FLAG_CARRY));
+
+            put8(lanes->l, low, mask);
+            put8(lanes->h, high, mask);
+            put8(lanes->flags, or8(andnot8(set8(FLAG_CARRY), load8(lanes->flags)), carry), mask);
+            advance(lanes, mask, 1);
+            return true;
+        }
+
+        // INX SP, DCX SP
+        case 0x33: case 0x3b: {
+            V16 sp = load16(lanes->sp);
+            V16 step = set16(opcode == 0x33 ? 1 : 0xffff);
+
+            store16(lanes->sp, blend16(sp, add16(sp, step), widen(mask)));
+            advance(lanes, mask, 1);
+            return true;
+        }
+
+        // RLC, RRC, RAL, RAR
+        case 0x07: case 0x0f: case 0x17: case 0x1f: {
+            V8 a = load8(lanes->a);
+            V8 flags = load8(lanes->flags);
+            bool right = opcode & 0x08;
+
+            // The bit rotated out becomes the carry; RAL and RAR rotate the
+            // old carry in, RLC and RRC the bit itself.
+            V8 out = right ? and8(a, set8(1)) : srl8(a, 7);
+            V8 in = opcode & 0x10 ? and8(flags, set8(FLAG_CARRY)) : out;
+            V8 result = right ? or8(srl8(a, 1), and8(sub8(set8(0), in), set8(0x80)))
+                              : or8(add8(a, a), in);
+
+            put8(lanes->a, result, mask);
+            put8(lanes->flags, or8(andnot8(set8(FLAG_CARRY), flags), out), mask);
+            advance(lanes, mask, 1);
+            return true;
+        }
+
+        case 0x2f: // CMA
+            put8(lanes->a, xor8(load8(lanes->a), set8(0xff)), mask);
+            advance(lanes, mask, 1);
+            return true;
+
+        case 0x37: // STC
+            put8(lanes->flags, or8(load8(lanes->flags), set8(FLAG_CARRY)), mask);
+            advance(lanes, mask, 1);
+            return true;
+
+        case 0x3f: // CMC
+            put8(lanes->flags, xor8(load8(lanes->flags), set8(FLAG_CARRY)), mask);
+            advance(lanes, mask, 1);
+            return true;
+
+        case 0xeb: { // XCHG
+            V8 d = load8(lanes->d), e = load8(lanes->e);
+            V8 h = load8(lanes->h), l = load8(lanes->l);
+
+            put8(lanes->d, h, mask);
+            put8(lanes->e, l, mask);
+            put8(lanes->h, d, mask);
+            put8(lanes->l, e, mask);
+            advance(lanes, mask, 1);
+            return true;
+        }
+
+        // JMP and Jcc
+        case 0xc3:
+        case 0xc2: case 0xca: case 0xd2: case 0xda:
+        case 0xe2: case 0xea: case 0xf2: case 0xfa: {
+            V8 taken = opcode == 0xc3 ? mask : condition(lanes, opcode >> 3 & 7, mask);
+
+            V16 pc = load16(lanes->pc);
+            V16 next = blend16(add16(pc, set16(3)), operand16(lanes, bits, together), widen(taken));
+            store16(lanes->pc, blend16(pc, next, widen(mask)));
+            return true;
+        }
+
+        default:
+            return false;
+    }
+}
+
+// The addresses that mirror a stored byte may be code as well.
+static void forget_aliases(Lanes *lanes, u32 i, u16 addr) {
+    const MemoryMap *map = lanes->maps[i];
+    u32 page = addr / PAGE_SIZE;
+    const u8 *base = map->write[page] ? map->write[page] : map->read[page];
+    uintptr_t stored = (uintptr_t)base + addr % PAGE_SIZE;
+
+    for (u64 pages = map->aliases[page] & lanes->stamped; pages; pages &= pages - 1) {
+        u32 mapped = __builtin_ctzll(pages);
+        uintptr_t fetched = (uintptr_t)map->fetch[mapped];
+        if (stored >= fetched && stored < fetched + PAGE_SIZE)
+            lanes->same[mapped * PAGE_SIZE + (stored - fetched)] = 0;
+    }
+}
+
+// Stores make the lanes forget they agree on the byte: it may be code.
+static inline void store(Lanes *lanes, u32 i, u16 addr, u8 value) {
+#ifdef CPU_BLOCK_CACHE
+    write_byte(lanes->cpus[i], addr, value);
+#else
+    // write_byte without the call, when there are no blocks to invalidate.
+    u8 *page = lanes->maps[i]->write[addr / PAGE_SIZE];
+    if (page)
+        page[addr % PAGE_SIZE] = value;
+    else
+        write_byte(lanes->cpus[i], addr, value);
+#endif
+
+    lanes->same[addr] = 0;
+    if (lanes->maps[i]->aliases[addr / PAGE_SIZE] & lanes->stamped)
+        forget_aliases(lanes, i, addr);
+}
+
+static inline u16 load_word(Lanes *lanes, u32 i, u16 addr) {
+    return load(lanes, i, addr) | load(lanes, i, addr + 1) << 8;
+}
+
+static inline void store_word(Lanes *lanes, u32 i, u16 addr, u16 value) {
+    store(lanes, i, addr, value);
+    store(lanes, i, addr + 1, value >> 8);
+}
+
+static inline void push(Lanes *lanes, u32 i, u16 value) {
+    lanes->sp[i] -= 2;
+    store_word(lanes, i, lanes->sp[i], value);
+}
+
+static inline u16 pop(Lanes *lanes, u32 i) {
+    u16 value = load_word(lanes, i, lanes->sp[i]);
+    lanes->sp[i] += 2;
+
+    return value;
+}
+
+static inline bool lane_condition(Lanes *lanes, u32 i, u8 cc) {
+    static const u8 FLAG[4] = { FLAG_ZERO, FLAG_CARRY, FLAG_PARITY, FLAG_SIGN };
+
+    return !(lanes->flags[i] & FLAG[cc >> 1]) == !(cc & 1);
+}
+
+static inline u8 zsp(u8 value) {
+    return (value & FLAG_SIGN) | (value ? 0 : FLAG_ZERO) | (__builtin_parity(value) ? 0 : FLAG_PARITY);
+}
+
+static inline u16 pair(const u8 *hi, const u8 *lo, u32 i) {
+    return hi[i] << 8 | lo[i];
+}
+
+// Runs the statement that follows once for each lane `i` of `bits`.
+#define EACH_LANE(i, bits) \
+    for (u32 rest_ = (bits), i = 0; rest_ && (i = __builtin_ctz(rest_), true); rest_ &= rest_ - 1)
+
+/**
+ * Runs `opcode` on the lanes of `bits` one at a time without leaving the
+ * lane arrays, for loads, stores, the stack and calls. Returns false for
+ * anything else. Taken conditional calls and returns add their extra
+ * cycles to their lane; the caller adds CYCLES[opcode].
+ */
+static bool execute_serial(Lanes *lanes, u8 opcode, V8 mask, u32 bits, bool together) {
+    u8 *const REGS[8] = {
+        lanes->b, lanes->c, lanes->d, lanes->e, lanes->h, lanes->l, 0, lanes->a,
+    };
+
+    u32 first = __builtin_ctz(bits);
+    u16 shared = fetch_word(lanes->maps[first], lanes->pc[first] + 1);
+    u16 imm[LANES];
+    if (!together) {
+        EACH_LANE(i, bits)
+            imm[i] = fetch_word(lanes->maps[i], lanes->pc[i] + 1);
+    }
+
+    #define IMM(i) (together ? shared : imm[i])
+    #define HL(i)  pair(lanes->h, lanes->l, i)
+
+    // MOV M, r
+    if (opcode >= 0x70 && opcode < 0x78 && opcode != 0x76) {
+        u8 *src = REGS[opcode & 7];
+        EACH_LANE(i, bits)
+            store(lanes, i, HL(i), src[i]);
+
+        advance(lanes, mask, 1);
+        return true;
+    }
+
+    switch (opcode) {
+        case 0x36: // MVI M
+            EACH_LANE(i, bits)
+                store(lanes, i, HL(i), IMM(i));
+            advance(lanes, mask, 2);
+            return true;
+
+        case 0x76: // MOV M, M
+            EACH_LANE(i, bits)
+                store(lanes, i, HL(i), load(lanes, i, HL(i)));
+            advance(lanes, mask, 1);
+            return true;
+
+        // INR M, DCR M
+        case 0x34: case 0x35:
+            EACH_LANE(i, bits) {
+                u8 value = load(lanes, i, HL(i)) + (opcode == 0x34 ? 1 : -1);
+                bool aux = opcode == 0x34 ? (value & 0x0f) == 0 : (value & 0x0f) != 0x0f;
+
+                store(lanes, i, HL(i), value);
+                lanes->flags[i] = (lanes->flags[i] & FLAG_CARRY) | zsp(value) | (aux ? FLAG_AUX_CARRY : 0);
+            }
+            advance(lanes, mask, 1);
+            return true;
+
+        // STAX B, D
+        case 0x02: case 0x12: {
+            u8 *hi = REGS[(opcode >> 4) * 2];
+            u8 *lo = REGS[(opcode >> 4) * 2 + 1];
+
+            EACH_LANE(i, bits)
+                store(lanes, i, pair(hi, lo, i), lanes->a[i]);
+            advance(lanes, mask, 1);
+            return true;
+        }
+
+        // LDAX B, D
+        case 0x0a: case 0x1a: {
+            u8 *hi = REGS[(opcode >> 4) * 2];
+            u8 *lo = REGS[(opcode >> 4) * 2 + 1];
+
+            EACH_LANE(i, bits)
+                lanes->a[i] = load(lanes, i, pair(hi, lo, i));
+            advance(lanes, mask, 1);
+            return true;
+        }
+
+        case 0x32: // STA
+            EACH_LANE(i, bits)
+                store(lanes, i, IMM(i), lanes->a[i]);
+            advance(lanes, mask, 3);
+            return true;
+
+        case 0x3a: // LDA
+            EACH_LANE(i, bits)
+                lanes->a[i] = load(lanes, i, IMM(i));
+            advance(lanes, mask, 3);
+            return true;
+
+        case 0x22: // SHLD
+            EACH_LANE(i, bits)
+                store_word(lanes, i, IMM(i), HL(i));
+            advance(lanes, mask, 3);
+            return true;
+
+        case 0x2a: // LHLD
+            EACH_LANE(i, bits) {
+                u16 value = load_word(lanes, i, IMM(i));
+                lanes->h[i] = value >> 8;
+                lanes->l[i] = value;
+            }
+            advance(lanes, mask, 3);
+            return true;
+
+        case 0x39: // DAD SP
+            EACH_LANE(i, bits) {
+                u32 sum = HL(i) + lanes->sp[i];
+
+                lanes->h[i] = sum >> 8;
+                lanes->l[i] = sum;
+                lanes->flags[i] = (lanes->flags[i] & ~FLAG_CARRY) | (sum >> 16 ? FLAG_CARRY : 0);
+            }
+            advance(lanes, mask, 1);
+            return true;
+
+        // PUSH B, D, H, PSW
+        case 0xc5: case 0xd5: case 0xe5: case 0xf5: {
+            u8 *hi = opcode == 0xf5 ? lanes->a : REGS[(opcode >> 4 & 3) * 2];
+            u8 *lo = opcode == 0xf5 ? lanes->flags : REGS[(opcode >> 4 & 3) * 2 + 1];
+            u8 fixed = opcode == 0xf5 ? 0x02 : 0;
+
+            EACH_LANE(i, bits)
+                push(lanes, i, pair(hi, lo, i) | fixed);
+            advance(lanes, mask, 1);
+            return true;
+        }
+
+        // POP B, D, H, PSW
+        case 0xc1: case 0xd1: case 0xe1: case 0xf1: {
+            u8 *hi = opcode == 0xf1 ? lanes->a : REGS[(opcode >> 4 & 3) * 2];
+            u8 *lo = opcode == 0xf1 ? lanes->flags : REGS[(opcode >> 4 & 3) * 2 + 1];
+            u8 kept = opcode == 0xf1
+                    ? FLAG_SIGN | FLAG_ZERO | FLAG_AUX_CARRY | FLAG_PARITY | FLAG_CARRY
+                    : 0xff;
+
+            EACH_LANE(i, bits) {
+                u16 value = pop(lanes, i);
+                hi[i] = value >> 8;
+                lo[i] = value & kept;
+            }
+            advance(lanes, mask, 1);
+            return true;
+        }
+
+        case 0xe3: // XTHL
+            EACH_LANE(i, bits) {
+                u16 value = load_word(lanes, i, lanes->sp[i]);
+                store_word(lanes, i, lanes->sp[i], HL(i));
+                lanes->h[i] = value >> 8;
+                lanes->l[i] = value;
+            }
+            advance(lanes, mask, 1);
+            return true;
+
+        case 0xe9: // PCHL
+            EACH_LANE(i, bits)
+                lanes->pc[i] = HL(i);
+            return true;
+
+        case 0xf9: // SPHL
+            EACH_LANE(i, bits)
+                lanes->sp[i] = HL(i);
+            advance(lanes, mask, 1);
+            return true;
+
+        case 0xf3: // DI
+            EACH_LANE(i, bits)
+                lanes->cpus[i]->interrupts_enabled = false;
+            advance(lanes, mask, 1);
+            return true;
+
+        // CALL, its undocumented twin and Ccc
+        case 0xcd: case 0xdd:
+        case 0xc4: case 0xcc: case 0xd4: case 0xdc:
+        case 0xe4: case 0xec: case 0xf4: case 0xfc: {
+            bool always = (opcode & 0x0f) == 0x0d;
+
+            EACH_LANE(i, bits) {
+                if (always || lane_condition(lanes, i, opcode >> 3 & 7)) {
+                    push(lanes, i, lanes->pc[i] + 3);
+                    lanes->pc[i] = IMM(i);
+                    lanes->cycles[i] += always ? 0 : 6;
+                }
+                else
+                    lanes->pc[i] += 3;
+            }
+            return true;
+        }
+
+        // RET and Rcc
+        case 0xc9:
+        case 0xc0: case 0xc8: case 0xd0: case 0xd8:
+        case 0xe0: case 0xe8: case 0xf0: case 0xf8:
+            EACH_LANE(i, bits) {
+                if (opcode == 0xc9 || lane_condition(lanes, i, opcode >> 3 & 7)) {
+                    lanes->pc[i] = pop(lanes, i);
+                    lanes->cycles[i] += opcode == 0xc9 ? 0 : 6;
+                }
+                else
+                    lanes->pc[i] += 1;
+            }
+            return true;
+
+        default:
+            return false;
+    }
+
+    #undef IMM
+    #undef HL
+}
+
+static void load_lane(Lanes *lanes, u32 i) {
+    CPU *cpu = lanes->cpus[i];
+
+    lanes->a[i] = cpu->regs.a;
+    lanes->flags[i] = cpu_flags(cpu);
+    lanes->b[i] = cpu->regs.b;
+    lanes->c[i] = cpu->regs.c;
+    lanes->d[i] = cpu->regs.d;
+    lanes->e[i] = cpu->regs.e;
+    lanes->h[i] = cpu->regs.h;
+    lanes->l[i] = cpu->regs.l;
+    lanes->pc[i] = cpu->pc;
+    lanes->sp[i] = cpu->sp;
+    lanes->cycles[i] = cpu->cycles;
+    lanes->maps[i] = cpu->map;
+}
+
+static void store_lane(Lanes *lanes, u32 i) {
+    CPU *cpu = lanes->cpus[i];
+
+    cpu->regs.a = lanes->a[i];
+    cpu->flags = lanes->flags[i];
+    cpu->lazy = 0;
+    cpu->regs.b = lanes->b[i];
+    cpu->regs.c = lanes->c[i];
+    cpu->regs.d = lanes->d[i];
+    cpu->regs.e = lanes->e[i];
+    cpu->regs.h = lanes->h[i];
+    cpu->regs.l = lanes->l[i];
+    cpu->pc = lanes->pc[i];
+    cpu->sp = lanes->sp[i];
+    cpu->cycles = lanes->cycles[i];
+}
+
+// Same as the SYNC point of cpu_run.
+static void sync(CPU *cpu) {
+    if (cpu->interrupts_enabled && cpu->interrupt_vector) {
+        u8 vector = cpu->interrupt_vector;
+        cpu->interrupt_vector = 0;
+        cpu_interrupt(cpu, vector);
+    }
+}
+
+static void execute_scalar(Lanes *lanes, u32 i, u8 opcode) {
+    CPU *cpu = lanes->cpus[i];
+
+    store_lane(lanes, i);
+    cpu->pc++;
+    cpu_execute(cpu, opcode);
+
+    // IN, OUT and EI
+    if (opcode == 0xdb || opcode == 0xd3 || opcode == 0xfb)
+        sync(cpu);
+
+    load_lane(lanes, i);
+}
+
+/**
+ * Runs the lanes of `running`, all at one PC, for as long as they stay
+ * there together and none can reach its target: `room` is the fewest cycles
+ * any lane has left. Each step is one fetch and one execution for all of
+ * them, and their cycles are added up once at the end. Returns the number
+ * of steps, 0 if the first instruction needs cpu_execute.
+ */
+static u32 run_together(Lanes *lanes, u32 running, u64 room) {
+    u32 first = __builtin_ctz(running);
+    const MemoryMap *map = lanes->maps[first];
+    V8 mask = mask8(running);
+
+    u64 spent = 0;  // By every lane.
+    u64 most = 0;   // By any lane, with taken Ccc and Rcc.
+    u32 steps = 0, vector = 0, serial = 0;
+
+    do {
+        u16 pc = lanes->pc[first];
+        u8 opcode = fetch(map, pc);
+        if (!agree(lanes, running, pc, length(opcode)))
+            break;
+
+        if (execute_vector(lanes, opcode, mask, running, true))
+            vector++;
+        else if (execute_serial(lanes, opcode, mask, running, true))
+            serial++;
+        else
+            break;
+
+        steps++;
+        spent += CYCLES[opcode];
+        most += CYCLES[opcode] + ((opcode & 0xc3) == 0xc0 ? 6 : 0);
+
+        // Branches, calls and returns can send lanes apart.
+        if (opcode >= 0xc0 && !converged(lanes, running))
+            break;
+    } while (most < room);
+
+    for (u32 bits = running; bits; bits &= bits - 1)
+        lanes->cycles[__builtin_ctz(bits)] += spent;
+
+    u32 count = __builtin_popcount(running);
+    lanes->steps += steps;
+    lanes->groups += steps;
+    lanes->vector += (u64)vector * count;
+    lanes->serial += (u64)serial * count;
+
+    return steps;
+}
+
+/**
+ * One step of lanes whose code differs, or that need cpu_execute: every
+ * running lane fetches its own opcode, lanes are grouped by opcode and
+ * every group executes once, under a mask of its lanes.
+ */
+static void step(Lanes *lanes, u32 running) {
+    u8 opcodes[LANES] = { 0 };
+    for (u32 bits = running; bits; bits &= bits - 1) {
+        u32 i = __builtin_ctz(bits);
+        opcodes[i] = fetch(lanes->maps[i], lanes->pc[i]);
+    }
+
+    V8 all = load8(opcodes);
+
+    u32 pending = running;
+    while (pending) {
+        u32 first = __builtin_ctz(pending);
+        u8 opcode = opcodes[first];
+        u32 bits = bits8(eq8(all, set8(opcode))) & pending;
+        pending &= ~bits;
+
+        // A group at one PC still shares its operands.
+        bool together = (bits & (bits - 1)) && converged(lanes, bits)
+                     && agree(lanes, running, lanes->pc[first], length(opcode));
+
+        V8 mask = mask8(bits);
+        lanes->groups++;
+
+        if (execute_vector(lanes, opcode, mask, bits, together))
+            lanes->vector += __builtin_popcount(bits);
+        else if (execute_serial(lanes, opcode, mask, bits, together))
+            lanes->serial += __builtin_popcount(bits);
+        else {
+            for (u32 group = bits; group; group &= group - 1)
+                execute_scalar(lanes, __builtin_ctz(group), opcode);
+            lanes->scalar += __builtin_popcount(bits);
+
+            // cpu_execute already counted the cycles, and may have written
+            // memory through the stack or a device.
+            forget(lanes);
+            continue;
+        }
+
+        for (u32 group = bits; group; group &= group - 1)
+            lanes->cycles[__builtin_ctz(group)] += CYCLES[opcode];
+    }
+
+    lanes->steps++;
+}
+
+/**
+ * Regroups lanes that went apart: the most lanes at one PC carry on in
+ * lockstep and the rest, which would only cost the group a step each, run
+ * to their targets alone through cpu_run. Returns the lanes still running
+ * and adds the instructions run alone to `instructions`.
+ */
+static u32 split(Lanes *lanes, u32 running, const u64 *target, u64 *instructions) {
+    V16 pcs = load16(lanes->pc);
+    u32 keep = 0;
+
+    for (u32 rest = running; rest; ) {
+        u32 at = bits8(eq16(pcs, set16(lanes->pc[__builtin_ctz(rest)]))) & running;
+        if (__builtin_popcount(at) > __builtin_popcount(keep))
+            keep = at;
+        rest &= ~at;
+    }
+
+    // A lane on its own is faster through cpu_run.
+    if (!(keep & (keep - 1)))
+        keep = 0;
+
+    for (u32 bits = running & ~keep; bits; bits &= bits - 1) {
+        u32 i = __builtin_ctz(bits);
+
+        store_lane(lanes, i);
+        u64 count = cpu_run(lanes->cpus[i], target[i] - lanes->cycles[i]);
+        load_lane(lanes, i);
+
+        lanes->instructions[i] += count;
+        lanes->alone += count;
+        *instructions += count;
+    }
+
+    // cpu_run wrote memory behind store()'s back.
+    if (running & ~keep)
+        forget(lanes);
+
+    return keep;
+}
+
+void lanes_init(Lanes *lanes, CPU **cpus, u32 count) {
+    if (count > LANES) {
+        fprintf(stderr, "Lanes: At most %d lanes.\n", LANES);
+        exit(1);
+    }
+
+    *lanes = (Lanes){ .count = count };
+    for (u32 i = 0; i < count; i++) {
+        lanes->cpus[i] = cpus[i];
+        load_lane(lanes, i);
+    }
+}
+
+/**
+ * Runs every lane until its CPU's cycle count reaches `deadlines[i]`, like
+ * cpu_run does for one CPU. Lanes that reach their deadline or are stopped
+ * sit out the remaining steps, and lanes that go apart from the others
+ * finish alone. Returns the number of instructions executed over all lanes.
+ */
+u64 lanes_run_until(Lanes *lanes, const u64 *deadlines) {
+    u64 target[LANES];
+    u32 running = 0;
+
+    for (u32 i = 0; i < lanes->count; i++) {
+        CPU *cpu = lanes->cpus[i];
+        cpu->stop = false;
+        // As in cpu_run, an interrupt taken here counts against the budget.
+        target[i] = deadlines[i];
+        sync(cpu);
+        load_lane(lanes, i);
+        if (lanes->cycles[i] < target[i])
+            running |= 1 << i;
+    }
+
+    // Memory may have changed since the last run.
+    forget(lanes);
+
+    u64 instructions = 0;
+    while (running) {
+        if (!converged(lanes, running)) {
+            running = split(lanes, running, target, &instructions);
+            if (!running)
+                break;
+        }
+
+        u64 room = UINT64_MAX;
+        for (u32 bits = running; bits; bits &= bits - 1) {
+            u32 i = __builtin_ctz(bits);
+            if (target[i] - lanes->cycles[i] < room)
+                room = target[i] - lanes->cycles[i];
+        }
+
+        u32 steps = run_together(lanes, running, room);
+        if (!steps) {
+            step(lanes, running);
+            steps = 1;
+        }
+
+        instructions += (u64)steps * __builtin_popcount(running);
+
+        for (u32 bits = running; bits; bits &= bits - 1) {
+            u32 i = __builtin_ctz(bits);
+            lanes->instructions[i] += steps;
+            if (lanes->cycles[i] >= target[i] || lanes->cpus[i]->stop)
+                running &= ~(1 << i);
+        }
+    }
+
+    for (u32 i = 0; i < lanes->count; i++)
+        store_lane(lanes, i);
+
+    return instructions;
+}
+
+// Runs every lane for `cycles` more.
+u64 lanes_run(Lanes *lanes, u64 cycles) {
+    u64 deadlines[LANES];
+    for (u32 i = 0; i < lanes->count; i++)
+        deadlines[i] = lanes->cpus[i]->cycles + cycles;
+
+    return lanes_run_until(lanes, deadlines);
+}
@@ -0,0 +1,145 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include "memory.h"
+
+// What opcode fetches from an I/O page see.
+static const u8 open_bus[PAGE_SIZE] = { [0 ... PAGE_SIZE - 1] = 0xff };
+
+MemoryMap *memory_map_new(u8 *ram) {
+    MemoryMap *map = calloc(1, sizeof(MemoryMap));
+    if (!map) {
+        fprintf(stderr, "Memory: Out of memory.\n");
+        exit(1);
+    }
+
+    memory_map_ram(map, 0x0000, 0x10000, ram);
+
+    return map;
+}
+
+void memory_map_free(MemoryMap *map) {
+    free(map);
+}
+
+// Where writes to `page` store their bytes: watched RAM has no write pointer
+// but stores into what it reads from.
+static const u8 *written(const MemoryMap *map, u32 page) {
+    return map->write[page] ? map->write[page] : map->read[page];
+}
+
+static void find_aliases(MemoryMap *map) {
+    for (u32 page = 0; page < PAGES; page++) {
+        uintptr_t base = (uintptr_t)written(map, page);
+        map->aliases[page] = 0;
+        if (!base)
+            continue;
+
+        for (u32 other = 0; other < PAGES; other++) {
+            uintptr_t fetched = (uintptr_t)map->fetch[other];
+            if (other != page && fetched < base + PAGE_SIZE && base < fetched + PAGE_SIZE)
+                map->aliases[page] |= 1ull << other;
+        }
+    }
+}
+
+static void check_range(u16 start, u32 size) {
+    if (start % PAGE_SIZE || size % PAGE_SIZE || start + size > 0x10000) {
+        fprintf(stderr, "Memory: Range %04x+%x is not page aligned.\n", start, size);
+        exit(1);
+    }
+}
+
+void memory_map_ram(MemoryMap *map, u16 start, u32 size, u8 *base) {
+    check_range(start, size);
+
+    for (u32 offset = 0; offset < size; offset += PAGE_SIZE) {
+        u8 page = (start + offset) / PAGE_SIZE;
+        map->read[page]  = base + offset;
+        map->write[page] = base + offset;
+        map->fetch[page] = base + offset;
+    }
+
+    find_aliases(map);
+}
+
+void memory_map_rom(MemoryMap *map, u16 start, u32 size, u8 *base) {
+    check_range(start, size);
+
+    for (u32 offset = 0; offset < size; offset += PAGE_SIZE) {
+        u8 page = (start + offset) / PAGE_SIZE;
+        map->read[page]  = base + offset;
+        map->write[page] = map->discard;
+        map->fetch[page] = base + offset;
+    }
+
+    find_aliases(map);
+}
+
+/**
+ * Repeats the mapping of [source, source + source_size) over
+ * [start, start + size).
+ */
+void memory_map_mirror(MemoryMap *map, u16 start, u32 size, u16 source, u32 source_size) {
+    check_range(start, size);
+    check_range(source, source_size);
+
+    for (u32 offset = 0; offset < size; offset += PAGE_SIZE) {
+        u8 page = (start + offset) / PAGE_SIZE;
+        u8 from = (source + offset % source_size) / PAGE_SIZE;
+
+        map->read[page]  = map->read[from];
+        map->write[page] = map->write[from];
+        map->fetch[page] = map->fetch[from];
+        map->io[page]    = map->io[from];
+    }
+
+    find_aliases(map);
+}
+
+/**
+ * Maps RAM whose writes are reported. Reads and fetches go straight to
+ * `base`; writes go to `write`, which has to store the value itself.
+ */
+void memory_map_watch(MemoryMap *map, u16 start, u32 size, u8 *base,
+        MemoryWrite write, void *context) {
+    check_range(start, size);
+
+    for (u32 offset = 0; offset < size; offset += PAGE_SIZE) {
+        u8 page = (start + offset) / PAGE_SIZE;
+        map->read[page]  = base + offset;
+        map->write[page] = 0;
+        map->fetch[page] = base + offset;
+        map->io[page] = (MemoryIO){ 0, write, context };
+    }
+
+    find_aliases(map);
+}
+
+void memory_map_io(MemoryMap *map, u16 start, u32 size,
+        MemoryRead read, MemoryWrite write, void *context) {
+    check_range(start, size);
+
+    for (u32 offset = 0; offset < size; offset += PAGE_SIZE) {
+        u8 page = (start + offset) / PAGE_SIZE;
+        map->read[page]  = 0;
+        map->write[page] = 0;
+        map->fetch[page] = open_bus;
+        map->io[page] = (MemoryIO){ read, write, context };
+    }
+
+    find_aliases(map);
+}
+
+u8 memory_read_io(MemoryMap *map, u16 addr) {
+    MemoryIO *io = &map->io[addr / PAGE_SIZE];
+    if (!io->read)
+        return 0xff;
+
+    return io->read(io->context, addr);
+}
+
+void memory_write_io(MemoryMap *map, u16 addr, u8 value) {
+    MemoryIO *io = &map->io[addr / PAGE_SIZE];
+    if (io->write)
+        io->write(io->context, addr, value);
+}
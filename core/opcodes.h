@@ -0,0 +1,354 @@
+/**
+ * Opcode bodies shared by every execution engine in cpu.c.
+ *
+ * This file is included inside a function body, once per engine, after the
+ * following macros have been defined:
+ *
+ *   OP(opcode)  Entry point of an opcode (a case label or a threaded label).
+ *   OP_DEFAULT  Entry point for opcodes without a body.
+ *   NEXT        Leaves the opcode and continues with the next one.
+ *   SYNC        Runs after anything that may change state behind the
+ *               engine's back (I/O callbacks, EI).
+ *   IMM8        Immediate byte operand.
+ *   IMM16       Immediate word operand.
+ *   PORT_IN(p)  Calls the input callback for port p.
+ *   PORT_OUT(p) Calls the output callback for port p.
+ *
+ * Single registers are read through B, C, D, E, H and L and written through
+ * SET_B(v)..SET_L(v), so that an engine may keep the register pairs as whole
+ * words.
+ *
+ * `cpu` and `opcode` must be in scope. Cycles are accounted by the engine
+ * before entering the body, except for the extra cycles of taken
+ * conditional calls and returns.
+ */
+
+// NOP
+OP(0x00) NEXT;
+
+// LXI
+OP(0x01) cpu->regs.bc = IMM16; NEXT;
+OP(0x11) cpu->regs.de = IMM16; NEXT;
+OP(0x21) cpu->regs.hl = IMM16; NEXT;
+OP(0x31) cpu->sp = IMM16; NEXT;
+
+// INX
+OP(0x03) cpu->regs.bc += 1; NEXT;
+OP(0x13) cpu->regs.de += 1; NEXT;
+OP(0x23) cpu->regs.hl += 1; NEXT;
+OP(0x33) cpu->sp += 1; NEXT;
+
+// INR
+OP(0x3c) cpu->regs.a = inr(cpu, cpu->regs.a); NEXT;
+OP(0x04) SET_B(inr(cpu, B)); NEXT;
+OP(0x0c) SET_C(inr(cpu, C)); NEXT;
+OP(0x14) SET_D(inr(cpu, D)); NEXT;
+OP(0x1c) SET_E(inr(cpu, E)); NEXT;
+OP(0x24) SET_H(inr(cpu, H)); NEXT;
+OP(0x2c) SET_L(inr(cpu, L)); NEXT;
+OP(0x34) write_byte(cpu, cpu->regs.hl, inr(cpu, read_byte(cpu, cpu->regs.hl))); NEXT;
+
+// DCX
+OP(0x0b) cpu->regs.bc -= 1; NEXT;
+OP(0x1b) cpu->regs.de -= 1; NEXT;
+OP(0x2b) cpu->regs.hl -= 1; NEXT;
+OP(0x3b) cpu->sp -= 1; NEXT;
+
+// DCR
+OP(0x3d) cpu->regs.a = dcr(cpu, cpu->regs.a); NEXT;
+OP(0x05) SET_B(dcr(cpu, B)); NEXT;
+OP(0x0d) SET_C(dcr(cpu, C)); NEXT;
+OP(0x15) SET_D(dcr(cpu, D)); NEXT;
+OP(0x1d) SET_E(dcr(cpu, E)); NEXT;
+OP(0x25) SET_H(dcr(cpu, H)); NEXT;
+OP(0x2d) SET_L(dcr(cpu, L)); NEXT;
+OP(0x35) write_byte(cpu, cpu->regs.hl, dcr(cpu, read_byte(cpu, cpu->regs.hl))); NEXT;
+
+// MVI
+OP(0x3e) cpu->regs.a = IMM8; NEXT;
+OP(0x06) SET_B(IMM8); NEXT;
+OP(0x0e) SET_C(IMM8); NEXT;
+OP(0x16) SET_D(IMM8); NEXT;
+OP(0x1e) SET_E(IMM8); NEXT;
+OP(0x26) SET_H(IMM8); NEXT;
+OP(0x2e) SET_L(IMM8); NEXT;
+OP(0x36) write_byte(cpu, cpu->regs.hl, IMM8); NEXT;
+
+OP(0x27) daa(cpu); NEXT; // DAA
+OP(0x2f) cma(cpu); NEXT; // CMA
+OP(0x37) stc(cpu); NEXT; // STC
+OP(0x3f) cmc(cpu); NEXT; // CMC
+
+// DAD
+OP(0x09) dad(cpu, cpu->regs.bc); NEXT;
+OP(0x19) dad(cpu, cpu->regs.de); NEXT;
+OP(0x29) dad(cpu, cpu->regs.hl); NEXT;
+OP(0x39) dad(cpu, cpu->sp); NEXT;
+
+// STAX
+OP(0x02) write_byte(cpu, cpu->regs.bc, cpu->regs.a); NEXT;
+OP(0x12) write_byte(cpu, cpu->regs.de, cpu->regs.a); NEXT;
+OP(0x32) write_byte(cpu, IMM16, cpu->regs.a); NEXT; // STA
+
+// LDAX
+OP(0x0a) cpu->regs.a = read_byte(cpu, cpu->regs.bc); NEXT;
+OP(0x1a) cpu->regs.a = read_byte(cpu, cpu->regs.de); NEXT;
+OP(0x3a) cpu->regs.a = read_byte(cpu, IMM16); NEXT; // LDA
+
+OP(0x07) rlc(cpu); NEXT; // RLC
+OP(0x0f) rrc(cpu); NEXT; // RRC
+OP(0x17) ral(cpu); NEXT; // RAL
+OP(0x1f) rar(cpu); NEXT; // RAR
+
+OP(0x22) write_word(cpu, IMM16, cpu->regs.hl); NEXT; // SHLD
+OP(0x2a) cpu->regs.hl = read_word(cpu, IMM16); NEXT; // LHLD
+
+// MOV
+OP(0x7f) cpu->regs.a = cpu->regs.a; NEXT;
+OP(0x78) cpu->regs.a = B; NEXT;
+OP(0x79) cpu->regs.a = C; NEXT;
+OP(0x7a) cpu->regs.a = D; NEXT;
+OP(0x7b) cpu->regs.a = E; NEXT;
+OP(0x7c) cpu->regs.a = H; NEXT;
+OP(0x7d) cpu->regs.a = L; NEXT;
+OP(0x7e) cpu->regs.a = read_byte(cpu, cpu->regs.hl); NEXT;
+
+OP(0x47) SET_B(cpu->regs.a); NEXT;
+OP(0x40) SET_B(B); NEXT;
+OP(0x41) SET_B(C); NEXT;
+OP(0x42) SET_B(D); NEXT;
+OP(0x43) SET_B(E); NEXT;
+OP(0x44) SET_B(H); NEXT;
+OP(0x45) SET_B(L); NEXT;
+OP(0x46) SET_B(read_byte(cpu, cpu->regs.hl)); NEXT;
+
+OP(0x4f) SET_C(cpu->regs.a); NEXT;
+OP(0x48) SET_C(B); NEXT;
+OP(0x49) SET_C(C); NEXT;
+OP(0x4a) SET_C(D); NEXT;
+OP(0x4b) SET_C(E); NEXT;
+OP(0x4c) SET_C(H); NEXT;
+OP(0x4d) SET_C(L); NEXT;
+OP(0x4e) SET_C(read_byte(cpu, cpu->regs.hl)); NEXT;
+
+OP(0x57) SET_D(cpu->regs.a); NEXT;
+OP(0x50) SET_D(B); NEXT;
+OP(0x51) SET_D(C); NEXT;
+OP(0x52) SET_D(D); NEXT;
+OP(0x53) SET_D(E); NEXT;
+OP(0x54) SET_D(H); NEXT;
+OP(0x55) SET_D(L); NEXT;
+OP(0x56) SET_D(read_byte(cpu, cpu->regs.hl)); NEXT;
+
+OP(0x5f) SET_E(cpu->regs.a); NEXT;
+OP(0x58) SET_E(B); NEXT;
+OP(0x59) SET_E(C); NEXT;
+OP(0x5a) SET_E(D); NEXT;
+OP(0x5b) SET_E(E); NEXT;
+OP(0x5c) SET_E(H); NEXT;
+OP(0x5d) SET_E(L); NEXT;
+OP(0x5e) SET_E(read_byte(cpu, cpu->regs.hl)); NEXT;
+
+OP(0x67) SET_H(cpu->regs.a); NEXT;
+OP(0x60) SET_H(B); NEXT;
+OP(0x61) SET_H(C); NEXT;
+OP(0x62) SET_H(D); NEXT;
+OP(0x63) SET_H(E); NEXT;
+OP(0x64) SET_H(H); NEXT;
+OP(0x65) SET_H(L); NEXT;
+OP(0x66) SET_H(read_byte(cpu, cpu->regs.hl)); NEXT;
+
+OP(0x6f) SET_L(cpu->regs.a); NEXT;
+OP(0x68) SET_L(B); NEXT;
+OP(0x69) SET_L(C); NEXT;
+OP(0x6a) SET_L(D); NEXT;
+OP(0x6b) SET_L(E); NEXT;
+OP(0x6c) SET_L(H); NEXT;
+OP(0x6d) SET_L(L); NEXT;
+OP(0x6e) SET_L(read_byte(cpu, cpu->regs.hl)); NEXT;
+
+OP(0x77) write_byte(cpu, cpu->regs.hl, cpu->regs.a); NEXT;
+OP(0x70) write_byte(cpu, cpu->regs.hl, B); NEXT;
+OP(0x71) write_byte(cpu, cpu->regs.hl, C); NEXT;
+OP(0x72) write_byte(cpu, cpu->regs.hl, D); NEXT;
+OP(0x73) write_byte(cpu, cpu->regs.hl, E); NEXT;
+OP(0x74) write_byte(cpu, cpu->regs.hl, H); NEXT;
+OP(0x75) write_byte(cpu, cpu->regs.hl, L); NEXT;
+OP(0x76) write_byte(cpu, cpu->regs.hl, read_byte(cpu, cpu->regs.hl)); NEXT;
+
+// ADD
+OP(0x87) add(cpu, cpu->regs.a, 0); NEXT;
+OP(0x80) add(cpu, B, 0); NEXT;
+OP(0x81) add(cpu, C, 0); NEXT;
+OP(0x82) add(cpu, D, 0); NEXT;
+OP(0x83) add(cpu, E, 0); NEXT;
+OP(0x84) add(cpu, H, 0); NEXT;
+OP(0x85) add(cpu, L, 0); NEXT;
+OP(0x86) add(cpu, read_byte(cpu, cpu->regs.hl), 0); NEXT;
+OP(0xc6) add(cpu, IMM8, 0); NEXT;
+
+// ADC
+OP(0x8f) add(cpu, cpu->regs.a, flag(cpu, FLAG_CARRY)); NEXT;
+OP(0x88) add(cpu, B, flag(cpu, FLAG_CARRY)); NEXT;
+OP(0x89) add(cpu, C, flag(cpu, FLAG_CARRY)); NEXT;
+OP(0x8a) add(cpu, D, flag(cpu, FLAG_CARRY)); NEXT;
+OP(0x8b) add(cpu, E, flag(cpu, FLAG_CARRY)); NEXT;
+OP(0x8c) add(cpu, H, flag(cpu, FLAG_CARRY)); NEXT;
+OP(0x8d) add(cpu, L, flag(cpu, FLAG_CARRY)); NEXT;
+OP(0x8e) add(cpu, read_byte(cpu, cpu->regs.hl), flag(cpu, FLAG_CARRY)); NEXT;
+OP(0xce) add(cpu, IMM8, flag(cpu, FLAG_CARRY)); NEXT;
+
+// SUB
+OP(0x97) sub(cpu, cpu->regs.a, 0); NEXT;
+OP(0x90) sub(cpu, B, 0); NEXT;
+OP(0x91) sub(cpu, C, 0); NEXT;
+OP(0x92) sub(cpu, D, 0); NEXT;
+OP(0x93) sub(cpu, E, 0); NEXT;
+OP(0x94) sub(cpu, H, 0); NEXT;
+OP(0x95) sub(cpu, L, 0); NEXT;
+OP(0x96) sub(cpu, read_byte(cpu, cpu->regs.hl), 0); NEXT;
+OP(0xd6) sub(cpu, IMM8, 0); NEXT;
+
+// SBB
+OP(0x9f) sub(cpu, cpu->regs.a, flag(cpu, FLAG_CARRY)); NEXT;
+OP(0x98) sub(cpu, B, flag(cpu, FLAG_CARRY)); NEXT;
+OP(0x99) sub(cpu, C, flag(cpu, FLAG_CARRY)); NEXT;
+OP(0x9a) sub(cpu, D, flag(cpu, FLAG_CARRY)); NEXT;
+OP(0x9b) sub(cpu, E, flag(cpu, FLAG_CARRY)); NEXT;
+OP(0x9c) sub(cpu, H, flag(cpu, FLAG_CARRY)); NEXT;
+OP(0x9d) sub(cpu, L, flag(cpu, FLAG_CARRY)); NEXT;
+OP(0x9e) sub(cpu, read_byte(cpu, cpu->regs.hl), flag(cpu, FLAG_CARRY)); NEXT;
+OP(0xde) sub(cpu, IMM8, flag(cpu, FLAG_CARRY)); NEXT;
+
+// ANA
+OP(0xa7) ana(cpu, cpu->regs.a); NEXT;
+OP(0xa0) ana(cpu, B); NEXT;
+OP(0xa1) ana(cpu, C); NEXT;
+OP(0xa2) ana(cpu, D); NEXT;
+OP(0xa3) ana(cpu, E); NEXT;
+OP(0xa4) ana(cpu, H); NEXT;
+OP(0xa5) ana(cpu, L); NEXT;
+OP(0xa6) ana(cpu, read_byte(cpu, cpu->regs.hl)); NEXT;
+OP(0xe6) ana(cpu, IMM8); NEXT;
+
+// XRA
+OP(0xaf) xra(cpu, cpu->regs.a); NEXT;
+OP(0xa8) xra(cpu, B); NEXT;
+OP(0xa9) xra(cpu, C); NEXT;
+OP(0xaa) xra(cpu, D); NEXT;
+OP(0xab) xra(cpu, E); NEXT;
+OP(0xac) xra(cpu, H); NEXT;
+OP(0xad) xra(cpu, L); NEXT;
+OP(0xae) xra(cpu, read_byte(cpu, cpu->regs.hl)); NEXT;
+OP(0xee) xra(cpu, IMM8); NEXT;
+
+// ORA
+OP(0xb7) ora(cpu, cpu->regs.a); NEXT;
+OP(0xb0) ora(cpu, B); NEXT;
+OP(0xb1) ora(cpu, C); NEXT;
+OP(0xb2) ora(cpu, D); NEXT;
+OP(0xb3) ora(cpu, E); NEXT;
+OP(0xb4) ora(cpu, H); NEXT;
+OP(0xb5) ora(cpu, L); NEXT;
+OP(0xb6) ora(cpu, read_byte(cpu, cpu->regs.hl)); NEXT;
+OP(0xf6) ora(cpu, IMM8); NEXT;
+
+// PUSH
+OP(0xc5) push(cpu, cpu->regs.bc); NEXT;
+OP(0xd5) push(cpu, cpu->regs.de); NEXT;
+OP(0xe5) push(cpu, cpu->regs.hl); NEXT;
+OP(0xf5) push_psw(cpu); NEXT;
+
+// POP
+OP(0xc1) cpu->regs.bc = pop(cpu); NEXT;
+OP(0xd1) cpu->regs.de = pop(cpu); NEXT;
+OP(0xe1) cpu->regs.hl = pop(cpu); NEXT;
+OP(0xf1) pop_psw(cpu); NEXT;
+
+// PCHL
+OP(0xe9) cpu->pc = cpu->regs.hl; NEXT;
+
+// JMP
+OP(0xc3) jmp(cpu, IMM16, 1); NEXT;
+OP(0xc2) jmp(cpu, IMM16, !flag(cpu, FLAG_ZERO)); NEXT;
+OP(0xca) jmp(cpu, IMM16, flag(cpu, FLAG_ZERO)); NEXT;
+OP(0xd2) jmp(cpu, IMM16, !flag(cpu, FLAG_CARRY)); NEXT;
+OP(0xda) jmp(cpu, IMM16, flag(cpu, FLAG_CARRY)); NEXT;
+OP(0xe2) jmp(cpu, IMM16, !flag(cpu, FLAG_PARITY)); NEXT;
+OP(0xea) jmp(cpu, IMM16, flag(cpu, FLAG_PARITY)); NEXT;
+OP(0xf2) jmp(cpu, IMM16, !flag(cpu, FLAG_SIGN)); NEXT;
+OP(0xfa) jmp(cpu, IMM16, flag(cpu, FLAG_SIGN)); NEXT;
+
+// RET
+OP(0xc9) ret(cpu); NEXT;
+OP(0xc0) cond_ret(cpu, !flag(cpu, FLAG_ZERO)); NEXT;
+OP(0xc8) cond_ret(cpu, flag(cpu, FLAG_ZERO)); NEXT;
+OP(0xd0) cond_ret(cpu, !flag(cpu, FLAG_CARRY)); NEXT;
+OP(0xd8) cond_ret(cpu, flag(cpu, FLAG_CARRY)); NEXT;
+OP(0xe0) cond_ret(cpu, !flag(cpu, FLAG_PARITY)); NEXT;
+OP(0xe8) cond_ret(cpu, flag(cpu, FLAG_PARITY)); NEXT;
+OP(0xf0) cond_ret(cpu, !flag(cpu, FLAG_SIGN)); NEXT;
+OP(0xf8) cond_ret(cpu, flag(cpu, FLAG_SIGN)); NEXT;
+
+// CALL
+OP(0xcd) call(cpu, IMM16); NEXT;
+OP(0xc4) cond_call(cpu, IMM16, !flag(cpu, FLAG_ZERO)); NEXT;
+OP(0xcc) cond_call(cpu, IMM16, flag(cpu, FLAG_ZERO)); NEXT;
+OP(0xd4) cond_call(cpu, IMM16, !flag(cpu, FLAG_CARRY)); NEXT;
+OP(0xdc) cond_call(cpu, IMM16, flag(cpu, FLAG_CARRY)); NEXT;
+OP(0xe4) cond_call(cpu, IMM16, !flag(cpu, FLAG_PARITY)); NEXT;
+OP(0xec) cond_call(cpu, IMM16, flag(cpu, FLAG_PARITY)); NEXT;
+OP(0xf4) cond_call(cpu, IMM16, !flag(cpu, FLAG_SIGN)); NEXT;
+OP(0xfc) cond_call(cpu, IMM16, flag(cpu, FLAG_SIGN)); NEXT;
+
+// IN
+OP(0xdb) PORT_IN(IMM8); SYNC; NEXT;
+
+// OUT
+OP(0xd3) PORT_OUT(IMM8); SYNC; NEXT;
+
+// XCHG
+OP(0xeb) xchg(cpu); NEXT;
+
+// XTHL
+OP(0xe3) xthl(cpu); NEXT;
+
+// SPHL
+OP(0xf9) cpu->sp = cpu->regs.hl; NEXT;
+
+OP(0xfb) cpu->interrupts_enabled = true; SYNC; NEXT; // EI
+OP(0xf3) cpu->interrupts_enabled = false; NEXT; // DI
+
+// CMP
+OP(0xbf) cmp(cpu, cpu->regs.a); NEXT;
+OP(0xb8) cmp(cpu, B); NEXT;
+OP(0xb9) cmp(cpu, C); NEXT;
+OP(0xba) cmp(cpu, D); NEXT;
+OP(0xbb) cmp(cpu, E); NEXT;
+OP(0xbc) cmp(cpu, H); NEXT;
+OP(0xbd) cmp(cpu, L); NEXT;
+OP(0xbe) cmp(cpu, read_byte(cpu, cpu->regs.hl)); NEXT;
+OP(0xfe) cmp(cpu, IMM8); NEXT;
+
+// RST
+OP(0xcf) rst(cpu, 0x1); NEXT;
+OP(0xd7) rst(cpu, 0x2); NEXT;
+OP(0xdf) rst(cpu, 0x3); NEXT;
+OP(0xe7) rst(cpu, 0x4); NEXT;
+OP(0xef) rst(cpu, 0x5); NEXT;
+OP(0xf7) rst(cpu, 0x6); NEXT;
+OP(0xff) rst(cpu, 0x7); NEXT;
+
+// Undocumented opcodes
+OP(0x08) NEXT;
+OP(0x10) NEXT;
+OP(0x18) NEXT;
+OP(0x20) NEXT;
+OP(0x28) NEXT;
+OP(0x30) NEXT;
+OP(0x38) NEXT;
+
+// Undocumented calls
+OP(0xdd) call(cpu, IMM16); NEXT;
+
+OP_DEFAULT not_implemented(opcode); NEXT;
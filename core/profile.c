@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "profile.h"
+
+#define C PROFILE_CALL
+#define R PROFILE_RETURN
+
+const u8 PROFILE_FLOW[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    R, 0, 0, 0, C, 0, 0, C, R, R, 0, 0, C, C, 0, C,
+    R, 0, 0, 0, C, 0, 0, C, R, 0, 0, 0, C, 0, 0, C,
+    R, 0, 0, 0, C, 0, 0, C, R, 0, 0, 0, C, 0, 0, C,
+    R, 0, 0, 0, C, 0, 0, C, R, 0, 0, 0, C, 0, 0, C,
+};
+
+#undef C
+#undef R
+
+Profile *profile_new(void) {
+    Profile *profile = calloc(1, sizeof(Profile));
+    if (profile) {
+        profile->nodes = calloc(PROFILE_NODES, sizeof(ProfileNode));
+        profile->arcs = calloc(PROFILE_ARCS, sizeof(ProfileArc));
+    }
+
+    if (!profile || !profile->nodes || !profile->arcs) {
+        fprintf(stderr, "Profile: Out of memory.\n");
+        exit(1);
+    }
+
+    profile->node = PROFILE_NONE;
+    return profile;
+}
+
+void profile_free(Profile *profile) {
+    if (!profile)
+        return;
+
+    for (u32 addr = 0; addr < 0x10000; addr++)
+        free(profile->labels[addr]);
+
+    free(profile->nodes);
+    free(profile->arcs);
+    free(profile);
+}
+
+/**
+ * Reads names for addresses from `path`: one per line, a hex address and
+ * the name, e.g. `18d4 reset`. Blank lines and ones starting with # or ;
+ * are skipped.
+ */
+bool profile_labels(Profile *profile, const char *path) {
+    File *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Could not open %s.\n", path);
+        return false;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        char name[128];
+        unsigned addr;
+        if (line[0] == '#' || line[0] == ';' || sscanf(line, "%x %127s", &addr, name) != 2
+                || addr > 0xffff)
+            continue;
+
+        free(profile->labels[addr]);
+        profile->labels[addr] = strdup(name);
+    }
+
+    fclose(file);
+    return true;
+}
+
+static u32 hash(u32 a, u32 b, u32 c) {
+    u32 h = a * 0x9e3779b1u ^ b * 0x85ebca77u ^ c * 0xc2b2ae3du;
+    return h ^ h >> 15;
+}
+
+/**
+ * The node of `function` called from the context `parent`, added if it is
+ * new. A full tree charges new contexts to their parent.
+ */
+static u32 child(Profile *profile, u32 parent, u16 function) {
+    u32 slot = hash(parent, function, 0) % PROFILE_NODES;
+    while (profile->nodes[slot].used) {
+        ProfileNode *node = &profile->nodes[slot];
+        if (node->parent == parent && node->function == function)
+            return slot;
+        slot = (slot + 1) % PROFILE_NODES;
+    }
+
+    if (profile->node_count >= PROFILE_NODES * 3 / 4 && parent != PROFILE_NONE)
+        return parent;
+
+    profile->nodes[slot] = (ProfileNode){ parent, function, true, 0 };
+    profile->node_count++;
+    return slot;
+}
+
+static u32 arc(Profile *profile, u16 caller, u16 site, u16 callee) {
+    u32 slot = hash(caller, site, callee) % PROFILE_ARCS;
+    while (profile->arcs[slot].used) {
+        ProfileArc *arc = &profile->arcs[slot];
+        if (arc->caller == caller && arc->site == site && arc->callee == callee)
+            return slot;
+        slot = (slot + 1) % PROFILE_ARCS;
+    }
+
+    if (profile->arc_count >= PROFILE_ARCS * 3 / 4)
+        return PROFILE_NONE;
+
+    profile->arcs[slot] = (ProfileArc){ caller, site, callee, true, 0, 0, 0 };
+    profile->arc_count++;
+    return slot;
+}
+
+static void enter(Profile *profile, u16 function, u16 sp, u64 cycles) {
+    if (profile->depth == PROFILE_DEPTH) {
+        profile->lost++;
+        return;
+    }
+
+    u32 called = arc(profile, profile->function, profile->last_pc, function);
+    if (called != PROFILE_NONE)
+        profile->arcs[called].calls++;
+
+    profile->stack[profile->depth++] = (ProfileFrame){
+        profile->function, sp, profile->node, called, profile->instructions, cycles
+    };
+    profile->node = child(profile, profile->node, function);
+    profile->function = function;
+}
+
+// Leaves the innermost frame, charging its inclusive cost to its arc.
+static void leave(Profile *profile, u64 cycles) {
+    ProfileFrame *frame = &profile->stack[--profile->depth];
+    if (frame->arc != PROFILE_NONE) {
+        profile->arcs[frame->arc].instructions += profile->instructions - frame->instructions;
+        profile->arcs[frame->arc].cycles += cycles - frame->cycles;
+    }
+
+    profile->node = frame->caller;
+    profile->function = frame->function;
+}
+
+/**
+ * Follows the call or return the last instruction may have made, now
+ * that its effect on SP shows.
+ */
+void profile_flow(Profile *profile, u16 sp, u16 pc, u64 cycles) {
+    if (profile->last_flow == PROFILE_CALL && sp == (u16)(profile->last_sp - 2))
+        enter(profile, pc, sp, cycles);
+    else if (profile->last_flow == PROFILE_RETURN && sp == (u16)(profile->last_sp + 2)) {
+        while (profile->depth && profile->stack[profile->depth - 1].sp < sp)
+            leave(profile, cycles);
+    }
+}
+
+#ifdef CPU_PROFILE
+
+/**
+ * Starts counting what `cpu` runs into `profile`, or resumes: a profile
+ * can be attached and detached any number of times. The first attach
+ * makes the current PC the root of the call graph.
+ */
+bool profile_attach(Profile *profile, CPU *cpu) {
+    if (profile->node == PROFILE_NONE) {
+        profile->root = profile->function = cpu->pc;
+        profile->node = child(profile, PROFILE_NONE, cpu->pc);
+    }
+
+    profile->last_pc = cpu->pc;
+    profile->last_sp = cpu->sp;
+    profile->last_flow = 0;
+    profile->last_cycles = cpu->cycles;
+
+    cpu->profile = profile;
+    return true;
+}
+
+// Stops counting, charging the last instruction run.
+void profile_detach(CPU *cpu) {
+    Profile *profile = cpu->profile;
+    if (!profile)
+        return;
+
+    u64 spent = cpu->cycles - profile->last_cycles;
+    profile->cycles[profile->last_pc] += spent;
+    profile->nodes[profile->node].cycles += spent;
+    profile->last_cycles = cpu->cycles;
+
+    cpu->profile = 0;
+}
+
+#else
+
+bool profile_attach(Profile *profile, CPU *cpu) {
+    (void)profile;
+    (void)cpu;
+    fprintf(stderr, "Profiling needs a build with profile=1.\n");
+    return false;
+}
+
+void profile_detach(CPU *cpu) {
+    (void)cpu;
+}
+
+#endif
+
+static const char *name(const Profile *profile, u16 addr, char buffer[16]) {
+    if (profile->labels[addr])
+        return profile->labels[addr];
+
+    snprintf(buffer, 16, "sub_%04x", addr);
+    return buffer;
+}
+
+static int compare_keys(const void *a, const void *b) {
+    u32 x = *(const u32 *)a, y = *(const u32 *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Callgrind format, for KCachegrind and callgrind_annotate: the cost of
+ * each PC under the function it ran in, then the calls each function made
+ * with their inclusive cost. Positions are instruction addresses.
+ */
+static void write_callgrind(const Profile *profile, File *file, const char *command) {
+    u64 total = 0;
+    for (u32 addr = 0; addr < 0x10000; addr++)
+        total += profile->cycles[addr];
+
+    fprintf(file, "# callgrind format\nversion: 1\ncreator: intel8080\ncmd: %s\n"
+            "positions: instr\nevents: Instructions Cycles\nsummary: %llu %llu\n",
+            command, (unsigned long long)profile->instructions, (unsigned long long)total);
+
+    // PCs that ran, by function and then address.
+    u32 *keys = malloc(0x10000 * sizeof(u32));
+    if (!keys) {
+        fprintf(stderr, "Profile: Out of memory.\n");
+        exit(1);
+    }
+
+    u32 count = 0;
+    for (u32 addr = 0; addr < 0x10000; addr++) {
+        if (profile->count[addr] || profile->cycles[addr])
+            keys[count++] = profile->owner[addr] << 16 | addr;
+    }
+
+    qsort(keys, count, sizeof(u32), compare_keys);
+
+    char buffer[2][16];
+    for (u32 i = 0; i < count;) {
+        u16 function = keys[i] >> 16;
+        fprintf(file, "\nfn=%s\n", name(profile, function, buffer[0]));
+
+        for (; i < count && keys[i] >> 16 == function; i++) {
+            u16 pc = keys[i];
+            fprintf(file, "0x%04x %llu %llu\n", pc, (unsigned long long)profile->count[pc],
+                    (unsigned long long)profile->cycles[pc]);
+        }
+
+        for (u32 slot = 0; slot < PROFILE_ARCS; slot++) {
+            const ProfileArc *arc = &profile->arcs[slot];
+            if (!arc->used || arc->caller != function)
+                continue;
+
+            fprintf(file, "cfn=%s\ncalls=%llu 0x%04x\n0x%04x %llu %llu\n",
+                    name(profile, arc->callee, buffer[1]), (unsigned long long)arc->calls,
+                    arc->callee, arc->site, (unsigned long long)arc->instructions,
+                    (unsigned long long)arc->cycles);
+        }
+    }
+
+    free(keys);
+}
+
+static void write_path(const Profile *profile, File *file, u32 node) {
+    char buffer[16];
+    if (profile->nodes[node].parent != PROFILE_NONE) {
+        write_path(profile, file, profile->nodes[node].parent);
+        fputc(';', file);
+    }
+
+    fputs(name(profile, profile->nodes[node].function, buffer), file);
+}
+
+/**
+ * Collapsed stacks, for flamegraph.pl and speedscope: one line for each
+ * calling context that spent cycles in itself.
+ */
+static void write_folded(const Profile *profile, File *file) {
+    for (u32 slot = 0; slot < PROFILE_NODES; slot++) {
+        const ProfileNode *node = &profile->nodes[slot];
+        if (!node->used || !node->cycles)
+            continue;
+
+        write_path(profile, file, slot);
+        fprintf(file, " %llu\n", (unsigned long long)node->cycles);
+    }
+}
+
+/**
+ * Writes `prefix`.callgrind and `prefix`.folded. Calls still open are
+ * charged up to the last instruction counted, as if they returned then.
+ */
+bool profile_write(Profile *profile, const char *prefix, const char *command) {
+    ProfileFrame stack[PROFILE_DEPTH];
+    u32 depth = profile->depth;
+    u32 node = profile->node;
+    u16 function = profile->function;
+    memcpy(stack, profile->stack, depth * sizeof(ProfileFrame));
+
+    while (profile->depth)
+        leave(profile, profile->last_cycles);
+
+    char path[4096];
+    bool written = true;
+    for (u32 kind = 0; kind < 2; kind++) {
+        snprintf(path, sizeof(path), "%s.%s", prefix, kind ? "folded" : "callgrind");
+        File *file = fopen(path, "w");
+        if (!file) {
+            fprintf(stderr, "Could not create %s.\n", path);
+            written = false;
+            continue;
+        }
+
+        if (kind)
+            write_folded(profile, file);
+        else
+            write_callgrind(profile, file, command);
+        fclose(file);
+    }
+
+    // Put the open calls back, without what was charged for them.
+    for (u32 i = 0; i < depth; i++) {
+        ProfileFrame *frame = &stack[i];
+        if (frame->arc != PROFILE_NONE) {
+            profile->arcs[frame->arc].instructions -= profile->instructions - frame->instructions;
+            profile->arcs[frame->arc].cycles -= profile->last_cycles - frame->cycles;
+        }
+    }
+
+    memcpy(profile->stack, stack, depth * sizeof(ProfileFrame));
+    profile->depth = depth;
+    profile->node = node;
+    profile->function = function;
+
+    if (profile->lost)
+        fprintf(stderr, "Profile: %llu calls deeper than %u not followed\n",
+                (unsigned long long)profile->lost, PROFILE_DEPTH);
+
+    return written;
+}
@@ -0,0 +1,291 @@
+#include <stdlib.h>
+#include <string.h>
+#include "replay.h"
+#include "varint.h"
+
+/**
+ * Recording file:
+ *
+ *   "8080RPL" 0, u32 REPLAY_VERSION, u32 size of the machine state after
+ *   the CPU, u64 keyframe interval
+ *   'E', LEB128 cycles since the previous event, u8 port, u8 value
+ *   'K', snapshot_write of the machine
+ *   'Z', LEB128 cycle count at which recording stopped
+ *
+ * Events and keyframes follow in the order they were taken. The file is
+ * flushed after every keyframe, so a recording cut short by a crash still
+ * plays back up to its last one.
+ */
+
+static const char MAGIC[8] = "8080RPL";
+
+// Bumped whenever the file format or the snapshot format changes.
+#define REPLAY_VERSION 2
+
+static void *grow(void *items, u32 *capacity, size_t size) {
+    *capacity = *capacity ? *capacity * 2 : 64;
+
+    items = realloc(items, *capacity * size);
+    if (!items) {
+        fprintf(stderr, "Replay: Out of memory.\n");
+        exit(1);
+    }
+
+    return items;
+}
+
+static void add_event(Replay *replay, ReplayEvent event) {
+    if (replay->count == replay->capacity)
+        replay->events = grow(replay->events, &replay->capacity, sizeof(ReplayEvent));
+
+    replay->events[replay->count++] = event;
+}
+
+static void add_keyframe(Replay *replay, Snapshot *keyframe) {
+    if (replay->keyframe_count == replay->keyframe_capacity)
+        replay->keyframes = grow(replay->keyframes, &replay->keyframe_capacity, sizeof(Snapshot *));
+
+    replay->keyframes[replay->keyframe_count++] = keyframe;
+}
+
+static Snapshot *last_keyframe(Replay *replay) {
+    return replay->keyframe_count ? replay->keyframes[replay->keyframe_count - 1] : 0;
+}
+
+static void keyframe(Replay *replay, CPU *cpu) {
+    Snapshot *snapshot = cpu_snapshot(cpu, replay->machine_size);
+
+    fputc('K', replay->file);
+    snapshot_write(snapshot, last_keyframe(replay), replay->file);
+    fflush(replay->file);
+
+    add_keyframe(replay, snapshot);
+    replay->next_keyframe = cpu->cycles + replay->interval;
+}
+
+// What a snapshot keeps of the machine besides the CPU, which is stored
+// the same way by every build.
+static u32 device_size(u32 machine_size) {
+    return machine_size > sizeof(CPU) ? machine_size - sizeof(CPU) : 0;
+}
+
+static Replay *replay_new(void) {
+    Replay *replay = calloc(1, sizeof(Replay));
+    if (!replay) {
+        fprintf(stderr, "Replay: Out of memory.\n");
+        exit(1);
+    }
+
+    return replay;
+}
+
+/**
+ * Starts recording the machine that embeds `cpu`, `machine_size` bytes in
+ * all, from its current state.
+ */
+Replay *replay_record(const char *path, CPU *cpu, u32 machine_size, u64 interval) {
+    Replay *replay = replay_new();
+    replay->recording = true;
+    replay->machine_size = machine_size;
+    replay->interval = interval ? interval : REPLAY_INTERVAL;
+    replay->last_cycles = cpu->cycles;
+
+    replay->file = fopen(path, "wb");
+    if (!replay->file) {
+        fprintf(stderr, "Could not open %s.\n", path);
+        exit(1);
+    }
+
+    u32 version = REPLAY_VERSION;
+    u32 device = device_size(machine_size);
+    fwrite(MAGIC, 1, sizeof(MAGIC), replay->file);
+    fwrite(&version, sizeof(u32), 1, replay->file);
+    fwrite(&device, sizeof(u32), 1, replay->file);
+    fwrite(&replay->interval, sizeof(u64), 1, replay->file);
+
+    keyframe(replay, cpu);
+
+    return replay;
+}
+
+/**
+ * Loads a recording of a machine `machine_size` bytes long, like
+ * replay_record takes, for playback. Call replay_seek before running.
+ */
+Replay *replay_open(const char *path, u32 machine_size) {
+    File *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Could not open %s.\n", path);
+        exit(1);
+    }
+
+    Replay *replay = replay_new();
+    replay->machine_size = machine_size;
+
+    char magic[sizeof(MAGIC)];
+    u32 version, device;
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, MAGIC, sizeof(MAGIC))
+            || fread(&version, sizeof(u32), 1, file) != 1) {
+        fprintf(stderr, "%s is not a recording.\n", path);
+        exit(1);
+    }
+
+    if (version != REPLAY_VERSION) {
+        fprintf(stderr, "%s is a recording of another version (%u, not %u).\n", path, version, REPLAY_VERSION);
+        exit(1);
+    }
+
+    if (fread(&device, sizeof(u32), 1, file) != 1 || fread(&replay->interval, sizeof(u64), 1, file) != 1) {
+        fprintf(stderr, "%s is not a recording.\n", path);
+        exit(1);
+    }
+
+    if (device != device_size(machine_size)) {
+        fprintf(stderr, "%s is a recording of another machine (%u bytes of state, not %u).\n",
+                path, device, device_size(machine_size));
+        exit(1);
+    }
+
+    u64 cycles = 0;
+    int tag;
+    while ((tag = fgetc(file)) != EOF) {
+        if (tag == 'E') {
+            u64 delta;
+            int port, value;
+            if (!varint_read(file, &delta) || (port = fgetc(file)) == EOF || (value = fgetc(file)) == EOF)
+                break;
+
+            cycles += delta;
+            add_event(replay, (ReplayEvent){ cycles, port, value });
+        }
+        else if (tag == 'Z') {
+            if (!varint_read(file, &replay->end))
+                break;
+        }
+        else if (tag == 'K') {
+            Snapshot *snapshot = snapshot_read(file, last_keyframe(replay), replay->machine_size);
+            if (!snapshot)
+                break;
+
+            add_keyframe(replay, snapshot);
+        }
+        else
+            break;
+    }
+
+    fclose(file);
+
+    if (!replay->keyframe_count) {
+        fprintf(stderr, "%s holds no keyframe.\n", path);
+        exit(1);
+    }
+
+    return replay;
+}
+
+void replay_close(Replay *replay) {
+    if (replay->recording) {
+        fputc('Z', replay->file);
+        varint_write(replay->file, replay->end);
+    }
+
+    if (replay->file)
+        fclose(replay->file);
+
+    for (u32 i = 0; i < replay->keyframe_count; i++)
+        snapshot_free(replay->keyframes[i]);
+
+    free(replay->keyframes);
+    free(replay->events);
+    free(replay);
+}
+
+/**
+ * Records that `port` now reads `value`. Only changes are logged.
+ */
+void replay_input(Replay *replay, CPU *cpu, u8 port, u8 value) {
+    if (!replay->recording || replay->ports[port] == (0x100 | value))
+        return;
+
+    replay->ports[port] = 0x100 | value;
+
+    fputc('E', replay->file);
+    varint_write(replay->file, cpu->cycles - replay->last_cycles);
+    fputc(port, replay->file);
+    fputc(value, replay->file);
+
+    replay->last_cycles = cpu->cycles;
+    add_event(replay, (ReplayEvent){ cpu->cycles, port, value });
+}
+
+/**
+ * Takes the next recorded event that is due by the CPU's cycle count.
+ * Returns false when there is none; call again until there is not.
+ */
+bool replay_next(Replay *replay, CPU *cpu, ReplayEvent *event) {
+    if (replay->recording || replay->cursor == replay->count)
+        return false;
+
+    if (replay->events[replay->cursor].cycles > cpu->cycles)
+        return false;
+
+    *event = replay->events[replay->cursor++];
+    return true;
+}
+
+/**
+ * Takes a keyframe when one is due.
+ */
+void replay_sync(Replay *replay, CPU *cpu) {
+    if (!replay->recording)
+        return;
+
+    replay->end = cpu->cycles;
+    if (cpu->cycles >= replay->next_keyframe)
+        keyframe(replay, cpu);
+}
+
+/**
+ * Restores the last keyframe at or before `cycles` and returns its cycle
+ * count. The frontend then runs the machine on, playing back events, until
+ * it reaches `cycles`.
+ */
+u64 replay_seek(Replay *replay, CPU *cpu, u64 cycles) {
+    u32 low = 0, high = replay->keyframe_count;
+    while (high - low > 1) {
+        u32 middle = (low + high) / 2;
+        if (replay->keyframes[middle]->cpu.cycles <= cycles)
+            low = middle;
+        else
+            high = middle;
+    }
+
+    Snapshot *keyframe = replay->keyframes[low];
+    cpu_restore(cpu, keyframe);
+
+    // Inputs latched at the keyframe's own cycle were logged after it.
+    u64 start = keyframe->cpu.cycles;
+    low = 0, high = replay->count;
+    while (low < high) {
+        u32 middle = (low + high) / 2;
+        if (replay->events[middle].cycles < start)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    replay->cursor = low;
+    return start;
+}
+
+// Cycle count at which recording stopped, or of the last thing recorded
+// if it never did.
+u64 replay_length(Replay *replay) {
+    u64 cycles = replay->end;
+    if (last_keyframe(replay)->cpu.cycles > cycles)
+        cycles = last_keyframe(replay)->cpu.cycles;
+    if (replay->count && replay->events[replay->count - 1].cycles > cycles)
+        cycles = replay->events[replay->count - 1].cycles;
+
+    return cycles;
+}
@@ -1,71 +1,300 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "cpu.h"
+#include "cpm.h"
+#include "farm.h"
+#include "memory.h"
+#include "profile.h"
 
-static bool test_done = 0;
+static double seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-static void load_test(u8 *memory, const char *test) {
-    File *file = fopen(test, "rb");
-    if (!file) {
-        fprintf(stderr, "Could not open %s.\n", test);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static Cpm machine;
+
+// With -p, where each program's profile is written, and the labels for it.
+static const char *profiles = 0;
+static const char *labels = 0;
+
+static Profile *profile_test(CPU *cpu) {
+    if (!profiles)
+        return 0;
+
+    Profile *profile = profile_new();
+    if ((labels && !profile_labels(profile, labels)) || !profile_attach(profile, cpu))
+        exit(1);
+
+    return profile;
+}
+
+// Writes the profile of `filename` to the -p prefix followed by its name.
+static void profile_save(Profile *profile, CPU *cpu, const char *filename) {
+    if (!profile)
+        return;
+
+    profile_detach(cpu);
+
+    const char *slash = strrchr(filename, '/');
+    const char *base = slash ? slash + 1 : filename;
+    const char *dot = strrchr(base, '.');
+
+    char prefix[4096];
+    int length = dot ? (int)(dot - base) : (int)strlen(base);
+    snprintf(prefix, sizeof(prefix), "%s%.*s", profiles, length, base);
+    if (profile_write(profile, prefix, filename))
+        printf("%s: profile written to %s.callgrind and %s.folded\n", filename, prefix, prefix);
+
+    profile_free(profile);
+}
+
+/**
+ * Runs the CP/M program `filename` to the end, with drive A: on `drive`,
+ * when given, and `kind` naming it in the report.
+ */
+static void test(const char *filename, const char *drive, const char *kind) {
+    CPU *cpu = &machine.cpu;
+    cpm_init(&machine, stdout, 0);
+    if (drive && !cpm_mount(&machine, 0, drive))
+        exit(1);
+    cpm_load(&machine, filename, 0, 0);
+    Profile *profile = profile_test(cpu);
+
+    u64 instructions = 0;
+    double start = seconds();
+
+    while (!machine.done) {
+        instructions += cpu_run(cpu, 1000000);
+    }
+
+    double elapsed = seconds() - start;
+    bool ended = !machine.length || machine.console[machine.length - 1] == '\n';
+    cpm_flush(&machine);
+    printf("%s%s%s%s (%s): %llu instructions in %.2f s, %.1f MIPS\n",
+            ended ? "" : "\n", filename, kind ? " on " : "", kind ? kind : "",
+            cpu_engine(), (unsigned long long)instructions,
+            elapsed, instructions / elapsed / 1e6);
+
+    profile_save(profile, cpu, filename);
+    cpm_free(&machine);
+}
+
+/**
+ * Runs the file tests on a scratch directory and on a blank disk image.
+ * The tests delete what they create, so the directory is left behind only
+ * when one of them fails.
+ */
+static void test_files(void) {
+    char directory[] = "/tmp/cpm-test-XXXXXX";
+    char image[] = "/tmp/cpm-test-XXXXXX.img";
+    int fd = mkstemps(image, 4);
+    if (!mkdtemp(directory) || fd < 0) {
+        fprintf(stderr, "Could not create the scratch drives.\n");
+        exit(1);
+    }
+
+    // A blank image has every directory entry free.
+    u8 *blank = malloc(CPM_IMAGE_SIZE);
+    memset(blank, 0xe5, CPM_IMAGE_SIZE);
+    bool written = write(fd, blank, CPM_IMAGE_SIZE) == CPM_IMAGE_SIZE;
+    close(fd);
+    free(blank);
+    if (!written) {
+        fprintf(stderr, "Could not write %s.\n", image);
         exit(1);
     }
 
-    fread(memory, sizeof(u8), 0x10000, file);
-    fclose(file);
+    test("tests/FILES.COM", directory, "a directory");
+    test("tests/FILES.COM", image, "a disk image");
+    test("tests/RANDOM.COM", directory, "a directory");
+    test("tests/RANDOM.COM", image, "a disk image");
+
+    unlink(image);
+    rmdir(directory);
 }
 
-static inline void out(CPU *cpu, u8 port) {
-    switch (port) {
-        case 0: test_done = 1; break;
-        case 1: {
-            u8 operation = cpu->regs.c;
-            if (operation == 2) {
-                printf("%c", cpu->regs.e);
-            }
-            else if (operation == 9) {
-                u16 addr = cpu->regs.de;
-
-                u8 c;
-                while ((c = read_byte(cpu, addr++)) != '$') {
-                    printf("%c", c);
-                }
-
-                printf("\n");
-            }
-            else {
-                fprintf(stderr, "Operation %d not handled.\n", operation);
-                exit(1);
-            }
-
-            break;
-        }
-        default: fprintf(stderr, "Port %d not handled.\n", port); exit(1);
+/**
+ * Runs a stretch of the test twice from one snapshot, restoring it many
+ * times in between, and checks that both runs end in the same state.
+ */
+static void test_snapshots(const char *filename) {
+    CPU *cpu = &machine.cpu;
+    cpm_init(&machine, 0, 0);
+    cpm_load(&machine, filename, 0, 0);
+
+    cpu_run(cpu, 5000000);
+    Snapshot *snapshot = cpu_snapshot(cpu, CPM_STATE);
+
+    cpu_run(cpu, 2000000);
+    CPU expected = *cpu;
+    u8 *memory = malloc(0x10000);
+    memcpy(memory, cpu->memory, 0x10000);
+
+    u32 restores = 10000;
+    double start = seconds();
+
+    for (u32 i = 0; i < restores; i++) {
+        cpu_restore(cpu, snapshot);
+        cpu_run(cpu, 1000);
     }
+
+    double elapsed = seconds() - start;
+
+    cpu_restore(cpu, snapshot);
+    cpu_run(cpu, 2000000);
+
+    bool same = cpu->pc == expected.pc && cpu->sp == expected.sp
+             && cpu->regs.a == expected.regs.a && cpu->regs.bc == expected.regs.bc
+             && cpu->regs.de == expected.regs.de && cpu->regs.hl == expected.regs.hl
+             && cpu_flags(cpu) == cpu_flags(&expected) && cpu->cycles == expected.cycles
+             && memcmp(cpu->memory, memory, 0x10000) == 0;
+
+    if (!same) {
+        fprintf(stderr, "ERROR: %s differs after restoring its snapshot.\n", filename);
+        exit(1);
+    }
+
+    printf("%s (%s): %u restores in %.2f s, %.0f per second\n",
+            filename, cpu_engine(), restores, elapsed, restores / elapsed);
+
+    free(memory);
+    snapshot_free(snapshot);
+    cpm_free(&machine);
 }
 
-static void test(const char *filename) {
+static void stop_out(CPU *cpu, u8 port) {
+    (void)port;
+    cpu_stop(cpu);
+}
+
+/**
+ * Runs a subroutine from a mirror of page 0 until it is hot, then rewrites
+ * its immediate through page 0 itself. Engines that cache decoded or
+ * translated code have to drop it at the mirror too.
+ */
+static void test_mirror(void) {
+    static const u8 program[] = {
+        [0x00] = 0x3e, 0x01,       // 0400: MVI A,01
+        [0x02] = 0xc9,             // 0402: RET
+        [0x20] = 0x06, 0x00,       // 0420: MVI B,00
+        [0x22] = 0xcd, 0x00, 0x04, // 0422: CALL 0400
+        [0x25] = 0x05,             // 0425: DCR B
+        [0x26] = 0xc2, 0x22, 0x04, // 0426: JNZ 0422
+        [0x29] = 0x3e, 0x2a,       // 0429: MVI A,2A
+        [0x2b] = 0x32, 0x01, 0x00, // 042b: STA 0001, the immediate at 0401
+        [0x2e] = 0xcd, 0x00, 0x04, // 042e: CALL 0400
+        [0x31] = 0xd3, 0x00,       // 0431: OUT 0
+    };
+
     CPU cpu;
-    cpu_init(&cpu, 0, out);
+    cpu_init(&cpu, 0, stop_out);
+    memory_map_mirror(cpu.map, 0x0400, PAGE_SIZE, 0x0000, PAGE_SIZE);
+    memcpy(cpu.memory, program, sizeof(program));
+    cpu.pc = 0x0420;
+    cpu.sp = 0x8000;
+    cpu_run(&cpu, 100000);
+
+    if (cpu.pc != 0x0433 || cpu.regs.a != 0x2a) {
+        fprintf(stderr, "ERROR: code rewritten through a mirror ran stale.\n");
+        exit(1);
+    }
+
+    printf("Mirrored code (%s): rewritten through page 0\n", cpu_engine());
+    cpu_free(&cpu);
+}
 
-    load_test(&cpu.memory[0x100], filename);
-    cpu.pc = 0x100;
+// Blocks forever, like a device that never answers.
+static void blocked_out(CPU *cpu, u8 port) {
+    (void)cpu;
+    (void)port;
+    for (;;)
+        pause();
+}
+
+static bool never_done(CPU *cpu) {
+    (void)cpu;
+    return false;
+}
+
+/**
+ * Runs a machine that blocks in its first OUT next to one looping on JMP 0
+ * on a single worker. The watchdog has to give up on the first and leave
+ * the second to a new worker, which runs it out of cycles. A farm that
+ * hangs instead is killed by the alarm. Then checks that a machine which
+ * only takes long is left alone.
+ */
+static void test_farm(void) {
+    // The stuck machine's worker keeps it, so both are left to the process.
+    static CPU stuck, looping;
+    cpu_init(&stuck, 0, blocked_out);
+    cpu_init(&looping, 0, 0);
+    stuck.memory[0] = 0xd3;   // OUT 0
+    looping.memory[0] = 0xc3; // JMP 0
+
+    FarmJob jobs[] = {
+        { .name = "stuck", .cpu = &stuck, .done = never_done },
+        { .name = "looping", .cpu = &looping, .done = never_done, .max_cycles = 20000000 },
+    };
+    Farm farm = { .threads = 1, .slice = 1000000, .timeout = 0.2 };
+
+    alarm(10);
+    farm_run(&farm, jobs, 2);
+    alarm(0);
+
+    if (jobs[0].status != FARM_STUCK || !jobs[0].abandoned || jobs[1].status != FARM_CYCLES) {
+        fprintf(stderr, "ERROR: the farm did not recover from a stuck worker.\n");
+        exit(1);
+    }
 
-    cpu.memory[0x0] = 0xd3;
-    cpu.memory[0x1] = 0x00;
+    // A single slice far longer than the timeout is slow, not stuck: the
+    // machine runs out of cycles on the worker it started on.
+    static CPU slow;
+    cpu_init(&slow, 0, 0);
+    slow.memory[0] = 0xc3;
 
-    cpu.memory[0x5] = 0xd3;
-    cpu.memory[0x6] = 0x01;
-    cpu.memory[0x7] = 0xc9;
+    FarmJob job = { .name = "slow", .cpu = &slow, .done = never_done, .max_cycles = 400000000 };
+    Farm single = { .threads = 1, .slice = 400000000, .timeout = 0.01 };
+    farm_run(&single, &job, 1);
 
-    test_done = 0;
-    while (!test_done) {
-        cpu_execute(&cpu);
+    if (job.status != FARM_CYCLES || job.abandoned) {
+        fprintf(stderr, "ERROR: the farm took a slow slice for a stuck one.\n");
+        exit(1);
     }
+
+    printf("Farm (%s): recovered from a stuck worker in %.2f s, kept a %.2f s slice\n",
+            cpu_engine(), farm.seconds, single.seconds);
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "Usage: test [-p prefix [-l labels]]\n"
+            "\n"
+            "Runs the CPU tests. -p, in builds with profile=1, writes each test's\n"
+            "profile to `prefix` and its name, as .callgrind and .folded files,\n"
+            "naming functions from `labels` when given.\n");
+    exit(1);
 }
 
-int main(void) {
-    test("tests/8080PRE.COM"); 
-    test("tests/8080EXM.COM");
+int main(int argc, char **argv) {
+    int option;
+    while ((option = getopt(argc, argv, "p:l:")) != -1) {
+        switch (option) {
+            case 'p': profiles = optarg; break;
+            case 'l': labels = optarg; break;
+            default: usage();
+        }
+    }
+
+    test("tests/8080PRE.COM", 0, 0);
+    test("tests/8080EXM.COM", 0, 0);
+    test_files();
+    test_snapshots("tests/8080EXM.COM");
+    test_mirror();
+    test_farm();
 }
@@ -0,0 +1,405 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+
+#include "trace.h"
+
+/**
+ * A trace file is a header, then chunks of up to TRACE_CHUNK records, then
+ * the index of the chunks and a trailer pointing at it. A chunk is its
+ * record count and size, then each record XORed with the one before it:
+ * 3 bytes with a bit for each byte that changed, then those bytes. The
+ * first record of a chunk is XORed with zeros, so every chunk decodes on
+ * its own. A trace that was never stopped has no index; readers then
+ * rebuild it from the chunk headers.
+ */
+static const char MAGIC[8] = "I8080TRC";
+static const char INDEX_MAGIC[8] = "TRCINDEX";
+#define VERSION 1
+
+typedef struct {
+    char magic[8];
+    u32 version;
+    u32 record_size;
+} Header;
+
+typedef struct {
+    u32 count;
+    u32 size;
+} ChunkHeader;
+
+typedef struct {
+    u64 chunks;
+    u64 offset;
+    char magic[8];
+} Trailer;
+
+static bool decode(const u8 *in, u32 size, TraceRecord *records, u32 count) {
+    u8 previous[sizeof(TraceRecord)] = { 0 };
+    u32 at = 0;
+
+    for (u32 i = 0; i < count; i++) {
+        if (at + 3 > size)
+            return false;
+
+        u32 mask = in[at] | in[at + 1] << 8 | in[at + 2] << 16;
+        at += 3;
+
+        for (u32 byte = 0; byte < sizeof(TraceRecord); byte++) {
+            if (mask >> byte & 1) {
+                if (at == size)
+                    return false;
+                previous[byte] ^= in[at++];
+            }
+        }
+
+        memcpy(&records[i], previous, sizeof(TraceRecord));
+    }
+
+    return at == size;
+}
+
+#ifdef CPU_TRACE
+
+// Encodes a word at a time, one byte for each byte that changed.
+static u32 encode(const TraceRecord *records, u32 count, u8 *out) {
+    u64 previous[3] = { 0 };
+    u32 size = 0;
+
+    for (u32 i = 0; i < count; i++) {
+        u64 record[3];
+        memcpy(record, &records[i], sizeof(record));
+
+        u32 mask = 0;
+        u32 at = size;
+        size += 3;
+
+        for (u32 word = 0; word < 3; word++) {
+            u64 changed = record[word] ^ previous[word];
+            while (changed) {
+                u32 byte = __builtin_ctzll(changed) / 8;
+                mask |= 1u << (word * 8 + byte);
+                out[size++] = changed >> byte * 8;
+                changed &= ~(0xffull << byte * 8);
+            }
+            previous[word] = record[word];
+        }
+
+        out[at] = mask;
+        out[at + 1] = mask >> 8;
+        out[at + 2] = mask >> 16;
+    }
+
+    return size;
+}
+
+static void sleep_briefly(void) {
+    struct timespec pause = { 0, 1000000 };
+    nanosleep(&pause, 0);
+}
+
+static void write_chunk(Trace *trace, u64 tail, u32 count, TraceRecord *records, u8 *encoded) {
+    // Only the last chunk can be short, so a chunk straddles the end of the
+    // ring only if TRACE_RING is not a multiple of TRACE_CHUNK.
+    if (tail % TRACE_RING + count <= TRACE_RING)
+        records = &trace->ring[tail % TRACE_RING];
+    else {
+        for (u32 i = 0; i < count; i++)
+            records[i] = trace->ring[(tail + i) % TRACE_RING];
+    }
+
+    if (trace->chunks == trace->capacity) {
+        trace->capacity = trace->capacity ? trace->capacity * 2 : 256;
+        trace->index = realloc(trace->index, trace->capacity * sizeof(TraceIndex));
+        if (!trace->index) {
+            fprintf(stderr, "Trace: Out of memory.\n");
+            exit(1);
+        }
+    }
+
+    trace->index[trace->chunks++] = (TraceIndex){ tail, records[0].cycles, trace->bytes };
+
+    ChunkHeader header = { count, encode(records, count, encoded) };
+    fwrite(&header, sizeof(header), 1, trace->file);
+    fwrite(encoded, 1, header.size, trace->file);
+    trace->bytes += sizeof(header) + header.size;
+}
+
+/**
+ * Drains the ring a chunk at a time, and what is left of it once the trace
+ * is closing. Only the writer touches the file, so the CPU never waits on
+ * compression or I/O unless the ring fills.
+ */
+static void *writer(void *argument) {
+    Trace *trace = argument;
+    TraceRecord *records = malloc(TRACE_CHUNK * sizeof(TraceRecord));
+    u8 *encoded = malloc(TRACE_ENCODED);
+    if (!records || !encoded) {
+        fprintf(stderr, "Trace: Out of memory.\n");
+        exit(1);
+    }
+
+    u64 tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+    while (true) {
+        bool closing = atomic_load_explicit(&trace->closing, memory_order_acquire);
+        u64 head = atomic_load_explicit(&trace->head, memory_order_acquire);
+
+        if (head - tail >= TRACE_CHUNK || (closing && head != tail)) {
+            u32 count = head - tail < TRACE_CHUNK ? head - tail : TRACE_CHUNK;
+            write_chunk(trace, tail, count, records, encoded);
+            tail += count;
+            atomic_store_explicit(&trace->tail, tail, memory_order_release);
+        }
+        else if (closing)
+            break;
+        else
+            sleep_briefly();
+    }
+
+    free(records);
+    free(encoded);
+    return 0;
+}
+
+void trace_wait(Trace *trace) {
+    atomic_store_explicit(&trace->head, trace->next, memory_order_release);
+
+    while (true) {
+        u64 tail = atomic_load_explicit(&trace->tail, memory_order_acquire);
+        trace->space = TRACE_RING - (trace->next - tail);
+        if (trace->space)
+            return;
+
+        trace->stalls++;
+        sched_yield();
+    }
+}
+
+/**
+ * Starts tracing every instruction `cpu` runs to the file at `path`.
+ * Returns false if it cannot be created.
+ */
+bool trace_start(CPU *cpu, const char *path) {
+    Trace *trace = aligned_alloc(64, sizeof(Trace));
+    if (!trace) {
+        fprintf(stderr, "Trace: Out of memory.\n");
+        exit(1);
+    }
+
+    memset(trace, 0, sizeof(Trace));
+
+    trace->file = fopen(path, "wb");
+    if (!trace->file) {
+        fprintf(stderr, "Could not create %s.\n", path);
+        free(trace);
+        return false;
+    }
+
+    Header header = { { 0 }, VERSION, sizeof(TraceRecord) };
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    fwrite(&header, sizeof(header), 1, trace->file);
+    trace->bytes = sizeof(header);
+
+    trace->space = TRACE_RING;
+    if (pthread_create(&trace->thread, 0, writer, trace)) {
+        fprintf(stderr, "Trace: Could not start the writer thread.\n");
+        exit(1);
+    }
+
+    cpu->trace = trace;
+    return true;
+}
+
+/**
+ * Writes out what is left in the ring and the index, and reports the size
+ * of the trace on stderr.
+ */
+void trace_stop(CPU *cpu) {
+    Trace *trace = cpu->trace;
+    if (!trace)
+        return;
+
+    cpu->trace = 0;
+    atomic_store_explicit(&trace->head, trace->next, memory_order_release);
+    atomic_store_explicit(&trace->closing, true, memory_order_release);
+    pthread_join(trace->thread, 0);
+
+    Trailer trailer = { trace->chunks, trace->bytes, { 0 } };
+    memcpy(trailer.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    fwrite(trace->index, sizeof(TraceIndex), trace->chunks, trace->file);
+    fwrite(&trailer, sizeof(trailer), 1, trace->file);
+    fclose(trace->file);
+
+    fprintf(stderr, "Trace: %llu records in %.1f MiB, %.1f bytes each, %llu stalls\n",
+            (unsigned long long)trace->next, trace->bytes / 1048576.0,
+            trace->next ? (double)trace->bytes / trace->next : 0.0,
+            (unsigned long long)trace->stalls);
+
+    free(trace->index);
+    free(trace);
+}
+
+#else
+
+bool trace_start(CPU *cpu, const char *path) {
+    (void)cpu;
+    (void)path;
+    fprintf(stderr, "Tracing needs a build with trace=1.\n");
+    return false;
+}
+
+void trace_stop(CPU *cpu) {
+    (void)cpu;
+}
+
+#endif
+
+static bool read_index(TraceReader *reader) {
+    Trailer trailer;
+    if (fseek(reader->file, -(long)sizeof(trailer), SEEK_END)
+            || fread(&trailer, sizeof(trailer), 1, reader->file) != 1
+            || memcmp(trailer.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)))
+        return false;
+
+    reader->chunks = trailer.chunks;
+    reader->index = malloc(trailer.chunks * sizeof(TraceIndex) + 1);
+    return reader->index && !fseek(reader->file, trailer.offset, SEEK_SET)
+        && fread(reader->index, sizeof(TraceIndex), trailer.chunks, reader->file) == trailer.chunks;
+}
+
+// Walks the chunk headers of a trace that has no index.
+static void rebuild_index(TraceReader *reader) {
+    u32 capacity = 0;
+    u64 record = 0;
+    long offset = sizeof(Header);
+    ChunkHeader chunk;
+    u8 first[3 + sizeof(TraceRecord)];
+
+    free(reader->index);
+    reader->index = 0;
+    reader->chunks = 0;
+
+    while (!fseek(reader->file, offset, SEEK_SET)
+            && fread(&chunk, sizeof(chunk), 1, reader->file) == 1 && chunk.count) {
+        TraceRecord first_record;
+        u32 size = chunk.size < sizeof(first) ? chunk.size : sizeof(first);
+        if (fread(first, 1, size, reader->file) != size)
+            break;
+
+        // Only the first record is decoded, for its cycle count.
+        u32 length = 3;
+        u32 mask = first[0] | first[1] << 8 | first[2] << 16;
+        for (u32 byte = 0; byte < sizeof(TraceRecord); byte++)
+            length += mask >> byte & 1;
+        if (length > size || !decode(first, length, &first_record, 1))
+            break;
+
+        if (reader->chunks == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            reader->index = realloc(reader->index, capacity * sizeof(TraceIndex));
+            if (!reader->index) {
+                fprintf(stderr, "Trace: Out of memory.\n");
+                exit(1);
+            }
+        }
+
+        reader->index[reader->chunks++] = (TraceIndex){ record, first_record.cycles, offset };
+        record += chunk.count;
+        offset += sizeof(chunk) + chunk.size;
+    }
+}
+
+/**
+ * Opens a trace written by trace_start, positioned at its first record.
+ * Returns null if it is not one.
+ */
+TraceReader *trace_reader_open(const char *path) {
+    File *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Could not open %s.\n", path);
+        return 0;
+    }
+
+    Header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, MAGIC, sizeof(MAGIC))
+            || header.version != VERSION || header.record_size != sizeof(TraceRecord)) {
+        fprintf(stderr, "%s is not a trace.\n", path);
+        fclose(file);
+        return 0;
+    }
+
+    TraceReader *reader = calloc(1, sizeof(TraceReader));
+    if (!reader) {
+        fprintf(stderr, "Trace: Out of memory.\n");
+        exit(1);
+    }
+
+    reader->file = file;
+    if (!read_index(reader))
+        rebuild_index(reader);
+
+    return reader;
+}
+
+void trace_reader_close(TraceReader *reader) {
+    if (!reader)
+        return;
+
+    fclose(reader->file);
+    free(reader->index);
+    free(reader);
+}
+
+static bool read_chunk(TraceReader *reader, u32 chunk) {
+    u8 *encoded = reader->encoded;
+    ChunkHeader header;
+
+    if (chunk >= reader->chunks
+            || fseek(reader->file, reader->index[chunk].offset, SEEK_SET)
+            || fread(&header, sizeof(header), 1, reader->file) != 1
+            || header.count > TRACE_CHUNK || header.size > TRACE_ENCODED
+            || fread(encoded, 1, header.size, reader->file) != header.size
+            || !decode(encoded, header.size, reader->records, header.count))
+        return false;
+
+    reader->chunk = chunk + 1;
+    reader->count = header.count;
+    reader->position = 0;
+    return true;
+}
+
+/**
+ * Moves to the first record at or after `cycles`, through the index.
+ * Returns false if there is none.
+ */
+bool trace_reader_seek(TraceReader *reader, u64 cycles) {
+    u32 low = 0, high = reader->chunks;
+    while (high - low > 1) {
+        u32 middle = (low + high) / 2;
+        if (reader->index[middle].cycles <= cycles)
+            low = middle;
+        else
+            high = middle;
+    }
+
+    reader->count = reader->position = 0;
+    reader->chunk = low;
+
+    while (reader->position < reader->count || read_chunk(reader, reader->chunk)) {
+        if (reader->records[reader->position].cycles >= cycles)
+            return true;
+        reader->position++;
+    }
+
+    return false;
+}
+
+bool trace_reader_next(TraceReader *reader, TraceRecord *record) {
+    if (reader->position == reader->count && !read_chunk(reader, reader->chunk))
+        return false;
+
+    *record = reader->records[reader->position++];
+    return true;
+}
@@ -0,0 +1,575 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "disassembler.h"
+
+#define MAX_PROGRAMS 16
+
+// Instructions of a minimized case listed before the rest are left out.
+#define MAX_LISTING 200
+
+// Furthest before a divergence that a case is tried from.
+#define MAX_REBASE 256
+
+#define FLAGS_MASK (FLAG_SIGN | FLAG_ZERO | FLAG_AUX_CARRY | FLAG_PARITY | FLAG_CARRY)
+
+/**
+ * One program and the state it starts from: all 64 KiB of memory, which
+ * it may run anywhere in, and the registers. A case is made from its seed
+ * alone, so the seed is enough to run it again.
+ */
+typedef struct Case {
+    u64 seed;
+    bool mutated;
+    u8 memory[0x10000];
+    Registers regs;
+    u8 flags;
+    u16 sp;
+    u16 pc;
+    bool interrupts_enabled;
+    u64 cycles; // Run for this many.
+} Case;
+
+typedef struct Program {
+    const char *path;
+    u8 *data;
+    u32 size;
+} Program;
+
+typedef struct Machine {
+    CPU cpu; // First, so that the I/O callbacks can cast back to the machine.
+    u64 seed;
+    u64 inputs;  // IN instructions run, which the values they read depend on.
+    u64 outputs; // Hash of the port and value of every OUT.
+} Machine;
+
+// Where the engine first differed from the reference.
+typedef struct Divergence {
+    u64 cycles;
+    u64 instructions; // Run by the reference by then.
+    char what[160];
+} Divergence;
+
+typedef struct Verify {
+    u64 first; // Seed of the first case.
+    u32 cases;
+    u64 cycles;
+    u64 interval;
+    Program programs[MAX_PROGRAMS];
+    u32 program_count;
+
+    atomic_uint next;
+    atomic_bool failed;
+    atomic_ullong instructions;
+} Verify;
+
+typedef struct Worker {
+    Verify *verify;
+    pthread_t thread;
+    Machine reference;
+    Machine engine;
+    Case test;
+    Case trial;
+} Worker;
+
+static double seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// splitmix64.
+static u64 mix(u64 value) {
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+    return value ^ (value >> 31);
+}
+
+static u64 next(u64 *state) {
+    return mix(*state += 0x9e3779b97f4a7c15ull);
+}
+
+// Opcodes without an instruction, which end the process when they run.
+static bool unimplemented(u8 opcode) {
+    return opcode == 0xc7 || opcode == 0xcb || opcode == 0xd9 || opcode == 0xed || opcode == 0xfd;
+}
+
+/**
+ * Every write goes through here, on both machines alike, so that no
+ * program can store an opcode without an instruction and then run it.
+ */
+static void store(void *context, u16 addr, u8 value) {
+    u8 *memory = context;
+    memory[addr] = unimplemented(value) ? 0x00 : value;
+}
+
+static void port_in(CPU *cpu, u8 port) {
+    Machine *machine = (Machine *)cpu;
+    cpu->regs.a = mix(machine->seed ^ (u64)port << 48 ^ machine->inputs++);
+}
+
+static void port_out(CPU *cpu, u8 port) {
+    Machine *machine = (Machine *)cpu;
+    machine->outputs = mix(machine->outputs ^ (port << 8 | cpu->regs.a));
+}
+
+static void setup(Machine *machine, const Case *test) {
+    CPU *cpu = &machine->cpu;
+    cpu_reset(cpu);
+
+    memcpy(cpu->memory, test->memory, 0x10000);
+    memory_map_watch(cpu->map, 0x0000, 0x10000, cpu->memory, store, cpu->memory);
+
+    cpu->regs = test->regs;
+    cpu->flags = test->flags;
+    cpu->sp = test->sp;
+    cpu->pc = test->pc;
+    cpu->interrupts_enabled = test->interrupts_enabled;
+
+    machine->seed = test->seed;
+    machine->inputs = 0;
+    machine->outputs = 0;
+}
+
+/**
+ * Makes case `seed`: memory full of random bytes, or, for half of the
+ * cases when there are programs to start from, with one of them at 0x100
+ * and a few of its bytes mutated. The registers point near the code
+ * often enough that programs also write over themselves.
+ */
+static void generate(const Verify *verify, Case *test, u64 seed) {
+    u64 state = seed;
+    test->seed = seed;
+
+    for (u32 addr = 0; addr < 0x10000; addr += 8) {
+        u64 bytes = next(&state);
+        memcpy(&test->memory[addr], &bytes, 8);
+    }
+
+    test->pc = next(&state);
+    test->mutated = verify->program_count && next(&state) % 2;
+
+    if (test->mutated) {
+        const Program *program = &verify->programs[next(&state) % verify->program_count];
+        u32 size = program->size < 0x10000 - 0x100 ? program->size : 0x10000 - 0x100;
+        memcpy(&test->memory[0x100], program->data, size);
+        test->pc = 0x100;
+
+        for (u32 mutations = 1 + next(&state) % 8; mutations; mutations--) {
+            u16 addr = 0x100 + next(&state) % size;
+            switch (next(&state) % 3) {
+                case 0: test->memory[addr] = next(&state); break;
+                case 1: test->memory[addr] ^= 1 << next(&state) % 8; break;
+                case 2: test->memory[addr] = test->memory[(u16)(addr + 1)]; break;
+            }
+        }
+    }
+
+    for (u32 addr = 0; addr < 0x10000; addr++) {
+        if (unimplemented(test->memory[addr]))
+            test->memory[addr] = 0x00;
+    }
+
+    u64 registers = next(&state);
+    test->regs.bc = registers;
+    test->regs.de = registers >> 16;
+    test->regs.hl = registers >> 32;
+    test->regs.a = registers >> 48;
+    test->flags = (registers >> 56) & FLAGS_MASK;
+    test->sp = next(&state);
+    test->interrupts_enabled = next(&state) % 2;
+
+    u64 near = next(&state);
+    if (near & 1)
+        test->regs.bc = test->pc + (u8)(near >> 8);
+    if (near & 2)
+        test->regs.de = test->pc + (u8)(near >> 16);
+    if (near & 4)
+        test->regs.hl = test->pc + (u8)(near >> 24);
+
+    test->cycles = verify->cycles;
+}
+
+static bool differs(Divergence *divergence, const char *name, u64 expected, u64 actual) {
+    if (expected == actual)
+        return false;
+
+    snprintf(divergence->what, sizeof(divergence->what),
+             "%s is %llx in the reference and %llx in %s", name,
+             (unsigned long long)expected, (unsigned long long)actual, cpu_engine());
+    return true;
+}
+
+/**
+ * Compares the whole state of the two machines after the reference ran
+ * `steps` instructions and the engine `count`.
+ */
+static bool compare(Machine *reference, Machine *engine, u64 steps, u64 count,
+                    Divergence *divergence) {
+    CPU *expected = &reference->cpu;
+    CPU *actual = &engine->cpu;
+
+    divergence->cycles = actual->cycles;
+    divergence->instructions = steps;
+
+    if (differs(divergence, "cycles", expected->cycles, actual->cycles)
+            || differs(divergence, "instructions", steps, count)
+            || differs(divergence, "pc", expected->pc, actual->pc)
+            || differs(divergence, "sp", expected->sp, actual->sp)
+            || differs(divergence, "a", expected->regs.a, actual->regs.a)
+            || differs(divergence, "flags", cpu_flags(expected), cpu_flags(actual))
+            || differs(divergence, "bc", expected->regs.bc, actual->regs.bc)
+            || differs(divergence, "de", expected->regs.de, actual->regs.de)
+            || differs(divergence, "hl", expected->regs.hl, actual->regs.hl)
+            || differs(divergence, "interrupts enabled", expected->interrupts_enabled,
+                       actual->interrupts_enabled)
+            || differs(divergence, "inputs", reference->inputs, engine->inputs)
+            || differs(divergence, "outputs", reference->outputs, engine->outputs))
+        return true;
+
+    if (!memcmp(expected->memory, actual->memory, 0x10000))
+        return false;
+
+    u32 addr = 0;
+    while (expected->memory[addr] == actual->memory[addr])
+        addr++;
+
+    char name[32];
+    snprintf(name, sizeof(name), "memory at %04x", addr);
+    return differs(divergence, name, expected->memory[addr], actual->memory[addr]);
+}
+
+/**
+ * Runs `test` on the engine, `interval` cycles at a time, and after each
+ * run steps the reference through cpu_execute to the same cycle. Returns
+ * whether they ever differ, and where.
+ */
+static bool run_case(Worker *worker, const Case *test, u64 interval, Divergence *divergence,
+                     u64 *instructions) {
+    Machine *reference = &worker->reference;
+    Machine *engine = &worker->engine;
+    setup(reference, test);
+    setup(engine, test);
+
+    u64 steps = 0;
+    u64 count = 0;
+    bool diverged = false;
+
+    while (!diverged && engine->cpu.cycles < test->cycles) {
+        u64 left = test->cycles - engine->cpu.cycles;
+        count += cpu_run(&engine->cpu, left < interval ? left : interval);
+
+        while (reference->cpu.cycles < engine->cpu.cycles) {
+            cpu_step(&reference->cpu);
+            steps++;
+        }
+
+        diverged = compare(reference, engine, steps, count, divergence);
+    }
+
+    if (instructions)
+        *instructions = steps;
+
+    return diverged;
+}
+
+static bool zero(const u8 *memory, u32 size) {
+    for (u32 i = 0; i < size; i++) {
+        if (memory[i])
+            return false;
+    }
+
+    return true;
+}
+
+// Keeps `trial` as the case if it still diverges, comparing after every run.
+static bool still_diverges(Worker *worker, Case *test, const Case *trial, Divergence *divergence) {
+    if (!run_case(worker, trial, 1, divergence, 0))
+        return false;
+
+    *test = *trial;
+    test->cycles = divergence->cycles;
+    return true;
+}
+
+/**
+ * Starts the case as close to where it diverges as it still does: from the
+ * state the reference was in one instruction before, or two, and so on.
+ * Divergences that need what the engine ran before, like stale decoded
+ * code, keep an earlier start.
+ */
+static void rebase(Worker *worker, Case *test, Divergence *divergence) {
+    CPU *cpu = &worker->reference.cpu;
+    Case *trial = &worker->trial;
+    u64 instructions = divergence->instructions;
+
+    for (u64 back = 1; back < instructions && back <= MAX_REBASE; back++) {
+        setup(&worker->reference, test);
+        for (u64 i = 0; i + back < instructions; i++)
+            cpu_step(cpu);
+
+        *trial = *test;
+        memcpy(trial->memory, cpu->memory, 0x10000);
+        trial->regs = cpu->regs;
+        trial->flags = cpu_flags(cpu);
+        trial->sp = cpu->sp;
+        trial->pc = cpu->pc;
+        trial->interrupts_enabled = cpu->interrupts_enabled;
+        trial->cycles = test->cycles - cpu->cycles;
+
+        if (still_diverges(worker, test, trial, divergence))
+            return;
+    }
+}
+
+/**
+ * Shrinks a case that diverges: it is cut short where the engine first
+ * differs and started as close to that as it can be. Then ever smaller
+ * pieces of its memory are turned into NOPs and its registers cleared, as
+ * long as it keeps diverging. What is left is the program that makes the
+ * engine differ and little else.
+ */
+static void minimize(Worker *worker, Case *test, Divergence *divergence) {
+    Case *trial = &worker->trial;
+    *trial = *test;
+    still_diverges(worker, test, trial, divergence);
+    rebase(worker, test, divergence);
+
+    for (u32 chunk = 0x8000; chunk; chunk /= 2) {
+        for (u32 start = 0; start < 0x10000; start += chunk) {
+            if (zero(&test->memory[start], chunk))
+                continue;
+
+            *trial = *test;
+            memset(&trial->memory[start], 0, chunk);
+            still_diverges(worker, test, trial, divergence);
+        }
+    }
+
+    for (u32 i = 0; i < 7; i++) {
+        *trial = *test;
+        switch (i) {
+            case 0: trial->regs.a = 0; break;
+            case 1: trial->flags = 0; break;
+            case 2: trial->regs.bc = 0; break;
+            case 3: trial->regs.de = 0; break;
+            case 4: trial->regs.hl = 0; break;
+            case 5: trial->sp = 0; break;
+            case 6: trial->interrupts_enabled = false; break;
+        }
+        still_diverges(worker, test, trial, divergence);
+    }
+
+    run_case(worker, test, 1, divergence, 0);
+}
+
+// Prints what the reference runs of `test`, up to the divergence.
+static void list(Worker *worker, const Case *test, const Divergence *divergence) {
+    CPU *cpu = &worker->reference.cpu;
+    setup(&worker->reference, test);
+
+    u64 listed = 0;
+    for (u64 i = 0; i < divergence->instructions; i++) {
+        if (listed == MAX_LISTING) {
+            printf("        ... %llu more\n", (unsigned long long)(divergence->instructions - i));
+            break;
+        }
+
+        // A run of NOPs, which is most of a minimized case, takes one line.
+        u64 nops = 0;
+        while (i + nops < divergence->instructions && cpu->memory[cpu->pc] == 0) {
+            cpu_step(cpu);
+            nops++;
+        }
+        if (nops > 1) {
+            printf("  %04x  NOP x%llu\n", (u16)(cpu->pc - nops), (unsigned long long)nops);
+            i += nops - 1;
+            listed++;
+            continue;
+        }
+        if (nops == 1) {
+            printf("  %04x  NOP\n", (u16)(cpu->pc - 1));
+            listed++;
+            continue;
+        }
+
+        Instruction instruction;
+        char text[DIS_TEXT];
+        disassemble(cpu->memory, 0x10000, 0, cpu->pc, &instruction);
+        disassemble_format(&instruction, 0, text);
+        printf("  %04x  %s\n", cpu->pc, text);
+        cpu_step(cpu);
+        listed++;
+    }
+}
+
+static void report(Worker *worker, const Case *test, const Divergence *divergence) {
+    const Verify *verify = worker->verify;
+    printf("Case %llu%s diverges: %s, at cycle %llu, after %llu instructions.\n",
+           (unsigned long long)test->seed, test->mutated ? " (mutated)" : "", divergence->what,
+           (unsigned long long)divergence->cycles, (unsigned long long)divergence->instructions);
+    printf("Run it again with -s %llu -n 1 -c %llu -i %llu.\n", (unsigned long long)test->seed,
+           (unsigned long long)verify->cycles, (unsigned long long)verify->interval);
+
+    Case *minimized = &worker->test;
+    Divergence shortest;
+    minimize(worker, minimized, &shortest);
+
+    u32 bytes = 0;
+    for (u32 addr = 0; addr < 0x10000; addr++)
+        bytes += minimized->memory[addr] != 0;
+
+    printf("\nMinimized to %u byte%s that are not NOP, diverging after %llu instructions: %s.\n",
+           bytes, bytes == 1 ? "" : "s", (unsigned long long)shortest.instructions, shortest.what);
+    printf("  A %02x  F %02x  BC %04x  DE %04x  HL %04x  SP %04x  PC %04x  %s\n",
+           minimized->regs.a, minimized->flags, minimized->regs.bc, minimized->regs.de,
+           minimized->regs.hl, minimized->sp, minimized->pc,
+           minimized->interrupts_enabled ? "EI" : "DI");
+
+    for (u32 addr = 0; addr < 0x10000; addr++) {
+        if (!minimized->memory[addr])
+            continue;
+
+        printf("  %04x:", addr);
+        for (u32 i = 0; i < 16 && addr < 0x10000 && minimized->memory[addr]; i++, addr++)
+            printf(" %02x", minimized->memory[addr]);
+        printf("\n");
+    }
+
+    printf("\nWhat the reference runs:\n");
+    list(worker, minimized, &shortest);
+}
+
+static void *work(void *data) {
+    Worker *worker = data;
+    Verify *verify = worker->verify;
+    cpu_init(&worker->reference.cpu, port_in, port_out);
+    cpu_init(&worker->engine.cpu, port_in, port_out);
+
+    while (!atomic_load(&verify->failed)) {
+        u32 index = atomic_fetch_add(&verify->next, 1);
+        if (index >= verify->cases)
+            break;
+
+        generate(verify, &worker->test, verify->first + index);
+
+        Divergence divergence;
+        u64 instructions;
+        bool diverged = run_case(worker, &worker->test, verify->interval, &divergence, &instructions);
+        atomic_fetch_add(&verify->instructions, instructions);
+
+        // Only the first case found is minimized and reported.
+        bool failed = false;
+        if (diverged && atomic_compare_exchange_strong(&verify->failed, &failed, true))
+            report(worker, &worker->test, &divergence);
+    }
+
+    cpu_free(&worker->reference.cpu);
+    cpu_free(&worker->engine.cpu);
+    return 0;
+}
+
+static void load(Program *program, const char *path) {
+    File *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Could not open %s.\n", path);
+        exit(1);
+    }
+
+    program->path = path;
+    program->data = malloc(0x10000);
+    if (!program->data) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    program->size = fread(program->data, 1, 0x10000, file);
+    fclose(file);
+
+    if (!program->size) {
+        fprintf(stderr, "%s is empty.\n", path);
+        exit(1);
+    }
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "Usage: verify [-n cases] [-c cycles] [-i interval] [-j threads] [-s seed]\n"
+            "              [program.com ...]\n"
+            "\n"
+            "Runs `cases` random programs, each for `cycles` cycles, on the engine\n"
+            "this build was made with and on the reference cpu_execute, in\n"
+            "lockstep on `threads` threads, comparing the whole machine every\n"
+            "`interval` cycles. Half of the cases are the programs given with a\n"
+            "few bytes mutated. Case numbers start from `seed`. The first case\n"
+            "that diverges is minimized and printed, and the exit status is 1.\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    static Verify verify;
+    verify.first = 1;
+    verify.cases = 2000;
+    verify.cycles = 100000;
+    verify.interval = 1000;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int option;
+    while ((option = getopt(argc, argv, "n:c:i:j:s:")) != -1) {
+        switch (option) {
+            case 'n': verify.cases = strtoul(optarg, 0, 10); break;
+            case 'c': verify.cycles = strtoull(optarg, 0, 10); break;
+            case 'i': verify.interval = strtoull(optarg, 0, 10); break;
+            case 'j': threads = strtol(optarg, 0, 10); break;
+            case 's': verify.first = strtoull(optarg, 0, 10); break;
+            default: usage();
+        }
+    }
+
+    if (optind + MAX_PROGRAMS < argc || !verify.interval || threads < 1)
+        usage();
+
+    for (int i = optind; i < argc; i++)
+        load(&verify.programs[verify.program_count++], argv[i]);
+
+    Worker *workers = calloc(threads, sizeof(Worker));
+    if (!workers) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    double start = seconds();
+
+    for (long i = 0; i < threads; i++) {
+        workers[i].verify = &verify;
+        if (pthread_create(&workers[i].thread, 0, work, &workers[i])) {
+            fprintf(stderr, "Could not start a worker thread.\n");
+            exit(1);
+        }
+    }
+
+    for (long i = 0; i < threads; i++)
+        pthread_join(workers[i].thread, 0);
+
+    double elapsed = seconds() - start;
+    bool failed = atomic_load(&verify.failed);
+
+    if (!failed) {
+        printf("%s: %u cases, %llu instructions in %.2f s on %ld thread%s, all the same as the reference\n",
+               cpu_engine(), verify.cases, (unsigned long long)atomic_load(&verify.instructions),
+               elapsed, threads, threads == 1 ? "" : "s");
+    }
+
+    for (u32 i = 0; i < verify.program_count; i++)
+        free(verify.programs[i].data);
+    free(workers);
+
+    return failed;
+}
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpm.h"
+#include "trace.h"
+#include "debugger.h"
+
+static double seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "Usage: cpm [-A path] ... [-P path] [-v] [-d] [-T trace] program.com [arguments]\n"
+            "\n"
+            "Runs a CP/M 2.2 program with its console on stdin and stdout. -A to -P\n"
+            "mount drives A: to P:, each a host directory or an 8\" single density\n"
+            "disk image; A: is the current directory unless given. -v reports the\n"
+            "instructions run and their speed on stderr when the program ends.\n"
+            "-d stops before the first instruction in the debugger, which takes\n"
+            "its commands from stdin ahead of the program. -T records every\n"
+            "instruction to `trace`, in builds with trace=1.\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    static Cpm cpm;
+    cpm_init(&cpm, stdout, stdin);
+
+    bool verbose = false;
+    bool debug = false;
+    bool mounted = false;
+    const char *trace = 0;
+
+    int option;
+    while ((option = getopt(argc, argv, "A:B:C:D:E:F:G:H:I:J:K:L:M:N:O:P:vdT:")) != -1) {
+        if (option == 'v')
+            verbose = true;
+        else if (option == 'd')
+            debug = true;
+        else if (option == 'T')
+            trace = optarg;
+        else if (option >= 'A' && option <= 'P') {
+            if (!cpm_mount(&cpm, option - 'A', optarg))
+                exit(1);
+            mounted |= option == 'A';
+        }
+        else
+            usage();
+    }
+
+    if (optind == argc)
+        usage();
+
+    if (!mounted && !cpm_mount(&cpm, 0, "."))
+        exit(1);
+
+    cpm_load(&cpm, argv[optind], argc - optind - 1, argv + optind + 1);
+    if (trace && !trace_start(&cpm.cpu, trace))
+        exit(1);
+
+    Debugger *debugger = debug ? debugger_new(&cpm.cpu, stdin, stderr) : 0;
+    if (debugger)
+        debugger_pause(debugger);
+
+    u64 instructions = 0;
+    double start = seconds();
+
+    while (!cpm.done)
+        instructions += cpu_run(&cpm.cpu, 1000000);
+
+    double elapsed = seconds() - start;
+    cpm_flush(&cpm);
+    trace_stop(&cpm.cpu);
+    debugger_free(debugger);
+
+    if (verbose) {
+        fprintf(stderr, "%llu instructions in %.2f s, %.1f MIPS, %.1f MHz emulated\n",
+                (unsigned long long)instructions, elapsed, instructions / elapsed / 1e6,
+                cpm.cpu.cycles / elapsed / 1e6);
+    }
+
+    cpm_free(&cpm);
+    return 0;
+}
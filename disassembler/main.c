@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disassembler.h"
+
+#define TIMED_RUNS 1000
+
+static double seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "Usage: disassemble [-b base] [-e entry] ... [-t] rom\n"
+            "\n"
+            "Writes a labelled listing of `rom`, loaded at `base` (0 by default), to\n"
+            "stdout. Code is found by following jumps and calls from the reset and\n"
+            "RST vectors and from each `entry`; the rest is listed as data. -t\n"
+            "reports on stderr how long discovery and the listing take.\n");
+    exit(1);
+}
+
+static void discover(CodeMap *map, const u16 *entries, u32 count) {
+    code_map_discover_vectors(map);
+    for (u32 i = 0; i < count; i++)
+        code_map_discover(map, entries[i]);
+}
+
+int main(int argc, char **argv) {
+    static CodeMap map;
+    static u8 rom[0x10000];
+    u16 entries[64];
+    u32 count = 0;
+    u16 base = 0;
+    bool timed = false;
+
+    int option;
+    while ((option = getopt(argc, argv, "b:e:t")) != -1) {
+        switch (option) {
+            case 'b': base = strtoul(optarg, 0, 16); break;
+            case 'e':
+                if (count < sizeof(entries) / sizeof(entries[0]))
+                    entries[count++] = strtoul(optarg, 0, 16);
+                break;
+            case 't': timed = true; break;
+            default: usage();
+        }
+    }
+
+    if (optind + 1 != argc)
+        usage();
+
+    File *file = fopen(argv[optind], "rb");
+    if (!file) {
+        fprintf(stderr, "Could not open %s.\n", argv[optind]);
+        exit(1);
+    }
+
+    u32 size = fread(rom, sizeof(u8), 0x10000 - base, file);
+    fclose(file);
+
+    code_map_init(&map, rom, size, base);
+    discover(&map, entries, count);
+
+    u32 length = code_map_listing(&map, 0, 0);
+    char *listing = malloc(length + 1);
+    code_map_listing(&map, listing, length + 1);
+    fwrite(listing, sizeof(char), length, stdout);
+
+    if (timed) {
+        double start = seconds();
+        for (u32 i = 0; i < TIMED_RUNS; i++) {
+            code_map_init(&map, rom, size, base);
+            discover(&map, entries, count);
+        }
+        double discovered = seconds();
+        for (u32 i = 0; i < TIMED_RUNS; i++)
+            code_map_listing(&map, listing, length + 1);
+        double listed = seconds();
+
+        fprintf(stderr, "%u bytes, %u instructions: discovery %.1f us, listing %.1f us\n",
+                size, map.instructions, (discovered - start) * 1e6 / TIMED_RUNS,
+                (listed - discovered) * 1e6 / TIMED_RUNS);
+    }
+
+    free(listing);
+    return 0;
+}
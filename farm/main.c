@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "cpm.h"
+#include "farm.h"
+#include "invaders.h"
+#include "lanes.h"
+
+#define CACHE_LINE 64
+
+static const char *invaders_rom = "roms/invaders/invaders";
+static u64 invaders_frames = 60 * 60;
+static bool invaders_fuzz = false;
+
+static void *alloc_machine(size_t size) {
+    // Machines never share a cache line, so their workers don't either.
+    void *machine = aligned_alloc(CACHE_LINE, (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+    if (!machine) {
+        fprintf(stderr, "Farm: Out of memory.\n");
+        exit(1);
+    }
+
+    return machine;
+}
+
+static bool cpm_done(CPU *cpu) {
+    return ((Cpm *)cpu)->done;
+}
+
+/**
+ * A CP/M machine as build/cpm sets it up, with the working directory as
+ * drive A:. Machines share the process, so their console output is
+ * dropped; the farm only reports how they ended.
+ */
+static CPU *cpm_new(const char *path) {
+    Cpm *machine = alloc_machine(sizeof(Cpm));
+    cpm_init(machine, 0, 0);
+    if (!cpm_mount(machine, 0, "."))
+        exit(1);
+    cpm_load(machine, path, 0, 0);
+
+    return &machine->cpu;
+}
+
+/**
+ * With -z, every machine plays its own random inputs, seeded by where it
+ * sits in the farm. The seed lives with the machine, so runs repeat.
+ */
+typedef struct {
+    Invaders machine;
+    u32 seed;
+} Player;
+
+static void invaders_input(Invaders *machine) {
+    if (!invaders_fuzz)
+        return;
+
+    Player *player = (Player *)machine;
+    u32 x = player->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    player->seed = x;
+
+    // Coin, starts, shot, left and right around the always-set bit 3.
+    machine->port1 = (x & 0x77) | 1 << 3;
+}
+
+static u64 invaders_run(CPU *cpu, u64 cycles) {
+    Invaders *machine = (Invaders *)cpu;
+    u64 start = cpu->cycles;
+    u64 instructions = 0;
+
+    while (cpu->cycles - start < cycles && machine->frames < invaders_frames) {
+        invaders_input(machine);
+        instructions += invaders_frame(machine);
+    }
+
+    return instructions;
+}
+
+static bool invaders_done(CPU *cpu) {
+    return ((Invaders *)cpu)->frames >= invaders_frames;
+}
+
+static CPU *invaders_new(u32 seed) {
+    Player *player = alloc_machine(sizeof(Player));
+    invaders_init(&player->machine, invaders_rom);
+    player->seed = seed * 2654435761u | 1;
+
+    return &player->machine.cpu;
+}
+
+static bool is_invaders(const char *program) {
+    return strcmp(program, "invaders") == 0;
+}
+
+static double seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void lockstep_slice(Farm *farm, Lanes *lanes, bool invaders) {
+    if (!invaders) {
+        lanes_run(lanes, farm->slice);
+        return;
+    }
+
+    for (u32 i = 0; i < lanes->count; i++)
+        invaders_input((Invaders *)lanes->cpus[i]);
+
+    for (u32 half = 0; half < 2; half++) {
+        u64 deadlines[LANES];
+        for (u32 i = 0; i < lanes->count; i++)
+            deadlines[i] = invaders_deadline((Invaders *)lanes->cpus[i], half);
+        lanes_run_until(lanes, deadlines);
+
+        for (u32 i = 0; i < lanes->count; i++) {
+            invaders_interrupt((Invaders *)lanes->cpus[i], half);
+            lanes->instructions[i]++;
+        }
+    }
+}
+
+/**
+ * Runs up to LANES copies of one program in lockstep. A machine leaves its
+ * group once it is done or out of cycles; the rest carry on together.
+ */
+static void lockstep_group(Farm *farm, FarmJob **group, u32 count, Lanes *totals) {
+    bool invaders = is_invaders(group[0]->name);
+
+    while (count) {
+        CPU *cpus[LANES];
+        u64 cycles[LANES];
+        for (u32 i = 0; i < count; i++) {
+            cpus[i] = group[i]->cpu;
+            cycles[i] = cpus[i]->cycles;
+        }
+
+        Lanes lanes;
+        lanes_init(&lanes, cpus, count);
+        lockstep_slice(farm, &lanes, invaders);
+
+        totals->steps  += lanes.steps;
+        totals->groups += lanes.groups;
+        totals->vector += lanes.vector;
+        totals->serial += lanes.serial;
+        totals->scalar += lanes.scalar;
+        totals->alone  += lanes.alone;
+        farm->slices++;
+
+        u32 running = 0;
+        for (u32 i = 0; i < count; i++) {
+            FarmJob *job = group[i];
+            job->instructions += lanes.instructions[i];
+            job->cycles += cpus[i]->cycles - cycles[i];
+
+            if (job->done(job->cpu))
+                job->status = FARM_DONE;
+            else if (job->max_cycles && job->cycles >= job->max_cycles)
+                job->status = FARM_CYCLES;
+            else
+                group[running++] = job;
+        }
+
+        count = running;
+    }
+}
+
+static void lockstep(Farm *farm, FarmJob *jobs, u32 count, u32 programs) {
+    Lanes totals = { 0 };
+    double start = seconds();
+
+    farm->threads = 1;
+    farm->slices = 0;
+    farm->steals = 0;
+
+    for (u32 program = 0; program < programs; program++) {
+        FarmJob *group[LANES];
+        u32 size = 0;
+
+        for (u32 i = program; i < count; i += programs) {
+            jobs[i].status = FARM_RUNNING;
+            group[size++] = &jobs[i];
+
+            if (size == LANES || i + programs >= count) {
+                double group_start = seconds();
+                lockstep_group(farm, group, size, &totals);
+
+                for (u32 j = 0; j < size; j++)
+                    group[j]->busy = seconds() - group_start;
+                size = 0;
+            }
+        }
+    }
+
+    farm->seconds = seconds() - start;
+
+    u64 instructions = totals.vector + totals.serial + totals.scalar + totals.alone;
+    double percent = instructions ? 100.0 / instructions : 0;
+    printf("Lockstep (%s, %d lanes): %llu instructions, %.1f%% vectorized, "
+            "%.1f%% serial, %.1f%% through cpu_execute, %.1f%% alone, "
+            "%.2f opcode groups per step\n",
+            lanes_isa(), LANES, (unsigned long long)instructions,
+            totals.vector * percent, totals.serial * percent, totals.scalar * percent,
+            totals.alone * percent, totals.steps ? (double)totals.groups / totals.steps : 0);
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "Usage: farm [-j threads] [-n copies] [-s slice] [-t timeout] [-c cycles]\n"
+            "            [-f frames] [-r rom] [-z] [-l] program...\n"
+            "\n"
+            "Runs `copies` of every program, each a CP/M .COM file or `invaders`.\n"
+            "-z feeds invaders random inputs, -l runs copies in lockstep on one thread.\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    Farm farm = { .threads = sysconf(_SC_NPROCESSORS_ONLN), .slice = 1000000 };
+    u32 copies = 1;
+    u64 max_cycles = 0;
+    bool lanes = false;
+
+    int option;
+    while ((option = getopt(argc, argv, "j:n:s:t:c:f:r:zl")) != -1) {
+        switch (option) {
+            case 'j': farm.threads = atoi(optarg); break;
+            case 'n': copies = atoi(optarg); break;
+            case 's': farm.slice = strtoull(optarg, 0, 10); break;
+            case 't': farm.timeout = atof(optarg); break;
+            case 'c': max_cycles = strtoull(optarg, 0, 10); break;
+            case 'f': invaders_frames = strtoull(optarg, 0, 10); break;
+            case 'r': invaders_rom = optarg; break;
+            case 'z': invaders_fuzz = true; break;
+            case 'l': lanes = true; break;
+            default: usage();
+        }
+    }
+
+    u32 programs = argc - optind;
+    if (!programs || !copies)
+        usage();
+
+    u32 count = programs * copies;
+    FarmJob *jobs = calloc(count, sizeof(FarmJob));
+    if (!jobs) {
+        fprintf(stderr, "Farm: Out of memory.\n");
+        exit(1);
+    }
+
+    for (u32 i = 0; i < count; i++) {
+        const char *program = argv[optind + i % programs];
+        FarmJob *job = &jobs[i];
+
+        job->name = program;
+        job->max_cycles = max_cycles;
+        if (is_invaders(program)) {
+            job->cpu  = invaders_new(i);
+            job->run  = invaders_run;
+            job->done = invaders_done;
+        }
+        else {
+            job->cpu  = cpm_new(program);
+            job->done = cpm_done;
+        }
+    }
+
+    if (lanes)
+        lockstep(&farm, jobs, count, programs);
+    else
+        farm_run(&farm, jobs, count);
+    farm_report(&farm, jobs, count, stdout);
+
+    int failed = 0;
+    for (u32 i = 0; i < count; i++) {
+        FarmJob *job = &jobs[i];
+        if (job->status != FARM_DONE)
+            failed++;
+
+        // A machine stuck in a callback is still in use by its worker.
+        if (job->abandoned)
+            continue;
+
+        if (is_invaders(job->name))
+            cpu_free(job->cpu);
+        else
+            cpm_free((Cpm *)job->cpu);
+        free(job->cpu);
+    }
+
+    free(jobs);
+
+    return failed != 0;
+}
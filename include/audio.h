@@ -0,0 +1,10 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include "types.h"
+#include "sound.h"
+
+bool audio_init(Sound *sound, const char *samples, u32 buffer);
+void audio_quit(void);
+
+#endif
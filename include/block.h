@@ -0,0 +1,75 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include "types.h"
+
+#define BLOCK_MAX_OPS   32
+#define BLOCK_MAX_BYTES (BLOCK_MAX_OPS * 3)
+
+/**
+ * A pre-decoded instruction. Register operands are implied by the opcode and
+ * resolved by its handler; immediates are read once at decode time.
+ */
+struct MicroOp {
+    u8  opcode;
+    u16 imm;
+    u16 next; // Address of the following instruction.
+};
+
+/**
+ * A straight-line run of instructions. Only the last instruction of a block
+ * may transfer control or call out of the CPU.
+ */
+struct Block {
+    u16 start;
+    u32 end; // One past the last byte.
+    u32 cycles;
+    u8  count;
+    bool valid;
+
+    u32 hits;
+    void *native; // Translated code, if any.
+
+    Block *retired;
+
+    MicroOp ops[];
+};
+
+struct BlockCache {
+    Block *blocks[0x10000]; // Indexed by start address.
+
+    // Number of blocks covering each byte, saturating at 255. Code pages
+    // also hold data, so a per-byte filter keeps data writes from scanning
+    // for blocks to invalidate.
+    u8 code[0x10000];
+
+    Block *retired;         // Invalidated blocks that may still be running.
+
+    u64 decoded;
+    u64 invalidated;
+};
+
+BlockCache *block_cache_new(void);
+void block_cache_free(BlockCache *cache);
+
+Block *block_decode(CPU *cpu, u16 pc);
+void block_invalidate(BlockCache *cache, u16 addr);
+void block_free_retired(BlockCache *cache);
+
+// The block at `pc`, decoded on a miss.
+static inline Block *block_fetch(CPU *cpu, BlockCache *cache, u16 pc) {
+    Block *block = cache->blocks[pc];
+    return block ? block : block_decode(cpu, pc);
+}
+
+// Frees invalidated blocks, once none of them can be running.
+static inline void block_collect(BlockCache *cache) {
+    if (cache->retired)
+        block_free_retired(cache);
+}
+
+static inline bool block_is_code(BlockCache *cache, u16 addr) {
+    return cache->code[addr] != 0;
+}
+
+#endif
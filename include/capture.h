@@ -0,0 +1,68 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "types.h"
+#include "framebuffer.h"
+
+// Frames that can wait for the writer, half a second of video.
+#define CAPTURE_QUEUE 32
+
+typedef enum {
+    CAPTURE_Y4M,     // 8-bit greyscale YUV4MPEG2, playable as is.
+    CAPTURE_PACKED,  // 1 bit per pixel, delta and run-length coded.
+} CaptureFormat;
+
+typedef struct CaptureFrame {
+    u64 number;
+    u8 vram[FRAMEBUFFER_BYTES];
+} CaptureFrame;
+
+/**
+ * Video capture off the emulation thread. capture_frame copies the 1 bpp
+ * video memory into a ring that a writer thread drains to the file; the
+ * emulation never waits on it. A frame that finds the ring full is dropped
+ * and counted. The writer repeats the last frame over gaps in the frame
+ * numbers, so video stays at 60 frames per second through drops.
+ *
+ * The ring has one producer and one consumer: `head` is only stored by the
+ * emulation thread and `tail` only by the writer.
+ */
+typedef struct Capture {
+    File *file;
+    CaptureFormat format;
+
+    CaptureFrame *frames;
+    atomic_uint head;
+    atomic_uint tail;
+
+    sem_t ready; // Posted once per queued frame, and once more to close.
+    atomic_bool closing;
+    pthread_t writer;
+
+    // Writer state: the last frame written and its number, and the
+    // buffers that turn video memory into greyscale.
+    u8 last[FRAMEBUFFER_BYTES];
+    u64 last_number;
+    Framebuffer framebuffer;
+    u32 *pixels;
+    u8 *luma;
+
+    // Numbers of the first and the latest frame offered, queued or not.
+    u64 first;
+    u64 latest;
+
+    u64 dropped;
+    u64 written;
+} Capture;
+
+Capture *capture_open(const char *path, CaptureFormat format);
+void capture_frame(Capture *capture, const u8 *vram, u64 number);
+void capture_close(Capture *capture);
+
+bool capture_convert(File *packed, File *y4m);
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef CPM_H
+#define CPM_H
+
+#include <stddef.h>
+
+#include "types.h"
+#include "cpu.h"
+
+#define CPM_DRIVES  16
+#define CPM_CONSOLE 0x10000
+#define CPM_RECORD  128
+
+/**
+ * Where the system lives at the top of memory. BDOS calls at 0x0005 jump to
+ * CPM_BDOS + 6, which traps to CPM_BDOS_PORT, and the BIOS jump table at
+ * CPM_BIOS has one entry per function, each trapping to CPM_BIOS_PORT plus
+ * its number. Programs find the top of their memory at 0x0006, as usual.
+ */
+#define CPM_BDOS      0xfb00
+#define CPM_BIOS      0xfe00
+#define CPM_BDOS_PORT 0x01
+#define CPM_BIOS_PORT 0x10
+
+/**
+ * IBM 3740 8" single density, the format CP/M 2.2 is distributed on: 77
+ * tracks of 26 sectors, 2 of them reserved for the system, 1 KiB blocks
+ * and 64 directory entries.
+ */
+#define CPM_IMAGE_TRACKS   77
+#define CPM_IMAGE_SECTORS  26
+#define CPM_IMAGE_RESERVED 2
+#define CPM_IMAGE_BLOCKS   243
+#define CPM_IMAGE_ENTRIES  64
+#define CPM_IMAGE_SIZE     (CPM_IMAGE_TRACKS * CPM_IMAGE_SECTORS * CPM_RECORD)
+
+typedef enum {
+    CPM_NONE,
+    CPM_DIRECTORY, // Files of a host directory, named like 8.3 CP/M files.
+    CPM_IMAGE,     // A disk image, mapped into memory.
+} CpmDriveKind;
+
+typedef struct CpmDrive {
+    CpmDriveKind kind;
+    char *path;
+    u8 *image;
+} CpmDrive;
+
+/**
+ * A host file kept open between BDOS calls, since programs need not close
+ * the files they only read.
+ */
+typedef struct CpmOpen {
+    File *file;
+    u8 drive;
+    u8 name[11];
+    u64 used;
+} CpmOpen;
+
+#define CPM_OPEN 8
+
+/**
+ * A CP/M 2.2 machine: a CPU with the BDOS and BIOS implemented on the host.
+ * Drives are host directories or disk images. Console output is gathered
+ * in `console` and written to `output` when it fills, when the program
+ * waits for input and when it ends; a null `output` discards it.
+ *
+ * The CPU comes first, so the I/O callbacks can cast back to the machine.
+ * Everything before `output` is the machine's state, and CPM_STATE bytes
+ * of it are what snapshots keep.
+ */
+typedef struct Cpm {
+    CPU cpu;
+    bool done;
+
+    u8 drive; // Current drive, 0 for A:.
+    u8 user;
+    u8 iobyte;
+    u16 dma;
+
+    // Raw sector access through the BIOS.
+    u8 bios_drive;
+    u16 track;
+    u16 sector;
+    u16 bios_dma;
+
+    File *output;
+    File *input;
+    char console[CPM_CONSOLE];
+    u32 length;
+    bool exhausted;
+
+    CpmDrive drives[CPM_DRIVES];
+    CpmOpen open[CPM_OPEN];
+    u64 opened;
+
+    // Directory entries left for Search Next.
+    u8 (*found)[32];
+    u32 found_count;
+    u32 found_next;
+} Cpm;
+
+#define CPM_STATE offsetof(Cpm, output)
+
+void cpm_init(Cpm *cpm, File *output, File *input);
+void cpm_free(Cpm *cpm);
+bool cpm_mount(Cpm *cpm, u8 drive, const char *path);
+void cpm_load(Cpm *cpm, const char *path, int argc, char **argv);
+void cpm_flush(Cpm *cpm);
+
+#endif
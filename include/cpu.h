@@ -2,7 +2,9 @@
 #define CPU_H
 
 #include <stdbool.h>
+#include <stdatomic.h>
 #include "types.h"
+#include "memory.h"
 
 struct Registers {
     union {
@@ -32,17 +34,25 @@ struct Registers {
     u8 a;
 };
 
-struct Flags {
-    bool sign      : 1;
-    bool zero      : 1;
-    bool aux_carry : 1;
-    bool parity    : 1;
-    bool carry     : 1;
-};
+/**
+ * Flags are kept packed in their PSW layout:
+ *
+ *   7   6   5   4   3   2   1   0
+ *   S   Z   0   AC  0   P   1   C
+ */
+#define FLAG_CARRY     0x01
+#define FLAG_PARITY    0x04
+#define FLAG_AUX_CARRY 0x10
+#define FLAG_ZERO      0x40
+#define FLAG_SIGN      0x80
 
 struct CPU {
     Registers regs;
-    Flags flags;
+    u8 flags;
+
+    // With CPU_LAZY_FLAGS, 0x100 | result of the last operation whose
+    // Z, S and P flags have not been folded into `flags` yet.
+    u16 lazy;
 
     union {
         u16 sp;
@@ -63,18 +73,100 @@ struct CPU {
     bool interrupts_enabled;
     u8 interrupt_vector;
 
+    bool stop;
+
     u64 cycles;
 
+    // Backing store of the default all-RAM map, and the page table every
+    // access goes through.
     u8 *memory;
+    MemoryMap *map;
+
+    // Pages shared with snapshots, null until the first cpu_snapshot.
+    PageSet *pages;
+
+    // Decoded and translated code, only used by the block and JIT engines.
+    BlockCache *blocks;
+    Jit *jit;
+
+    // Set while a debugger has something to stop at: cpu_run then leaves
+    // the run to it.
+    Debugger *debugger;
 
+#ifdef CPU_TRACE
+    // Where every instruction is recorded, null when not tracing.
+    Trace *trace;
+#endif
+
+#ifdef CPU_PROFILE
+    // What every instruction is counted into, null when not profiling.
+    Profile *profile;
+#endif
+
+    // Called with the CPU passed to cpu_run or cpu_execute, so a machine that
+    // embeds its CPU as the first member can recover itself with a cast.
     void (*in)(CPU *cpu, u8 port); 
     void (*out)(CPU *cpu, u8 port);
 };
 
+/**
+ * A page of `memory` as it was when a snapshot was taken. Snapshots taken
+ * while a page is not written share it.
+ */
+struct Page {
+    atomic_uint refs;
+    u8 data[PAGE_SIZE];
+};
+
+/**
+ * What `memory` held at the last snapshot or restore, and which of its
+ * pages have been written since. Until one is, a RAM page is mapped
+ * write-protected: its first write goes through the I/O path, which sets
+ * its dirty bit and maps it writable again.
+ */
+struct PageSet {
+    Page *pages[PAGES];
+    u64 dirty;
+
+    u8 *memory;
+    MemoryMap *map;
+};
+
+// Format of snapshot_write, and the register bytes it writes.
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_REGISTERS 15
+
+/**
+ * Saved state of a machine: its CPU, the pages of `memory`, and the `size`
+ * bytes that follow the CPU in the machine struct that embeds it.
+ */
+struct Snapshot {
+    CPU cpu;
+    Page *pages[PAGES];
+
+    u32 size;
+    u8 device[];
+};
+
+extern const u8 CYCLES[256];
+
 void cpu_init(CPU *cpu, void (*in)(CPU *cpu, u8 port), void (*out)(CPU *cpu, u8 port));
+void cpu_free(CPU *cpu);
 void cpu_reset(CPU *cpu);
+Snapshot *cpu_snapshot(CPU *cpu, u32 machine_size);
+void cpu_restore(CPU *cpu, const Snapshot *snapshot);
+void snapshot_free(Snapshot *snapshot);
+void snapshot_write(const Snapshot *snapshot, const Snapshot *previous, File *file);
+Snapshot *snapshot_read(File *file, const Snapshot *previous, u32 machine_size);
 void cpu_execute(CPU *cpu, u8 opcode);
+void cpu_interrupt(CPU *cpu, u8 vector);
 void cpu_step(CPU *cpu);
+u64 cpu_run(CPU *cpu, u64 cycles);
+void cpu_stop(CPU *cpu);
+const char *cpu_engine(void);
+
+// The flags as pushed by PUSH PSW, minus the always-set bit 1.
+u8 cpu_flags(CPU *cpu);
 
 u8 read_byte(CPU *cpu, u16 addr);
 void write_byte(CPU *cpu, u16 addr, u8 value);
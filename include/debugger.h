@@ -0,0 +1,92 @@
+#ifndef DEBUGGER_H
+#define DEBUGGER_H
+
+#include "types.h"
+#include "cpu.h"
+
+// Breakpoints, watchpoints and conditions a debugger can hold at once.
+#define DEBUG_POINTS 64
+
+// What a point stops on. Conditions on their own have no kind.
+#define DEBUG_EXECUTE 0x01
+#define DEBUG_READ    0x02
+#define DEBUG_WRITE   0x04
+#define DEBUG_IN      0x08
+#define DEBUG_OUT     0x10
+
+typedef enum {
+    DEBUG_A, DEBUG_B, DEBUG_C, DEBUG_D, DEBUG_E, DEBUG_H, DEBUG_L, DEBUG_F,
+    DEBUG_BC, DEBUG_DE, DEBUG_HL, DEBUG_SP, DEBUG_PC,
+} DebugRegister;
+
+typedef enum {
+    DEBUG_EQUAL, DEBUG_NOT_EQUAL, DEBUG_LESS, DEBUG_LESS_EQUAL,
+    DEBUG_GREATER, DEBUG_GREATER_EQUAL, DEBUG_AND,
+} DebugOperator;
+
+// `reg op value`, where `&` holds if any of the bits in `value` are set.
+typedef struct DebugCondition {
+    bool used;
+    DebugRegister reg;
+    DebugOperator op;
+    u16 value;
+} DebugCondition;
+
+/**
+ * A breakpoint at `start`, a watchpoint on the addresses or ports from
+ * `start` to `end`, or, with no kind, a condition that stops the CPU when
+ * it becomes true. Breakpoints and watchpoints with a condition only stop
+ * it while the condition holds.
+ */
+struct DebugPoint {
+    u32 id;
+    u8 kind;
+    u16 start;
+    u16 end;
+    DebugCondition condition;
+    bool held; // Whether a lone condition held before the last instruction.
+    u64 hits;
+};
+
+/**
+ * Stops a CPU at its points and hands it to a command console on `in` and
+ * `out`. The CPU only points at its debugger while it has a point to check
+ * or is being stepped: cpu_run then runs the debugger's loop, which steps
+ * one instruction at a time, instead of its own.
+ *
+ * Watchpoints are found by decoding the memory and port accesses of each
+ * instruction before it runs; a flag per page and per port spares the
+ * decoding of instructions that touch nothing watched.
+ */
+struct Debugger {
+    CPU *cpu;
+    File *in;
+    File *out;
+
+    DebugPoint points[DEBUG_POINTS];
+    u32 count;
+    u32 next_id;
+
+    // Filters rebuilt from the points whenever they change.
+    u8 code[0x10000]; // Breakpoints at each address.
+    u8 pages[PAGES];  // DEBUG_READ and DEBUG_WRITE of each page.
+    u8 ports[256];    // DEBUG_IN and DEBUG_OUT of each port.
+    u8 watched;       // Every kind some point watches.
+    u32 conditions;   // Points with no kind.
+
+    u64 steps;   // Instructions to run before stopping, 0 if not stepping.
+    bool paused; // Stop before the next instruction.
+    bool resume; // Skip the breakpoints of the next instruction.
+    u16 listed;  // Where the next `u` goes on from.
+};
+
+Debugger *debugger_new(CPU *cpu, File *in, File *out);
+void debugger_free(Debugger *debugger);
+u32 debugger_break(Debugger *debugger, u16 addr, const DebugCondition *condition);
+u32 debugger_watch(Debugger *debugger, u8 kind, u16 start, u16 end, const DebugCondition *condition);
+u32 debugger_when(Debugger *debugger, const DebugCondition *condition);
+bool debugger_delete(Debugger *debugger, u32 id);
+void debugger_pause(Debugger *debugger);
+u64 debugger_run(Debugger *debugger, u64 cycles);
+
+#endif
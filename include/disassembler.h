@@ -1,6 +1,68 @@
 #ifndef DIS_H
 #define DIS_H
 
-void disassemble_opcode(CPU *cpu, u8 opcode);
+#include "types.h"
+
+typedef enum {
+    DIS_NEXT,    // Falls through to the next instruction.
+    DIS_BRANCH,  // Conditional jump: to the target or the next instruction.
+    DIS_CALL,    // CALL, conditional calls and RST: the target, then the next one.
+    DIS_JUMP,    // JMP: the target only.
+    DIS_RETURN,  // RET and PCHL: nowhere that can be known without running.
+    DIS_INVALID, // An opcode the CPU does not implement.
+} DisFlow;
+
+typedef enum {
+    OPERAND_NONE,
+    OPERAND_BYTE, // Immediate byte or port.
+    OPERAND_WORD, // Immediate word (LXI).
+    OPERAND_DATA, // Address of data (LDA, STA, LHLD, SHLD).
+    OPERAND_ADDR, // Address of code (jumps and calls).
+} DisOperand;
+
+struct Instruction {
+    u16 addr;
+    u8 opcode;
+    u8 length; // 0 when the instruction runs past the end of the buffer.
+    u16 operand;
+    u16 target; // Where a jump, call or RST goes.
+    DisOperand kind;
+    DisFlow flow;
+    const char *mnemonic; // Up to the operand, e.g. "MVI A,".
+};
+
+// Longest formatted instruction, with its terminator: "LXI SP,loc_0000".
+#define DIS_TEXT 24
+
+// Flags a code map keeps for each address.
+#define DIS_CODE   0x01 // First byte of an instruction.
+#define DIS_BODY   0x02 // Operand byte of an instruction.
+#define DIS_JUMPED 0x04 // Target of a jump.
+#define DIS_CALLED 0x08 // Target of a call or RST.
+#define DIS_ENTRY  0x10 // Where discovery started.
+#define DIS_DATA   0x20 // Loaded or stored by LDA, STA, LHLD or SHLD.
+
+/**
+ * What is code and what is data in `size` bytes of `memory` loaded at
+ * `base`, found by following every jump and call from the entry points.
+ * Bytes never reached are data. Jumps through PCHL cannot be followed, so
+ * the tables they go through need their targets given as entry points.
+ */
+struct CodeMap {
+    const u8 *memory;
+    u32 size;
+    u16 base;
+    u32 instructions;
+    u8 flags[0x10000];
+    u16 pending[0x10000];
+};
+
+u8 disassemble(const u8 *memory, u32 size, u16 base, u16 addr, Instruction *instruction);
+u32 disassemble_format(const Instruction *instruction, const CodeMap *map, char *out);
+
+void code_map_init(CodeMap *map, const u8 *memory, u32 size, u16 base);
+void code_map_discover(CodeMap *map, u16 entry);
+void code_map_discover_vectors(CodeMap *map);
+u32 code_map_listing(const CodeMap *map, char *out, u32 capacity);
 
 #endif
@@ -0,0 +1,55 @@
+#ifndef FARM_H
+#define FARM_H
+
+#include "types.h"
+#include "cpu.h"
+
+typedef enum {
+    FARM_RUNNING,
+    FARM_DONE,    // The stop condition was met.
+    FARM_CYCLES,  // The cycle budget ran out first.
+    FARM_STUCK,   // The watchdog gave up on the machine.
+} FarmStatus;
+
+/**
+ * One machine to run. The farm only sees its CPU; the stop condition gets
+ * the same pointer and can cast it back to the machine that embeds it.
+ */
+struct FarmJob {
+    const char *name;
+    CPU *cpu;
+
+    // Checked after every slice.
+    bool (*done)(CPU *cpu);
+
+    // Advances the machine by about `cycles`, cpu_run if null. Machines
+    // that need interrupts or frame timing bring their own.
+    u64 (*run)(CPU *cpu, u64 cycles);
+
+    // Cycles after which the machine is abandoned, 0 for no limit.
+    u64 max_cycles;
+
+    // Filled in by farm_run.
+    FarmStatus status;
+    bool abandoned; // Stuck in a callback: its worker still holds the machine.
+    u64 instructions;
+    u64 cycles;
+    double busy; // Seconds spent running slices.
+};
+
+struct Farm {
+    u32 threads;
+    u64 slice;      // Cycles a machine runs before its worker moves on.
+    double timeout; // Busy seconds, or seconds in one I/O callback, after
+                    // which a machine is stuck, 0 for none.
+
+    // Filled in by farm_run.
+    double seconds;
+    u64 slices;
+    u64 steals;
+};
+
+void farm_run(Farm *farm, FarmJob *jobs, u32 count);
+void farm_report(const Farm *farm, const FarmJob *jobs, u32 count, File *file);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "types.h"
+
+// The screen is the 256x224 raster turned 90 degrees counterclockwise.
+#define FRAMEBUFFER_WIDTH  224
+#define FRAMEBUFFER_HEIGHT 256
+
+// Offset of video RAM in the address space, and its size.
+#define FRAMEBUFFER_VRAM   0x2400
+#define FRAMEBUFFER_BYTES  (FRAMEBUFFER_WIDTH * 32)
+
+/**
+ * Converts 1 bit per pixel video RAM into 32-bit pixels. `expand` maps a
+ * byte to its 8 pixels; it is built once per pair of colours.
+ */
+typedef struct Framebuffer {
+    u32 expand[256][8];
+} Framebuffer;
+
+void framebuffer_init(Framebuffer *framebuffer, u32 on, u32 off);
+void framebuffer_convert(const Framebuffer *framebuffer, const u8 *vram,
+        u32 *pixels, u32 pitch, u32 first, u32 last);
+void framebuffer_convert_lines(const Framebuffer *framebuffer, const u8 *vram,
+        u32 *pixels, u32 pitch, u32 first, u32 last, u32 begin, u32 end);
+
+#endif
@@ -1,9 +1,34 @@
 #ifndef INPUT_H
 #define INPUT_H
 
+#include <stdatomic.h>
+
 #include "types.h"
 
-void keyboard_init(void);
-u8 port1();
+// Port 1 bit 3 is always set.
+#define INPUT_IDLE (1 << 3)
+
+/**
+ * Input ports 1 and 2 as the keyboard last set them. input_poll handles the
+ * SDL events on the thread that owns the window and publishes both ports in
+ * `latched`, in the low 16 bits, with the monotonic time of the change in
+ * microseconds above them. The emulation latches a frame's input with a
+ * single load, and knows how long the change waited for it.
+ */
+typedef struct Input {
+    atomic_ullong latched;
+    u8 ports[2];
+} Input;
+
+static inline u8 input_port(u64 latched, u8 port) {
+    return latched >> 8 * (port - 1);
+}
+
+static inline u64 input_time(u64 latched) {
+    return latched >> 16;
+}
+
+void input_init(Input *input);
+bool input_poll(Input *input);
 
 #endif
@@ -0,0 +1,55 @@
+#ifndef INVADERS_H
+#define INVADERS_H
+
+#include <stddef.h>
+
+#include "cpu.h"
+#include "shift.h"
+#include "sound.h"
+
+/**
+ * A Space Invaders board without its frontend. Everything the I/O callbacks
+ * touch lives here, so any number of machines can run side by side.
+ */
+typedef struct Invaders {
+    CPU cpu; // First, so that the I/O callbacks can cast back to the machine.
+    Shift shift;
+
+    // Input ports 1 and 2, latched by the frontend before each frame.
+    u8 port1;
+    u8 port2;
+
+    u64 frames;
+    // The CPU cycle the current frame started at. The halves end at fixed
+    // offsets from it, so cycles run past one deadline come off the next.
+    u64 frame_start;
+
+    // Byte columns of video memory written since the frontend last drew
+    // them, for raster lines 0 to 111 and 112 to 223. Column c is screen
+    // rows 248 - 8c to 255 - 8c.
+    u32 vram_dirty[2];
+
+    // Host side, not part of snapshots: where port 3 and 5 writes go, if
+    // anywhere.
+    Sound *sound;
+} Invaders;
+
+// Bytes of the machine that snapshots and recordings keep.
+#define INVADERS_STATE offsetof(Invaders, sound)
+
+// Cycles between the mid-screen and end-of-screen interrupts.
+#define INVADERS_HALF_FRAME 16667 // (2MHz / 60s) / 2
+
+// Raster lines scanned out between them.
+#define INVADERS_HALF_LINES 112
+
+void invaders_init(Invaders *machine, const char *rom);
+void invaders_free(Invaders *machine);
+u64 invaders_frame(Invaders *machine);
+u64 invaders_half_frame(Invaders *machine, u32 half);
+u64 invaders_deadline(const Invaders *machine, u32 half);
+void invaders_interrupt(Invaders *machine, u32 half);
+bool invaders_playing(Invaders *machine);
+u32 invaders_vram_dirty(Invaders *machine, u32 half);
+
+#endif
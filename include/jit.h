@@ -0,0 +1,39 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "types.h"
+
+// Executions of a block before it is translated.
+#define JIT_THRESHOLD 8
+
+#define JIT_BUFFER_SIZE (4 << 20)
+
+/**
+ * Translated block: runs the whole block and returns the number of
+ * instructions it executed.
+ */
+typedef u32 (*JitBlock)(CPU *cpu);
+
+/**
+ * Opcode handler called from translated code. `imm` is the immediate
+ * operand, or the opcode itself for jit_invalid.
+ */
+typedef void (*JitOp)(CPU *cpu, u16 imm);
+
+extern const JitOp JIT_OPS[256];
+void jit_invalid(CPU *cpu, u16 opcode);
+
+struct Jit {
+    u8 *code;
+    u32 used;
+
+    u64 translated;
+    u64 flushes;
+};
+
+Jit *jit_new(void);
+void jit_free(Jit *jit);
+
+bool jit_translate(Jit *jit, BlockCache *cache, Block *block);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef LANES_H
+#define LANES_H
+
+#include "types.h"
+#include "cpu.h"
+
+#define LANES 16
+
+/**
+ * Up to LANES machines executed in lockstep. Registers, flags, PC, SP and
+ * cycles live in lane arrays for the length of lanes_run; everything else
+ * (memory, I/O callbacks and interrupts) stays in each lane's CPU.
+ */
+struct Lanes {
+    u8 a[LANES];
+    u8 flags[LANES];
+    u8 b[LANES];
+    u8 c[LANES];
+    u8 d[LANES];
+    u8 e[LANES];
+    u8 h[LANES];
+    u8 l[LANES];
+
+    u16 pc[LANES];
+    u16 sp[LANES];
+    u64 cycles[LANES];
+
+    CPU *cpus[LANES];
+    MemoryMap *maps[LANES];
+    u32 count;
+
+    u64 instructions[LANES];
+
+    // The era in which every running lane was found to hold the same byte
+    // at an address, so that lanes at one PC fetch their code once.
+    u8 same[0x10000];
+    u8 era;
+    // The pages with bytes stamped in this era, one bit per page.
+    u64 stamped;
+
+    // How instructions ran: `groups` counts the distinct opcodes executed
+    // per step, so groups == steps means no divergence. `vector` ran on a
+    // whole group at once, `serial` lane by lane on the lane arrays,
+    // `scalar` through cpu_execute and `alone` through cpu_run, once the
+    // lane had gone apart from the others.
+    u64 steps;
+    u64 groups;
+    u64 vector;
+    u64 serial;
+    u64 scalar;
+    u64 alone;
+};
+
+void lanes_init(Lanes *lanes, CPU **cpus, u32 count);
+u64 lanes_run(Lanes *lanes, u64 cycles);
+u64 lanes_run_until(Lanes *lanes, const u64 *deadlines);
+const char *lanes_isa(void);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include "types.h"
+
+#define PAGE_SIZE 0x400
+#define PAGES     (0x10000 / PAGE_SIZE)
+
+typedef u8   (*MemoryRead)(void *context, u16 addr);
+typedef void (*MemoryWrite)(void *context, u16 addr, u8 value);
+
+struct MemoryIO {
+    MemoryRead  read;
+    MemoryWrite write;
+    void *context;
+};
+
+/**
+ * Page table of the 64 KiB address space. RAM and ROM pages point straight
+ * into their backing store, so accessing them is a single indexed load or
+ * store. Pages with a null pointer are memory-mapped I/O and go through
+ * their handlers. Writes to ROM land in a scratch page and are lost.
+ * Watched RAM has a read pointer but no write pointer: only its writes
+ * go through a handler.
+ *
+ * Opcode fetches use their own table, which is never null: fetching from an
+ * I/O page reads open bus instead of calling the handler, and the dispatch
+ * loop is spared the check.
+ */
+struct MemoryMap {
+    u8 *read[PAGES];
+    u8 *write[PAGES];
+    const u8 *fetch[PAGES];
+
+    MemoryIO io[PAGES];
+
+    // Per page, the other pages that fetch bytes its writes store into,
+    // such as mirrors of it, one bit each.
+    u64 aliases[PAGES];
+
+    // Target of every write to a ROM page. Kept per map so that machines
+    // running on different threads never share a written page.
+    u8 discard[PAGE_SIZE];
+};
+
+MemoryMap *memory_map_new(u8 *ram);
+void memory_map_free(MemoryMap *map);
+
+void memory_map_ram(MemoryMap *map, u16 start, u32 size, u8 *base);
+void memory_map_rom(MemoryMap *map, u16 start, u32 size, u8 *base);
+void memory_map_mirror(MemoryMap *map, u16 start, u32 size, u16 source, u32 source_size);
+void memory_map_watch(MemoryMap *map, u16 start, u32 size, u8 *base,
+        MemoryWrite write, void *context);
+void memory_map_io(MemoryMap *map, u16 start, u32 size,
+        MemoryRead read, MemoryWrite write, void *context);
+
+u8 memory_read_io(MemoryMap *map, u16 addr);
+void memory_write_io(MemoryMap *map, u16 addr, u8 value);
+
+#endif
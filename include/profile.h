@@ -0,0 +1,128 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "types.h"
+#include "cpu.h"
+
+// Calls deeper than this are charged to the deepest frame kept.
+#define PROFILE_DEPTH 256
+
+// Capacity of the call tree and of the table of call arcs.
+#define PROFILE_NODES (1 << 16)
+#define PROFILE_ARCS  (1 << 14)
+
+// What an opcode does to the call stack, if it is taken.
+#define PROFILE_CALL   1
+#define PROFILE_RETURN 2
+
+extern const u8 PROFILE_FLOW[256];
+
+/**
+ * A function in one calling context: the node of its caller and its entry
+ * point. The root has no parent.
+ */
+typedef struct ProfileNode {
+    u32 parent;
+    u16 function;
+    bool used;
+    u64 cycles; // Spent in the function itself.
+} ProfileNode;
+
+// Calls from one site in `caller` to `callee`, with their inclusive cost.
+typedef struct ProfileArc {
+    u16 caller;
+    u16 site;
+    u16 callee;
+    bool used;
+    u64 calls;
+    u64 instructions;
+    u64 cycles;
+} ProfileArc;
+
+typedef struct ProfileFrame {
+    u16 function;
+    u16 sp; // Right after the call pushed its return address.
+    u32 caller; // Node to go back to.
+    u32 arc;
+    u64 instructions;
+    u64 cycles;
+} ProfileFrame;
+
+#define PROFILE_NONE 0xffffffffu
+
+/**
+ * Executions and cycles of every PC, and the emulated call graph. Calls
+ * and returns are told apart from jumps by the stack: a CALL, RST or
+ * interrupt that pushed a word enters a function, and a RET that popped
+ * one leaves every frame pushed below the new SP, so code that drops its
+ * return address does not leave the stack out of step for long.
+ */
+struct Profile {
+    u64 count[0x10000];
+    u64 cycles[0x10000];
+    u16 owner[0x10000]; // Function each PC last ran in.
+    u64 instructions;
+
+    // The instruction before the one being recorded.
+    u16 last_pc;
+    u16 last_sp;
+    u8 last_flow;
+    u64 last_cycles;
+
+    u16 root;
+    u16 function;
+    u32 node;
+    ProfileFrame stack[PROFILE_DEPTH];
+    u32 depth;
+    u64 lost; // Calls not kept for lack of room.
+
+    ProfileNode *nodes;
+    ProfileArc *arcs;
+    u32 node_count;
+    u32 arc_count;
+
+    char *labels[0x10000];
+};
+
+void profile_flow(Profile *profile, u16 sp, u16 pc, u64 cycles);
+
+/**
+ * Counts the instruction about to run at `pc`, at cycle `cycles`, and
+ * charges the cycles since the last one to it. The CPU engines call it
+ * only when built with CPU_PROFILE and a profile is attached.
+ */
+static inline void profile_step(Profile *profile, const CPU *cpu, u16 pc, u8 opcode,
+                                u64 cycles, bool interrupt) {
+    u64 spent = cycles - profile->last_cycles;
+    profile->cycles[profile->last_pc] += spent;
+    profile->nodes[profile->node].cycles += spent;
+
+    if (profile->last_flow)
+        profile_flow(profile, cpu->sp, pc, cycles);
+
+    // An interrupt is no execution of the instruction it comes before; its
+    // RST is charged to the handler.
+    if (interrupt) {
+        profile->last_pc = opcode & 0x38;
+        profile->last_flow = PROFILE_CALL;
+    }
+    else {
+        profile->count[pc]++;
+        profile->owner[pc] = profile->function;
+        profile->instructions++;
+        profile->last_pc = pc;
+        profile->last_flow = PROFILE_FLOW[opcode];
+    }
+
+    profile->last_sp = cpu->sp;
+    profile->last_cycles = cycles;
+}
+
+Profile *profile_new(void);
+void profile_free(Profile *profile);
+bool profile_labels(Profile *profile, const char *path);
+bool profile_attach(Profile *profile, CPU *cpu);
+void profile_detach(CPU *cpu);
+bool profile_write(Profile *profile, const char *prefix, const char *command);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "types.h"
+#include "cpu.h"
+
+// Default keyframe interval, 10 s of a 2 MHz machine.
+#define REPLAY_INTERVAL 20000000
+
+/**
+ * A value latched into an input port at `cycles`.
+ */
+struct ReplayEvent {
+    u64 cycles;
+    u8 port;
+    u8 value;
+};
+
+/**
+ * An input recording. The file holds every change of an input port against
+ * the CPU's cycle count, and a snapshot of the machine every `interval`
+ * cycles to seek from. Snapshots only store the pages that changed since
+ * the one before.
+ *
+ * The machine has to latch its inputs between calls to cpu_run, where the
+ * frontend can log them or take them from the recording; a replay is then
+ * exact. Keyframes are taken in replay_sync, which the frontend calls at
+ * the same points, usually once per frame.
+ */
+struct Replay {
+    File *file;
+    bool recording;
+
+    u32 machine_size;
+    u64 interval;
+    u64 next_keyframe;
+
+    ReplayEvent *events;
+    u32 count;
+    u32 capacity;
+    u32 cursor; // Next event to play back.
+
+    Snapshot **keyframes;
+    u32 keyframe_count;
+    u32 keyframe_capacity;
+
+    // Last value logged for each port, with bit 8 set once there is one.
+    u16 ports[256];
+    u64 last_cycles;
+
+    // Cycle count at the last replay_sync while recording.
+    u64 end;
+};
+
+Replay *replay_record(const char *path, CPU *cpu, u32 machine_size, u64 interval);
+Replay *replay_open(const char *path, u32 machine_size);
+void replay_close(Replay *replay);
+
+void replay_input(Replay *replay, CPU *cpu, u8 port, u8 value);
+bool replay_next(Replay *replay, CPU *cpu, ReplayEvent *event);
+void replay_sync(Replay *replay, CPU *cpu);
+u64 replay_seek(Replay *replay, CPU *cpu, u64 cycles);
+u64 replay_length(Replay *replay);
+
+#endif
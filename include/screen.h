@@ -3,8 +3,8 @@
 
 void screen_init(void);
 void screen_draw(u8 *memory);
-void screen_draw_bottom(u8 *memory);
-void screen_draw_top(u8 *memory);
+void screen_update(u8 *memory, u32 begin, u32 end, u32 dirty);
+void screen_present(void);
 void screen_quit(void);
 
 #endif
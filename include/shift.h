@@ -3,8 +3,13 @@
 
 #include "types.h"
 
-void shift_write(u8 value);
-void shift_offset(u8 value);
-u8 shift_read(void);
+typedef struct Shift {
+    u16 reg;
+    u8  offset;
+} Shift;
+
+void shift_write(Shift *shift, u8 value);
+void shift_offset(Shift *shift, u8 value);
+u8 shift_read(const Shift *shift);
 
 #endif
@@ -0,0 +1,81 @@
+#ifndef SOUND_H
+#define SOUND_H
+
+#include <stdatomic.h>
+
+#include "types.h"
+
+#define SOUND_RATE  44100
+#define SOUND_CLOCK 2000000
+
+/**
+ * The samples of the board, numbered like the usual sample set (0.wav to
+ * 9.wav). Port 3 bits 0 to 4 are the UFO, which loops while its bit is
+ * set, shot, player death, invader death and extra life; port 5 bits 0 to
+ * 4 are the four fleet steps and the UFO hit.
+ */
+enum {
+    SOUND_UFO,
+    SOUND_SHOT,
+    SOUND_PLAYER_DIE,
+    SOUND_INVADER_DIE,
+    SOUND_FLEET_1,
+    SOUND_FLEET_2,
+    SOUND_FLEET_3,
+    SOUND_FLEET_4,
+    SOUND_UFO_HIT,
+    SOUND_EXTRA_LIFE,
+    SOUND_COUNT,
+};
+
+typedef struct SoundSample {
+    i16 *data;
+    u32 length;
+} SoundSample;
+
+typedef struct SoundVoice {
+    u32 position;
+    bool playing;
+    bool loop;
+} SoundVoice;
+
+/**
+ * Mixes the samples triggered by port writes into 16-bit mono at
+ * SOUND_RATE, as emulated time passes, and queues the result for the audio
+ * device. The queue is a ring with one producer, the emulation thread, and
+ * one consumer, the audio callback: `head` is only stored by the first and
+ * `tail` by the second, so neither ever waits. The mixer drops samples the
+ * ring has no room for and counts an overrun; the callback plays silence
+ * for samples that are not there yet and counts an underrun.
+ *
+ * The ring's capacity bounds the audio queued ahead of the device, so it
+ * sets the latency.
+ */
+typedef struct Sound {
+    SoundSample samples[SOUND_COUNT];
+    SoundVoice voices[SOUND_COUNT];
+    u8 ports[2]; // Last values written to ports 3 and 5.
+
+    // Emulated time mixed up to.
+    u64 cycles;
+    bool started;
+
+    i16 *ring;
+    u32 capacity;
+    atomic_ullong head;
+    atomic_ullong tail;
+
+    u64 overruns;
+    u64 dropped; // Samples lost to overruns.
+    atomic_ullong underruns;
+} Sound;
+
+void sound_init(Sound *sound, u32 capacity);
+void sound_free(Sound *sound);
+void sound_sample(Sound *sound, u32 id, i16 *data, u32 length);
+
+void sound_port(Sound *sound, u8 port, u8 value, u64 cycles);
+void sound_advance(Sound *sound, u64 cycles);
+void sound_read(Sound *sound, i16 *out, u32 count);
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "types.h"
+#include "cpu.h"
+
+/**
+ * The state of the CPU before an instruction ran. Interrupts get a record
+ * of their own, with the RST they delivered as `opcode` and the PC they
+ * interrupted.
+ */
+struct TraceRecord {
+    u64 cycles;
+    u16 pc;
+    u16 sp;
+    u16 bc;
+    u16 de;
+    u16 hl;
+    u8 a;
+    u8 flags;
+    u8 opcode;
+    u8 interrupt;
+    u8 unused[2];
+};
+
+_Static_assert(sizeof(TraceRecord) == 24, "Trace records are written as they are");
+
+// Records in the ring, and how many the CPU writes before publishing them.
+#define TRACE_RING  (1 << 16)
+#define TRACE_BATCH 256
+
+// Records per compressed chunk, the unit the index can seek to.
+#define TRACE_CHUNK 4096
+
+// Largest compressed chunk: 3 bytes of mask and the whole record each.
+#define TRACE_ENCODED (TRACE_CHUNK * (3 + sizeof(TraceRecord)))
+
+typedef struct TraceIndex {
+    u64 record; // Number of the chunk's first record.
+    u64 cycles; // And its cycle count.
+    u64 offset; // Of the chunk in the file.
+} TraceIndex;
+
+/**
+ * A trace being written: the CPU fills the ring, a writer thread drains it
+ * to the file. When the ring is full the CPU waits for the writer, so a
+ * trace never loses records; `stalls` counts the waits.
+ */
+struct Trace {
+    TraceRecord ring[TRACE_RING];
+
+    // Written by the CPU only. `head` is published every TRACE_BATCH records.
+    u64 next;
+    u64 space; // Records the CPU can write before it must check `tail` again.
+    u64 stalls;
+    _Alignas(64) atomic_ullong head;
+
+    // Written by the writer only.
+    _Alignas(64) atomic_ullong tail;
+    u64 bytes;
+    TraceIndex *index;
+    u32 chunks;
+    u32 capacity;
+
+    atomic_bool closing;
+    pthread_t thread;
+    File *file;
+};
+
+/**
+ * Reads a trace back a record at a time. `records` holds the decoded
+ * chunk that `position` is in.
+ */
+typedef struct TraceReader {
+    File *file;
+    TraceIndex *index;
+    u32 chunks;
+    u32 chunk; // Next chunk to read.
+
+    u8 encoded[TRACE_ENCODED];
+    TraceRecord records[TRACE_CHUNK];
+    u32 count;
+    u32 position;
+} TraceReader;
+
+void trace_wait(Trace *trace);
+
+/**
+ * Appends a record for the instruction about to run at `pc`, at cycle
+ * `cycles`. The CPU engines call it only when built with CPU_TRACE and a
+ * trace is started.
+ */
+static inline void trace_record(Trace *trace, const CPU *cpu, u16 pc, u8 opcode,
+                                u8 flags, u64 cycles, bool interrupt) {
+    if (!trace->space)
+        trace_wait(trace);
+
+    TraceRecord *record = &trace->ring[trace->next % TRACE_RING];
+    record->cycles = cycles;
+    record->pc = pc;
+    record->sp = cpu->sp;
+    record->bc = cpu->regs.bc;
+    record->de = cpu->regs.de;
+    record->hl = cpu->regs.hl;
+    record->a = cpu->regs.a;
+    record->flags = flags;
+    record->opcode = opcode;
+    record->interrupt = interrupt;
+    record->unused[0] = record->unused[1] = 0;
+
+    trace->space--;
+    if (++trace->next % TRACE_BATCH == 0)
+        atomic_store_explicit(&trace->head, trace->next, memory_order_release);
+}
+
+bool trace_start(CPU *cpu, const char *path);
+void trace_stop(CPU *cpu);
+
+TraceReader *trace_reader_open(const char *path);
+void trace_reader_close(TraceReader *reader);
+bool trace_reader_seek(TraceReader *reader, u64 cycles);
+bool trace_reader_next(TraceReader *reader, TraceRecord *record);
+
+#endif
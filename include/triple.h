@@ -0,0 +1,48 @@
+#ifndef TRIPLE_H
+#define TRIPLE_H
+
+#include <stdatomic.h>
+
+#include "types.h"
+#include "framebuffer.h"
+
+/**
+ * Video memory as scanned out, and the byte columns of each half of the
+ * raster that changed since the frame the reader took before it.
+ */
+typedef struct TripleFrame {
+    u8 vram[FRAMEBUFFER_BYTES];
+    u32 dirty[2];
+    u64 number;
+} TripleFrame;
+
+/**
+ * Lock-free triple buffer between one writer and one reader. The writer
+ * fills `back` and swaps it with the middle slot; the reader swaps its
+ * `front` with the middle slot when that holds a newer frame. Neither ever
+ * waits: the writer overwrites a frame the reader did not get to, and the
+ * reader keeps its frame while nothing new is published.
+ *
+ * `middle` holds the index of the middle slot, with TRIPLE_FRESH set while
+ * the reader has not taken it. `unseen` is the writer's record of the
+ * columns changed since the last frame it knows the reader took, so that
+ * frames skipped by the reader still get redrawn.
+ */
+typedef struct Triple {
+    TripleFrame frames[3];
+
+    atomic_uint middle;
+    u32 back;
+    u32 front;
+
+    u32 unseen[2];
+} Triple;
+
+#define TRIPLE_FRESH 4
+
+void triple_init(Triple *triple);
+TripleFrame *triple_back(Triple *triple);
+void triple_publish(Triple *triple, const u32 dirty[2]);
+TripleFrame *triple_take(Triple *triple);
+
+#endif
@@ -1,8 +1,28 @@
 #ifndef TYPEDEF_H
 #define TYPEDEF_H
 
-typedef struct Registers Registers;
-typedef struct Flags     Flags;
-typedef struct CPU       CPU;
+typedef struct Registers  Registers;
+typedef struct CPU        CPU;
+typedef struct MicroOp    MicroOp;
+typedef struct Block      Block;
+typedef struct BlockCache BlockCache;
+typedef struct Jit        Jit;
+typedef struct MemoryMap  MemoryMap;
+typedef struct MemoryIO   MemoryIO;
+typedef struct Page       Page;
+typedef struct PageSet    PageSet;
+typedef struct Snapshot   Snapshot;
+typedef struct Farm       Farm;
+typedef struct FarmJob    FarmJob;
+typedef struct Lanes      Lanes;
+typedef struct Replay     Replay;
+typedef struct ReplayEvent ReplayEvent;
+typedef struct Instruction Instruction;
+typedef struct CodeMap    CodeMap;
+typedef struct Trace      Trace;
+typedef struct TraceRecord TraceRecord;
+typedef struct Profile    Profile;
+typedef struct Debugger   Debugger;
+typedef struct DebugPoint DebugPoint;
 
 #endif
@@ -0,0 +1,35 @@
+#ifndef VARINT_H
+#define VARINT_H
+
+#include "types.h"
+
+/**
+ * LEB128 integers, as recordings and captures store their counts: seven
+ * bits a byte, lowest first, with the top bit set on all but the last.
+ */
+static inline void varint_write(File *file, u64 value) {
+    do {
+        u8 byte = value & 0x7f;
+        value >>= 7;
+        fputc(byte | (value ? 0x80 : 0), file);
+    } while (value);
+}
+
+// False at the end of the file or past 64 bits.
+static inline bool varint_read(File *file, u64 *value) {
+    *value = 0;
+
+    for (u32 shift = 0; shift < 64; shift += 7) {
+        int byte = fgetc(file);
+        if (byte == EOF)
+            return false;
+
+        *value |= (u64)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+
+    return false;
+}
+
+#endif
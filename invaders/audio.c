@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <string.h>
+#include <SDL.h>
+
+#include "audio.h"
+
+static SDL_AudioDeviceID device;
+
+static void callback(void *data, Uint8 *stream, int length) {
+    sound_read(data, (i16 *)stream, length / sizeof(i16));
+}
+
+/**
+ * Loads `directory`/0.wav to 9.wav over the stand-ins, converted to the
+ * mixer's format. Missing files keep their stand-in.
+ */
+static void load_samples(Sound *sound, const char *directory) {
+    for (u32 id = 0; id < SOUND_COUNT; id++) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%u.wav", directory, id);
+
+        SDL_AudioSpec spec;
+        Uint8 *data;
+        Uint32 length;
+        if (!SDL_LoadWAV(path, &spec, &data, &length))
+            continue;
+
+        SDL_AudioCVT cvt;
+        if (SDL_BuildAudioCVT(&cvt, spec.format, spec.channels, spec.freq, AUDIO_S16SYS, 1, SOUND_RATE) < 0) {
+            SDL_FreeWAV(data);
+            continue;
+        }
+
+        cvt.len = length;
+        cvt.buf = malloc(length * cvt.len_mult);
+        memcpy(cvt.buf, data, length);
+        SDL_FreeWAV(data);
+
+        if (SDL_ConvertAudio(&cvt) < 0) {
+            free(cvt.buf);
+            continue;
+        }
+
+        sound_sample(sound, id, (i16 *)cvt.buf, cvt.len_cvt / sizeof(i16));
+    }
+}
+
+/**
+ * Opens the audio device, pulling `buffer` samples at a time from the
+ * sound's ring. Returns false, leaving the game silent, if there is none.
+ */
+bool audio_init(Sound *sound, const char *samples, u32 buffer) {
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO))
+        return false;
+
+    load_samples(sound, samples);
+
+    SDL_AudioSpec want = { 0 }, have;
+    want.freq = SOUND_RATE;
+    want.format = AUDIO_S16SYS;
+    want.channels = 1;
+    want.samples = buffer;
+    want.callback = callback;
+    want.userdata = sound;
+
+    device = SDL_OpenAudioDevice(0, 0, &want, &have, 0);
+    if (!device) {
+        fprintf(stderr, "Audio: %s\n", SDL_GetError());
+        return false;
+    }
+
+    SDL_PauseAudioDevice(device, 0);
+    return true;
+}
+
+void audio_quit(void) {
+    if (device)
+        SDL_CloseAudioDevice(device);
+}
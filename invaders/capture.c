@@ -0,0 +1,254 @@
+#include <stdlib.h>
+#include <string.h>
+#include "capture.h"
+#include "varint.h"
+
+/**
+ * Packed capture file:
+ *
+ *   "8080VID" 0
+ *   'F', LEB128 frames since the previous one, then the video memory as
+ *        runs: LEB128 unchanged bytes, LEB128 changed bytes, the changed
+ *        bytes; until all of it is covered.
+ *
+ * Bytes are compared with the frame before, which starts out all zeros.
+ * A gap of more than one frame means the ones in between were dropped.
+ */
+
+static const char MAGIC[8] = "8080VID";
+
+static const u8 BRIGHT = 0xf0;
+static const u8 DARK   = 0x08;
+
+static void write_packed(File *file, const u8 *last, const u8 *vram, u64 gap) {
+    fputc('F', file);
+    varint_write(file, gap);
+
+    u32 i = 0;
+    while (i < FRAMEBUFFER_BYTES) {
+        u32 same = i;
+        while (same < FRAMEBUFFER_BYTES && vram[same] == last[same])
+            same++;
+
+        u32 changed = same;
+        while (changed < FRAMEBUFFER_BYTES && vram[changed] != last[changed])
+            changed++;
+
+        varint_write(file, same - i);
+        varint_write(file, changed - same);
+        fwrite(vram + same, 1, changed - same, file);
+        i = changed;
+    }
+}
+
+static bool read_packed(File *file, u8 *vram, u64 *gap) {
+    if (fgetc(file) != 'F' || !varint_read(file, gap))
+        return false;
+
+    u32 i = 0;
+    while (i < FRAMEBUFFER_BYTES) {
+        u64 same, changed;
+        if (!varint_read(file, &same) || !varint_read(file, &changed)
+                || same + changed > FRAMEBUFFER_BYTES - i)
+            return false;
+
+        i += same;
+        if (fread(vram + i, 1, changed, file) != changed)
+            return false;
+        i += changed;
+    }
+
+    return true;
+}
+
+static void write_y4m_header(File *file) {
+    fprintf(file, "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 Cmono\n", FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT);
+}
+
+static void write_y4m(Capture *capture, const u8 *vram, u64 copies) {
+    u32 count = FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT;
+
+    framebuffer_convert(&capture->framebuffer, vram, capture->pixels,
+            FRAMEBUFFER_WIDTH * sizeof(u32), 0, 32);
+    for (u32 i = 0; i < count; i++)
+        capture->luma[i] = capture->pixels[i];
+
+    for (u64 i = 0; i < copies; i++) {
+        fputs("FRAME\n", capture->file);
+        fwrite(capture->luma, 1, count, capture->file);
+    }
+}
+
+static void write_frame(Capture *capture, const CaptureFrame *frame) {
+    u64 gap = frame->number - (capture->written ? capture->last_number : capture->first - 1);
+
+    if (capture->format == CAPTURE_PACKED)
+        write_packed(capture->file, capture->last, frame->vram, gap);
+    else {
+        // Repeat the last frame over the dropped ones, then show this one.
+        if (gap > 1)
+            write_y4m(capture, capture->last, gap - 1);
+        write_y4m(capture, frame->vram, 1);
+    }
+
+    memcpy(capture->last, frame->vram, FRAMEBUFFER_BYTES);
+    capture->last_number = frame->number;
+    capture->written++;
+}
+
+static void *writer(void *data) {
+    Capture *capture = data;
+
+    for (;;) {
+        sem_wait(&capture->ready);
+
+        u32 tail = atomic_load_explicit(&capture->tail, memory_order_relaxed);
+        if (tail == atomic_load_explicit(&capture->head, memory_order_acquire)) {
+            if (atomic_load(&capture->closing))
+                break;
+            continue;
+        }
+
+        write_frame(capture, &capture->frames[tail % CAPTURE_QUEUE]);
+        atomic_store_explicit(&capture->tail, tail + 1, memory_order_release);
+    }
+
+    return 0;
+}
+
+static Capture *capture_new(File *file, CaptureFormat format) {
+    Capture *capture = calloc(1, sizeof(Capture));
+    if (!capture) {
+        fprintf(stderr, "Capture: Out of memory.\n");
+        exit(1);
+    }
+
+    capture->file = file;
+    capture->format = format;
+    capture->pixels = malloc(FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT * sizeof(u32));
+    capture->luma = malloc(FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT);
+    framebuffer_init(&capture->framebuffer, BRIGHT, DARK);
+
+    return capture;
+}
+
+static void capture_free(Capture *capture) {
+    free(capture->pixels);
+    free(capture->luma);
+    free(capture->frames);
+    free(capture);
+}
+
+/**
+ * Starts writing a capture to `path` in the background.
+ */
+Capture *capture_open(const char *path, CaptureFormat format) {
+    File *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Could not open %s.\n", path);
+        exit(1);
+    }
+
+    Capture *capture = capture_new(file, format);
+    capture->frames = malloc(CAPTURE_QUEUE * sizeof(CaptureFrame));
+    atomic_init(&capture->head, 0);
+    atomic_init(&capture->tail, 0);
+    atomic_init(&capture->closing, false);
+    sem_init(&capture->ready, 0, 0);
+
+    if (format == CAPTURE_PACKED)
+        fwrite(MAGIC, 1, sizeof(MAGIC), file);
+    else
+        write_y4m_header(file);
+
+    if (!capture->frames || pthread_create(&capture->writer, 0, writer, capture)) {
+        fprintf(stderr, "Capture: Could not start the writer.\n");
+        exit(1);
+    }
+
+    return capture;
+}
+
+/**
+ * Queues frame `number`, 1 bpp video memory as the screen shows it. Never
+ * blocks: if the writer is a whole queue behind, the frame is dropped.
+ */
+void capture_frame(Capture *capture, const u8 *vram, u64 number) {
+    u32 head = atomic_load_explicit(&capture->head, memory_order_relaxed);
+    if (!head && !capture->dropped)
+        capture->first = number;
+    capture->latest = number;
+
+    if (head - atomic_load_explicit(&capture->tail, memory_order_acquire) == CAPTURE_QUEUE) {
+        capture->dropped++;
+        return;
+    }
+
+    CaptureFrame *frame = &capture->frames[head % CAPTURE_QUEUE];
+    frame->number = number;
+    memcpy(frame->vram, vram, FRAMEBUFFER_BYTES);
+
+    atomic_store_explicit(&capture->head, head + 1, memory_order_release);
+    sem_post(&capture->ready);
+}
+
+/**
+ * Lets the writer finish the queued frames and closes the file. Frames
+ * dropped after the last one written repeat it.
+ */
+void capture_close(Capture *capture) {
+    atomic_store(&capture->closing, true);
+    sem_post(&capture->ready);
+    pthread_join(capture->writer, 0);
+
+    u64 gap = capture->latest - capture->last_number;
+    if (capture->written && gap) {
+        if (capture->format == CAPTURE_PACKED)
+            write_packed(capture->file, capture->last, capture->last, gap);
+        else
+            write_y4m(capture, capture->last, gap);
+    }
+
+    sem_destroy(&capture->ready);
+    fclose(capture->file);
+    capture_free(capture);
+}
+
+/**
+ * Turns a packed capture into YUV4MPEG2, repeating frames over the ones
+ * that were dropped. Returns false if `packed` is not a whole capture.
+ */
+bool capture_convert(File *packed, File *y4m) {
+    char magic[sizeof(MAGIC)];
+    if (fread(magic, 1, sizeof(magic), packed) != sizeof(magic) || memcmp(magic, MAGIC, sizeof(MAGIC)))
+        return false;
+
+    Capture *capture = capture_new(y4m, CAPTURE_Y4M);
+    capture->first = 1;
+    write_y4m_header(y4m);
+
+    CaptureFrame *frame = malloc(sizeof(CaptureFrame));
+    memset(frame->vram, 0, FRAMEBUFFER_BYTES);
+
+    bool whole = true;
+    u64 number = 0;
+    int tag;
+    while ((tag = fgetc(packed)) != EOF) {
+        ungetc(tag, packed);
+
+        u64 gap;
+        if (!read_packed(packed, frame->vram, &gap)) {
+            whole = false;
+            break;
+        }
+
+        number += gap;
+        frame->number = number;
+        write_frame(capture, frame);
+    }
+
+    free(frame);
+    capture_free(capture);
+
+    return whole;
+}
@@ -0,0 +1,30 @@
+#include <stdio.h>
+
+#include "capture.h"
+
+/**
+ * Turns a packed capture (invaders -c session.vid) into a YUV4MPEG2 video,
+ * e.g. to encode it further with ffmpeg -i session.y4m.
+ */
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: capture-convert capture.vid video.y4m\n");
+        return 1;
+    }
+
+    File *packed = fopen(argv[1], "rb");
+    File *y4m = fopen(argv[2], "wb");
+    if (!packed || !y4m) {
+        fprintf(stderr, "Could not open %s.\n", packed ? argv[2] : argv[1]);
+        return 1;
+    }
+
+    bool whole = capture_convert(packed, y4m);
+    if (!whole)
+        fprintf(stderr, "%s is cut short or not a capture.\n", argv[1]);
+
+    fclose(packed);
+    fclose(y4m);
+
+    return !whole;
+}
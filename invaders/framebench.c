@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "framebuffer.h"
+
+#ifdef FRAMEBENCH_SDL
+#include <SDL.h>
+#endif
+
+/**
+ * Nanoseconds per frame of the framebuffer kernel against the per-pixel
+ * path it replaced in screen_draw. With SDL the old path locks a real
+ * surface and calls SDL_MapRGB per pixel, like it did; without SDL it
+ * keeps its loop structure with a plain call standing in for them.
+ */
+
+#define WHITE 0xf0, 0xf0, 0xf0
+#define BLACK 0x08, 0x08, 0x08
+#define ARGB(...) RGB_TO_ARGB(__VA_ARGS__)
+#define RGB_TO_ARGB(r, g, b) (0xff000000u | (r) << 16 | (g) << 8 | (b))
+
+#ifdef FRAMEBENCH_SDL
+
+static SDL_Surface *surface;
+
+static void old_init(void) {
+    surface = SDL_CreateRGBSurfaceWithFormat(0, FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT,
+            32, SDL_PIXELFORMAT_ARGB8888);
+}
+
+static u32 *old_pixels(void) { return surface->pixels; }
+static u32 old_pitch(void)   { return surface->pitch; }
+static const char *old_name(void) { return "SDL surface"; }
+
+#else
+
+static struct {
+    void *pixels;
+    int pitch;
+} surface_data, *surface = &surface_data;
+
+__attribute__((noinline)) static void SDL_LockSurface(void *s)   { __asm__ volatile("" :: "r"(s)); }
+__attribute__((noinline)) static void SDL_UnlockSurface(void *s) { __asm__ volatile("" :: "r"(s)); }
+
+__attribute__((noinline)) static u32 map_rgb(u8 r, u8 g, u8 b) {
+    return RGB_TO_ARGB(r, g, b);
+}
+
+#define SDL_MapRGB(format, ...) map_rgb(__VA_ARGS__)
+
+static void old_init(void) {
+    surface->pitch = FRAMEBUFFER_WIDTH * 4;
+    surface->pixels = malloc(FRAMEBUFFER_HEIGHT * surface->pitch);
+}
+
+static u32 *old_pixels(void) { return surface->pixels; }
+static u32 old_pitch(void)   { return surface->pitch; }
+static const char *old_name(void) { return "no SDL, stand-in calls"; }
+
+#endif
+
+// screen_draw as it was, minus SDL_UpdateWindowSurface.
+static void old_draw(u8 *memory) {
+    for (int row = 0; row < 224; row++) {
+        for (int col = 0; col < 256 / 8; col++) {
+            u8 byte = memory[row * 32 + col];
+            for (int k = 0; k < 8; k++) {
+                bool pixel = byte & (1 << k);
+                SDL_LockSurface(surface);
+                int x = row;
+                int y = 256 - (col * 8 + k) - 1;
+                u8 *pixels = (u8 *)surface->pixels;
+                u32 *drawing_pixel = (u32 *)(pixels + y * surface->pitch + x * 4);
+                if (pixel)
+                    *drawing_pixel = SDL_MapRGB(surface->format, WHITE);
+                else
+                    *drawing_pixel = SDL_MapRGB(surface->format, BLACK);
+                SDL_UnlockSurface(surface);
+            }
+        }
+    }
+}
+
+static double seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    u32 frames = argc > 1 ? atoi(argv[1]) : 2000;
+
+    u8 vram[FRAMEBUFFER_BYTES];
+    srand(8080);
+    for (u32 i = 0; i < FRAMEBUFFER_BYTES; i++)
+        vram[i] = rand();
+
+    old_init();
+
+    Framebuffer framebuffer;
+    framebuffer_init(&framebuffer, ARGB(WHITE), ARGB(BLACK));
+
+    u32 pitch = FRAMEBUFFER_WIDTH * sizeof(u32);
+    u32 *pixels = malloc(FRAMEBUFFER_HEIGHT * pitch);
+
+    double start = seconds();
+    for (u32 i = 0; i < frames; i++) {
+        vram[i % FRAMEBUFFER_BYTES] ^= 1;
+        old_draw(vram);
+    }
+    double old = (seconds() - start) / frames;
+
+    start = seconds();
+    for (u32 i = 0; i < frames; i++) {
+        vram[i % FRAMEBUFFER_BYTES] ^= 1;
+        framebuffer_convert(&framebuffer, vram, pixels, pitch, 0, 32);
+    }
+    double new = (seconds() - start) / frames;
+
+    old_draw(vram);
+
+    bool same = true;
+    for (u32 y = 0; y < FRAMEBUFFER_HEIGHT; y++) {
+        const u8 *row = (const u8 *)old_pixels() + y * old_pitch();
+        same &= memcmp(row, pixels + y * FRAMEBUFFER_WIDTH, pitch) == 0;
+    }
+
+    printf("Old per-pixel path (%s): %.0f ns per frame\n", old_name(), old * 1e9);
+    printf("Framebuffer kernel: %.0f ns per frame, %.1fx faster%s\n",
+            new * 1e9, old / new, same ? "" : ", ERROR: pixels differ");
+
+    return !same;
+}
@@ -0,0 +1,68 @@
+#include <string.h>
+#include "framebuffer.h"
+
+/**
+ * Bit k of byte column c of raster row r is screen pixel (r, 255 - 8c - k).
+ * The 8 raster rows of one byte column make an 8x8 tile; transposed, each
+ * of its bytes holds 8 horizontally adjacent screen pixels, which `expand`
+ * turns into one run of an output row. Tiles are walked along the screen
+ * rows, so output is written sequentially, 8 rows at a time.
+ */
+
+void framebuffer_init(Framebuffer *framebuffer, u32 on, u32 off) {
+    for (u32 byte = 0; byte < 256; byte++) {
+        for (u32 bit = 0; bit < 8; bit++)
+            framebuffer->expand[byte][bit] = byte >> bit & 1 ? on : off;
+    }
+}
+
+// Bit j of byte i of the result is bit i of byte j of `tile`.
+static inline u64 transpose(u64 tile) {
+    tile = (tile & 0xaa55aa55aa55aa55ull)
+         | (tile & 0x00aa00aa00aa00aaull) << 7
+         | (tile >> 7 & 0x00aa00aa00aa00aaull);
+    tile = (tile & 0xcccc3333cccc3333ull)
+         | (tile & 0x0000cccc0000ccccull) << 14
+         | (tile >> 14 & 0x0000cccc0000ccccull);
+    tile = (tile & 0xf0f0f0f00f0f0f0full)
+         | (tile & 0x00000000f0f0f0f0ull) << 28
+         | (tile >> 28 & 0x00000000f0f0f0f0ull);
+
+    return tile;
+}
+
+/**
+ * Converts raster byte columns [first, last) of `vram` into the band of
+ * screen rows they cover, from row 256 - 8 * last down to 255 - 8 * first.
+ * `pixels` points at the top row of the band, rows are `pitch` bytes apart.
+ * Columns 0 to 16 are the bottom half of the screen, 16 to 32 the top half.
+ */
+void framebuffer_convert(const Framebuffer *framebuffer, const u8 *vram,
+        u32 *pixels, u32 pitch, u32 first, u32 last) {
+    framebuffer_convert_lines(framebuffer, vram, pixels, pitch, first, last, 0, FRAMEBUFFER_WIDTH);
+}
+
+/**
+ * Like framebuffer_convert, for raster lines [begin, end) only: screen
+ * columns begin to end - 1, of which `pixels` points at the first. Both
+ * have to be multiples of 8.
+ */
+void framebuffer_convert_lines(const Framebuffer *framebuffer, const u8 *vram,
+        u32 *pixels, u32 pitch, u32 first, u32 last, u32 begin, u32 end) {
+    for (u32 column = first; column < last; column++) {
+        u8 *rows = (u8 *)pixels + (8 * (last - column) - 1) * pitch;
+
+        for (u32 x = begin; x < end; x += 8) {
+            u64 tile = 0;
+            for (u32 i = 0; i < 8; i++)
+                tile |= (u64)vram[(x + i) * 32 + column] << 8 * i;
+
+            tile = transpose(tile);
+
+            for (u32 k = 0; k < 8; k++) {
+                u32 *run = (u32 *)(rows - k * pitch) + (x - begin);
+                memcpy(run, framebuffer->expand[tile >> 8 * k & 0xff], 8 * sizeof(u32));
+            }
+        }
+    }
+}
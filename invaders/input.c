@@ -1,23 +1,81 @@
-#include <stdlib.h>
+#include <time.h>
 #include <SDL.h>
 #include "input.h"
 
-static const u8 *keyboard;
+/**
+ * The keys of both players, by port and bit. Port 2 bits 0, 1 and 7 are
+ * DIP switches, left off: three lives, bonus at 1500, coin info shown.
+ */
+static const struct {
+    SDL_Scancode key;
+    u8 port;
+    u8 bit;
+} KEYS[] = {
+    { SDL_SCANCODE_RETURN, 1, 0 }, // Coin insert
+    { SDL_SCANCODE_2,      1, 1 }, // 2p start
+    { SDL_SCANCODE_1,      1, 2 }, // 1p start
+    { SDL_SCANCODE_SPACE,  1, 4 }, // 1p shot
+    { SDL_SCANCODE_A,      1, 5 }, // 1p left
+    { SDL_SCANCODE_D,      1, 6 }, // 1p right
+    { SDL_SCANCODE_T,      2, 2 }, // Tilt
+    { SDL_SCANCODE_UP,     2, 4 }, // 2p shot
+    { SDL_SCANCODE_LEFT,   2, 5 }, // 2p left
+    { SDL_SCANCODE_RIGHT,  2, 6 }, // 2p right
+};
 
+static u64 microseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-void keyboard_init(void) {
-    keyboard = SDL_GetKeyboardState(0);
+    return now.tv_sec * 1000000ull + now.tv_nsec / 1000;
+}
+
+static void publish(Input *input) {
+    u64 latched = microseconds() << 16 | input->ports[1] << 8 | input->ports[0];
+    atomic_store_explicit(&input->latched, latched, memory_order_release);
+}
+
+void input_init(Input *input) {
+    input->ports[0] = INPUT_IDLE;
+    input->ports[1] = 0;
+    publish(input);
+}
+
+static void press(Input *input, SDL_Scancode key, bool down) {
+    for (u32 i = 0; i < sizeof(KEYS) / sizeof(KEYS[0]); i++) {
+        if (KEYS[i].key != key)
+            continue;
 
+        u8 *port = &input->ports[KEYS[i].port - 1];
+        u8 value = down ? *port | 1 << KEYS[i].bit : *port & ~(1 << KEYS[i].bit);
+        if (value != *port) {
+            *port = value;
+            publish(input);
+        }
+    }
 }
 
-u8 port1() {
-    SDL_PumpEvents();
-    return keyboard[SDL_SCANCODE_RETURN] /* Coin insert */
-        | ((u8)keyboard[SDL_SCANCODE_2]) << 1 /* 2p start */
-        | (u8)keyboard[SDL_SCANCODE_1] << 2 /* 1p start */
-        | 1 << 3 /* Always 1 */
-        | (u8)keyboard[SDL_SCANCODE_SPACE] << 4 /* 1p shot */
-        | (u8)keyboard[SDL_SCANCODE_A] << 5 /* 1p left */
-        | (u8)keyboard[SDL_SCANCODE_D] << 6; /* 1p right */
-        
+/**
+ * Handles the events queued since the last call, publishing the ports
+ * whenever a key changes them. Returns false once the window is closed.
+ */
+bool input_poll(Input *input) {
+    SDL_Event event;
+    bool open = true;
+
+    while (SDL_PollEvent(&event)) {
+        switch (event.type) {
+            case SDL_KEYDOWN:
+            case SDL_KEYUP:
+                if (!event.key.repeat)
+                    press(input, event.key.keysym.scancode, event.type == SDL_KEYDOWN);
+                break;
+            case SDL_WINDOWEVENT:
+                if (event.window.event == SDL_WINDOWEVENT_CLOSE)
+                    open = false;
+                break;
+        }
+    }
+
+    return open;
 }
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "invaders.h"
+#include "memory.h"
+
+static void load_rom(u8 *memory, const char *path) {
+    File *rom = fopen(path, "rb");
+    if (!rom) {
+        fprintf(stderr, "Could not open rom.\n");
+        exit(1);
+    }
+
+    fread(memory, sizeof(u8), 0x2000, rom);
+    fclose(rom);
+}
+
+/**
+ * Stores a byte of video memory and, if it changed, marks its byte column
+ * of the raster, 8 rows of the screen, for redrawing. Each half of the
+ * raster keeps its own columns; the second one starts at line 112, offset
+ * 0x1200 of the mirrored RAM.
+ */
+static void write_vram(void *context, u16 addr, u8 value) {
+    Invaders *machine = context;
+    u8 *byte = &machine->cpu.map->read[addr / PAGE_SIZE][addr % PAGE_SIZE];
+
+    if (*byte != value) {
+        *byte = value;
+        machine->vram_dirty[(addr & 0x1fff) >= 0x1200] |= 1u << (addr & 31);
+    }
+}
+
+/**
+ * 8 KiB of ROM followed by 8 KiB of RAM, the last 7 KiB of which is video
+ * memory. The RAM repeats over the rest of the address space.
+ */
+static void map_memory(Invaders *machine) {
+    CPU *cpu = &machine->cpu;
+
+    memory_map_rom(cpu->map, 0x0000, 0x2000, cpu->memory);
+    memory_map_ram(cpu->map, 0x2000, 0x0400, cpu->memory + 0x2000);
+    memory_map_watch(cpu->map, 0x2400, 0x1c00, cpu->memory + 0x2400, write_vram, machine);
+    memory_map_mirror(cpu->map, 0x4000, 0xc000, 0x2000, 0x2000);
+}
+
+static void in(CPU *cpu, u8 port) {
+    Invaders *machine = (Invaders *)cpu;
+
+    switch (port) {
+        case 1: {
+            cpu->regs.a = machine->port1;
+            break;
+        }
+        case 2: {
+            cpu->regs.a = machine->port2;
+            break;
+        }
+        case 3: {
+            cpu->regs.a = shift_read(&machine->shift);
+            break;
+        }
+        default: {
+            fprintf(stderr, "Input port %d not handled.\n", port);
+            exit(1);
+        }
+    }
+}
+
+static void out(CPU *cpu, u8 port) {
+    Invaders *machine = (Invaders *)cpu;
+
+    switch (port) {
+        case 2: {
+            shift_offset(&machine->shift, cpu->regs.a & 0x07);
+            break;
+        }
+        case 3: {
+            if (machine->sound)
+                sound_port(machine->sound, port, cpu->regs.a, cpu->cycles);
+            break;
+        }
+        case 4: {
+            shift_write(&machine->shift, cpu->regs.a);
+            break;
+        }
+        case 5: {
+            if (machine->sound)
+                sound_port(machine->sound, port, cpu->regs.a, cpu->cycles);
+            break;
+        }
+        case 6: {
+            break; // Watchdog
+        }
+        default: {
+            fprintf(stderr, "Output port %d not handled.\n", port);
+            exit(1);
+        }
+    }
+}
+
+void invaders_init(Invaders *machine, const char *rom) {
+    cpu_init(&machine->cpu, in, out);
+    load_rom(machine->cpu.memory, rom);
+    map_memory(machine);
+
+    machine->shift = (Shift){ 0, 0 };
+    machine->port1 = 1 << 3; // Always 1
+    machine->port2 = 0;
+    machine->frames = 0;
+    machine->frame_start = machine->cpu.cycles;
+    machine->vram_dirty[0] = ~0u;
+    machine->vram_dirty[1] = ~0u;
+    machine->sound = 0;
+}
+
+void invaders_free(Invaders *machine) {
+    cpu_free(&machine->cpu);
+}
+
+/**
+ * Raises the Mid (half 0) or End (half 1) of Screen interrupt. The frame
+ * is over after the second one.
+ */
+void invaders_interrupt(Invaders *machine, u32 half) {
+    cpu_interrupt(&machine->cpu, half ? 0xd7 : 0xcf);
+
+    if (half) {
+        machine->frames++;
+        machine->frame_start += 2 * INVADERS_HALF_FRAME;
+    }
+}
+
+// Whether a game is on rather than the attract mode: the ROM's game mode
+// flag, in RAM at 0x20ef.
+bool invaders_playing(Invaders *machine) {
+    return read_byte(&machine->cpu, 0x20ef) != 0;
+}
+
+// Byte columns of one half of the raster written since the last call.
+u32 invaders_vram_dirty(Invaders *machine, u32 half) {
+    u32 dirty = machine->vram_dirty[half];
+    machine->vram_dirty[half] = 0;
+
+    return dirty;
+}
+
+// The CPU cycle at which the Mid (half 0) or End (half 1) of Screen
+// interrupt is due.
+u64 invaders_deadline(const Invaders *machine, u32 half) {
+    return machine->frame_start + (half + 1) * INVADERS_HALF_FRAME;
+}
+
+/**
+ * Runs up to the Mid (half 0) or End (half 1) of Screen interrupt and
+ * raises it. The beam has then just scanned out the first or the second
+ * half of the raster.
+ */
+u64 invaders_half_frame(Invaders *machine, u32 half) {
+    u64 deadline = invaders_deadline(machine, half);
+    u64 cycles = deadline > machine->cpu.cycles ? deadline - machine->cpu.cycles : 0;
+    u64 instructions = cpu_run(&machine->cpu, cycles) + 1;
+    invaders_interrupt(machine, half);
+
+    if (machine->sound)
+        sound_advance(machine->sound, machine->cpu.cycles);
+
+    return instructions;
+}
+
+u64 invaders_frame(Invaders *machine) {
+    return invaders_half_frame(machine, 0) + invaders_half_frame(machine, 1);
+}
@@ -1,115 +1,620 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <SDL.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
-#include "cpu.h"
-#include "screen.h"
+#include "invaders.h"
+#include "replay.h"
+#include "capture.h"
+#include "triple.h"
 #include "input.h"
-#include "shift.h"
+#include "trace.h"
+#include "profile.h"
+#include "debugger.h"
 
-static File *open_rom(void) {
-    File *file = fopen("roms/invaders/invaders", "rb");
-    if (!file) {
-        fprintf(stderr, "Could not open rom.\n");
-        exit(1);
+#ifndef INVADERS_HEADLESS
+#include "screen.h"
+#include "audio.h"
+#endif
+
+#define CLOCK 2000000
+#define FPS   60
+
+// Milliseconds of audio that may be queued ahead of the device, and the
+// samples it takes at a time: 14 ms + 2.9 ms, inside 20 ms.
+#define AUDIO_QUEUE  14
+#define AUDIO_BUFFER 128
+
+static const char *rom = "roms/invaders/invaders";
+static bool headless = false;
+static bool beam = false;
+static bool threaded = false;
+static Capture *capture = 0;
+
+/**
+ * With -t the machine runs on its own thread and the main thread presents
+ * what it publishes to `triple`. `stop` asks the emulation to end,
+ * `finished` tells the main thread it has. `input` is set by whichever
+ * thread handles the window's events: once per frame, before the input is
+ * latched, or on every pass of the render loop with -t.
+ */
+static Triple triple;
+static Input input = { INPUT_IDLE, { INPUT_IDLE, 0 } };
+static atomic_bool stop;
+static atomic_bool finished;
+
+static double seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void sleep_for(double left) {
+    struct timespec wait = { (time_t)left, (long)((left - (time_t)left) * 1e9) };
+    nanosleep(&wait, 0);
+}
+
+/**
+ * Time between the frames of one thread: its mean, standard deviation and
+ * worst case.
+ */
+typedef struct Jitter {
+    double last;
+    u64 count;
+    double sum;
+    double squares;
+    double worst;
+} Jitter;
+
+static void jitter_tick(Jitter *jitter) {
+    double now = seconds();
+
+    if (jitter->last) {
+        double time = now - jitter->last;
+        jitter->count++;
+        jitter->sum += time;
+        jitter->squares += time * time;
+        if (time > jitter->worst)
+            jitter->worst = time;
     }
 
-    return file;
+    jitter->last = now;
 }
 
-static void load_rom(u8 *memory) {
-    File *rom = open_rom();
-    fread(memory, sizeof(u8), 0x2000, rom);
-    fclose(rom);
+static void jitter_report(const char *thread, const Jitter *jitter) {
+    if (!jitter->count)
+        return;
+
+    double mean = jitter->sum / jitter->count;
+    double deviation = sqrt(fmax(jitter->squares / jitter->count - mean * mean, 0));
+    printf("%s thread: %.2f ms per frame, %.2f ms deviation, %.2f ms worst\n",
+            thread, mean * 1e3, deviation * 1e3, jitter->worst * 1e3);
 }
 
-static void in(CPU *cpu, u8 port) {
-    switch (port) {
-        case 1: {
-            cpu->regs.a = port1();
-            break;
-        }
-        case 2: {
-            cpu->regs.a = 0x0;
-            break;
-        }
-        case 3: {
-            cpu->regs.a = shift_read();
-            break;
+/**
+ * The SDL side of the frontend. Headless runs, and builds without SDL
+ * (-DINVADERS_HEADLESS), get no window, no keyboard and no sound.
+ */
+#ifndef INVADERS_HEADLESS
+
+static void frontend_init(void) {
+    if (headless)
+        return;
+
+    screen_init();
+    input_init(&input);
+}
+
+// Handles the window's events. False once it is closed.
+static bool frontend_poll(void) {
+    return headless || input_poll(&input);
+}
+
+static void frontend_draw(u8 *vram, u32 begin, u32 end, u32 dirty) {
+    if (!headless)
+        screen_update(vram, begin, end, dirty);
+}
+
+static void frontend_present(void) {
+    if (!headless)
+        screen_present();
+}
+
+// Samples are looked for next to the ROM.
+static bool frontend_sound(Sound *sound, u32 buffer) {
+    if (headless)
+        return false;
+
+    char samples[1024];
+    const char *slash = strrchr(rom, '/');
+    snprintf(samples, sizeof(samples), "%.*s", slash ? (int)(slash - rom) : 1, slash ? rom : ".");
+
+    return audio_init(sound, samples, buffer);
+}
+
+static void frontend_quit(void) {
+    if (headless)
+        return;
+
+    audio_quit();
+    screen_quit();
+}
+
+#else
+
+static void frontend_init(void) {}
+static bool frontend_poll(void) { return true; }
+static void frontend_draw(u8 *vram, u32 begin, u32 end, u32 dirty) {
+    (void)vram; (void)begin; (void)end; (void)dirty;
+}
+static void frontend_present(void) {}
+static bool frontend_sound(Sound *sound, u32 buffer) { (void)sound; (void)buffer; return false; }
+static void frontend_quit(void) {}
+
+#endif
+
+/**
+ * How long key changes waited to be latched, in emulated cycles at the
+ * pace the machine runs: `rate` cycles per second, 0 when unpaced.
+ */
+static struct {
+    double rate;
+    u64 changes;
+    u64 cycles;
+    u64 worst;
+} keyed;
+
+/**
+ * Latches ports 1 and 2 for the coming frame: from the keyboard, logged
+ * when recording, or from the recording when playing one back.
+ */
+static void latch_input(Invaders *machine, Replay *replay, bool playback) {
+    CPU *cpu = &machine->cpu;
+
+    if (!playback) {
+        u64 latched = atomic_load_explicit(&input.latched, memory_order_acquire);
+        u8 port1 = input_port(latched, 1);
+        u8 port2 = input_port(latched, 2);
+
+        if ((port1 != machine->port1 || port2 != machine->port2) && keyed.rate) {
+            double waited = fmax(seconds() - input_time(latched) / 1e6, 0);
+            u64 cycles = waited * keyed.rate;
+            keyed.changes++;
+            keyed.cycles += cycles;
+            if (cycles > keyed.worst)
+                keyed.worst = cycles;
         }
-        default: {
-            fprintf(stderr, "Input port %d not handled.\n", port);
-            exit(1);
+
+        machine->port1 = port1;
+        machine->port2 = port2;
+        if (replay) {
+            replay_input(replay, cpu, 1, port1);
+            replay_input(replay, cpu, 2, port2);
         }
+        return;
+    }
+
+    ReplayEvent event;
+    while (replay_next(replay, cpu, &event)) {
+        if (event.port == 1)
+            machine->port1 = event.value;
+        else if (event.port == 2)
+            machine->port2 = event.value;
+    }
+}
+
+/**
+ * What is on screen. `dirty` holds the video memory written since each half
+ * of the raster was last scanned out; `fresh` whether any of it was written
+ * after the input latched at cycle `input`, which no scan-out has shown a
+ * reaction to yet while `waiting`. `shown` is video memory as scanned out,
+ * kept for capture and for the render thread.
+ */
+static struct {
+    u32 dirty[2];
+    bool fresh[2];
+    u8 shown[FRAMEBUFFER_BYTES];
+
+    bool waiting;
+    u64 input;
+
+    u64 latency;
+    u64 samples;
+    u64 redrawn; // Bytes of video memory converted.
+} display;
+
+// Picks up the video memory written during the last half frame.
+static void collect(Invaders *machine) {
+    for (u32 half = 0; half < 2; half++) {
+        u32 dirty = invaders_vram_dirty(machine, half);
+        display.dirty[half] |= dirty;
+        display.fresh[half] |= dirty && display.waiting;
     }
 }
 
-static void out(CPU *cpu, u8 port) {
-    switch (port) {
-        case 2: {
-            shift_offset(cpu->regs.a & 0x07);
+/**
+ * Shows raster halves [first, last) as they are in video memory now, and
+ * takes an input-to-photon sample if that shows the game's first change
+ * since the input did.
+ */
+static void scan_out(Invaders *machine, u32 first, u32 last) {
+    u32 dirty = 0;
+    u32 changed[2] = { 0, 0 };
+    bool fresh = false;
+    for (u32 half = first; half < last; half++) {
+        changed[half] = display.dirty[half];
+        dirty |= changed[half];
+        fresh |= display.fresh[half];
+        display.dirty[half] = 0;
+        display.fresh[half] = false;
+    }
+
+    u8 *vram = &machine->cpu.memory[0x2400];
+    u32 begin = first * INVADERS_HALF_LINES;
+    u32 end = last * INVADERS_HALF_LINES;
+    display.redrawn += __builtin_popcount(dirty) * (end - begin);
+
+    if (capture || threaded)
+        memcpy(display.shown + begin * 32, vram + begin * 32, (end - begin) * 32);
+
+    if (threaded) {
+        TripleFrame *frame = triple_back(&triple);
+        memcpy(frame->vram, display.shown, FRAMEBUFFER_BYTES);
+        frame->number = machine->frames;
+        triple_publish(&triple, changed);
+    }
+    else if (dirty) {
+        frontend_draw(vram, begin, end, dirty);
+        frontend_present();
+    }
+
+    if (fresh && display.waiting) {
+        display.latency += machine->cpu.cycles - display.input;
+        display.samples++;
+        display.waiting = false;
+    }
+}
+
+/**
+ * Waits for the end of a `period` seconds long step, unless it is 0 for
+ * uncapped. Deadlines are kept on a fixed grid, so waking up late does not
+ * add up into a slower game, or audio starved of samples; a run that falls
+ * more than a step behind starts a new grid.
+ */
+static void pace(double *deadline, double period) {
+    if (period <= 0)
+        return;
+
+    double now = seconds();
+    if (!*deadline || now - *deadline > period)
+        *deadline = now;
+
+    *deadline += period;
+    if (*deadline > now)
+        sleep_for(*deadline - now);
+}
+
+/**
+ * Runs a frame and scans it out, paced a half at a time so that sound is
+ * mixed in steps of 8 ms. Beam racing scans out each half of the
+ * raster at the interrupt after the game is done with it: it redraws the
+ * first half on the Mid of Screen interrupt, while the beam is in the
+ * second, and the second half during VBlank. So the second half is shown
+ * at the Mid of Screen interrupt and the first at the End of Screen one.
+ * Otherwise the whole screen is shown at the end of the frame.
+ */
+static u64 run_frame(Invaders *machine, double *deadline, double period) {
+    u64 instructions = 0;
+
+    for (u32 half = 0; half < 2; half++) {
+        instructions += invaders_half_frame(machine, half);
+        collect(machine);
+
+        if (beam)
+            scan_out(machine, !half, !half + 1);
+        else if (half)
+            scan_out(machine, 0, 2);
+
+        if (half && capture)
+            capture_frame(capture, display.shown, machine->frames);
+
+        pace(deadline, period / 2);
+    }
+
+    return instructions;
+}
+
+
+/**
+ * The run asked for on the command line, and what the emulation thread
+ * measures of it.
+ */
+static struct {
+    Invaders machine;
+    Replay *replay;
+    bool play;
+    u64 frames; // Frames to run, 0 for no limit.
+    bool game_over;
+    double speed;
+    double deadline;
+
+    Sound sound;
+    bool audio;
+
+    u64 instructions;
+    Jitter jitter;
+} session;
+
+// Brings a machine restored from a keyframe up to `cycles`, unthrottled.
+static void fast_forward(Invaders *machine, Replay *replay, u64 cycles) {
+    while (machine->cpu.cycles < cycles) {
+        latch_input(machine, replay, true);
+        invaders_frame(machine);
+    }
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "Usage: invaders [-H] [-b] [-t] [-m rom] [-f frames] [-x speed] [-g]\n"
+            "                [-r recording | -p recording [-s seconds]] [-c capture]\n"
+            "                [-a milliseconds] [-d] [-T trace] [-P profile [-L labels]]\n"
+            "\n"
+            "-H runs without a window or pacing, -x paces at `speed` times real\n"
+            "time (0 for uncapped). -b scans out each half of the screen at the\n"
+            "interrupt the game is done with it, rather than the whole screen\n"
+            "once per frame. -t runs the machine on a thread of its own, apart\n"
+            "from presentation. The run ends after `frames` frames, at game over\n"
+            "with -g, or at the end of the recording played back. -c writes the\n"
+            "screen to `capture`: a .y4m video, or packed 1 bpp frames for\n"
+            "capture-convert. -a sets how much audio may be queued ahead of the\n"
+            "device, 0 for no sound. -d stops in the debugger, which takes its\n"
+            "commands from stdin, before the first instruction. -T records every\n"
+            "instruction to `trace`, in builds with trace=1, from where playback\n"
+            "starts. -P, in builds with profile=1, writes where the game spent\n"
+            "its cycles to `profile`.callgrind and `profile`.folded, naming\n"
+            "functions from `labels` when given.\n");
+    exit(1);
+}
+
+/**
+ * Runs frames until the session is over or the window closes: latches the
+ * input, then runs, scans out and paces the frame.
+ */
+static void *emulate(void *data) {
+    (void)data;
+
+    Invaders *machine = &session.machine;
+    u64 first_frame = machine->frames;
+    bool playing = false;
+    double period = session.speed > 0 ? 1.0 / FPS / session.speed : 0;
+    keyed.rate = session.speed > 0 ? CLOCK * session.speed : 0;
+
+    for (;;) {
+        if (threaded ? atomic_load(&stop) : !frontend_poll())
             break;
-        }
-        case 3: {
+        if (session.frames && machine->frames - first_frame >= session.frames)
             break;
-        }
-        case 4: {
-            shift_write(cpu->regs.a);
+        if (session.play && machine->cpu.cycles >= replay_length(session.replay))
+            break;
+        if (session.game_over && playing && !invaders_playing(machine))
             break;
+
+        jitter_tick(&session.jitter);
+        playing = invaders_playing(machine);
+
+        u8 port1 = machine->port1;
+        u8 port2 = machine->port2;
+        latch_input(machine, session.replay, session.play);
+        if (machine->port1 != port1 || machine->port2 != port2) {
+            display.waiting = true;
+            display.input = machine->cpu.cycles;
+            display.fresh[0] = display.fresh[1] = false;
         }
-        case 5: {
+
+        session.instructions += run_frame(machine, &session.deadline, period);
+        if (session.replay)
+            replay_sync(session.replay, &machine->cpu);
+    }
+
+    atomic_store(&finished, true);
+    return 0;
+}
+
+/**
+ * The main thread under -t: polls the window and keyboard, and presents
+ * the newest frame published, if there is one it has not shown.
+ */
+static void render(Jitter *jitter) {
+    while (!atomic_load(&finished)) {
+        if (!frontend_poll()) {
+            atomic_store(&stop, true);
             break;
         }
-        case 6: {
-            break; // Watchdog
+
+        TripleFrame *frame = triple_take(&triple);
+        if (!frame) {
+            sleep_for(1e-3);
+            continue;
         }
-        default: {
-            fprintf(stderr, "Output port %d not handled.\n", port);
-            exit(1);
+
+        for (u32 half = 0; half < 2; half++) {
+            u32 begin = half * INVADERS_HALF_LINES;
+            frontend_draw(frame->vram, begin, begin + INVADERS_HALF_LINES, frame->dirty[half]);
         }
+        frontend_present();
+        jitter_tick(jitter);
     }
 }
 
-static inline bool window_close(SDL_Event event) {
-    return event.type == SDL_WINDOWEVENT
-        && event.window.event == SDL_WINDOWEVENT_CLOSE;
-}
+int main(int argc, char **argv) {
+    const char *record = 0;
+    const char *play = 0;
+    const char *captured = 0;
+    const char *trace = 0;
+    const char *profiled = 0;
+    const char *labels = 0;
+    bool debug = false;
+    double seek = 0;
+    double queue = AUDIO_QUEUE;
+    session.speed = -1;
 
-static void run_until_screen_interrupt(CPU *cpu, u8 interrupt) {
-    // Mid/End of Screen interrupt happens every half frame.
-    while (cpu->cycles < 16667) // (2MHz / 60s) / 2
-        cpu_step(cpu);
+#ifdef INVADERS_HEADLESS
+    headless = true;
+#endif
 
-    cpu_execute(cpu, interrupt);
-    cpu->cycles = 0;
-}
+    int option;
+    while ((option = getopt(argc, argv, "Hbtm:f:x:gr:p:s:c:a:dT:P:L:")) != -1) {
+        switch (option) {
+            case 'H': headless = true; break;
+            case 'b': beam = true; break;
+            case 't': threaded = true; break;
+            case 'm': rom = optarg; break;
+            case 'f': session.frames = strtoull(optarg, 0, 10); break;
+            case 'x': session.speed = atof(optarg); break;
+            case 'g': session.game_over = true; break;
+            case 'r': record = optarg; break;
+            case 'p': play = optarg; break;
+            case 's': seek = atof(optarg); break;
+            case 'c': captured = optarg; break;
+            case 'a': queue = atof(optarg); break;
+            case 'd': debug = true; break;
+            case 'T': trace = optarg; break;
+            case 'P': profiled = optarg; break;
+            case 'L': labels = optarg; break;
+            default: usage();
+        }
+    }
 
-static void run_frame(CPU *cpu) {
-    u32 start = SDL_GetTicks();
+    if (record && play)
+        usage();
 
-    run_until_screen_interrupt(cpu, 0xcf);
-    run_until_screen_interrupt(cpu, 0xd7);
-    screen_draw(&cpu->memory[0x2400]);
+    // Real time in a window, as fast as possible without one.
+    if (session.speed < 0)
+        session.speed = headless ? 0 : 1;
 
-    while (SDL_GetTicks() - start < 17);
-}
+    Invaders *machine = &session.machine;
+    invaders_init(machine, rom);
 
-int main(void) {
-    CPU cpu;
+    if (record)
+        session.replay = replay_record(record, &machine->cpu, INVADERS_STATE, 0);
+    else if (play) {
+        session.replay = replay_open(play, INVADERS_STATE);
+        session.play = true;
 
-    cpu_init(&cpu, in, out);
-    load_rom(cpu.memory);
+        u64 target = seek * CLOCK;
+        replay_seek(session.replay, &machine->cpu, target);
+        fast_forward(machine, session.replay, target);
+        machine->vram_dirty[0] = ~0u;
+        machine->vram_dirty[1] = ~0u;
+    }
 
-    screen_init();
-    keyboard_init();
+    if (trace && !trace_start(&machine->cpu, trace))
+        exit(1);
+
+    Profile *profile = profiled ? profile_new() : 0;
+    if (profile && ((labels && !profile_labels(profile, labels))
+            || !profile_attach(profile, &machine->cpu)))
+        exit(1);
+
+    Debugger *debugger = debug ? debugger_new(&machine->cpu, stdin, stderr) : 0;
+    if (debugger)
+        debugger_pause(debugger);
+
+    if (captured) {
+        size_t length = strlen(captured);
+        bool y4m = length >= 4 && !strcmp(captured + length - 4, ".y4m");
+        capture = capture_open(captured, y4m ? CAPTURE_Y4M : CAPTURE_PACKED);
+    }
+
+    frontend_init();
+
+    if (queue > 0) {
+        sound_init(&session.sound, queue / 1e3 * SOUND_RATE);
+        session.audio = frontend_sound(&session.sound, AUDIO_BUFFER);
+        if (session.audio)
+            machine->sound = &session.sound;
+    }
+
+    u64 first_frame = machine->frames;
+    u64 first_cycle = machine->cpu.cycles;
+    Jitter render_jitter = { 0 };
+    double start = seconds();
 
-    while (1) {
-        SDL_Event event;
-        while (SDL_PollEvent(&event)) {
-            if (window_close(event))
-                screen_quit();
+    if (threaded) {
+        triple_init(&triple);
+
+        pthread_t emulation;
+        if (pthread_create(&emulation, 0, emulate, 0)) {
+            fprintf(stderr, "Could not start the emulation thread.\n");
+            exit(1);
         }
 
-        run_frame(&cpu);
+        render(&render_jitter);
+        pthread_join(emulation, 0);
+    }
+    else
+        emulate(0);
+
+    double elapsed = seconds() - start;
+    if (elapsed <= 0)
+        elapsed = 1e-9;
+
+    trace_stop(&machine->cpu);
+    debugger_free(debugger);
+
+    if (profile) {
+        profile_detach(&machine->cpu);
+        if (profile_write(profile, profiled, rom))
+            printf("Profile written to %s.callgrind and %s.folded\n", profiled, profiled);
+        profile_free(profile);
+    }
+
+    u64 ran = machine->frames - first_frame;
+    u64 cycles = machine->cpu.cycles - first_cycle;
+    printf("%llu frames in %.2f s: %.0f frames per second (%.1fx real time), "
+            "%.1f MHz emulated, %.1f MIPS, %.1f%% of the screen redrawn per frame",
+            (unsigned long long)ran, elapsed, ran / elapsed, ran / elapsed / FPS,
+            cycles / elapsed / 1e6, session.instructions / elapsed / 1e6,
+            ran ? 100.0 * display.redrawn / ran / (2 * INVADERS_HALF_LINES * 32) : 0);
+    if (display.samples)
+        printf(", %.2f ms input to photon over %llu inputs",
+                1e3 * display.latency / display.samples / CLOCK,
+                (unsigned long long)display.samples);
+    printf("\n");
+
+    jitter_report("Emulation", &session.jitter);
+    jitter_report("Render", &render_jitter);
+
+    if (keyed.changes) {
+        printf("Input: %llu key changes latched %.0f cycles (%.2f ms) after the key, %llu cycles worst\n",
+                (unsigned long long)keyed.changes, (double)keyed.cycles / keyed.changes,
+                1e3 * keyed.cycles / keyed.changes / keyed.rate, (unsigned long long)keyed.worst);
+    }
+
+    if (session.audio) {
+        printf("Sound: %.0f ms queue, %llu underruns, %llu overruns (%llu samples dropped)\n",
+                queue, (unsigned long long)atomic_load(&session.sound.underruns),
+                (unsigned long long)session.sound.overruns, (unsigned long long)session.sound.dropped);
     }
+
+    if (capture) {
+        u64 dropped = capture->dropped;
+        capture_close(capture);
+        printf("Captured %llu frames to %s, %llu dropped\n",
+                (unsigned long long)(ran - dropped), captured, (unsigned long long)dropped);
+    }
+
+    if (session.replay)
+        replay_close(session.replay);
+    invaders_free(machine);
+    frontend_quit();
+    if (queue > 0)
+        sound_free(&session.sound);
+
+    return 0;
 }
@@ -3,115 +3,89 @@
 
 #include "types.h"
 #include "screen.h"
+#include "framebuffer.h"
 
-#define RASTER_WIDTH  256
-#define RASTER_HEIGHT 224
-
-#define SCREEN_WIDTH  RASTER_HEIGHT
-#define SCREEN_HEIGHT RASTER_WIDTH
+#define SCREEN_WIDTH  FRAMEBUFFER_WIDTH
+#define SCREEN_HEIGHT FRAMEBUFFER_HEIGHT
 
 #define WHITE 0xf0, 0xf0, 0xf0
 #define BLACK 0x08, 0x08, 0x08
 
 static SDL_Window   *window;
-static SDL_Surface  *surface;
+static SDL_Renderer *renderer;
+static SDL_Texture  *texture;
+
+static Framebuffer framebuffer;
 
 void screen_init(void) {
-    SDL_Init(SDL_INIT_EVENTS | SDL_INIT_TIMER);
+    SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS | SDL_INIT_TIMER);
 
     window = SDL_CreateWindow("Space Invaders",
             SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-            SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_SHOWN); 
+            SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_SHOWN);
 
-    surface  = SDL_GetWindowSurface(window);
-}
+    renderer = SDL_CreateRenderer(window, -1, 0);
+    texture  = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+            SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT);
 
-void screen_draw(u8 *memory) {
-    /**
-     * Memory:
-     *                  256 bits (32 bytes)
-     * (0,0)---------------------------------------------------(255,0)
-     *   |                                                         |        224 bits
-     * (0,223)-------------------------------------------------(255,223)
-     *
-     * Screen:
-     *                      224 pixels 
-     * (255,0)-----------------------------------------(255,223)
-     *     |                                               |                256 pixels
-     *   (0,0)-------------------------------------------(0,223)
-     */
-
-    // TODO: Cleanup code
-    for (int row = 0; row < RASTER_HEIGHT; row++) {
-        for (int col = 0; col < RASTER_WIDTH / 8; col++) {
-            u8 byte = memory[row * 32 + col];
-            for (int k = 0; k < 8; k++) {
-                bool pixel = byte & (1 << k);
-                SDL_LockSurface(surface);
-                int x = row;
-                int y = SCREEN_HEIGHT - (col * 8 + k) - 1;
-                u8 *pixels = (u8 *)surface->pixels;
-                u32 *drawing_pixel = (u32 *)(pixels + y * surface->pitch + x * 4);
-                if (pixel)
-                    *drawing_pixel = SDL_MapRGB(surface->format, WHITE);
-                else
-                    *drawing_pixel = SDL_MapRGB(surface->format, BLACK);
-                SDL_UnlockSurface(surface);
-            }
-        }
+    if (!window || !renderer || !texture) {
+        fprintf(stderr, "Screen: %s\n", SDL_GetError());
+        exit(1);
     }
 
-    SDL_UpdateWindowSurface(window);
+    // The colours are mapped once; the framebuffer expands bytes to them.
+    SDL_PixelFormat *format = SDL_AllocFormat(SDL_PIXELFORMAT_ARGB8888);
+    framebuffer_init(&framebuffer, SDL_MapRGB(format, WHITE), SDL_MapRGB(format, BLACK));
+    SDL_FreeFormat(format);
 }
 
-void screen_draw_bottom(u8 *memory) {
-    for (int row = 0; row < RASTER_WIDTH / 16; row++) {
-        for (int col = 0; col < RASTER_HEIGHT; col++) {
-            u8 byte = memory[col * 32 + row];
-            for (int k = 0; k < 8; k++) {
-                bool pixel = byte & (1 << k);
-
-                SDL_LockSurface(surface);
-                int x = col;
-                int y = SCREEN_HEIGHT - (row * 8 + k) - 1;
-                u8 *pixels = (u8 *)surface->pixels;
-                u32 *drawing_pixel = (u32 *)(pixels + y * surface->pitch + x * 4);
-                if (pixel)
-                    *drawing_pixel = SDL_MapRGB(surface->format, WHITE);
-                else
-                    *drawing_pixel = SDL_MapRGB(surface->format, BLACK);
-                SDL_UnlockSurface(surface);
-            }
-        }
-    }
-    SDL_UpdateWindowSurface(window);
+/**
+ * Converts raster byte columns [first, last) of raster lines [begin, end)
+ * straight into their rectangle of the texture. Only that rectangle is
+ * locked, since locked pixels start out undefined; the rest keeps what was
+ * drawn before.
+ */
+static void convert(u8 *memory, u32 first, u32 last, u32 begin, u32 end) {
+    SDL_Rect band = { begin, SCREEN_HEIGHT - 8 * last, end - begin, 8 * (last - first) };
+
+    void *pixels;
+    int pitch;
+    if (SDL_LockTexture(texture, &band, &pixels, &pitch))
+        return;
+
+    framebuffer_convert_lines(&framebuffer, memory, pixels, pitch, first, last, begin, end);
+    SDL_UnlockTexture(texture);
 }
 
-void screen_draw_top(u8 *memory) {
-    for (int row = RASTER_WIDTH / 16; row < RASTER_WIDTH / 8; row++) {
-        for (int col = 0; col < RASTER_HEIGHT; col++) {
-            u8 byte = memory[col * 32 + row];
-            for (int k = 0; k < 8; k++) {
-                bool pixel = byte & (1 << k);
-
-                SDL_LockSurface(surface);
-                int x = col;
-                int y = SCREEN_HEIGHT - (row * 8 + k) - 1;
-                u8 *pixels = (u8 *)surface->pixels;
-                u32 *drawing_pixel = (u32 *) (pixels + y * surface->pitch + x * 4);
-                if (pixel)
-                    *drawing_pixel = SDL_MapRGB(surface->format, WHITE);
-                else
-                    *drawing_pixel = SDL_MapRGB(surface->format, BLACK);
-                SDL_UnlockSurface(surface);
-            }
-        }
-    }
+void screen_present(void) {
+    SDL_RenderCopy(renderer, texture, 0, 0);
+    SDL_RenderPresent(renderer);
+}
 
-    SDL_UpdateWindowSurface(window);
+void screen_draw(u8 *memory) {
+    convert(memory, 0, 32, 0, SCREEN_WIDTH);
+    screen_present();
+}
+
+/**
+ * Redraws the byte columns set in `dirty` of raster lines [begin, end), a
+ * run of adjacent columns at a time, for the next screen_present.
+ */
+void screen_update(u8 *memory, u32 begin, u32 end, u32 dirty) {
+    while (dirty) {
+        u32 first = __builtin_ctz(dirty);
+        u32 last = first;
+        while (last < 32 && dirty >> last & 1)
+            last++;
+
+        convert(memory, first, last, begin, end);
+        dirty &= last < 32 ? ~0u << last : 0;
+    }
 }
 
 void screen_quit(void) {
+    SDL_DestroyTexture(texture);
+    SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
 
@@ -1,16 +1,13 @@
 #include "shift.h"
 
-static u16 reg;
-static u8  offset;
-
-void shift_write(u8 value) {
-    reg = (reg >> 8) | (value << 8);
+void shift_write(Shift *shift, u8 value) {
+    shift->reg = (shift->reg >> 8) | (value << 8);
 }
 
-void shift_offset(u8 value) {
-    offset = value;
+void shift_offset(Shift *shift, u8 value) {
+    shift->offset = value;
 }
 
-u8 shift_read(void) {
-    return (reg & (0xff00 >> offset)) >> (8 - offset);
+u8 shift_read(const Shift *shift) {
+    return (shift->reg & (0xff00 >> shift->offset)) >> (8 - shift->offset);
 }
@@ -0,0 +1,184 @@
+#include <stdlib.h>
+#include <string.h>
+#include "sound.h"
+
+#define VOLUME 6000
+
+/**
+ * Stand-ins for the sample set, used for any sample the frontend does not
+ * load: square waves of falling, rising or warbling pitch, and noise.
+ */
+typedef struct Tone {
+    double seconds;
+    double from; // Hz at the start and at the end, 0 for noise.
+    double to;
+    double warble; // Hz of vibrato, 0 for none.
+} Tone;
+
+static const Tone TONES[SOUND_COUNT] = {
+    [SOUND_UFO]         = { 0.10, 700, 700, 20 },
+    [SOUND_SHOT]        = { 0.25, 1200, 300, 0 },
+    [SOUND_PLAYER_DIE]  = { 1.00, 0, 0, 0 },
+    [SOUND_INVADER_DIE] = { 0.30, 900, 200, 0 },
+    [SOUND_FLEET_1]     = { 0.10, 98, 98, 0 },
+    [SOUND_FLEET_2]     = { 0.10, 87, 87, 0 },
+    [SOUND_FLEET_3]     = { 0.10, 78, 78, 0 },
+    [SOUND_FLEET_4]     = { 0.10, 73, 73, 0 },
+    [SOUND_UFO_HIT]     = { 0.60, 1000, 1000, 12 },
+    [SOUND_EXTRA_LIFE]  = { 0.50, 1500, 1500, 8 },
+};
+
+static void synthesize(SoundSample *sample, const Tone *tone) {
+    sample->length = tone->seconds * SOUND_RATE;
+    sample->data = malloc(sample->length * sizeof(i16));
+
+    u32 noise = 8080;
+    double phase = 0;
+    for (u32 i = 0; i < sample->length; i++) {
+        double t = (double)i / sample->length;
+        double pitch = tone->from + (tone->to - tone->from) * t;
+        if (tone->warble)
+            pitch *= (u32)(i * 2 * tone->warble / SOUND_RATE) & 1 ? 1.5 : 1;
+
+        bool high;
+        if (pitch) {
+            phase += pitch / SOUND_RATE;
+            high = phase - (u32)phase < 0.5;
+        }
+        else {
+            noise = noise * 1103515245 + 12345;
+            high = noise >> 16 & 1;
+        }
+
+        // Fades out over the last quarter so that nothing clicks.
+        double level = t < 0.75 ? 1 : (1 - t) * 4;
+        sample->data[i] = (high ? VOLUME : -VOLUME) * level;
+    }
+}
+
+void sound_init(Sound *sound, u32 capacity) {
+    memset(sound, 0, sizeof(Sound));
+
+    for (u32 id = 0; id < SOUND_COUNT; id++)
+        synthesize(&sound->samples[id], &TONES[id]);
+    sound->voices[SOUND_UFO].loop = true;
+
+    sound->capacity = capacity;
+    sound->ring = calloc(capacity, sizeof(i16));
+    if (!sound->ring) {
+        fprintf(stderr, "Sound: Out of memory.\n");
+        exit(1);
+    }
+
+    atomic_init(&sound->head, 0);
+    atomic_init(&sound->tail, 0);
+    atomic_init(&sound->underruns, 0);
+}
+
+void sound_free(Sound *sound) {
+    for (u32 id = 0; id < SOUND_COUNT; id++)
+        free(sound->samples[id].data);
+    free(sound->ring);
+}
+
+// Replaces the stand-in for sample `id`; the sound takes `data` over.
+void sound_sample(Sound *sound, u32 id, i16 *data, u32 length) {
+    free(sound->samples[id].data);
+    sound->samples[id] = (SoundSample){ data, length };
+    sound->voices[id].position = 0;
+}
+
+static i16 mix(Sound *sound) {
+    int sum = 0;
+
+    for (u32 id = 0; id < SOUND_COUNT; id++) {
+        SoundVoice *voice = &sound->voices[id];
+        SoundSample *sample = &sound->samples[id];
+        if (!voice->playing || !sample->length)
+            continue;
+
+        sum += sample->data[voice->position++];
+        if (voice->position == sample->length) {
+            voice->position = 0;
+            voice->playing = voice->loop;
+        }
+    }
+
+    return sum > 32767 ? 32767 : sum < -32768 ? -32768 : sum;
+}
+
+/**
+ * Mixes up to `cycles` into the ring. A machine restored to an earlier
+ * point just carries on from there.
+ */
+void sound_advance(Sound *sound, u64 cycles) {
+    if (!sound->started || cycles < sound->cycles) {
+        sound->cycles = cycles;
+        sound->started = true;
+        return;
+    }
+
+    u64 count = cycles * SOUND_RATE / SOUND_CLOCK - sound->cycles * SOUND_RATE / SOUND_CLOCK;
+    sound->cycles = cycles;
+
+    u64 head = atomic_load_explicit(&sound->head, memory_order_relaxed);
+    u64 room = sound->capacity - (head - atomic_load_explicit(&sound->tail, memory_order_acquire));
+
+    if (count > room) {
+        sound->overruns++;
+        sound->dropped += count - room;
+    }
+
+    for (u64 i = 0; i < count; i++) {
+        i16 value = mix(sound);
+        if (i < room)
+            sound->ring[(head + i) % sound->capacity] = value;
+    }
+
+    atomic_store_explicit(&sound->head, head + (count < room ? count : room), memory_order_release);
+}
+
+/**
+ * Port 3 or 5 was written at `cycles`: mixes up to then, and starts the
+ * samples whose bits went from 0 to 1. The UFO stops when its bit clears.
+ */
+void sound_port(Sound *sound, u8 port, u8 value, u64 cycles) {
+    sound_advance(sound, cycles);
+
+    u8 *last = &sound->ports[port == 5];
+    u8 rising = value & ~*last;
+    *last = value;
+
+    static const u8 PORT_3[] = { SOUND_UFO, SOUND_SHOT, SOUND_PLAYER_DIE, SOUND_INVADER_DIE, SOUND_EXTRA_LIFE };
+    static const u8 PORT_5[] = { SOUND_FLEET_1, SOUND_FLEET_2, SOUND_FLEET_3, SOUND_FLEET_4, SOUND_UFO_HIT };
+    const u8 *ids = port == 5 ? PORT_5 : PORT_3;
+
+    for (u32 bit = 0; bit < 5; bit++) {
+        if (rising >> bit & 1) {
+            sound->voices[ids[bit]].playing = true;
+            sound->voices[ids[bit]].position = 0;
+        }
+    }
+
+    if (port == 3 && !(value & 1))
+        sound->voices[SOUND_UFO].playing = false;
+}
+
+/**
+ * Takes `count` samples for the device, called from the audio thread.
+ * Missing samples are played as silence.
+ */
+void sound_read(Sound *sound, i16 *out, u32 count) {
+    u64 tail = atomic_load_explicit(&sound->tail, memory_order_relaxed);
+    u64 queued = atomic_load_explicit(&sound->head, memory_order_acquire) - tail;
+    u32 taken = count < queued ? count : queued;
+
+    for (u32 i = 0; i < taken; i++)
+        out[i] = sound->ring[(tail + i) % sound->capacity];
+    atomic_store_explicit(&sound->tail, tail + taken, memory_order_release);
+
+    if (taken < count) {
+        memset(out + taken, 0, (count - taken) * sizeof(i16));
+        atomic_fetch_add(&sound->underruns, 1);
+    }
+}
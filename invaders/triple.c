@@ -0,0 +1,51 @@
+#include <string.h>
+#include "triple.h"
+
+void triple_init(Triple *triple) {
+    memset(triple->frames, 0, sizeof(triple->frames));
+    triple->back = 0;
+    atomic_init(&triple->middle, 1);
+    triple->front = 2;
+    triple->unseen[0] = triple->unseen[1] = 0;
+}
+
+// The slot to fill with the next frame, owned by the writer.
+TripleFrame *triple_back(Triple *triple) {
+    return &triple->frames[triple->back];
+}
+
+/**
+ * Publishes the back slot, `dirty` being the columns changed since the
+ * frame published before it.
+ */
+void triple_publish(Triple *triple, const u32 dirty[2]) {
+    TripleFrame *frame = &triple->frames[triple->back];
+    for (u32 half = 0; half < 2; half++) {
+        frame->dirty[half] = triple->unseen[half] | dirty[half];
+        triple->unseen[half] = frame->dirty[half];
+    }
+
+    u32 old = atomic_exchange_explicit(&triple->middle, triple->back | TRIPLE_FRESH, memory_order_acq_rel);
+    triple->back = old & ~TRIPLE_FRESH;
+
+    // The reader took the frame before this one, so only this one's
+    // changes can be unseen.
+    if (!(old & TRIPLE_FRESH)) {
+        triple->unseen[0] = dirty[0];
+        triple->unseen[1] = dirty[1];
+    }
+}
+
+/**
+ * The newest frame if one was published since the last call, else null.
+ * It stays the reader's until the next call.
+ */
+TripleFrame *triple_take(Triple *triple) {
+    if (!(atomic_load_explicit(&triple->middle, memory_order_relaxed) & TRIPLE_FRESH))
+        return 0;
+
+    u32 old = atomic_exchange_explicit(&triple->middle, triple->front, memory_order_acq_rel);
+    triple->front = old & ~TRIPLE_FRESH;
+
+    return &triple->frames[triple->front];
+}
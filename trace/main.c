@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define MAX_CONTEXT 64
+
+/**
+ * Which records to print: those from cycle `from` until `to`, at a PC in
+ * `pc_low`..`pc_high`, with `opcode` if it is not -1, up to `limit`.
+ */
+typedef struct {
+    u64 from;
+    u64 to;
+    u16 pc_low;
+    u16 pc_high;
+    int opcode;
+    u64 limit;
+} Filter;
+
+static void print_record(const TraceRecord *record, const char *mark) {
+    printf("%s%12llu  %04x  %02x%s  A %02x  F %02x  BC %04x  DE %04x  HL %04x  SP %04x\n",
+           mark, (unsigned long long)record->cycles, record->pc, record->opcode,
+           record->interrupt ? " INT" : "    ", record->a, record->flags, record->bc,
+           record->de, record->hl, record->sp);
+}
+
+static bool matches(const Filter *filter, const TraceRecord *record) {
+    return record->pc >= filter->pc_low && record->pc <= filter->pc_high
+        && (filter->opcode < 0 || record->opcode == filter->opcode);
+}
+
+static int dump(const char *path, const Filter *filter) {
+    TraceReader *reader = trace_reader_open(path);
+    if (!reader)
+        return 1;
+
+    TraceRecord record;
+    u64 printed = 0;
+    bool found = trace_reader_seek(reader, filter->from);
+
+    while (found && printed < filter->limit && trace_reader_next(reader, &record)
+            && record.cycles < filter->to) {
+        if (matches(filter, &record)) {
+            print_record(&record, "");
+            printed++;
+        }
+    }
+
+    trace_reader_close(reader);
+    return 0;
+}
+
+static bool same(const TraceRecord *a, const TraceRecord *b) {
+    return !memcmp(a, b, sizeof(TraceRecord));
+}
+
+/**
+ * Reads two traces side by side and reports the first record where they
+ * differ, after the `context` records that led up to it.
+ */
+static int diff(const char *first, const char *second, u64 from, u32 context) {
+    TraceReader *a = trace_reader_open(first);
+    TraceReader *b = trace_reader_open(second);
+    if (!a || !b)
+        return 1;
+
+    TraceRecord history[MAX_CONTEXT];
+    TraceRecord x, y;
+    u64 compared = 0;
+    int status = 0;
+
+    bool more_a = trace_reader_seek(a, from);
+    bool more_b = trace_reader_seek(b, from);
+
+    while (true) {
+        more_a = more_a && trace_reader_next(a, &x);
+        more_b = more_b && trace_reader_next(b, &y);
+        if (!more_a || !more_b)
+            break;
+
+        if (!same(&x, &y)) {
+            u32 shown = compared < context ? compared : context;
+            for (u32 i = shown; i > 0; i--)
+                print_record(&history[(compared - i) % MAX_CONTEXT], "  ");
+            print_record(&x, "- ");
+            print_record(&y, "+ ");
+            printf("Traces differ after %llu records.\n", (unsigned long long)compared);
+            status = 1;
+            break;
+        }
+
+        history[compared++ % MAX_CONTEXT] = x;
+    }
+
+    if (!status && more_a != more_b) {
+        printf("%s ends after %llu records.\n", more_a ? second : first,
+               (unsigned long long)compared);
+        status = 1;
+    }
+    else if (!status)
+        printf("%llu records identical.\n", (unsigned long long)compared);
+
+    trace_reader_close(a);
+    trace_reader_close(b);
+    return status;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "Usage: trace [-s cycle] [-e cycle] [-p pc[-pc]] [-o opcode] [-n count] trace\n"
+            "       trace -d [-s cycle] [-c context] trace trace\n"
+            "\n"
+            "Prints the records of a trace written by a trace=1 build, from cycle\n"
+            "-s until cycle -e, at a PC or range of them and with an opcode (all\n"
+            "in hex), up to `count`. With -d, compares two traces from cycle -s on\n"
+            "and prints the first record that differs after `context` records\n"
+            "before it, exiting with 1 if there is one.\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    Filter filter = { 0, ~0ull, 0, 0xffff, -1, ~0ull };
+    bool compare = false;
+    u32 context = 8;
+
+    int option;
+    while ((option = getopt(argc, argv, "s:e:p:o:n:dc:")) != -1) {
+        char *end;
+        switch (option) {
+            case 's': filter.from = strtoull(optarg, 0, 10); break;
+            case 'e': filter.to = strtoull(optarg, 0, 10); break;
+            case 'p':
+                filter.pc_low = filter.pc_high = strtoul(optarg, &end, 16);
+                if (*end == '-')
+                    filter.pc_high = strtoul(end + 1, 0, 16);
+                break;
+            case 'o': filter.opcode = strtoul(optarg, 0, 16) & 0xff; break;
+            case 'n': filter.limit = strtoull(optarg, 0, 10); break;
+            case 'd': compare = true; break;
+            case 'c':
+                context = strtoul(optarg, 0, 10);
+                context = context < MAX_CONTEXT ? context : MAX_CONTEXT;
+                break;
+            default: usage();
+        }
+    }
+
+    if (optind + 1 + compare != argc)
+        usage();
+
+    if (compare)
+        return diff(argv[optind], argv[optind + 1], filter.from, context);
+
+    return dump(argv[optind], &filter);
+}